@@ -43,6 +43,11 @@ void CommonGraphicsChannelClient::release_recv_buf(uint16_t type, uint32_t size,
     }
 }
 
+bool CommonGraphicsChannelClient::can_parse_in_place(uint16_t type, uint32_t size)
+{
+    return type != SPICE_MSGC_MIGRATE_DATA && size <= sizeof(recv_buf);
+}
+
 bool CommonGraphicsChannelClient::config_socket()
 {
     RedClient *client = get_client();
@@ -50,7 +55,6 @@ bool CommonGraphicsChannelClient::config_socket()
     RedStream *stream = get_stream();
     gboolean is_low_bandwidth;
 
-    // TODO - this should be dynamic, not one time at channel creation
     is_low_bandwidth = mcc->is_low_bandwidth();
     if (!red_stream_set_auto_flush(stream, false)) {
         /* FIXME: Using Nagle's Algorithm can lead to apparent delays, depending
@@ -63,5 +67,19 @@ bool CommonGraphicsChannelClient::config_socket()
     }
     // TODO: move wide/narrow ack setting to red_channel.
     ack_set_client_window(is_low_bandwidth ? WIDE_CLIENT_ACK_WINDOW : NARROW_CLIENT_ACK_WINDOW);
+    ack_set_adaptive_window(MIN_CLIENT_ACK_WINDOW, MAX_CLIENT_ACK_WINDOW);
+    update_pipe_bytes_budget();
     return true;
 }
+
+void CommonGraphicsChannelClient::update_pipe_bytes_budget()
+{
+    MainChannelClient *mcc = get_client()->get_main();
+
+    uint64_t pipe_bytes = COMMON_CLIENT_MAX_PIPE_BYTES;
+    if (mcc->is_network_info_initialized()) {
+        pipe_bytes = mcc->get_bitrate_per_sec() / 8 * COMMON_CLIENT_PIPE_LATENCY_MS / 1000;
+        pipe_bytes = CLAMP(pipe_bytes, COMMON_CLIENT_MIN_PIPE_BYTES, COMMON_CLIENT_MAX_PIPE_BYTES);
+    }
+    set_pipe_bytes_budget(pipe_bytes);
+}
@@ -25,6 +25,12 @@
 
 #define COMMON_CLIENT_TIMEOUT (NSEC_PER_SEC * 30)
 
+/* The byte budget of the client pipes allows to queue about this time of
+ * data at the bandwidth measured by the main channel */
+#define COMMON_CLIENT_PIPE_LATENCY_MS 200
+#define COMMON_CLIENT_MIN_PIPE_BYTES (256 * 1024)
+#define COMMON_CLIENT_MAX_PIPE_BYTES (32 * 1024 * 1024)
+
 class CommonGraphicsChannel: public RedChannel
 {
 public:
@@ -65,7 +71,10 @@ public:
 protected:
     virtual uint8_t *alloc_recv_buf(uint16_t type, uint32_t size) override;
     virtual void release_recv_buf(uint16_t type, uint32_t size, uint8_t *msg) override;
+    virtual bool can_parse_in_place(uint16_t type, uint32_t size) override;
     virtual bool config_socket() override;
+    /* size the pipe for the current bandwidth to the client */
+    void update_pipe_bytes_budget();
 };
 
 /* pipe item used to release a specific cached item on the client */
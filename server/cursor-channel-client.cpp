@@ -66,6 +66,13 @@ void CursorChannelClient::migrate()
     RedChannelClient::migrate();
 }
 
+/* the budget follows the estimate the display channel shares through the
+ * main channel, it is more accurate than the one of the cursor traffic */
+void CursorChannelClient::on_bandwidth_estimate(uint64_t bits_per_sec, uint32_t roundtrip_us)
+{
+    update_pipe_bytes_budget();
+}
+
 CursorChannelClient::CursorChannelClient(RedChannel *channel,
                                          RedClient *client,
                                          RedStream *stream,
@@ -53,6 +53,7 @@ protected:
      * This is the equivalent of RedChannel client migrate callback.
      */
     virtual void migrate() override;
+    virtual void on_bandwidth_estimate(uint64_t bits_per_sec, uint32_t roundtrip_us) override;
 
 public:
     red::unique_link<CursorChannelClientPrivate> priv;
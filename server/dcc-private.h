@@ -19,9 +19,11 @@
 #ifndef DCC_PRIVATE_H_
 #define DCC_PRIVATE_H_
 
+#include <atomic>
+
 #include "cache-item.h"
 #include "dcc.h"
-#include "image-encoders.h"
+#include "image-encoder-pool.h"
 #include "video-stream.h"
 #include "red-channel-client.h"
 
@@ -52,6 +54,10 @@ struct DisplayChannelClientPrivate
         FreeList free_list;
         uint64_t pixmap_cache_items[MAX_DRAWABLE_PIXMAP_CACHE_ITEMS];
         int num_pixmap_cache_items;
+        /* pool job of the item being marshalled, if any */
+        ImageEncoderJob *compress_job;
+        /* trace of the drawable being sent, completed once it is written */
+        FrameTrace frame_trace;
     } send_data;
 
     /* Host preferred video-codec order sorted with client preferred */
@@ -67,6 +73,13 @@ struct DisplayChannelClientPrivate
     uint32_t streams_max_latency;
     uint64_t streams_max_bit_rate;
     bool gl_draw_ongoing;
+    /* written by the video encoder threads when a frame is compressed, to
+     * push the pipe whose head waits for it, see dcc_video_frame_done() */
+    int video_frame_recv_fd = -1;
+    int video_frame_send_fd = -1;
+    SpiceWatch *video_frame_watch = nullptr;
+    /* the worker was woken up and did not handle it yet */
+    std::atomic<bool> video_frame_notified{false};
 };
 
 #include "pop-visibility.h"
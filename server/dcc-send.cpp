@@ -54,19 +54,14 @@ static int dcc_pixmap_cache_unlocked_hit(DisplayChannelClient *dcc, uint64_t id,
     uint64_t serial;
 
     serial = dcc->get_message_serial();
-    item = cache->hash_table[BITS_CACHE_HASH_KEY(id)];
-
-    while (item) {
-        if (item->id == id) {
-            ring_remove(&item->lru_link);
-            ring_add(&cache->lru, &item->lru_link);
-            spice_assert(dcc->priv->id < MAX_CACHE_CLIENTS);
-            item->sync[dcc->priv->id] = serial;
-            cache->sync[dcc->priv->id] = serial;
-            *lossy = item->lossy;
-            break;
-        }
-        item = item->next;
+    item = pixmap_cache_unlocked_lookup(cache, id);
+
+    if (item) {
+        pixmap_cache_unlocked_hit(cache, item);
+        spice_assert(dcc->priv->id < MAX_CACHE_CLIENTS);
+        item->sync[dcc->priv->id] = serial;
+        cache->sync[dcc->priv->id] = serial;
+        *lossy = item->lossy;
     }
 
     return !!item;
@@ -177,9 +172,10 @@ static RedChannelClient::Pipe::iterator get_pipe_tail(RedChannelClient::Pipe& pi
     return pipe.empty() ? pipe.end() : --pipe.end();
 }
 
+/* @cost is the size of the image data sent to the client */
 static void red_display_add_image_to_pixmap_cache(DisplayChannelClient *dcc,
                                                   SpiceImage *image, SpiceImage *io_image,
-                                                  int is_lossy)
+                                                  int is_lossy, uint64_t cost)
 {
     DisplayChannel *display_channel G_GNUC_UNUSED = DCC_TO_DC(dcc);
 
@@ -188,7 +184,7 @@ static void red_display_add_image_to_pixmap_cache(DisplayChannelClient *dcc,
         if (!(io_image->descriptor.flags & SPICE_IMAGE_FLAGS_CACHE_REPLACE_ME)) {
             if (dcc_pixmap_cache_unlocked_add(dcc, image->descriptor.id,
                                               image->descriptor.width * image->descriptor.height,
-                                              is_lossy)) {
+                                              is_lossy, MIN(cost, UINT32_MAX))) {
                 io_image->descriptor.flags |= SPICE_IMAGE_FLAGS_CACHE_ME;
                 dcc->priv->send_data.pixmap_cache_items[dcc->priv->send_data.num_pixmap_cache_items++] =
                                                                                image->descriptor.id;
@@ -321,17 +317,30 @@ static void marshaller_compress_buf_free(uint8_t *data, void *opaque)
     compress_buf_free((RedCompressBuf*) opaque);
 }
 
+static void marshaller_unref_shared_image(uint8_t *data, void *opaque)
+{
+    red_shared_compressed_image_unref((RedSharedCompressedImage*) opaque);
+}
+
 static void marshaller_add_compressed(SpiceMarshaller *m,
-                                      RedCompressBuf *comp_buf, size_t size)
+                                      const compress_send_data_t *comp_data)
 {
-    size_t max = size;
+    RedCompressBuf *comp_buf = comp_data->comp_buf;
+    size_t max = comp_data->comp_buf_size;
     size_t now;
     do {
         spice_return_if_fail(comp_buf);
         now = MIN(sizeof(comp_buf->buf), max);
         max -= now;
-        spice_marshaller_add_by_ref_full(m, comp_buf->buf.bytes, now,
-                                         marshaller_compress_buf_free, comp_buf);
+        if (comp_data->shared) {
+            /* the buffers are referenced by the marshallers of other clients */
+            spice_marshaller_add_by_ref_full(m, comp_buf->buf.bytes, now,
+                                             marshaller_unref_shared_image,
+                                             red_shared_compressed_image_ref(comp_data->shared));
+        } else {
+            spice_marshaller_add_by_ref_full(m, comp_buf->buf.bytes, now,
+                                             marshaller_compress_buf_free, comp_buf);
+        }
         comp_buf = comp_buf->send_next;
     } while (max);
 }
@@ -369,6 +378,7 @@ static FillBitsType fill_bits(DisplayChannelClient *dcc, SpiceMarshaller *m,
 
     if ((simage->descriptor.flags & SPICE_IMAGE_FLAGS_CACHE_ME)) {
         int lossy_cache_item;
+        stat_inc_counter(display->priv->pixmap_cache_lookups_counter, 1);
         if (dcc_pixmap_cache_unlocked_hit(dcc, image.descriptor.id, &lossy_cache_item)) {
             dcc->priv->send_data.pixmap_cache_items[dcc->priv->send_data.num_pixmap_cache_items++] =
                 image.descriptor.id;
@@ -435,7 +445,9 @@ static FillBitsType fill_bits(DisplayChannelClient *dcc, SpiceMarshaller *m,
                                 drawable, can_lossy, &comp_send_data)) {
             SpicePalette *palette;
 
-            red_display_add_image_to_pixmap_cache(dcc, simage, &image, FALSE);
+            red_display_add_image_to_pixmap_cache(dcc, simage, &image, FALSE,
+                                                  (uint64_t) simage->u.bitmap.stride *
+                                                  simage->u.bitmap.y);
 
             *bitmap = simage->u.bitmap;
             bitmap->flags = bitmap->flags & SPICE_BITMAP_FLAGS_TOP_DOWN;
@@ -462,14 +474,14 @@ static FillBitsType fill_bits(DisplayChannelClient *dcc, SpiceMarshaller *m,
             return FILL_BITS_TYPE_BITMAP;
         } else {
             red_display_add_image_to_pixmap_cache(dcc, simage, &image,
-                                                  comp_send_data.is_lossy);
+                                                  comp_send_data.is_lossy,
+                                                  comp_send_data.comp_buf_size);
 
             spice_marshall_Image(m, &image,
                                  &bitmap_palette_out, &lzplt_palette_out);
             spice_assert(bitmap_palette_out == NULL);
 
-            marshaller_add_compressed(m, comp_send_data.comp_buf,
-                                      comp_send_data.comp_buf_size);
+            marshaller_add_compressed(m, &comp_send_data);
 
             if (lzplt_palette_out && comp_send_data.lzplt_palette) {
                 spice_marshall_Palette(lzplt_palette_out, comp_send_data.lzplt_palette);
@@ -483,7 +495,8 @@ static FillBitsType fill_bits(DisplayChannelClient *dcc, SpiceMarshaller *m,
         break;
     }
     case SPICE_IMAGE_TYPE_QUIC:
-        red_display_add_image_to_pixmap_cache(dcc, simage, &image, FALSE);
+        red_display_add_image_to_pixmap_cache(dcc, simage, &image, FALSE,
+                                              simage->u.quic.data_size);
         image.u.quic = simage->u.quic;
         spice_marshall_Image(m, &image,
                              &bitmap_palette_out, &lzplt_palette_out);
@@ -734,7 +747,7 @@ static void red_pipe_replace_rendered_drawables_with_images(DisplayChannelClient
         resent_areas[num_resent] = drawable->red_drawable->bbox;
         num_resent++;
 
-        l = pipe.erase(l);
+        l = dcc->pipe_erase(l);
     }
 }
 
@@ -1640,9 +1653,10 @@ static void red_release_video_encoder_buffer(uint8_t *data, void *opaque)
 
 static bool red_marshall_stream_data(DisplayChannelClient *dcc,
                                      SpiceMarshaller *base_marshaller,
-                                     Drawable *drawable)
+                                     RedDrawablePipeItem *dpi)
 {
     DisplayChannel *display = DCC_TO_DC(dcc);
+    Drawable *drawable = dpi->drawable;
     VideoStream *stream = drawable->stream;
     SpiceCopy *copy;
     uint32_t frame_mm_time;
@@ -1656,9 +1670,7 @@ static bool red_marshall_stream_data(DisplayChannelClient *dcc,
         return FALSE;
     }
 
-    is_sized = (copy->src_area.right - copy->src_area.left != stream->width) ||
-               (copy->src_area.bottom - copy->src_area.top != stream->height) ||
-               !rect_is_equal(&drawable->red_drawable->bbox, &stream->dest_area);
+    is_sized = video_stream_is_sized_frame(stream, drawable->red_drawable);
 
     if (is_sized &&
         !dcc->test_remote_cap(SPICE_DISPLAY_CAP_SIZED_STREAM)) {
@@ -1668,17 +1680,25 @@ static bool red_marshall_stream_data(DisplayChannelClient *dcc,
     int stream_id = display_channel_get_video_stream_id(display, stream);
     VideoStreamAgent *agent = &dcc->priv->stream_agents[stream_id];
     VideoBuffer *outbuf;
-    /* workaround for vga streams */
-    frame_mm_time =  drawable->red_drawable->mm_time ?
-                        drawable->red_drawable->mm_time :
-                        reds_get_mm_time();
-    ret = !agent->video_encoder ? VIDEO_ENCODER_FRAME_UNSUPPORTED :
-          agent->video_encoder->encode_frame(agent->video_encoder,
-                                             frame_mm_time,
-                                             &copy->src_bitmap->u.bitmap,
-                                             &copy->src_area, stream->top_down,
-                                             drawable->red_drawable,
-                                             &outbuf);
+    if (dpi->video_frame &&
+        video_encoder_frame_get_encoder(dpi->video_frame) == agent->video_encoder) {
+        /* compressed since the item was queued */
+        frame_mm_time = dpi->video_frame_mm_time;
+        ret = video_encoder_frame_complete(dpi->video_frame, &outbuf);
+        dpi->video_frame = NULL;
+    } else {
+        /* workaround for vga streams */
+        frame_mm_time =  drawable->red_drawable->mm_time ?
+                            drawable->red_drawable->mm_time :
+                            reds_get_mm_time();
+        ret = !agent->video_encoder ? VIDEO_ENCODER_FRAME_UNSUPPORTED :
+              agent->video_encoder->encode_frame(agent->video_encoder,
+                                                 frame_mm_time,
+                                                 &copy->src_bitmap->u.bitmap,
+                                                 &copy->src_area, stream->top_down,
+                                                 drawable->red_drawable,
+                                                 &outbuf);
+    }
     switch (ret) {
     case VIDEO_ENCODER_FRAME_DROP:
 #ifdef STREAM_STATS
@@ -1944,8 +1964,7 @@ static void red_marshall_image(DisplayChannelClient *dcc,
         spice_marshall_Image(src_bitmap_out, &red_image,
                              &bitmap_palette_out, &lzplt_palette_out);
 
-        marshaller_add_compressed(src_bitmap_out,
-                                  comp_send_data.comp_buf, comp_send_data.comp_buf_size);
+        marshaller_add_compressed(src_bitmap_out, &comp_send_data);
 
         if (lzplt_palette_out && comp_send_data.lzplt_palette) {
             spice_marshall_Palette(lzplt_palette_out, comp_send_data.lzplt_palette);
@@ -2089,7 +2108,7 @@ static void marshall_qxl_drawable(DisplayChannelClient *dcc,
     spice_return_if_fail(display);
     /* allow sized frames to be streamed, even if they where replaced by another frame, since
      * newer frames might not cover sized frames completely if they are bigger */
-    if (item->stream && red_marshall_stream_data(dcc, m, item)) {
+    if (item->stream && red_marshall_stream_data(dcc, m, dpi)) {
         return;
     }
     if (display->priv->enable_jpeg)
@@ -2318,6 +2337,8 @@ static void reset_send_data(DisplayChannelClient *dcc)
     dcc->priv->send_data.num_pixmap_cache_items = 0;
     memset(dcc->priv->send_data.free_list.sync, 0,
            sizeof(dcc->priv->send_data.free_list.sync));
+    dcc->priv->send_data.compress_job = NULL;
+    memset(&dcc->priv->send_data.frame_trace, 0, sizeof(dcc->priv->send_data.frame_trace));
 }
 
 void DisplayChannelClient::send_item(RedPipeItem *pipe_item)
@@ -2329,7 +2350,11 @@ void DisplayChannelClient::send_item(RedPipeItem *pipe_item)
     switch (pipe_item->type) {
     case RED_PIPE_ITEM_TYPE_DRAW: {
         RedDrawablePipeItem *dpi = static_cast<RedDrawablePipeItem*>(pipe_item);
+        dcc->priv->send_data.compress_job = dpi->compress_job;
         marshall_qxl_drawable(this, m, dpi);
+        if (send_message_pending()) {
+            dcc->priv->send_data.frame_trace = dpi->drawable->red_drawable->trace;
+        }
         break;
     }
     case RED_PIPE_ITEM_TYPE_INVAL_ONE:
@@ -2354,9 +2379,12 @@ void DisplayChannelClient::send_item(RedPipeItem *pipe_item)
     case RED_PIPE_ITEM_TYPE_MIGRATE_DATA:
         display_channel_marshall_migrate_data(this, m);
         break;
-    case RED_PIPE_ITEM_TYPE_IMAGE:
-        red_marshall_image(this, m, static_cast<RedImageItem*>(pipe_item));
+    case RED_PIPE_ITEM_TYPE_IMAGE: {
+        RedImageItem *item = static_cast<RedImageItem*>(pipe_item);
+        dcc->priv->send_data.compress_job = item->compress_job;
+        red_marshall_image(this, m, item);
         break;
+    }
     case RED_PIPE_ITEM_TYPE_PIXMAP_SYNC:
         display_channel_marshall_pixmap_sync(this, m);
         break;
@@ -2403,3 +2431,15 @@ void DisplayChannelClient::send_item(RedPipeItem *pipe_item)
         ::begin_send_message(this);
     }
 }
+
+void DisplayChannelClient::on_message_sent()
+{
+    FrameTrace *trace = &priv->send_data.frame_trace;
+
+    if (!frame_trace_is_active(trace)) {
+        return;
+    }
+    trace->time[FRAME_TRACE_SENT] = stat_now(CLOCK_MONOTONIC);
+    frame_trace_stats_add(&DCC_TO_DC(this)->priv->frame_trace_stats, trace);
+    memset(trace, 0, sizeof(*trace));
+}
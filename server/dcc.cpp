@@ -17,18 +17,27 @@
 */
 #include <config.h>
 
+#ifdef HAVE_SYS_EVENTFD_H
+#include <sys/eventfd.h>
+#endif
+
 #include <common/utils.h>
 #include "dcc-private.h"
 #include "display-channel.h"
 #include "display-channel-private.h"
 #include "red-client.h"
 #include "main-channel-client.h"
+#include "net-utils.h"
+#include "sys-socket.h"
 #include <spice-server-enums.h>
 
 #define DISPLAY_CLIENT_SHORT_TIMEOUT 15000000000ULL //nano
 #define DISPLAY_FREE_LIST_DEFAULT_SIZE 128
 
 static void dcc_init_stream_agents(DisplayChannelClient *dcc);
+static ImageEncoderJob *dcc_submit_compress_job(DisplayChannelClient *dcc, SpiceBitmap *src,
+                                                Drawable *drawable, int can_lossy,
+                                                bool own_chunks);
 
 DisplayChannelClient::DisplayChannelClient(DisplayChannel *display,
                          RedClient *client, RedStream *stream,
@@ -66,6 +75,13 @@ DisplayChannelClient::DisplayChannelClient(DisplayChannel *display,
 
 DisplayChannelClient::~DisplayChannelClient()
 {
+    red_watch_remove(priv->video_frame_watch);
+    if (priv->video_frame_send_fd != priv->video_frame_recv_fd) {
+        socket_close(priv->video_frame_send_fd);
+    }
+    if (priv->video_frame_recv_fd != -1) {
+        socket_close(priv->video_frame_recv_fd);
+    }
     g_clear_pointer(&priv->preferred_video_codecs, g_array_unref);
     g_clear_pointer(&priv->client_preferred_video_codecs, g_array_unref);
 }
@@ -130,7 +146,7 @@ bool dcc_clear_surface_drawables_from_pipe(DisplayChannelClient *dcc, int surfac
         }
 
         if (drawable->surface_id == surface_id) {
-            l = pipe.erase(item_pos);
+            l = dcc->pipe_erase(item_pos);
             continue;
         }
 
@@ -187,11 +203,15 @@ void dcc_create_surface(DisplayChannelClient *dcc, int surface_id)
     dcc->pipe_add(std::move(create));
 }
 
-// adding the pipe item after pos. If pos == NULL, adding to head.
-void
-dcc_add_surface_area_image(DisplayChannelClient *dcc, int surface_id,
-                           SpiceRect *area, RedChannelClient::Pipe::iterator pipe_item_pos,
-                           int can_lossy)
+/* Images of at least this size are split in horizontal bands when the
+ * encoder pool is enabled, so that the bands are compressed in parallel */
+#define IMAGE_BAND_MIN_BYTES (256 * 1024)
+
+static void
+dcc_add_surface_area_image_item(DisplayChannelClient *dcc, int surface_id,
+                                const SpiceRect *area,
+                                RedChannelClient::Pipe::iterator pipe_item_pos,
+                                int can_lossy)
 {
     DisplayChannel *display = DCC_TO_DC(dcc);
     RedSurface *surface = &display->priv->surfaces[surface_id];
@@ -237,6 +257,23 @@ dcc_add_surface_area_image(DisplayChannelClient *dcc, int surface_id,
         }
     }
 
+    if (display->priv->encoder_pool) {
+        SpiceBitmap bitmap;
+
+        bitmap.format = item->image_format;
+        bitmap.flags = item->top_down ? SPICE_BITMAP_FLAGS_TOP_DOWN : 0;
+        bitmap.x = item->width;
+        bitmap.y = item->height;
+        bitmap.stride = item->stride;
+        bitmap.palette = NULL;
+        bitmap.palette_id = 0;
+        bitmap.data = spice_chunks_new_linear(item->data, bitmap.stride * bitmap.y);
+        item->compress_job = dcc_submit_compress_job(dcc, &bitmap, NULL, can_lossy, true);
+        if (!item->compress_job) {
+            spice_chunks_destroy(bitmap.data);
+        }
+    }
+
     if (pipe_item_pos != dcc->get_pipe().end()) {
         dcc->pipe_add_after_pos(std::move(item), pipe_item_pos);
     } else {
@@ -244,6 +281,48 @@ dcc_add_surface_area_image(DisplayChannelClient *dcc, int surface_id,
     }
 }
 
+// adding the pipe item after pos. If pos == NULL, adding to head.
+void
+dcc_add_surface_area_image(DisplayChannelClient *dcc, int surface_id,
+                           SpiceRect *area, RedChannelClient::Pipe::iterator pipe_item_pos,
+                           int can_lossy)
+{
+    DisplayChannel *display = DCC_TO_DC(dcc);
+    RedSurface *surface = &display->priv->surfaces[surface_id];
+    unsigned int n_bands = 1;
+    SpiceRect band;
+    int height;
+    int band_height;
+
+    spice_assert(area);
+
+    height = area->bottom - area->top;
+    if (display->priv->encoder_pool) {
+        uint64_t size = (uint64_t) (area->right - area->left) * height *
+                        (SPICE_SURFACE_FMT_DEPTH(surface->context.format) / 8);
+
+        n_bands = MIN(image_encoder_pool_get_n_threads(display->priv->encoder_pool),
+                      size / IMAGE_BAND_MIN_BYTES);
+    }
+    if (n_bands <= 1 || height < 2) {
+        dcc_add_surface_area_image_item(dcc, surface_id, area, pipe_item_pos, can_lossy);
+        return;
+    }
+
+    /* each band is sent as an image of its own, the client does not care
+     * about the split. Each band is inserted at the same position, ahead of
+     * the ones inserted before it, so they are added from the bottom one to
+     * be sent from the top one */
+    band_height = (height + n_bands - 1) / n_bands;
+    n_bands = (height + band_height - 1) / band_height;
+    band = *area;
+    while (n_bands--) {
+        band.top = area->top + (int) n_bands * band_height;
+        band.bottom = MIN(band.top + band_height, area->bottom);
+        dcc_add_surface_area_image_item(dcc, surface_id, &band, pipe_item_pos, can_lossy);
+    }
+}
+
 void dcc_push_surface_image(DisplayChannelClient *dcc, int surface_id)
 {
     DisplayChannel *display;
@@ -302,19 +381,150 @@ RedDrawablePipeItem::RedDrawablePipeItem(DisplayChannelClient *init_dcc, Drawabl
 {
     drawable->pipes = g_list_prepend(drawable->pipes, this);
     drawable->refs++;
+    frame_trace_mark(&drawable->red_drawable->trace, FRAME_TRACE_PIPE_ADD);
 }
 
 RedDrawablePipeItem::~RedDrawablePipeItem()
 {
-    drawable->pipes = g_list_remove(drawable->pipes, this);
+    // the job reads the drawable data, release it first
+    image_encoder_job_free(compress_job);
+    video_encoder_frame_release(video_frame);
+    drawable_remove_pipe_item(drawable, this);
     drawable_unref(drawable);
 }
 
+RedImageItem::~RedImageItem()
+{
+    image_encoder_job_free(compress_job);
+}
+
+size_t RedImageItem::get_size_estimate() const
+{
+    return (size_t) stride * height;
+}
+
+/* uncompressed size of @image, the actual size depends on the compression */
+static size_t image_size_estimate(const SpiceImage *image)
+{
+    if (!image || image->descriptor.type != SPICE_IMAGE_TYPE_BITMAP) {
+        return 0;
+    }
+    return (size_t) image->u.bitmap.stride * image->u.bitmap.y;
+}
+
+size_t RedDrawablePipeItem::get_size_estimate() const
+{
+    RedDrawable *red_drawable = drawable->red_drawable;
+    size_t size = RedPipeItem::get_size_estimate();
+
+    switch (red_drawable->type) {
+    case QXL_DRAW_COPY:
+        size += image_size_estimate(red_drawable->u.copy.src_bitmap);
+        size += image_size_estimate(red_drawable->u.copy.mask.bitmap);
+        break;
+    case QXL_DRAW_BLEND:
+        size += image_size_estimate(red_drawable->u.blend.src_bitmap);
+        break;
+    case QXL_DRAW_OPAQUE:
+        size += image_size_estimate(red_drawable->u.opaque.src_bitmap);
+        break;
+    case QXL_DRAW_TRANSPARENT:
+        size += image_size_estimate(red_drawable->u.transparent.src_bitmap);
+        break;
+    case QXL_DRAW_ALPHA_BLEND:
+        size += image_size_estimate(red_drawable->u.alpha_blend.src_bitmap);
+        break;
+    default:
+        break;
+    }
+    return size;
+}
+
+/* Start compressing the source image of the drawable in the encoder pool,
+ * by the time the item is sent the image will hopefully be ready */
+static void dcc_drawable_submit_compress_job(DisplayChannelClient *dcc, RedDrawablePipeItem *dpi)
+{
+    DisplayChannel *display = DCC_TO_DC(dcc);
+    Drawable *drawable = dpi->drawable;
+    RedDrawable *red_drawable = drawable->red_drawable;
+    SpiceImage *image;
+    int can_lossy;
+
+    if (!display->priv->encoder_pool || drawable->stream) {
+        return;
+    }
+
+    /* guess the lossy permission the marshaller will use, see
+     * red_lossy_marshall_qxl_draw_copy/opaque. In case of mismatch the
+     * job is discarded */
+    switch (red_drawable->type) {
+    case QXL_DRAW_COPY:
+        image = red_drawable->u.copy.src_bitmap;
+        can_lossy = display->priv->enable_jpeg;
+        break;
+    case QXL_DRAW_OPAQUE: {
+        int rop = red_drawable->u.opaque.rop_descriptor;
+        image = red_drawable->u.opaque.src_bitmap;
+        can_lossy = display->priv->enable_jpeg &&
+            !((rop & SPICE_ROPD_OP_OR) || (rop & SPICE_ROPD_OP_AND) || (rop & SPICE_ROPD_OP_XOR));
+        break;
+    }
+    default:
+        return;
+    }
+
+    if (!image || image->descriptor.type != SPICE_IMAGE_TYPE_BITMAP ||
+        (image->u.bitmap.data->flags & SPICE_CHUNKS_FLAGS_UNSTABLE)) {
+        return;
+    }
+    if ((image->descriptor.flags & SPICE_IMAGE_FLAGS_CACHE_ME) && dcc->priv->pixmap_cache &&
+        pixmap_cache_contains(dcc->priv->pixmap_cache, image->descriptor.id)) {
+        return;
+    }
+
+    dpi->compress_job = dcc_submit_compress_job(dcc, &image->u.bitmap, drawable, can_lossy, false);
+}
+
+/* Start compressing the stream frame in the thread of the video encoder,
+ * see red_marshall_stream_data */
+static void dcc_drawable_submit_video_frame(DisplayChannelClient *dcc, RedDrawablePipeItem *dpi)
+{
+    Drawable *drawable = dpi->drawable;
+    RedDrawable *red_drawable = drawable->red_drawable;
+    VideoStream *stream = drawable->stream;
+
+    if (!stream || red_drawable->type != QXL_DRAW_COPY) {
+        return;
+    }
+
+    int stream_id = display_channel_get_video_stream_id(DCC_TO_DC(dcc), stream);
+    VideoEncoder *video_encoder = dcc->priv->stream_agents[stream_id].video_encoder;
+    SpiceCopy *copy = &red_drawable->u.copy;
+
+    if (!video_encoder || !video_encoder->submit_frame ||
+        copy->src_bitmap->descriptor.type != SPICE_IMAGE_TYPE_BITMAP) {
+        return;
+    }
+    if (video_stream_is_sized_frame(stream, red_drawable) &&
+        !dcc->test_remote_cap(SPICE_DISPLAY_CAP_SIZED_STREAM)) {
+        return;
+    }
+
+    /* workaround for vga streams */
+    dpi->video_frame_mm_time = red_drawable->mm_time ? red_drawable->mm_time : reds_get_mm_time();
+    dpi->video_frame = video_encoder->submit_frame(video_encoder, dpi->video_frame_mm_time,
+                                                   &copy->src_bitmap->u.bitmap,
+                                                   &copy->src_area, stream->top_down,
+                                                   red_drawable);
+}
+
 void dcc_prepend_drawable(DisplayChannelClient *dcc, Drawable *drawable)
 {
     auto dpi = red::make_shared<RedDrawablePipeItem>(dcc, drawable);
 
     add_drawable_surface_images(dcc, drawable);
+    dcc_drawable_submit_compress_job(dcc, dpi.get());
+    dcc_drawable_submit_video_frame(dcc, dpi.get());
     dcc->pipe_add(std::move(dpi));
 }
 
@@ -323,6 +533,8 @@ void dcc_append_drawable(DisplayChannelClient *dcc, Drawable *drawable)
     auto dpi = red::make_shared<RedDrawablePipeItem>(dcc, drawable);
 
     add_drawable_surface_images(dcc, drawable);
+    dcc_drawable_submit_compress_job(dcc, dpi.get());
+    dcc_drawable_submit_video_frame(dcc, dpi.get());
     dcc->pipe_add_tail(std::move(dpi));
 }
 
@@ -331,6 +543,8 @@ void dcc_add_drawable_after(DisplayChannelClient *dcc, Drawable *drawable, RedPi
     auto dpi = red::make_shared<RedDrawablePipeItem>(dcc, drawable);
 
     add_drawable_surface_images(dcc, drawable);
+    dcc_drawable_submit_compress_job(dcc, dpi.get());
+    dcc_drawable_submit_video_frame(dcc, dpi.get());
     dcc->pipe_add_after(std::move(dpi), pos);
 }
 
@@ -653,61 +867,280 @@ static SpiceImageCompression get_compression_for_bitmap(SpiceBitmap *bitmap,
     return SPICE_IMAGE_COMPRESSION_INVALID;
 }
 
+/* Which job of the encoder pool would produce the same result as
+ * dcc_compress_image(). Returns FALSE if the compression can't be offloaded */
+static bool get_compress_job_type(DisplayChannelClient *dcc, SpiceBitmap *src,
+                                  SpiceImageCompression image_compression, int can_lossy,
+                                  ImageEncoderJobType *type)
+{
+    DisplayChannel *display_channel = DCC_TO_DC(dcc);
+
+    switch (image_compression) {
+    case SPICE_IMAGE_COMPRESSION_QUIC:
+        if (can_lossy && display_channel->priv->enable_jpeg &&
+            (src->format != SPICE_BITMAP_FMT_RGBA || !bitmap_has_extra_stride(src))) {
+            *type = IMAGE_ENCODER_JOB_JPEG;
+        } else {
+            *type = IMAGE_ENCODER_JOB_QUIC;
+        }
+        return TRUE;
+#ifdef USE_LZ4
+    case SPICE_IMAGE_COMPRESSION_LZ4:
+        if (dcc->test_remote_cap(SPICE_DISPLAY_CAP_LZ4_COMPRESSION)) {
+            *type = IMAGE_ENCODER_JOB_LZ4;
+            return TRUE;
+        }
+        /* fall through */
+#endif
+    case SPICE_IMAGE_COMPRESSION_LZ:
+        *type = IMAGE_ENCODER_JOB_LZ;
+        return TRUE;
+    default:
+        /* GLZ must be encoded in sending order */
+        return FALSE;
+    }
+}
+
+/* Whether @job compresses @src as @type, with the same quality for JPEG */
+static bool compress_job_matches(const ImageEncoderJob *job, const SpiceBitmap *src,
+                                 ImageEncoderJobType type, int jpeg_quality)
+{
+    return job && image_encoder_job_is_for(job, src) &&
+           image_encoder_job_get_type(job) == type &&
+           (type != IMAGE_ENCODER_JOB_JPEG ||
+            image_encoder_job_get_jpeg_quality(job) == jpeg_quality);
+}
+
+static ImageEncoderJob *dcc_submit_compress_job(DisplayChannelClient *dcc, SpiceBitmap *src,
+                                                Drawable *drawable, int can_lossy,
+                                                bool own_chunks)
+{
+    DisplayChannel *display_channel = DCC_TO_DC(dcc);
+    SpiceImageCompression image_compression;
+    ImageEncoderJobType type;
+
+    /* images are not compressed on local connections, see fill_bits */
+    if (red_stream_get_family(dcc->get_stream()) == AF_UNIX) {
+        return NULL;
+    }
+
+    image_compression = get_compression_for_bitmap(src, dcc->priv->image_compression, drawable);
+    if (!get_compress_job_type(dcc, src, image_compression, can_lossy, &type)) {
+        return NULL;
+    }
+
+    /* already compressed for another client, the data will be shared,
+     * see dcc_share_compressed_image */
+    if (drawable) {
+        for (GList *l = drawable->pipes; l != NULL; l = l->next) {
+            RedDrawablePipeItem *dpi = (RedDrawablePipeItem *) l->data;
+            if (compress_job_matches(dpi->compress_job, src, type,
+                                     dcc->priv->encoders.jpeg_quality)) {
+                return NULL;
+            }
+        }
+    }
+
+    return image_encoder_pool_submit(display_channel->priv->encoder_pool, type,
+                                     dcc->priv->encoders.jpeg_quality, src, own_chunks);
+}
+
+/* Use the result of the pool job submitted for @src, if any.
+ * Returns FALSE if the image still needs to be compressed */
+static bool dcc_compress_image_from_job(DisplayChannelClient *dcc,
+                                        SpiceImage *dest, SpiceBitmap *src,
+                                        SpiceImageCompression image_compression,
+                                        int can_lossy,
+                                        compress_send_data_t* o_comp_data,
+                                        int *success)
+{
+    ImageEncoderJob *job = dcc->priv->send_data.compress_job;
+    ImageEncoderJobType type;
+
+    if (!job || !image_encoder_job_is_for(job, src)) {
+        return FALSE;
+    }
+    dcc->priv->send_data.compress_job = NULL;
+
+    /* settings changed since the submission */
+    if (!get_compress_job_type(dcc, src, image_compression, can_lossy, &type) ||
+        type != image_encoder_job_get_type(job)) {
+        return FALSE;
+    }
+
+    switch (image_encoder_job_take_result(job, dest, o_comp_data)) {
+    case IMAGE_ENCODER_JOB_RESULT_SUCCESS:
+        *success = TRUE;
+        return TRUE;
+    case IMAGE_ENCODER_JOB_RESULT_FAILED:
+        *success = FALSE;
+        return TRUE;
+    default:
+        return FALSE;
+    }
+}
+
+/* Reuse the data compressed for another client from the same bitmap of
+ * @drawable with the same settings, if any */
+static bool dcc_compress_image_from_shared(DisplayChannelClient *dcc,
+                                           SpiceImage *dest, SpiceBitmap *src,
+                                           Drawable *drawable,
+                                           SpiceImageCompression image_compression,
+                                           int can_lossy,
+                                           compress_send_data_t* o_comp_data)
+{
+    ImageEncoderJobType type;
+    GList *l;
+
+    if (!drawable || !drawable->compressed_images ||
+        !get_compress_job_type(dcc, src, image_compression, can_lossy, &type)) {
+        return FALSE;
+    }
+
+    for (l = drawable->compressed_images; l != NULL; l = l->next) {
+        RedSharedCompressedImage *shared = (RedSharedCompressedImage *) l->data;
+
+        if (shared->src != src || shared->encoding != type ||
+            (type == IMAGE_ENCODER_JOB_JPEG &&
+             shared->jpeg_quality != dcc->priv->encoders.jpeg_quality)) {
+            continue;
+        }
+        dest->descriptor.type = shared->image.descriptor.type;
+        dest->u = shared->image.u;
+        *o_comp_data = shared->comp_data;
+        return TRUE;
+    }
+    return FALSE;
+}
+
+/* Keep the data just compressed on @drawable if other clients will have to
+ * send it too. GLZ data depends on the dictionary of each client and is
+ * never shared */
+static void dcc_share_compressed_image(DisplayChannelClient *dcc,
+                                       SpiceImage *dest, SpiceBitmap *src,
+                                       Drawable *drawable,
+                                       SpiceImageCompression image_compression,
+                                       int can_lossy,
+                                       compress_send_data_t* o_comp_data)
+{
+    RedSharedCompressedImage *shared;
+    ImageEncoderJobType type;
+
+    /* the drawable is queued to the pipe of another client */
+    if (!drawable || g_list_length(drawable->pipes) < 2 ||
+        !get_compress_job_type(dcc, src, image_compression, can_lossy, &type)) {
+        return;
+    }
+
+    shared = red_shared_compressed_image_new(src, type, dcc->priv->encoders.jpeg_quality,
+                                             dest, o_comp_data);
+    /* palette cache flags are set for each client */
+    if (dest->descriptor.type == SPICE_IMAGE_TYPE_LZ_PLT) {
+        shared->image.u.lz_plt.flags &= ~(SPICE_BITMAP_FLAGS_PAL_FROM_CACHE |
+                                          SPICE_BITMAP_FLAGS_PAL_CACHE_ME);
+    }
+    drawable->compressed_images = g_list_prepend(drawable->compressed_images, shared);
+    o_comp_data->shared = shared;
+
+    /* the other clients will use the shared data, don't compress it again */
+    for (GList *l = drawable->pipes; l != NULL; l = l->next) {
+        RedDrawablePipeItem *dpi = (RedDrawablePipeItem *) l->data;
+        if (dpi->dcc != dcc &&
+            compress_job_matches(dpi->compress_job, src, type, shared->jpeg_quality)) {
+            image_encoder_job_cancel(dpi->compress_job);
+        }
+    }
+}
+
 int dcc_compress_image(DisplayChannelClient *dcc,
                        SpiceImage *dest, SpiceBitmap *src, Drawable *drawable,
                        int can_lossy,
                        compress_send_data_t* o_comp_data)
 {
     DisplayChannel *display_channel = DCC_TO_DC(dcc);
-    SpiceImageCompression image_compression;
+    SpiceImageCompression image_compression, requested_compression;
     stat_start_time_t start_time;
     int success = FALSE;
+    bool already_compressed = false;
 
     stat_start_time_init(&start_time, &display_channel->priv->encoder_shared_data.off_stat);
+    if (drawable) {
+        frame_trace_mark(&drawable->red_drawable->trace, FRAME_TRACE_COMPRESS_START);
+    }
 
     image_compression = get_compression_for_bitmap(src, dcc->priv->image_compression, drawable);
-    switch (image_compression) {
-    case SPICE_IMAGE_COMPRESSION_OFF:
-        break;
-    case SPICE_IMAGE_COMPRESSION_QUIC:
-        if (can_lossy && display_channel->priv->enable_jpeg &&
-            (src->format != SPICE_BITMAP_FMT_RGBA || !bitmap_has_extra_stride(src))) {
-            success = image_encoders_compress_jpeg(&dcc->priv->encoders, dest, src, o_comp_data);
-            break;
+    requested_compression = image_compression;
+    if (dcc_compress_image_from_shared(dcc, dest, src, drawable, image_compression, can_lossy,
+                                       o_comp_data)) {
+        ImageEncoderJob *job = dcc->priv->send_data.compress_job;
+
+        /* the job of this client is not needed, the item releases it */
+        if (job && image_encoder_job_is_for(job, src)) {
+            image_encoder_job_cancel(job);
+            dcc->priv->send_data.compress_job = NULL;
         }
-        success = image_encoders_compress_quic(&dcc->priv->encoders, dest, src, o_comp_data);
-        break;
-    case SPICE_IMAGE_COMPRESSION_GLZ:
-        success = image_encoders_compress_glz(&dcc->priv->encoders, dest, src,
-                                              drawable->red_drawable, &drawable->glz_retention,
-                                              o_comp_data,
-                                              display_channel->priv->enable_zlib_glz_wrap);
-        if (success) {
-            break;
+        success = TRUE;
+        already_compressed = true;
+    } else if (dcc_compress_image_from_job(dcc, dest, src, image_compression, can_lossy,
+                                           o_comp_data, &success)) {
+        already_compressed = true;
+    }
+
+    if (already_compressed) {
+        /* compressed by the encoder pool or for another client */
+        if (success && dest->descriptor.type == SPICE_IMAGE_TYPE_LZ_PLT) {
+            dcc_palette_cache_palette(dcc, dest->u.lz_plt.palette, &(dest->u.lz_plt.flags));
         }
-        goto lz_compress;
-#ifdef USE_LZ4
-    case SPICE_IMAGE_COMPRESSION_LZ4:
-        if (dcc->test_remote_cap(SPICE_DISPLAY_CAP_LZ4_COMPRESSION)) {
-            success = image_encoders_compress_lz4(&dcc->priv->encoders, dest, src, o_comp_data);
+    } else {
+        switch (image_compression) {
+        case SPICE_IMAGE_COMPRESSION_OFF:
             break;
-        }
+        case SPICE_IMAGE_COMPRESSION_QUIC:
+            if (can_lossy && display_channel->priv->enable_jpeg &&
+                (src->format != SPICE_BITMAP_FMT_RGBA || !bitmap_has_extra_stride(src))) {
+                success = image_encoders_compress_jpeg(&dcc->priv->encoders, dest, src, o_comp_data);
+                break;
+            }
+            success = image_encoders_compress_quic(&dcc->priv->encoders, dest, src, o_comp_data);
+            break;
+        case SPICE_IMAGE_COMPRESSION_GLZ:
+            success = image_encoders_compress_glz(&dcc->priv->encoders, dest, src,
+                                                  drawable->red_drawable, &drawable->glz_retention,
+                                                  o_comp_data,
+                                                  display_channel->priv->enable_zlib_glz_wrap);
+            if (success) {
+                break;
+            }
+            goto lz_compress;
+#ifdef USE_LZ4
+        case SPICE_IMAGE_COMPRESSION_LZ4:
+            if (dcc->test_remote_cap(SPICE_DISPLAY_CAP_LZ4_COMPRESSION)) {
+                success = image_encoders_compress_lz4(&dcc->priv->encoders, dest, src, o_comp_data);
+                break;
+            }
 #endif
-        /* fall through */
-    case SPICE_IMAGE_COMPRESSION_LZ:
+            /* fall through */
+        case SPICE_IMAGE_COMPRESSION_LZ:
 lz_compress:
-        success = image_encoders_compress_lz(&dcc->priv->encoders, dest, src, o_comp_data);
-        if (success && !bitmap_fmt_is_rgb(src->format)) {
-            dcc_palette_cache_palette(dcc, dest->u.lz_plt.palette, &(dest->u.lz_plt.flags));
+            success = image_encoders_compress_lz(&dcc->priv->encoders, dest, src, o_comp_data);
+            if (success && !bitmap_fmt_is_rgb(src->format)) {
+                dcc_palette_cache_palette(dcc, dest->u.lz_plt.palette, &(dest->u.lz_plt.flags));
+            }
+            break;
+        default:
+            spice_error("invalid image compression type %u", image_compression);
         }
-        break;
-    default:
-        spice_error("invalid image compression type %u", image_compression);
     }
 
     if (!success) {
         uint64_t image_size = src->stride * (uint64_t)src->y;
         stat_compress_add(&display_channel->priv->encoder_shared_data.off_stat, start_time, image_size, image_size);
+    } else if (!o_comp_data->shared) {
+        dcc_share_compressed_image(dcc, dest, src, drawable, requested_compression, can_lossy,
+                                   o_comp_data);
+    }
+    if (drawable) {
+        frame_trace_mark(&drawable->red_drawable->trace, FRAME_TRACE_COMPRESS_END);
     }
 
     return success;
@@ -760,16 +1193,15 @@ static void dcc_push_release(DisplayChannelClient *dcc, uint8_t type, uint64_t i
 }
 
 bool dcc_pixmap_cache_unlocked_add(DisplayChannelClient *dcc, uint64_t id,
-                                   uint32_t size, int lossy)
+                                   uint32_t size, int lossy, uint32_t cost)
 {
+    DisplayChannel *display = DCC_TO_DC(dcc);
     PixmapCache *cache = dcc->priv->pixmap_cache;
     NewCacheItem *item;
     uint64_t serial;
-    int key;
 
     spice_assert(size > 0);
 
-    item = g_new(NewCacheItem, 1);
     serial = dcc->get_message_serial();
 
     if (cache->generation != dcc->priv->pixmap_cache_generation) {
@@ -777,48 +1209,31 @@ bool dcc_pixmap_cache_unlocked_add(DisplayChannelClient *dcc, uint64_t id,
             dcc->pipe_add_type(RED_PIPE_ITEM_TYPE_PIXMAP_SYNC);
             dcc->priv->pending_pixmaps_sync = TRUE;
         }
-        g_free(item);
         return FALSE;
     }
 
     cache->available -= size;
     while (cache->available < 0) {
-        NewCacheItem *tail;
-        NewCacheItem **now;
+        NewCacheItem *victim;
 
-        SPICE_VERIFY(SPICE_OFFSETOF(NewCacheItem, lru_link) == 0);
-        if (!(tail = SPICE_CONTAINEROF(ring_get_tail(&cache->lru), NewCacheItem, lru_link)) ||
-                                                     tail->sync[dcc->priv->id] == serial) {
+        /* items used by the message being sent can't be released */
+        victim = pixmap_cache_unlocked_get_unused_victim(cache, dcc->priv->id, serial);
+        if (!victim) {
+            pixmap_cache_unlocked_end_eviction(cache);
             cache->available += size;
-            g_free(item);
             return FALSE;
         }
 
-        now = &cache->hash_table[BITS_CACHE_HASH_KEY(tail->id)];
-        for (;;) {
-            spice_assert(*now);
-            if (*now == tail) {
-                *now = tail->next;
-                break;
-            }
-            now = &(*now)->next;
-        }
-        ring_remove(&tail->lru_link);
-        cache->items--;
-        cache->available += tail->size;
+        cache->available += victim->size;
         cache->sync[dcc->priv->id] = serial;
-        dcc_push_release(dcc, SPICE_RES_TYPE_PIXMAP, tail->id, tail->sync);
-        g_free(tail);
-    }
-    ++cache->items;
-    item->next = cache->hash_table[(key = BITS_CACHE_HASH_KEY(id))];
-    cache->hash_table[key] = item;
-    ring_item_init(&item->lru_link);
-    ring_add(&cache->lru, &item->lru_link);
-    item->id = id;
-    item->size = size;
+        dcc_push_release(dcc, SPICE_RES_TYPE_PIXMAP, victim->id, victim->sync);
+        stat_inc_counter(display->priv->pixmap_cache_evictions_counter, 1);
+        stat_inc_counter(display->priv->pixmap_cache_evicted_pixels_counter, victim->size);
+        pixmap_cache_unlocked_remove(cache, victim);
+    }
+    pixmap_cache_unlocked_end_eviction(cache);
+    item = pixmap_cache_unlocked_insert(cache, id, size, cost);
     item->lossy = lossy;
-    memset(item->sync, 0, sizeof(item->sync));
     item->sync[dcc->priv->id] = serial;
     cache->sync[dcc->priv->id] = serial;
     return TRUE;
@@ -1208,9 +1623,118 @@ bool DisplayChannelClient::config_socket()
 
     is_low_bandwidth = mcc->is_low_bandwidth();
 
+    // images and video frames are large enough to save the copy to the socket
+    if (g_strcmp0(getenv(RED_STREAM_ZEROCOPY_ENV), "1") == 0 &&
+        !red_stream_enable_zerocopy(get_stream())) {
+        spice_debug("zero copy sends not available on this connection");
+    }
+
     return CommonGraphicsChannelClient::config_socket();
 }
 
+/* the display channel carries most of the data to the client, its estimate
+ * is the one shared with the other channels through the main channel */
+void DisplayChannelClient::on_bandwidth_estimate(uint64_t bits_per_sec, uint32_t roundtrip_us)
+{
+    MainChannelClient *mcc = get_client()->get_main();
+
+    mcc->update_network_estimate(bits_per_sec, roundtrip_us);
+    if (is_low_bandwidth != mcc->is_low_bandwidth()) {
+        is_low_bandwidth = mcc->is_low_bandwidth();
+        spice_debug("bandwidth %" G_GUINT64_FORMAT " bps, %s bandwidth",
+                    bits_per_sec, is_low_bandwidth ? "low" : "high");
+        display_channel_update_compression(DCC_TO_DC(this), this);
+    }
+    update_pipe_bytes_budget();
+}
+
+/* Value written to wake up the worker when a video frame is compressed */
+#ifdef HAVE_SYS_EVENTFD_H
+typedef uint64_t VideoFrameDoorbell;
+#else
+typedef uint8_t VideoFrameDoorbell;
+#endif
+
+static void dcc_video_frame_event(int fd, int event, DisplayChannelClient *dcc)
+{
+    VideoFrameDoorbell doorbell;
+
+    if (socket_read(fd, &doorbell, sizeof(doorbell)) <= 0) {
+        return;
+    }
+    /* the frames compressed from now on have to wake us up again, the ones
+     * compressed before are found by the push */
+    dcc->priv->video_frame_notified.store(false);
+    dcc->push();
+}
+
+bool dcc_video_frame_wakeup_init(DisplayChannelClient *dcc)
+{
+    DisplayChannelClientPrivate *priv = dcc->priv.get();
+
+    if (priv->video_frame_watch) {
+        return true;
+    }
+#ifdef HAVE_SYS_EVENTFD_H
+    int fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+
+    if (fd == -1) {
+        spice_warning("eventfd failed %s", strerror(errno));
+        return false;
+    }
+    priv->video_frame_recv_fd = fd;
+    priv->video_frame_send_fd = fd;
+#else
+    int channels[2];
+
+    if (socketpair(AF_LOCAL, SOCK_STREAM, 0, channels) == -1) {
+        spice_warning("socketpair failed %s", strerror(errno));
+        return false;
+    }
+    red_socket_set_non_blocking(channels[0], TRUE);
+    priv->video_frame_recv_fd = channels[0];
+    priv->video_frame_send_fd = channels[1];
+#endif
+    SpiceCoreInterfaceInternal *core = dcc->get_channel()->get_core_interface();
+    priv->video_frame_watch = core->watch_new(priv->video_frame_recv_fd, SPICE_WATCH_EVENT_READ,
+                                              dcc_video_frame_event, dcc);
+    return true;
+}
+
+void dcc_video_frame_done(void *opaque)
+{
+    auto dcc = static_cast<DisplayChannelClient *>(opaque);
+    DisplayChannelClientPrivate *priv = dcc->priv.get();
+    VideoFrameDoorbell doorbell = 1;
+
+    /* the worker has still to handle a previous notification, it will find
+     * this frame too */
+    if (priv->video_frame_notified.exchange(true)) {
+        return;
+    }
+    if (socket_write(priv->video_frame_send_fd, &doorbell, sizeof(doorbell)) == -1) {
+        spice_warning("failed to wake up the worker for a video frame");
+    }
+}
+
+bool DisplayChannelClient::pipe_item_is_ready(RedPipeItem *item)
+{
+    if (item->type != RED_PIPE_ITEM_TYPE_DRAW) {
+        return true;
+    }
+
+    auto dpi = static_cast<RedDrawablePipeItem*>(item);
+    /* the frame is not used if the drawable left the stream */
+    if (!dpi->video_frame || !dpi->drawable->stream ||
+        video_encoder_frame_is_done(dpi->video_frame)) {
+        return true;
+    }
+
+    /* the encoder thread wakes up the worker to push again once the frame
+     * is compressed, see dcc_video_frame_done() */
+    return false;
+}
+
 void DisplayChannelClient::on_disconnect()
 {
     DisplayChannel *display;
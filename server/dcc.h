@@ -50,10 +50,13 @@ protected:
     virtual bool config_socket() override;
     virtual void on_disconnect() override;
     virtual void send_item(RedPipeItem *item) override;
+    virtual void on_message_sent() override;
     virtual bool handle_migrate_data(uint32_t size, void *message) override;
     virtual void migrate() override;
     virtual void handle_migrate_flush_mark() override;
     virtual bool handle_migrate_data_get_serial(uint32_t size, void *message, uint64_t &serial) override;
+    virtual void on_bandwidth_estimate(uint64_t bits_per_sec, uint32_t roundtrip_us) override;
+    virtual bool pipe_item_is_ready(RedPipeItem *item) override;
 
 public:
     red::unique_link<DisplayChannelClientPrivate> priv;
@@ -75,8 +78,16 @@ public:
 
 #define WIDE_CLIENT_ACK_WINDOW 40
 #define NARROW_CLIENT_ACK_WINDOW 20
+/* bounds of the ack window adapted to the link, the fixed ones above are
+ * the initial values */
+#define MIN_CLIENT_ACK_WINDOW 8
+#define MAX_CLIENT_ACK_WINDOW 160
 
-#define MAX_PIPE_SIZE 50
+/* Maximum number of items in a client pipe before the worker stops processing
+ * commands. The pipes are mainly limited by their byte budget
+ * (see RedChannelClient::is_pipe_full()), this only bounds the number of
+ * small items */
+#define MAX_PIPE_SIZE 200
 
 struct DisplayChannel;
 struct VideoStream;
@@ -123,7 +134,8 @@ void                       dcc_palette_cache_palette                 (DisplayCha
                                                                       SpicePalette *palette,
                                                                       uint8_t *flags);
 bool                       dcc_pixmap_cache_unlocked_add             (DisplayChannelClient *dcc,
-                                                                      uint64_t id, uint32_t size, int lossy);
+                                                                      uint64_t id, uint32_t size, int lossy,
+                                                                      uint32_t cost);
 void                       dcc_prepend_drawable                      (DisplayChannelClient *dcc,
                                                                       Drawable *drawable);
 void                       dcc_append_drawable                       (DisplayChannelClient *dcc,
@@ -158,6 +170,12 @@ void dcc_set_max_stream_bit_rate(DisplayChannelClient *dcc, uint64_t rate);
 gboolean dcc_is_low_bandwidth(DisplayChannelClient *dcc);
 GArray *dcc_get_preferred_video_codecs_for_encoding(DisplayChannelClient *dcc);
 void dcc_video_codecs_update(DisplayChannelClient *dcc);
+/* Prepares the wake up of the worker by dcc_video_frame_done(), must be
+ * called before starting a video encoder thread */
+bool dcc_video_frame_wakeup_init(DisplayChannelClient *dcc);
+/* The video_encoder_frame_done_t of the video encoder threads of @opaque,
+ * a DisplayChannelClient */
+void dcc_video_frame_done(void *opaque);
 
 #include "pop-visibility.h"
 
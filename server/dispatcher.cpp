@@ -22,17 +22,30 @@
 #include <string.h>
 #include <pthread.h>
 #include <fcntl.h>
+#include <atomic>
 #ifndef _WIN32
 #include <poll.h>
 #endif
+#ifdef HAVE_SYS_EVENTFD_H
+#include <sys/eventfd.h>
+#endif
 
 #include "dispatcher.h"
 
 #define DISPATCHER_MESSAGE_TYPE_CUSTOM 0x7fffffffu
 
+/* Size of the ring containing the queued messages, must be a power of 2 */
+#define DISPATCHER_RING_SIZE (64 * 1024)
+
+/* Value written to the doorbell file descriptor to wake up the receiver */
+#ifdef HAVE_SYS_EVENTFD_H
+typedef uint64_t DispatcherDoorbell;
+#else
+typedef uint8_t DispatcherDoorbell;
+#endif
+
 /* structure to store message header information.
- * That structure is sent through a socketpair so it's optimized
- * to be transfered via sockets.
+ * That structure is copied to the message ring followed by the payload.
  * Is also packaged to not leave holes in both 32 and 64 environments
  * so memory instrumentation tools should not find uninitialised bytes.
  */
@@ -43,6 +56,12 @@ struct DispatcherMessage {
     uint32_t ack:1;
 };
 
+/* Messages are stored in a single-producer/single-consumer ring, senders
+ * are serialized by the lock so the ring has a single producer at a time.
+ * The receiver is woken up using a file descriptor (an eventfd where
+ * available) which is written only if a previous notification has
+ * not been handled yet, so a burst of messages costs a single syscall.
+ */
 struct DispatcherPrivate {
     SPICE_CXX_GLIB_ALLOCATOR
     DispatcherPrivate(uint32_t init_max_message_type):
@@ -54,6 +73,11 @@ struct DispatcherPrivate {
     bool handle_single_read();
     static void handle_event(int fd, int event, DispatcherPrivate* priv);
 
+    void ring_write(uint32_t pos, const void *data, size_t size);
+    void ring_read(uint32_t pos, void *data, size_t size);
+    void wait_ring_space(uint32_t head, uint32_t size);
+    void notify_receiver();
+
     int recv_fd;
     int send_fd;
     pthread_mutex_t lock;
@@ -63,15 +87,34 @@ struct DispatcherPrivate {
     size_t payload_size; /* used to track realloc calls */
     void *opaque;
     dispatcher_handle_any_message any_handler;
+
+    uint8_t *ring;
+    /* positions are free running, the offset is computed masking them */
+    std::atomic<uint32_t> ring_head{0}; /* written only by the sender */
+    std::atomic<uint32_t> ring_tail{0}; /* written only by the receiver */
+    /* the receiver was notified and did not handle the notification yet */
+    std::atomic<bool> notified{false};
+    /* a sender is waiting for space in the ring */
+    std::atomic<bool> sender_waiting{false};
+
+    /* used by the sender to wait for ring space or for an ACK */
+    pthread_mutex_t wait_lock;
+    pthread_cond_t wait_cond;
+    bool acked;
 };
 
 DispatcherPrivate::~DispatcherPrivate()
 {
     g_free(messages);
-    socket_close(send_fd);
+    if (send_fd != recv_fd) {
+        socket_close(send_fd);
+    }
     socket_close(recv_fd);
     pthread_mutex_destroy(&lock);
+    pthread_cond_destroy(&wait_cond);
+    pthread_mutex_destroy(&wait_lock);
     g_free(payload);
+    g_free(ring);
 }
 
 Dispatcher::~Dispatcher()
@@ -81,21 +124,33 @@ Dispatcher::~Dispatcher()
 Dispatcher::Dispatcher(uint32_t max_message_type):
     priv(new DispatcherPrivate(max_message_type))
 {
+#ifdef HAVE_SYS_EVENTFD_H
+    int fd = eventfd(0, EFD_CLOEXEC);
+
+    if (fd == -1) {
+        spice_error("eventfd failed %s", strerror(errno));
+        return;
+    }
+    priv->recv_fd = fd;
+    priv->send_fd = fd;
+#else
     int channels[2];
 
     if (socketpair(AF_LOCAL, SOCK_STREAM, 0, channels) == -1) {
         spice_error("socketpair failed %s", strerror(errno));
         return;
     }
-    pthread_mutex_init(&priv->lock, NULL);
     priv->recv_fd = channels[0];
     priv->send_fd = channels[1];
+#endif
+    pthread_mutex_init(&priv->lock, NULL);
+    pthread_mutex_init(&priv->wait_lock, NULL);
+    pthread_cond_init(&priv->wait_cond, NULL);
 
+    priv->ring = (uint8_t *) g_malloc(DISPATCHER_RING_SIZE);
     priv->messages = g_new0(DispatcherMessage, priv->max_message_type);
 }
 
-#define ACK 0xffffffff
-
 /*
  * read_safe
  * helper. reads until size bytes accumulated in buf, if an error other then
@@ -188,29 +243,53 @@ static int write_safe(int fd, uint8_t *buf, size_t size)
     return written_size;
 }
 
+void DispatcherPrivate::ring_write(uint32_t pos, const void *data, size_t size)
+{
+    uint32_t offset = pos & (DISPATCHER_RING_SIZE - 1);
+    size_t first = MIN(size, DISPATCHER_RING_SIZE - offset);
+
+    memcpy(ring + offset, data, first);
+    memcpy(ring, (const uint8_t *) data + first, size - first);
+}
+
+void DispatcherPrivate::ring_read(uint32_t pos, void *data, size_t size)
+{
+    uint32_t offset = pos & (DISPATCHER_RING_SIZE - 1);
+    size_t first = MIN(size, DISPATCHER_RING_SIZE - offset);
+
+    memcpy(data, ring + offset, first);
+    memcpy((uint8_t *) data + first, ring, size - first);
+}
+
+static inline uint32_t message_ring_size(const DispatcherMessage *msg)
+{
+    return SPICE_ALIGN(sizeof(*msg) + msg->size, sizeof(uint64_t));
+}
+
 bool DispatcherPrivate::handle_single_read()
 {
-    int ret;
     DispatcherMessage msg[1];
-    uint32_t ack = ACK;
+    uint32_t tail = ring_tail.load(std::memory_order_relaxed);
 
-    if ((ret = read_safe(recv_fd, (uint8_t*)msg, sizeof(msg), 0)) == -1) {
-        g_warning("error reading from dispatcher: %d", errno);
-        return false;
-    }
-    if (ret == 0) {
+    if (ring_head.load() == tail) {
         /* no message */
         return false;
     }
+    ring_read(tail, msg, sizeof(msg));
     if (G_UNLIKELY(msg->size > payload_size)) {
         payload = g_realloc(payload, msg->size);
         payload_size = msg->size;
     }
-    if (read_safe(recv_fd, (uint8_t*) payload, msg->size, 1) == -1) {
-        g_warning("error reading from dispatcher: %d", errno);
-        /* TODO: close socketpair? */
-        return false;
+    ring_read(tail + sizeof(msg), payload, msg->size);
+
+    /* the payload was copied, release the space to the sender */
+    ring_tail.store(tail + message_ring_size(msg));
+    if (sender_waiting.load()) {
+        pthread_mutex_lock(&wait_lock);
+        pthread_cond_broadcast(&wait_cond);
+        pthread_mutex_unlock(&wait_lock);
     }
+
     if (any_handler && msg->type != DISPATCHER_MESSAGE_TYPE_CUSTOM) {
         any_handler(opaque, msg->type, payload);
     }
@@ -220,49 +299,88 @@ bool DispatcherPrivate::handle_single_read()
         g_warning("error: no handler for message type %d", msg->type);
     }
     if (msg->ack) {
-        if (write_safe(recv_fd, (uint8_t*)&ack, sizeof(ack)) == -1) {
-            g_warning("error writing ack for message %d", msg->type);
-            /* TODO: close socketpair? */
-        }
+        pthread_mutex_lock(&wait_lock);
+        acked = true;
+        pthread_cond_broadcast(&wait_cond);
+        pthread_mutex_unlock(&wait_lock);
     }
     return true;
 }
 
 /*
  * handle_event
- * doesn't handle being in the middle of a message. all reads are blocking.
+ * handles all the messages queued in the ring.
  */
 void DispatcherPrivate::handle_event(int fd, int event, DispatcherPrivate* priv)
 {
+    DispatcherDoorbell doorbell;
+
+    if (read_safe(priv->recv_fd, (uint8_t*)&doorbell, sizeof(doorbell), 0) <= 0) {
+        return;
+    }
+    /* from now on senders have to notify us again, messages queued before
+     * are handled by the loop below */
+    priv->notified.store(false);
     while (priv->handle_single_read()) {
     }
 }
 
+void DispatcherPrivate::notify_receiver()
+{
+    DispatcherDoorbell doorbell = 1;
+
+    /* the receiver has still to handle a previous notification,
+     * it will find this message too */
+    if (notified.exchange(true)) {
+        return;
+    }
+    if (write_safe(send_fd, (uint8_t*)&doorbell, sizeof(doorbell)) == -1) {
+        g_warning("error: failed to notify dispatcher receiver");
+    }
+}
+
+void DispatcherPrivate::wait_ring_space(uint32_t head, uint32_t size)
+{
+    if (head - ring_tail.load() + size <= DISPATCHER_RING_SIZE) {
+        return;
+    }
+    pthread_mutex_lock(&wait_lock);
+    sender_waiting.store(true);
+    while (head - ring_tail.load() + size > DISPATCHER_RING_SIZE) {
+        pthread_cond_wait(&wait_cond, &wait_lock);
+    }
+    sender_waiting.store(false);
+    pthread_mutex_unlock(&wait_lock);
+}
+
 void DispatcherPrivate::send_message(const DispatcherMessage& msg, void *msg_payload)
 {
-    uint32_t ack;
+    uint32_t size = message_ring_size(&msg);
+    uint32_t head;
 
-    pthread_mutex_lock(&lock);
-    if (write_safe(send_fd, (uint8_t*)&msg, sizeof(msg)) == -1) {
-        g_warning("error: failed to send message header for message %d",
-                  msg.type);
-        goto unlock;
+    if (size > DISPATCHER_RING_SIZE) {
+        g_warning("error: message %d too big for the dispatcher", msg.type);
+        return;
     }
-    if (write_safe(send_fd, (uint8_t*) msg_payload, msg.size) == -1) {
-        g_warning("error: failed to send message body for message %d",
-                  msg.type);
-        goto unlock;
+
+    pthread_mutex_lock(&lock);
+    head = ring_head.load(std::memory_order_relaxed);
+    wait_ring_space(head, size);
+    ring_write(head, &msg, sizeof(msg));
+    ring_write(head + sizeof(msg), msg_payload, msg.size);
+    if (msg.ack) {
+        acked = false;
     }
+    ring_head.store(head + size);
+    notify_receiver();
+
     if (msg.ack) {
-        if (read_safe(send_fd, (uint8_t*)&ack, sizeof(ack), 1) == -1) {
-            g_warning("error: failed to read ack");
-        } else if (ack != ACK) {
-            g_warning("error: got wrong ack value in dispatcher "
-                      "for message %d\n", msg.type);
-            /* TODO handling error? */
+        pthread_mutex_lock(&wait_lock);
+        while (!acked) {
+            pthread_cond_wait(&wait_cond, &wait_lock);
         }
+        pthread_mutex_unlock(&wait_lock);
     }
-unlock:
     pthread_mutex_unlock(&lock);
 }
 
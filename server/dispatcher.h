@@ -42,8 +42,9 @@ typedef void (*dispatcher_handle_any_message)(void *opaque,
 
 /**
  * A Dispatcher provides inter-thread communication by serializing messages.
- * Currently the Dispatcher uses a unix socket (socketpair) for dispatching the
- * messages.
+ * Messages are queued in a shared memory ring, the receiving thread is
+ * woken up using an eventfd (or a socketpair where eventfd is not available)
+ * only if it is not already going to process the ring.
  *
  * Message types are identified by a unique integer value and must first be
  * registered with the class (see register_handler()) before they
@@ -19,6 +19,9 @@
 #define DISPLAY_CHANNEL_PRIVATE_H_
 
 #include "display-channel.h"
+#include "image-encoder-pool.h"
+#include "surface-grid.h"
+#include "stream-heatmap.h"
 
 #define TRACE_ITEMS_SHIFT 3
 #define NUM_TRACE_ITEMS (1 << TRACE_ITEMS_SHIFT)
@@ -46,6 +49,11 @@ typedef struct RedSurface {
      * actually used for drawing. The ring is maintained in order of age, the
      * tail being the oldest drawable. */
     Ring current_list;
+    /* Index of the items in 'current' by position, used to only visit the
+     * items near an area when walking the tree or 'current_list' */
+    SurfaceGrid grid;
+    /* last order given to an item added to 'current' or 'current_list' */
+    uint64_t tree_seq;
     DrawContext context;
 
     Ring depend_on_me;
@@ -111,6 +119,8 @@ struct DisplayChannelPrivate
     Ring streams;
     ItemTrace items_trace[NUM_TRACE_ITEMS];
     uint32_t next_item_trace;
+    /* updates of the primary surface, to find videos the trace misses */
+    StreamHeatmap stream_heatmap;
     uint64_t streams_size_total;
 
     RedSurface surfaces[NUM_SURFACES];
@@ -121,7 +131,8 @@ struct DisplayChannelPrivate
 
     int gl_draw_async_count;
 
-/* TODO: some day unify this, make it more runtime.. */
+    /* timings, published by display_channel_publish_stats() */
+    FrameTraceStats frame_trace_stats;
     stat_info_t add_stat;
     stat_info_t exclude_stat;
     stat_info_t __exclude_stat;
@@ -132,7 +143,14 @@ struct DisplayChannelPrivate
     RedStatCounter cache_hits_counter;
     RedStatCounter add_to_cache_counter;
     RedStatCounter non_cache_counter;
+    /* named after the eviction policy to compare runs with different ones */
+    RedStatNode pixmap_cache_stat;
+    RedStatCounter pixmap_cache_lookups_counter;
+    RedStatCounter pixmap_cache_evictions_counter;
+    RedStatCounter pixmap_cache_evicted_pixels_counter;
     ImageEncoderSharedData encoder_shared_data;
+    /* optional, compresses images queued to the clients in background */
+    ImageEncoderPool *encoder_pool;
 };
 
 #define FOREACH_DCC(_channel, _data) \
@@ -204,6 +222,8 @@ struct RedGlDrawItem: public RedPipeItemNum<RED_PIPE_ITEM_TYPE_GL_DRAW> {
 };
 
 struct RedImageItem final: public RedPipeItemNum<RED_PIPE_ITEM_TYPE_IMAGE> {
+    ~RedImageItem();
+    size_t get_size_estimate() const override;
     SpicePoint pos;
     int width;
     int height;
@@ -213,21 +233,33 @@ struct RedImageItem final: public RedPipeItemNum<RED_PIPE_ITEM_TYPE_IMAGE> {
     int image_format;
     uint32_t image_flags;
     int can_lossy;
+    ImageEncoderJob *compress_job = nullptr;
     uint8_t data[0];
 };
 
 struct RedDrawablePipeItem: public RedPipeItemNum<RED_PIPE_ITEM_TYPE_DRAW> {
     RedDrawablePipeItem(DisplayChannelClient *dcc, Drawable *drawable);
     ~RedDrawablePipeItem();
+    size_t get_size_estimate() const override;
     Drawable *const drawable;
     DisplayChannelClient *const dcc;
+    /* compression of the source image submitted to the encoder pool */
+    ImageEncoderJob *compress_job = nullptr;
+    /* stream frame submitted to the video encoder thread */
+    VideoEncoderFrame *video_frame = nullptr;
+    uint32_t video_frame_mm_time = 0;
 };
 
+/* Remove @dpi from the pipe items of @drawable. Once all the clients sent
+ * the drawable the data compressed for them is released */
+void drawable_remove_pipe_item(Drawable *drawable, RedDrawablePipeItem *dpi);
+
 /* This item is used to send a full quality image (lossless) of the area where the stream was.
  * This to avoid the artifacts due to the lossy compression. */
 struct RedUpgradeItem: public RedPipeItemNum<RED_PIPE_ITEM_TYPE_UPGRADE> {
     RedUpgradeItem(Drawable *drawable);
     ~RedUpgradeItem();
+    size_t get_size_estimate() const override;
     Drawable *const drawable;
     red::glib_unique_ptr<SpiceClipRects> rects;
 };
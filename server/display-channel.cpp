@@ -51,6 +51,7 @@ DisplayChannel::~DisplayChannel()
 
     monitors_config_unref(priv->monitors_config);
     g_array_unref(priv->video_codecs);
+    image_encoder_pool_free(priv->encoder_pool);
 }
 
 static void drawable_draw(DisplayChannel *display, Drawable *drawable);
@@ -74,18 +75,36 @@ void display_channel_compress_stats_reset(DisplayChannel *display)
     image_encoder_shared_stat_reset(&display->priv->encoder_shared_data);
 }
 
+void display_channel_publish_stats(DisplayChannel *display)
+{
+    RedsState *reds = display->get_server();
+    const RedStatNode *stat = display->get_stat_node();
+
+    stat_info_publish(&display->priv->add_stat, reds, stat);
+    stat_info_publish(&display->priv->exclude_stat, reds, stat);
+    stat_info_publish(&display->priv->__exclude_stat, reds, stat);
+    frame_trace_stats_publish(&display->priv->frame_trace_stats, reds, stat);
+    image_encoder_shared_stat_publish(&display->priv->encoder_shared_data, reds, stat);
+    if (display->priv->encoder_pool) {
+        image_encoder_pool_publish_stats(display->priv->encoder_pool, reds, stat);
+    }
+}
+
 void display_channel_compress_stats_print(DisplayChannel *display_channel)
 {
-#ifdef COMPRESS_STAT
     uint32_t id;
 
     spice_return_if_fail(display_channel);
 
+#ifndef COMPRESS_STAT
+    if (!stat_is_enabled()) {
+        return;
+    }
+#endif
     id = display_channel->id();
 
     spice_info("==> Compression stats for display %u", id);
     image_encoder_shared_stat_print(&display_channel->priv->encoder_shared_data);
-#endif
 }
 
 MonitorsConfig* monitors_config_ref(MonitorsConfig *monitors_config)
@@ -251,6 +270,10 @@ void display_channel_surface_unref(DisplayChannel *display, uint32_t surface_id)
     }
 
     region_destroy(&surface->draw_dirty_region);
+    surface_grid_destroy(&surface->grid);
+    if (is_primary_surface(display, surface_id)) {
+        stream_heatmap_destroy(&display->priv->stream_heatmap);
+    }
     surface->context.canvas = NULL;
     FOREACH_DCC(display, dcc) {
         dcc_destroy_surface(dcc, surface_id);
@@ -353,6 +376,24 @@ static void pipes_add_drawable_after(DisplayChannel *display,
     }
 }
 
+static void region_get_extents_rect(const QRegion *rgn, SpiceRect *rect)
+{
+    rect->left = rgn->extents.x1;
+    rect->top = rgn->extents.y1;
+    rect->right = rgn->extents.x2;
+    rect->bottom = rgn->extents.y2;
+}
+
+/* Adds @item to the grid of @surface with the extents of its region, which
+ * contain the region for all the life of the item */
+static void surface_grid_add_tree_item(RedSurface *surface, TreeItem *item)
+{
+    SpiceRect rect;
+
+    region_get_extents_rect(&item->rgn, &rect);
+    surface_grid_add(&surface->grid, &item->grid_item, &rect);
+}
+
 static void current_add_drawable(DisplayChannel *display,
                                  Drawable *drawable, RingItem *pos)
 {
@@ -363,6 +404,8 @@ static void current_add_drawable(DisplayChannel *display,
     ring_add_after(&drawable->tree_item.base.siblings_link, pos);
     ring_add(&display->priv->current_list, &drawable->list_link);
     ring_add(&surface->current_list, &drawable->surface_list_link);
+    drawable->tree_item.base.seq = drawable->surface_list_seq = ++surface->tree_seq;
+    surface_grid_add_tree_item(surface, &drawable->tree_item.base);
     drawable->refs++;
 }
 
@@ -372,6 +415,7 @@ static void current_remove_drawable(DisplayChannel *display, Drawable *item)
 {
     /* todo: move all to unref? */
     video_stream_trace_add_drawable(display, item);
+    surface_grid_remove(&item->tree_item.base.grid_item);
     draw_item_remove_shadow(&item->tree_item);
     ring_remove(&item->tree_item.base.siblings_link);
     ring_remove(&item->list_link);
@@ -493,6 +537,8 @@ static bool current_add_equal(DisplayChannel *display, DrawItem *item, TreeItem
                         is_drawable_independent_from_surfaces(drawable);
         video_stream_maintenance(display, drawable, other_drawable);
         current_add_drawable(display, drawable, &other->siblings_link);
+        /* the new drawable takes the place of the other one */
+        drawable->tree_item.base.seq = other->seq;
         other_drawable->refs++;
         current_remove_drawable(display, other_drawable);
         if (add_after) {
@@ -536,6 +582,7 @@ static bool current_add_equal(DisplayChannel *display, DrawItem *item, TreeItem
     case QXL_EFFECT_OPAQUE_BRUSH:
         if (is_same_geometry(drawable, other_drawable)) {
             current_add_drawable(display, drawable, &other->siblings_link);
+            drawable->tree_item.base.seq = other->seq;
             drawable_remove_from_pipes(other_drawable);
             current_remove_drawable(display, other_drawable);
             pipes_add_drawable(display, drawable);
@@ -735,8 +782,9 @@ static void exclude_region(DisplayChannel *display, Ring *ring, RingItem *ring_i
 
         spice_assert(!region_is_empty(&now->rgn));
 
-        /* check whether the ring_item item intersects the passed-in region */
-        if (region_intersects(rgn, &now->rgn)) {
+        /* check whether the ring_item item intersects the passed-in region,
+         * the bounds test avoids a full region intersection for far items */
+        if (region_bounds_intersects(rgn, &now->rgn) && region_intersects(rgn, &now->rgn)) {
             /* remove the overlapping portions of region and now->rgn, among
              * other things. See documentation for __exclude_region() */
             __exclude_region(display, ring, now, rgn, &top_ring, frame_candidate);
@@ -811,6 +859,7 @@ static bool current_add_with_shadow(DisplayChannel *display, Ring *ring, Drawabl
         .y = red_drawable->u.copy_bits.src_pos.y - red_drawable->bbox.top
     };
 
+    RedSurface *surface;
     Shadow *shadow = shadow_new(&item->tree_item, &delta);
     if (!shadow) {
         stat_add(&display->priv->add_stat, start_time);
@@ -826,6 +875,9 @@ static bool current_add_with_shadow(DisplayChannel *display, Ring *ring, Drawabl
 
     /* Prepend the shadow to the beginning of the current ring */
     ring_add(ring, &shadow->base.siblings_link);
+    surface = &display->priv->surfaces[item->surface_id];
+    shadow->base.seq = ++surface->tree_seq;
+    surface_grid_add_tree_item(surface, &shadow->base);
     /* Prepend the draw item to the beginning of the current ring. NOTE: this
      * means that the drawable is placed *before* its associated shadow in the
      * tree. Changing this order will violate several unstated assumptions */
@@ -849,11 +901,61 @@ static bool current_add_with_shadow(DisplayChannel *display, Ring *ring, Drawabl
     return TRUE;
 }
 
+typedef struct NextSiblingLookup {
+    /* container of the ring, NULL for the ring of the surface */
+    Container *container;
+    const QRegion *rgn;
+    /* order of the sibling to start after */
+    uint64_t after_seq;
+    TreeItem *sibling;
+} NextSiblingLookup;
+
+static void find_next_sibling(SurfaceGridItem *grid_item, void *opaque)
+{
+    NextSiblingLookup *lookup = (NextSiblingLookup *) opaque;
+    TreeItem *item = SPICE_CONTAINEROF(grid_item, TreeItem, grid_item);
+
+    if (!region_bounds_intersects(lookup->rgn, &item->rgn)) {
+        return;
+    }
+    /* the sibling is the ancestor of the item in the ring, if any */
+    while (item->container != lookup->container) {
+        if (!item->container) {
+            return;
+        }
+        item = &item->container->base;
+    }
+    if (item->seq < lookup->after_seq &&
+        (!lookup->sibling || item->seq > lookup->sibling->seq)) {
+        lookup->sibling = item;
+    }
+}
+
+/* Returns the first item of @ring after @after (or from the head of the ring
+ * if @after is @ring) whose bounds may intersect @rgn. Only the items of
+ * @surface near @rgn are visited, the ring order being given by their seq */
+static RingItem *current_next_near(RedSurface *surface, Ring *ring, RingItem *after,
+                                   const QRegion *rgn)
+{
+    NextSiblingLookup lookup;
+    SpiceRect rect;
+
+    lookup.container = ring == &surface->current ? NULL : SPICE_CONTAINEROF(ring, Container, items);
+    lookup.rgn = rgn;
+    lookup.after_seq = after == ring ? UINT64_MAX :
+                       SPICE_CONTAINEROF(after, TreeItem, siblings_link)->seq;
+    lookup.sibling = NULL;
+    region_get_extents_rect(rgn, &rect);
+    surface_grid_foreach(&surface->grid, &rect, find_next_sibling, &lookup);
+    return lookup.sibling ? &lookup.sibling->siblings_link : NULL;
+}
+
 /* Add a @drawable (without a shadow) to the current ring.
  * The return value indicates whether the new item should be added to the pipe */
 static bool current_add(DisplayChannel *display, Ring *ring, Drawable *drawable)
 {
     DrawItem *item = &drawable->tree_item;
+    RedSurface *surface = &display->priv->surfaces[drawable->surface_id];
     RingItem *now;
     QRegion exclude_rgn;
     RingItem *exclude_base = NULL;
@@ -861,7 +963,9 @@ static bool current_add(DisplayChannel *display, Ring *ring, Drawable *drawable)
 
     spice_assert(!region_is_empty(&item->base.rgn));
     region_init(&exclude_rgn);
-    now = ring_next(ring, ring);
+    /* the siblings which can't intersect the new drawable are skipped using
+     * the grid of the surface, in the order of the ring */
+    now = current_next_near(surface, ring, ring, &item->base.rgn);
 
     /* check whether the new drawable region intersects any of the items
      * already in the 'current' ring */
@@ -872,7 +976,7 @@ static bool current_add(DisplayChannel *display, Ring *ring, Drawable *drawable)
         if (!region_bounds_intersects(&item->base.rgn, &sibling->rgn)) {
             /* the bounds of the two items are totally disjoint, so no need to
              * check further. check the next item */
-            now = ring_next(ring, now);
+            now = current_next_near(surface, ring, now, &item->base.rgn);
             continue;
         }
         /* bounds overlap, but check whether the regions actually overlap */
@@ -880,7 +984,7 @@ static bool current_add(DisplayChannel *display, Ring *ring, Drawable *drawable)
         if (!(test_res & REGION_TEST_SHARED)) {
             /* there's no overlap of the regions between these two items. Move
              * on to the next one. */
-            now = ring_next(ring, now);
+            now = current_next_near(surface, ring, now, &item->base.rgn);
             continue;
         } else if (sibling->type != TREE_ITEM_TYPE_SHADOW) {
             /* there is an overlap between the two regions */
@@ -983,7 +1087,7 @@ static bool current_add(DisplayChannel *display, Ring *ring, Drawable *drawable)
                     item->base.container = container;
                     /* Start iterating over the container's children to see if
                      * any of them intersect this new drawable */
-                    now = ring_next(ring, ring);
+                    now = current_next_near(surface, ring, ring, &item->base.rgn);
                     continue;
                 }
                 spice_assert(IS_DRAW_ITEM(sibling));
@@ -996,6 +1100,7 @@ static bool current_add(DisplayChannel *display, Ring *ring, Drawable *drawable)
                         region_destroy(&exclude_rgn);
                         return FALSE;
                     }
+                    surface_grid_add_tree_item(surface, &container->base);
                     item->base.container = container;
                     /* reset 'ring' to the container's children ring, so that
                      * we can add the new drawable to this ring below */
@@ -1369,6 +1474,7 @@ static void display_channel_add_drawable(DisplayChannel *display, Drawable *draw
         add_to_pipe = current_add(display, ring, drawable);
     }
 
+    frame_trace_mark(&red_drawable->trace, FRAME_TRACE_INSERT);
     if (add_to_pipe)
         pipes_add_drawable(display, drawable);
 
@@ -1502,24 +1608,14 @@ void display_channel_free_some(DisplayChannel *display)
     spice_debug("#draw=%d, #glz_draw=%d", display->priv->drawable_count,
                 display->priv->encoder_shared_data.glz_drawable_count);
     FOREACH_DCC(display, dcc) {
-        ImageEncoders *encoders = dcc_get_encoders(dcc);
-
-        // encoding using the dictionary is prevented since the following operations might
-        // change the dictionary
-        if (image_encoders_glz_encode_lock(encoders)) {
-            n = image_encoders_free_some_independent_glz_drawables(encoders);
-        }
+        // the other display channels can keep encoding with the shared dictionaries,
+        // the removed images are only released once they stopped reading them
+        n = image_encoders_free_some_independent_glz_drawables(dcc_get_encoders(dcc));
     }
 
     while (!ring_is_empty(&display->priv->current_list) && n++ < RED_RELEASE_BUNCH_SIZE) {
         free_one_drawable(display, TRUE);
     }
-
-    FOREACH_DCC(display, dcc) {
-        ImageEncoders *encoders = dcc_get_encoders(dcc);
-
-        image_encoders_glz_encode_unlock(encoders);
-    }
 }
 
 static Drawable* drawable_try_new(DisplayChannel *display)
@@ -1621,6 +1717,19 @@ static void drawable_unref_surface_deps(DisplayChannel *display, Drawable *drawa
     }
 }
 
+void drawable_remove_pipe_item(Drawable *drawable, RedDrawablePipeItem *dpi)
+{
+    drawable->pipes = g_list_remove(drawable->pipes, dpi);
+
+    /* all the clients sent the drawable, the data compressed for them is
+     * not needed anymore */
+    if (drawable->pipes == NULL) {
+        g_list_free_full(drawable->compressed_images,
+                         (GDestroyNotify) red_shared_compressed_image_unref);
+        drawable->compressed_images = NULL;
+    }
+}
+
 void drawable_unref(Drawable *drawable)
 {
     DisplayChannel *display = drawable->display;
@@ -1641,6 +1750,8 @@ void drawable_unref(Drawable *drawable)
     display_channel_surface_unref(display, drawable->surface_id);
 
     glz_retention_detach_drawables(&drawable->glz_retention);
+    g_list_free_full(drawable->compressed_images,
+                     (GDestroyNotify) red_shared_compressed_image_unref);
 
     if (drawable->red_drawable) {
         red_drawable_unref(drawable->red_drawable);
@@ -1848,31 +1959,50 @@ static void draw_until(DisplayChannel *display, RedSurface *surface, Drawable *l
     } while (now != last);
 }
 
-/* Find the first Drawable in the @current ring that intersects the given
- * @area, starting at item @from (or the head of the ring if @from is NULL).
- *
- * NOTE: this function expects @current to be a ring of Drawables, and more
- * specifically an instance of Surface::current_list (not Surface::current) */
-static Drawable* current_find_intersects_rect(Ring *current, RingItem *from,
-                                              const SpiceRect *area)
-{
-    RingItem *it;
+typedef struct IntersectingDrawableLookup {
     QRegion rgn;
-    Drawable *last = NULL;
+    /* order of the drawable to start from */
+    uint64_t from_seq;
+    Drawable *drawable;
+} IntersectingDrawableLookup;
 
-    region_init(&rgn);
-    region_add(&rgn, area);
+static void find_intersecting_drawable(SurfaceGridItem *grid_item, void *opaque)
+{
+    IntersectingDrawableLookup *lookup = (IntersectingDrawableLookup *) opaque;
+    TreeItem *item = SPICE_CONTAINEROF(grid_item, TreeItem, grid_item);
+    Drawable *drawable;
 
-    for (it = from ? from : ring_next(current, current); it != NULL; it = ring_next(current, it)) {
-        Drawable *now = SPICE_CONTAINEROF(it, Drawable, surface_list_link);
-        if (region_intersects(&rgn, &now->tree_item.base.rgn)) {
-            last = now;
-            break;
-        }
+    if (item->type != TREE_ITEM_TYPE_DRAWABLE) {
+        return;
+    }
+    drawable = SPICE_CONTAINEROF(item, Drawable, tree_item.base);
+    if (drawable->surface_list_seq > lookup->from_seq ||
+        (lookup->drawable && drawable->surface_list_seq < lookup->drawable->surface_list_seq)) {
+        return;
+    }
+    if (region_bounds_intersects(&lookup->rgn, &item->rgn) &&
+        region_intersects(&lookup->rgn, &item->rgn)) {
+        lookup->drawable = drawable;
     }
+}
+
+/* Find the first Drawable in the Surface::current_list ring of @surface that
+ * intersects the given @area, starting at item @from (or the head of the ring
+ * if @from is NULL). Only the drawables near @area are visited. */
+static Drawable* current_find_intersects_rect(RedSurface *surface, RingItem *from,
+                                              const SpiceRect *area)
+{
+    IntersectingDrawableLookup lookup;
 
-    region_destroy(&rgn);
-    return last;
+    region_init(&lookup.rgn);
+    region_add(&lookup.rgn, area);
+    lookup.from_seq = from ? SPICE_CONTAINEROF(from, Drawable, surface_list_link)->surface_list_seq :
+                      UINT64_MAX;
+    lookup.drawable = NULL;
+    surface_grid_foreach(&surface->grid, area, find_intersecting_drawable, &lookup);
+
+    region_destroy(&lookup.rgn);
+    return lookup.drawable;
 }
 
 /*
@@ -1915,8 +2045,7 @@ void display_channel_draw_until(DisplayChannel *display, const SpiceRect *area,
     if (!surface_last)
         return;
 
-    last = current_find_intersects_rect(&surface->current_list,
-                                        &surface_last->surface_list_link, area);
+    last = current_find_intersects_rect(surface, &surface_last->surface_list_link, area);
     if (!last)
         return;
 
@@ -1936,7 +2065,7 @@ void display_channel_draw(DisplayChannel *display, const SpiceRect *area, int su
 
     surface = &display->priv->surfaces[surface_id];
 
-    last = current_find_intersects_rect(&surface->current_list, NULL, area);
+    last = current_find_intersects_rect(surface, NULL, area);
     if (last)
         draw_until(display, surface, last);
 
@@ -2109,6 +2238,11 @@ void display_channel_create_surface(DisplayChannel *display, uint32_t surface_id
     g_warn_if_fail(surface->destroy_cmd == NULL);
     ring_init(&surface->current);
     ring_init(&surface->current_list);
+    surface_grid_init(&surface->grid, width, height);
+    if (is_primary_surface(display, surface_id)) {
+        stream_heatmap_init(&display->priv->stream_heatmap, width, height,
+                            RED_STREAM_DETECTION_MAX_DELTA);
+    }
     ring_init(&surface->depend_on_me);
     region_init(&surface->draw_dirty_region);
     surface->refs = 1;
@@ -2205,6 +2339,10 @@ DisplayChannel::DisplayChannel(RedsState *reds,
     priv->stream_video = SPICE_STREAM_VIDEO_OFF;
 
     image_encoder_shared_init(&priv->encoder_shared_data);
+    unsigned int encoder_threads = image_encoder_pool_get_env_threads();
+    if (encoder_threads > 0) {
+        priv->encoder_pool = image_encoder_pool_new(encoder_threads);
+    }
 
     ring_init(&priv->current_list);
     drawables_init(this);
@@ -2220,6 +2358,7 @@ DisplayChannel::DisplayChannel(RedsState *reds,
     stat_init(&priv->add_stat, "add", CLOCK_THREAD_CPUTIME_ID);
     stat_init(&priv->exclude_stat, "exclude", CLOCK_THREAD_CPUTIME_ID);
     stat_init(&priv->__exclude_stat, "__exclude", CLOCK_THREAD_CPUTIME_ID);
+    frame_trace_stats_init(&priv->frame_trace_stats);
     const RedStatNode *stat = get_stat_node();
     stat_init_counter(&priv->cache_hits_counter, reds, stat,
                       "cache_hits", TRUE);
@@ -2227,6 +2366,17 @@ DisplayChannel::DisplayChannel(RedsState *reds,
                       "add_to_cache", TRUE);
     stat_init_counter(&priv->non_cache_counter, reds, stat,
                       "non_cache", TRUE);
+    char *pixmap_cache_name =
+        g_strdup_printf("pixmap_cache_%s",
+                        pixmap_cache_policy_get_name(pixmap_cache_get_env_policy()));
+    stat_init_node(&priv->pixmap_cache_stat, reds, stat, pixmap_cache_name, TRUE);
+    g_free(pixmap_cache_name);
+    stat_init_counter(&priv->pixmap_cache_lookups_counter, reds, &priv->pixmap_cache_stat,
+                      "lookups", TRUE);
+    stat_init_counter(&priv->pixmap_cache_evictions_counter, reds, &priv->pixmap_cache_stat,
+                      "evictions", TRUE);
+    stat_init_counter(&priv->pixmap_cache_evicted_pixels_counter, reds,
+                      &priv->pixmap_cache_stat, "evicted_pixels", TRUE);
 
     set_cap(SPICE_DISPLAY_CAP_MONITORS_CONFIG);
     set_cap(SPICE_DISPLAY_CAP_PREF_COMPRESSION);
@@ -2289,7 +2439,7 @@ void display_channel_process_surface_cmd(DisplayChannel *display,
     };
 }
 
-static void display_channel_update_compression(DisplayChannel *display, DisplayChannelClient *dcc)
+void display_channel_update_compression(DisplayChannel *display, DisplayChannelClient *dcc)
 {
     if (dcc_get_jpeg_state(dcc) == SPICE_WAN_COMPRESSION_AUTO) {
         display->priv->enable_jpeg = dcc_is_low_bandwidth(dcc);
@@ -61,12 +61,18 @@ typedef struct DependItem {
 struct Drawable {
     uint32_t refs;
     RingItem surface_list_link;
+    /* order of the drawable in the current_list of its surface, decreasing
+     * from the head of the ring to its tail */
+    uint64_t surface_list_seq;
     RingItem list_link;
     DrawItem tree_item;
     GList *pipes;
     RedDrawable *red_drawable;
 
     GlzImageRetention glz_retention;
+    /* RedSharedCompressedImage of the images of the drawable already
+     * compressed for a client, see dcc_compress_image() */
+    GList *compressed_images;
 
     red_time_t creation_time;
     red_time_t first_frame_time;
@@ -112,6 +118,8 @@ void                       display_channel_set_video_codecs          (DisplayCha
 int                        display_channel_get_streams_timeout       (DisplayChannel *display);
 void                       display_channel_compress_stats_print      (DisplayChannel *display);
 void                       display_channel_compress_stats_reset      (DisplayChannel *display);
+/* Publish the timing statistics once the channel statistics node is set */
+void                       display_channel_publish_stats             (DisplayChannel *display);
 void                       display_channel_surface_unref             (DisplayChannel *display,
                                                                       uint32_t surface_id);
 bool                       display_channel_wait_for_migrate_data     (DisplayChannel *display);
@@ -146,6 +154,8 @@ void display_channel_debug_oom(DisplayChannel *display, const char *msg);
 void display_channel_update_qxl_running(DisplayChannel *display, bool running);
 void display_channel_set_image_compression(DisplayChannel *display,
                                            SpiceImageCompression image_compression);
+/* choose the wan compressions for the bandwidth to the client of @dcc */
+void display_channel_update_compression(DisplayChannel *display, DisplayChannelClient *dcc);
 
 #include "pop-visibility.h"
 
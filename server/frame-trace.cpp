@@ -0,0 +1,80 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2020 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#include <config.h>
+
+#include <common/recorder.h>
+
+#include "frame-trace.h"
+
+RECORDER(frame_trace, 256, "Latency of the stages of the QXL draw commands");
+
+static const char *const frame_trace_stage_names[FRAME_TRACE_N_STAGES] = {
+    "total",
+    "parse",
+    "insert",
+    "pipe_add",
+    "compress_start",
+    "compress_end",
+    "sent",
+};
+
+void frame_trace_stats_init(FrameTraceStats *stats)
+{
+    stats->node.ref = INVALID_STAT_REF;
+    for (int i = 0; i < FRAME_TRACE_N_STAGES; i++) {
+        stat_init(&stats->latency[i], frame_trace_stage_names[i], CLOCK_MONOTONIC);
+    }
+}
+
+void frame_trace_stats_publish(FrameTraceStats *stats, SpiceServer *reds,
+                               const RedStatNode *parent)
+{
+    stat_init_node(&stats->node, reds, parent, "frame_latency", TRUE);
+    if (stats->node.ref == INVALID_STAT_REF) {
+        return;
+    }
+    for (int i = 0; i < FRAME_TRACE_N_STAGES; i++) {
+        stat_info_publish(&stats->latency[i], reds, &stats->node);
+    }
+}
+
+void frame_trace_stats_add(FrameTraceStats *stats, const FrameTrace *trace)
+{
+    stat_time_t prev = trace->time[FRAME_TRACE_FETCH];
+
+    if (!frame_trace_is_active(trace) || !trace->time[FRAME_TRACE_SENT]) {
+        return;
+    }
+
+    for (int i = FRAME_TRACE_PARSE; i < FRAME_TRACE_N_STAGES; i++) {
+        stat_time_t time = trace->time[i];
+
+        /* stage skipped, e.g. no image to compress */
+        if (!time) {
+            continue;
+        }
+        stat_info_add(&stats->latency[i], time - prev, 0, 0);
+        record(frame_trace, "frame %u %s %u us", trace->id, frame_trace_stage_names[i],
+               (unsigned) ((time - prev) / 1000));
+        prev = time;
+    }
+    stat_info_add(&stats->latency[0],
+                  trace->time[FRAME_TRACE_SENT] - trace->time[FRAME_TRACE_FETCH], 0, 0);
+    record(frame_trace, "frame %u total %u us", trace->id,
+           (unsigned) ((trace->time[FRAME_TRACE_SENT] - trace->time[FRAME_TRACE_FETCH]) / 1000));
+}
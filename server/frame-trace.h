@@ -0,0 +1,99 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2020 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+/**
+ * @file frame-trace.h
+ * Latency tracing of the QXL draw commands, from the command ring to the
+ * client socket.
+ *
+ * Each RedDrawable carries the time it reached every stage. When the message
+ * of a drawable has been written to a client the trace is emitted to the
+ * "frame_trace" recorder and the latency of each stage is added to the
+ * statistics of the display channel.
+ * Traces are taken only while the statistics are enabled, see
+ * spice_server_set_statistics().
+ */
+
+#ifndef FRAME_TRACE_H_
+#define FRAME_TRACE_H_
+
+#include "stat.h"
+
+SPICE_BEGIN_DECLS
+
+typedef enum {
+    FRAME_TRACE_FETCH,          /* command fetched from the QXL ring */
+    FRAME_TRACE_PARSE,          /* command parsed into a RedDrawable */
+    FRAME_TRACE_INSERT,         /* drawable inserted in the surface tree */
+    FRAME_TRACE_PIPE_ADD,       /* drawable queued to a client pipe */
+    FRAME_TRACE_COMPRESS_START,
+    FRAME_TRACE_COMPRESS_END,
+    FRAME_TRACE_SENT,           /* last byte of the message written */
+
+    FRAME_TRACE_N_STAGES
+} FrameTraceStage;
+
+typedef struct FrameTrace {
+    uint32_t id;
+    /* 0 if the stage was not reached, only the first time is kept */
+    stat_time_t time[FRAME_TRACE_N_STAGES];
+} FrameTrace;
+
+/* Latency of each stage from the previous one reached, and of the whole
+ * frame in the first slot */
+typedef struct FrameTraceStats {
+    RedStatNode node;
+    stat_info_t latency[FRAME_TRACE_N_STAGES];
+} FrameTraceStats;
+
+static inline stat_time_t frame_trace_now(void)
+{
+    return stat_is_enabled() ? stat_now(CLOCK_MONOTONIC) : 0;
+}
+
+/* @fetch_time is the value of frame_trace_now() when the command was fetched */
+static inline void frame_trace_begin(FrameTrace *trace, uint32_t id, stat_time_t fetch_time)
+{
+    trace->id = id;
+    trace->time[FRAME_TRACE_FETCH] = fetch_time;
+    if (fetch_time) {
+        trace->time[FRAME_TRACE_PARSE] = stat_now(CLOCK_MONOTONIC);
+    }
+}
+
+static inline void frame_trace_mark(FrameTrace *trace, FrameTraceStage stage)
+{
+    if (trace->time[FRAME_TRACE_FETCH] && !trace->time[stage]) {
+        trace->time[stage] = stat_now(CLOCK_MONOTONIC);
+    }
+}
+
+static inline int frame_trace_is_active(const FrameTrace *trace)
+{
+    return trace->time[FRAME_TRACE_FETCH] != 0;
+}
+
+void frame_trace_stats_init(FrameTraceStats *stats);
+void frame_trace_stats_publish(FrameTraceStats *stats, SpiceServer *reds,
+                               const RedStatNode *parent);
+/* Emit a completed @trace and account its latencies */
+void frame_trace_stats_add(FrameTraceStats *stats, const FrameTrace *trace);
+
+SPICE_END_DECLS
+
+#endif /* FRAME_TRACE_H_ */
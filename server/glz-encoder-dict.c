@@ -70,6 +70,15 @@ static bool glz_dictionary_window_create(SharedDictionary *dict, uint32_t size)
         return FALSE;
     }
 
+    dict->window.encoders_epochs = (uint64_t *)dict->cur_usr->malloc(dict->cur_usr,
+                                                            sizeof(uint64_t) * dict->max_encoders);
+
+    if (!dict->window.encoders_epochs) {
+        dict->cur_usr->free(dict->cur_usr, dict->window.encoders_heads);
+        dict->cur_usr->free(dict->cur_usr, dict->window.segs);
+        return FALSE;
+    }
+
     dict->window.used_images_head = NULL;
     dict->window.used_images_tail = NULL;
     dict->window.free_images = NULL;
@@ -137,6 +146,11 @@ static inline void glz_dictionary_window_destroy(SharedDictionary *dict)
         dict->cur_usr->free(dict->cur_usr, dict->window.encoders_heads);
         dict->window.encoders_heads = NULL;
     }
+
+    if (dict->window.encoders_epochs) {
+        dict->cur_usr->free(dict->cur_usr, dict->window.encoders_epochs);
+        dict->window.encoders_epochs = NULL;
+    }
 }
 
 /* logic removal only */
@@ -157,12 +171,14 @@ GlzEncDictContext *glz_enc_dictionary_create(uint32_t size, uint32_t max_encoder
 
     dict->cur_usr = usr;
     dict->last_image_id = 0;
+    dict->removed_images = 0;
     dict->max_encoders = max_encoders;
 
     pthread_mutex_init(&dict->lock, NULL);
     pthread_rwlock_init(&dict->rw_alloc_lock, NULL);
 
     dict->window.encoders_heads = NULL;
+    dict->window.encoders_epochs = NULL;
 
     // alloc window fields and reset
     if (!glz_dictionary_window_create(dict, size)) {
@@ -244,16 +260,44 @@ uint32_t glz_enc_dictionary_get_size(GlzEncDictContext *opaque_dict)
 }
 
 /* doesn't call the remove image callback */
-void glz_enc_dictionary_remove_image(GlzEncDictContext *opaque_dict,
-                                     GlzEncDictImageContext *opaque_image,
-                                     GlzEncoderUsrContext *usr)
+uint64_t glz_enc_dictionary_remove_image(GlzEncDictContext *opaque_dict,
+                                         GlzEncDictImageContext *opaque_image,
+                                         GlzUsrImageContext *usr_image_context,
+                                         GlzEncoderUsrContext *usr)
 {
     SharedDictionary *dict = (SharedDictionary *)opaque_dict;
     WindowImage *image = (WindowImage *)opaque_image;
-    dict->cur_usr = usr;
-    GLZ_ASSERT(dict->cur_usr, opaque_image && opaque_dict);
+    uint64_t epoch = 0;
+    GLZ_ASSERT(usr, opaque_image && opaque_dict);
+
+    pthread_mutex_lock(&dict->lock);
+    // the image may have left the window, and its WindowImage reused for another one
+    if (image->is_alive && image->usr_context == usr_image_context) {
+        glz_dictionary_window_kill_image(dict, image);
+        epoch = ++dict->removed_images;
+    }
+    pthread_mutex_unlock(&dict->lock);
+
+    return epoch;
+}
+
+bool glz_enc_dictionary_is_released(GlzEncDictContext *opaque_dict, uint64_t epoch)
+{
+    SharedDictionary *dict = (SharedDictionary *)opaque_dict;
+    bool released = TRUE;
+    uint32_t i;
+
+    pthread_mutex_lock(&dict->lock);
+    for (i = 0; i < dict->max_encoders; i++) {
+        if (dict->window.encoders_heads[i] != NULL_IMAGE_SEG_ID &&
+            dict->window.encoders_epochs[i] < epoch) {
+            released = FALSE;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&dict->lock);
 
-    glz_dictionary_window_kill_image(dict, image);
+    return released;
 }
 
 /***********************************************************************************
@@ -572,6 +616,7 @@ WindowImage *glz_dictionary_pre_encode(uint32_t encoder_id, GlzEncoderUsrContext
     dict->cur_usr = usr;
     GLZ_ASSERT(dict->cur_usr, dict->window.encoders_heads[encoder_id] == NULL_IMAGE_SEG_ID);
 
+    dict->window.encoders_epochs[encoder_id] = dict->removed_images;
     image_size = __get_pixels_num(image_type, image_height, image_stride);
     new_win_head = glz_dictionary_window_get_new_head(dict, image_size);
 
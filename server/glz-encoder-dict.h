@@ -19,6 +19,7 @@
 #define GLZ_ENCODER_DICT_H_
 
 #include <stdint.h>
+#include <stdbool.h>
 
 /*
     Interface for maintaining lz dictionary that is shared among several encoders.
@@ -62,10 +63,19 @@ void glz_enc_dictionary_get_restore_data(GlzEncDictContext *opaque_dict,
 GlzEncDictContext *glz_enc_dictionary_restore(GlzEncDictRestoreData *restore_data,
                                               GlzEncoderUsrContext *usr);
 
-/* image: the context returned by the encoder when the image was encoded.
-   NOTE - you should use this routine only when no encoder uses the dictionary.*/
-void glz_enc_dictionary_remove_image(GlzEncDictContext *opaque_dict,
-                                     GlzEncDictImageContext *image, GlzEncoderUsrContext *usr);
+/* image            : the context returned by the encoder when the image was encoded.
+   usr_image_context: the context given to the encoder for the image.
+   Can be called while other encoders use the dictionary. Returns 0 if the image already
+   left the window (the free_image callback was called for it), otherwise the epoch of the
+   removal: the encoders still running may read the image pixels until
+   glz_enc_dictionary_is_released() returns TRUE for it. */
+uint64_t glz_enc_dictionary_remove_image(GlzEncDictContext *opaque_dict,
+                                         GlzEncDictImageContext *image,
+                                         GlzUsrImageContext *usr_image_context,
+                                         GlzEncoderUsrContext *usr);
+
+/* returns TRUE when all the encoders which could read an image removed at @epoch finished */
+bool glz_enc_dictionary_is_released(GlzEncDictContext *opaque_dict, uint64_t epoch);
 
 SPICE_END_DECLS
 
@@ -103,6 +103,8 @@ struct SharedDictionary {
                                              // it started the encoding.
                                              // The head is NULL_IMAGE_SEG_ID when the encoder is
                                              // not encoding.
+        uint64_t            *encoders_epochs; // Holds for each encoding encoder the value of
+                                              // removed_images when it started the encoding.
 
         /* the window in a resolution of images. But here the head contains the oldest head*/
         WindowImage*        used_images_tail;
@@ -124,6 +126,9 @@ struct SharedDictionary {
 #endif
 
     uint64_t last_image_id;
+    /* number of images removed by their owner while they were in the window, the pixels
+       of such an image can be read by the encoders which started before its removal */
+    uint64_t removed_images;
     uint32_t max_encoders;
     pthread_mutex_t lock;
     pthread_rwlock_t rw_alloc_lock;
@@ -0,0 +1,368 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2020 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#include <config.h>
+
+#include <stdio.h>
+#include <signal.h>
+#include <glib.h>
+#include <spice/stats.h>
+
+#include "image-encoder-pool.h"
+
+// compatibility for FreeBSD
+#ifdef HAVE_PTHREAD_NP_H
+#include <pthread_np.h>
+#define pthread_setname_np pthread_set_name_np
+#endif
+
+typedef enum {
+    JOB_STATE_QUEUED,
+    JOB_STATE_RUNNING,
+    JOB_STATE_DONE,
+    JOB_STATE_TAKEN,
+} JobState;
+
+struct ImageEncoderJob {
+    ImageEncoderPool *pool;
+    GList link;
+    JobState state;
+
+    ImageEncoderJobType type;
+    int jpeg_quality;
+    SpiceBitmap src;
+    SpiceChunks *own_chunks;
+
+    bool success;
+    SpiceImage image;
+    compress_send_data_t comp_data;
+};
+
+typedef struct ImageEncoderThread {
+    ImageEncoderPool *pool;
+    pthread_t thread;
+    /* each thread has its own encoders, they are not thread safe */
+    ImageEncoderSharedData shared_data;
+    ImageEncoders encoders;
+    RedStatNode stat;
+} ImageEncoderThread;
+
+struct ImageEncoderPool {
+    pthread_mutex_t lock;
+    /* signaled when a job is queued or the pool is shutting down */
+    pthread_cond_t queue_cond;
+    /* signaled when a job completes */
+    pthread_cond_t done_cond;
+    GQueue queue;
+    bool quit;
+
+    unsigned int n_threads;
+    ImageEncoderThread *threads;
+};
+
+unsigned int image_encoder_pool_get_env_threads(void)
+{
+    const char *env = getenv(IMAGE_ENCODER_POOL_THREADS_ENV);
+    char *end;
+    guint64 n_threads;
+
+    if (env == NULL) {
+        return 0;
+    }
+    n_threads = g_ascii_strtoull(env, &end, 10);
+    if (end == env || *end != '\0') {
+        spice_warning("invalid value for %s: %s", IMAGE_ENCODER_POOL_THREADS_ENV, env);
+        return 0;
+    }
+    return MIN(n_threads, IMAGE_ENCODER_POOL_MAX_THREADS);
+}
+
+static void compress_bufs_free(RedCompressBuf *buf)
+{
+    while (buf) {
+        RedCompressBuf *next = buf->send_next;
+        compress_buf_free(buf);
+        buf = next;
+    }
+}
+
+static bool image_encoder_thread_compress(ImageEncoderThread *thread, ImageEncoderJob *job)
+{
+    ImageEncoders *enc = &thread->encoders;
+
+    switch (job->type) {
+    case IMAGE_ENCODER_JOB_QUIC:
+        return image_encoders_compress_quic(enc, &job->image, &job->src, &job->comp_data);
+    case IMAGE_ENCODER_JOB_LZ:
+        return image_encoders_compress_lz(enc, &job->image, &job->src, &job->comp_data);
+    case IMAGE_ENCODER_JOB_JPEG:
+        enc->jpeg_quality = job->jpeg_quality;
+        return image_encoders_compress_jpeg(enc, &job->image, &job->src, &job->comp_data);
+#ifdef USE_LZ4
+    case IMAGE_ENCODER_JOB_LZ4:
+        return image_encoders_compress_lz4(enc, &job->image, &job->src, &job->comp_data);
+#endif
+    default:
+        return false;
+    }
+}
+
+static void *image_encoder_thread_main(void *opaque)
+{
+    ImageEncoderThread *thread = (ImageEncoderThread *) opaque;
+    ImageEncoderPool *pool = thread->pool;
+
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        while (g_queue_is_empty(&pool->queue) && !pool->quit) {
+            pthread_cond_wait(&pool->queue_cond, &pool->lock);
+        }
+        if (pool->quit) {
+            break;
+        }
+
+        GList *link = g_queue_pop_head_link(&pool->queue);
+        ImageEncoderJob *job = (ImageEncoderJob *) link->data;
+        job->state = JOB_STATE_RUNNING;
+        pthread_mutex_unlock(&pool->lock);
+
+        bool success = image_encoder_thread_compress(thread, job);
+
+        pthread_mutex_lock(&pool->lock);
+        job->success = success;
+        job->state = JOB_STATE_DONE;
+        pthread_cond_broadcast(&pool->done_cond);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    return NULL;
+}
+
+ImageEncoderPool *image_encoder_pool_new(unsigned int n_threads)
+{
+    spice_return_val_if_fail(n_threads > 0, NULL);
+
+    ImageEncoderPool *pool = g_new0(ImageEncoderPool, 1);
+
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->queue_cond, NULL);
+    pthread_cond_init(&pool->done_cond, NULL);
+    g_queue_init(&pool->queue);
+
+#ifndef _WIN32
+    sigset_t thread_sig_mask;
+    sigset_t curr_sig_mask;
+
+    /* signals must be handled by the application threads */
+    sigfillset(&thread_sig_mask);
+    sigdelset(&thread_sig_mask, SIGILL);
+    sigdelset(&thread_sig_mask, SIGFPE);
+    sigdelset(&thread_sig_mask, SIGSEGV);
+    pthread_sigmask(SIG_SETMASK, &thread_sig_mask, &curr_sig_mask);
+#endif
+
+    pool->threads = g_new0(ImageEncoderThread, n_threads);
+    for (unsigned int i = 0; i < n_threads; i++) {
+        ImageEncoderThread *thread = &pool->threads[i];
+        int r;
+
+        thread->pool = pool;
+        image_encoder_shared_init(&thread->shared_data);
+        image_encoders_init(&thread->encoders, &thread->shared_data);
+        if ((r = pthread_create(&thread->thread, NULL, image_encoder_thread_main, thread))) {
+            spice_warning("create encoder thread failed %d", r);
+            image_encoders_free(&thread->encoders);
+            break;
+        }
+#if !defined(__APPLE__)
+        pthread_setname_np(thread->thread, "SPICE Encoder");
+#endif
+        pool->n_threads++;
+    }
+#ifndef _WIN32
+    pthread_sigmask(SIG_SETMASK, &curr_sig_mask, NULL);
+#endif
+
+    if (pool->n_threads == 0) {
+        image_encoder_pool_free(pool);
+        return NULL;
+    }
+    spice_debug("image encoder pool started with %u threads", pool->n_threads);
+
+    return pool;
+}
+
+void image_encoder_pool_free(ImageEncoderPool *pool)
+{
+    if (!pool) {
+        return;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    /* jobs are owned by the pipe items, they must be gone by now */
+    spice_warn_if_fail(g_queue_is_empty(&pool->queue));
+    pool->quit = true;
+    pthread_cond_broadcast(&pool->queue_cond);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (unsigned int i = 0; i < pool->n_threads; i++) {
+        ImageEncoderThread *thread = &pool->threads[i];
+
+        pthread_join(thread->thread, NULL);
+        image_encoders_free(&thread->encoders);
+    }
+
+    pthread_cond_destroy(&pool->done_cond);
+    pthread_cond_destroy(&pool->queue_cond);
+    pthread_mutex_destroy(&pool->lock);
+    g_free(pool->threads);
+    g_free(pool);
+}
+
+unsigned int image_encoder_pool_get_n_threads(const ImageEncoderPool *pool)
+{
+    return pool->n_threads;
+}
+
+void image_encoder_pool_publish_stats(ImageEncoderPool *pool,
+                                      SpiceServer *reds, const RedStatNode *parent)
+{
+    for (unsigned int i = 0; i < pool->n_threads; i++) {
+        ImageEncoderThread *thread = &pool->threads[i];
+        char name[SPICE_STAT_NODE_NAME_MAX];
+
+        snprintf(name, sizeof(name), "encoder[%u]", i);
+        stat_init_node(&thread->stat, reds, parent, name, TRUE);
+        image_encoder_shared_stat_publish(&thread->shared_data, reds, &thread->stat);
+    }
+}
+
+ImageEncoderJob *image_encoder_pool_submit(ImageEncoderPool *pool,
+                                           ImageEncoderJobType type,
+                                           int jpeg_quality,
+                                           const SpiceBitmap *src,
+                                           bool own_chunks)
+{
+    ImageEncoderJob *job = g_new0(ImageEncoderJob, 1);
+
+    job->pool = pool;
+    job->type = type;
+    job->jpeg_quality = jpeg_quality;
+    job->src = *src;
+    job->own_chunks = own_chunks ? src->data : NULL;
+    job->link.data = job;
+    job->state = JOB_STATE_QUEUED;
+
+    pthread_mutex_lock(&pool->lock);
+    g_queue_push_tail_link(&pool->queue, &job->link);
+    pthread_cond_signal(&pool->queue_cond);
+    pthread_mutex_unlock(&pool->lock);
+
+    return job;
+}
+
+ImageEncoderJobType image_encoder_job_get_type(const ImageEncoderJob *job)
+{
+    return job->type;
+}
+
+int image_encoder_job_get_jpeg_quality(const ImageEncoderJob *job)
+{
+    return job->jpeg_quality;
+}
+
+bool image_encoder_job_is_for(const ImageEncoderJob *job, const SpiceBitmap *src)
+{
+    return job->src.format == src->format &&
+           job->src.x == src->x && job->src.y == src->y &&
+           job->src.stride == src->stride &&
+           src->data->num_chunks > 0 &&
+           job->src.data->chunk[0].data == src->data->chunk[0].data;
+}
+
+/* must be called with the pool lock held */
+static void image_encoder_job_wait(ImageEncoderJob *job)
+{
+    ImageEncoderPool *pool = job->pool;
+
+    if (job->state == JOB_STATE_QUEUED) {
+        g_queue_unlink(&pool->queue, &job->link);
+        job->state = JOB_STATE_TAKEN;
+        return;
+    }
+    while (job->state == JOB_STATE_RUNNING) {
+        pthread_cond_wait(&pool->done_cond, &pool->lock);
+    }
+}
+
+void image_encoder_job_cancel(ImageEncoderJob *job)
+{
+    ImageEncoderPool *pool = job->pool;
+
+    pthread_mutex_lock(&pool->lock);
+    if (job->state == JOB_STATE_QUEUED) {
+        g_queue_unlink(&pool->queue, &job->link);
+        job->state = JOB_STATE_TAKEN;
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+ImageEncoderJobResult image_encoder_job_take_result(ImageEncoderJob *job, SpiceImage *dest,
+                                                    compress_send_data_t *o_comp_data)
+{
+    ImageEncoderPool *pool = job->pool;
+
+    pthread_mutex_lock(&pool->lock);
+    image_encoder_job_wait(job);
+    if (job->state != JOB_STATE_DONE) {
+        pthread_mutex_unlock(&pool->lock);
+        return IMAGE_ENCODER_JOB_RESULT_NONE;
+    }
+    job->state = JOB_STATE_TAKEN;
+    pthread_mutex_unlock(&pool->lock);
+
+    if (!job->success) {
+        return IMAGE_ENCODER_JOB_RESULT_FAILED;
+    }
+
+    dest->descriptor.type = job->image.descriptor.type;
+    dest->u = job->image.u;
+    *o_comp_data = job->comp_data;
+
+    return IMAGE_ENCODER_JOB_RESULT_SUCCESS;
+}
+
+void image_encoder_job_free(ImageEncoderJob *job)
+{
+    if (!job) {
+        return;
+    }
+
+    ImageEncoderPool *pool = job->pool;
+
+    pthread_mutex_lock(&pool->lock);
+    image_encoder_job_wait(job);
+    pthread_mutex_unlock(&pool->lock);
+
+    if (job->state == JOB_STATE_DONE && job->success) {
+        compress_bufs_free(job->comp_data.comp_buf);
+    }
+    if (job->own_chunks) {
+        spice_chunks_destroy(job->own_chunks);
+    }
+    g_free(job);
+}
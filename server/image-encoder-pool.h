@@ -0,0 +1,105 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2020 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+/**
+ * @file image-encoder-pool.h
+ * Pool of threads compressing images ahead of the display channel clients.
+ *
+ * Jobs are submitted by the worker thread when an image is queued to a
+ * client pipe. When the pipe item is finally marshalled the worker picks up
+ * the result (waiting for it if the job is still running), so the order of
+ * the messages sent to the client is not affected by the pool.
+ *
+ * GLZ is never offloaded: its dictionary window must follow the order in
+ * which images are sent to the client.
+ *
+ * Large surface images are split in bands, each queued as an image of its
+ * own, so that a single full screen update keeps all the threads busy.
+ */
+
+#ifndef IMAGE_ENCODER_POOL_H_
+#define IMAGE_ENCODER_POOL_H_
+
+#include "image-encoders.h"
+
+SPICE_BEGIN_DECLS
+
+/* Environment variable setting the number of threads of each pool,
+ * 0 (default) disables the pool */
+#define IMAGE_ENCODER_POOL_THREADS_ENV "SPICE_ENCODER_THREADS"
+#define IMAGE_ENCODER_POOL_MAX_THREADS 16
+
+typedef struct ImageEncoderPool ImageEncoderPool;
+typedef struct ImageEncoderJob ImageEncoderJob;
+
+typedef enum {
+    IMAGE_ENCODER_JOB_QUIC,
+    IMAGE_ENCODER_JOB_LZ,
+    IMAGE_ENCODER_JOB_JPEG,
+    IMAGE_ENCODER_JOB_LZ4,
+} ImageEncoderJobType;
+
+typedef enum {
+    /* the job was not started yet and has been cancelled, the caller
+     * should compress the image itself */
+    IMAGE_ENCODER_JOB_RESULT_NONE,
+    IMAGE_ENCODER_JOB_RESULT_FAILED,
+    IMAGE_ENCODER_JOB_RESULT_SUCCESS,
+} ImageEncoderJobResult;
+
+/* Number of threads requested by the environment */
+unsigned int image_encoder_pool_get_env_threads(void);
+
+ImageEncoderPool *image_encoder_pool_new(unsigned int n_threads);
+void image_encoder_pool_free(ImageEncoderPool *pool);
+/* Number of threads actually started */
+unsigned int image_encoder_pool_get_n_threads(const ImageEncoderPool *pool);
+/* Publish the compression statistics of each thread under @parent,
+ * must be called before submitting any job */
+void image_encoder_pool_publish_stats(ImageEncoderPool *pool,
+                                      SpiceServer *reds, const RedStatNode *parent);
+
+/* Queue the compression of @src.
+ * @src is copied but the pixel data it points to must stay valid until the
+ * job is freed. If @own_chunks is TRUE the job takes ownership of src->data.
+ */
+ImageEncoderJob *image_encoder_pool_submit(ImageEncoderPool *pool,
+                                           ImageEncoderJobType type,
+                                           int jpeg_quality,
+                                           const SpiceBitmap *src,
+                                           bool own_chunks);
+
+ImageEncoderJobType image_encoder_job_get_type(const ImageEncoderJob *job);
+int image_encoder_job_get_jpeg_quality(const ImageEncoderJob *job);
+/* Whether @job was submitted for the bitmap data described by @src */
+bool image_encoder_job_is_for(const ImageEncoderJob *job, const SpiceBitmap *src);
+/* Cancel @job if it was not started yet, its result is not needed anymore.
+ * It must still be released with image_encoder_job_free() */
+void image_encoder_job_cancel(ImageEncoderJob *job);
+/* Wait for @job to complete and move its compressed data to the caller.
+ * On success only the type and the compression specific part of @dest are set.
+ * The result can be taken only once.
+ */
+ImageEncoderJobResult image_encoder_job_take_result(ImageEncoderJob *job, SpiceImage *dest,
+                                                    compress_send_data_t *o_comp_data);
+/* Cancel or wait for @job and release it with any data not taken */
+void image_encoder_job_free(ImageEncoderJob *job);
+
+SPICE_END_DECLS
+
+#endif /* IMAGE_ENCODER_POOL_H_ */
@@ -73,6 +73,8 @@ struct RedGlzDrawable {
     uint8_t instances_count;
     gboolean has_drawable;
     ImageEncoders *encoders;
+    /* dictionary epoch after which no other encoder reads red_drawable, 0 if none can */
+    uint64_t release_epoch;
 };
 
 #define LINK_TO_GLZ(ptr) SPICE_CONTAINEROF((ptr), RedGlzDrawable, \
@@ -458,6 +460,7 @@ void image_encoders_init(ImageEncoders *enc, ImageEncoderSharedData *shared_data
 
     ring_init(&enc->glz_drawables);
     ring_init(&enc->glz_drawables_inst_to_free);
+    ring_init(&enc->glz_drawables_to_release);
     pthread_mutex_init(&enc->glz_drawables_inst_to_free_lock, NULL);
 
     image_encoders_init_glz_data(enc);
@@ -493,6 +496,32 @@ void image_encoders_free(ImageEncoders *enc)
     pthread_mutex_destroy(&enc->glz_drawables_inst_to_free_lock);
 }
 
+static void red_glz_drawable_release(RedGlzDrawable *glz_drawable)
+{
+    red_drawable_unref(glz_drawable->red_drawable);
+    glz_drawable->encoders->shared_data->glz_drawable_count--;
+    g_free(glz_drawable);
+}
+
+/* Release the drawables whose pixels are no longer read by other encoders,
+ * all of them if @force, in which case no encoder must be running */
+static void image_encoders_release_glz_drawables(ImageEncoders *enc, bool force)
+{
+    RingItem *ring_link;
+
+    while ((ring_link = ring_get_head(&enc->glz_drawables_to_release))) {
+        RedGlzDrawable *glz_drawable = SPICE_CONTAINEROF(ring_link, RedGlzDrawable, link);
+
+        // the ring is ordered by removal, so are the epochs
+        if (!force &&
+            !glz_enc_dictionary_is_released(enc->glz_dict->dict, glz_drawable->release_epoch)) {
+            break;
+        }
+        ring_remove(ring_link);
+        red_glz_drawable_release(glz_drawable);
+    }
+}
+
 /* Remove from the to_free list and the instances_list.
    When no instance is left - the RedGlzDrawable is released too. (and the qxl drawable too, if
    it is not used by Drawable).
@@ -519,25 +548,31 @@ static void glz_drawable_instance_item_free(GlzDrawableInstanceItem *instance)
     }
 
     if (ring_is_empty(&glz_drawable->instances)) {
+        ImageEncoders *enc = glz_drawable->encoders;
+
         spice_assert(glz_drawable->instances_count == 0);
 
         if (glz_drawable->has_drawable) {
             ring_remove(&glz_drawable->drawable_link);
         }
-        red_drawable_unref(glz_drawable->red_drawable);
-        glz_drawable->encoders->shared_data->glz_drawable_count--;
         if (ring_item_is_linked(&glz_drawable->link)) {
             ring_remove(&glz_drawable->link);
         }
-        g_free(glz_drawable);
+        if (glz_drawable->release_epoch &&
+            !glz_enc_dictionary_is_released(enc->glz_dict->dict, glz_drawable->release_epoch)) {
+            // another encoder may be matching against its pixels
+            ring_add_before(&glz_drawable->link, &enc->glz_drawables_to_release);
+            return;
+        }
+        red_glz_drawable_release(glz_drawable);
     }
 }
 
 /*
  * Releases all the instances of the drawable from the dictionary and the display channel client.
  * The release of the last instance will also release the drawable itself and the qxl drawable
- * if possible.
- * NOTE - the caller should prevent encoding using the dictionary during this operation
+ * if possible. The qxl drawable is kept until the other encoders using the dictionary
+ * can't read it anymore.
  */
 static void red_glz_drawable_free(RedGlzDrawable *glz_drawable)
 {
@@ -553,11 +588,17 @@ static void red_glz_drawable_free(RedGlzDrawable *glz_drawable)
         GlzDrawableInstanceItem *instance = SPICE_CONTAINEROF(head_instance,
                                                         GlzDrawableInstanceItem,
                                                         glz_link);
-        if (!ring_item_is_linked(&instance->free_link)) {
+        uint64_t epoch = glz_enc_dictionary_remove_image(enc->glz_dict->dict,
+                                                         instance->context, instance,
+                                                         &enc->glz_data.usr);
+        if (epoch) {
             // the instance didn't get out from window yet
-            glz_enc_dictionary_remove_image(enc->glz_dict->dict,
-                                            instance->context,
-                                            &enc->glz_data.usr);
+            glz_drawable->release_epoch = MAX(glz_drawable->release_epoch, epoch);
+        } else if (ring_item_is_linked(&instance->free_link)) {
+            // the encoder which released it from the window may be adding other instances
+            pthread_mutex_lock(&enc->glz_drawables_inst_to_free_lock);
+            ring_remove(&instance->free_link);
+            pthread_mutex_unlock(&enc->glz_drawables_inst_to_free_lock);
         }
         glz_drawable_instance_item_free(instance);
 
@@ -567,26 +608,9 @@ static void red_glz_drawable_free(RedGlzDrawable *glz_drawable)
     }
 }
 
-gboolean image_encoders_glz_encode_lock(ImageEncoders *enc)
-{
-    if (enc->glz_dict) {
-        pthread_rwlock_wrlock(&enc->glz_dict->encode_lock);
-        return TRUE;
-    }
-    return FALSE;
-}
-
-void image_encoders_glz_encode_unlock(ImageEncoders *enc)
-{
-    if (enc->glz_dict) {
-        pthread_rwlock_unlock(&enc->glz_dict->encode_lock);
-    }
-}
-
 /*
  * Remove from the global lz dictionary some glz_drawables that have no reference to
  * Drawable (their qxl drawables are released too).
- * NOTE - the caller should prevent encoding using the dictionary during the operation
  */
 int image_encoders_free_some_independent_glz_drawables(ImageEncoders *enc)
 {
@@ -623,6 +647,8 @@ void image_encoders_free_glz_drawables_to_free(ImageEncoders* enc)
         glz_drawable_instance_item_free(drawable_instance);
     }
     pthread_mutex_unlock(&enc->glz_drawables_inst_to_free_lock);
+
+    image_encoders_release_glz_drawables(enc, FALSE);
 }
 
 /* Clear all lz drawables - enforce their removal from the global dictionary.
@@ -644,6 +670,7 @@ void image_encoders_free_glz_drawables(ImageEncoders *enc)
         // thus not other thread access the to_free list of the channel
         red_glz_drawable_free(drawable);
     }
+    image_encoders_release_glz_drawables(enc, TRUE);
     pthread_rwlock_unlock(&glz_dict->encode_lock);
 }
 
@@ -1172,6 +1199,7 @@ static RedGlzDrawable *get_glz_drawable(ImageEncoders *enc, RedDrawable *red_dra
     ret->red_drawable = red_drawable_ref(red_drawable);
     ret->has_drawable = TRUE;
     ret->instances_count = 0;
+    ret->release_epoch = 0;
     ring_init(&ret->instances);
 
     ring_item_init(&ret->link);
@@ -1200,6 +1228,46 @@ static GlzDrawableInstanceItem *add_glz_drawable_instance(RedGlzDrawable *glz_dr
     return ret;
 }
 
+RedSharedCompressedImage *red_shared_compressed_image_new(const SpiceBitmap *src,
+                                                          int encoding, int jpeg_quality,
+                                                          const SpiceImage *image,
+                                                          const compress_send_data_t *comp_data)
+{
+    RedSharedCompressedImage *shared = g_new0(RedSharedCompressedImage, 1);
+
+    shared->refs = 1;
+    shared->src = src;
+    shared->encoding = encoding;
+    shared->jpeg_quality = jpeg_quality;
+    shared->image.descriptor.type = image->descriptor.type;
+    shared->image.u = image->u;
+    shared->comp_data = *comp_data;
+    shared->comp_data.shared = shared;
+
+    return shared;
+}
+
+RedSharedCompressedImage *red_shared_compressed_image_ref(RedSharedCompressedImage *shared)
+{
+    shared->refs++;
+    return shared;
+}
+
+void red_shared_compressed_image_unref(RedSharedCompressedImage *shared)
+{
+    if (--shared->refs != 0) {
+        return;
+    }
+
+    RedCompressBuf *buf = shared->comp_data.comp_buf;
+    while (buf) {
+        RedCompressBuf *next = buf->send_next;
+        compress_buf_free(buf);
+        buf = next;
+    }
+    g_free(shared);
+}
+
 #define MIN_GLZ_SIZE_FOR_ZLIB 100
 
 bool image_encoders_compress_glz(ImageEncoders *enc,
@@ -1331,9 +1399,25 @@ void image_encoder_shared_stat_reset(ImageEncoderSharedData *shared_data)
     stat_reset(&shared_data->lz4_stat);
 }
 
+void image_encoder_shared_stat_publish(ImageEncoderSharedData *shared_data,
+                                       SpiceServer *reds, const RedStatNode *parent)
+{
+    stat_init_node(&shared_data->stat, reds, parent, "compress", TRUE);
+    if (shared_data->stat.ref == INVALID_STAT_REF) {
+        return;
+    }
+    stat_info_publish(&shared_data->off_stat, reds, &shared_data->stat);
+    stat_info_publish(&shared_data->quic_stat, reds, &shared_data->stat);
+    stat_info_publish(&shared_data->lz_stat, reds, &shared_data->stat);
+    stat_info_publish(&shared_data->glz_stat, reds, &shared_data->stat);
+    stat_info_publish(&shared_data->jpeg_stat, reds, &shared_data->stat);
+    stat_info_publish(&shared_data->zlib_glz_stat, reds, &shared_data->stat);
+    stat_info_publish(&shared_data->jpeg_alpha_stat, reds, &shared_data->stat);
+    stat_info_publish(&shared_data->lz4_stat, reds, &shared_data->stat);
+}
+
 #define STAT_FMT "%s\t%8u\t%13.8g\t%12.8g\t%12.8g"
 
-#ifdef COMPRESS_STAT
 static void stat_print_one(const char *name, const stat_info_t *stat)
 {
     spice_info(STAT_FMT, name, stat->count,
@@ -1349,18 +1433,17 @@ static void stat_sum(stat_info_t *total, const stat_info_t *stat)
     total->comp_size += stat->comp_size;
     total->total += stat->total;
 }
-#endif
 
 void image_encoder_shared_stat_print(const ImageEncoderSharedData *shared_data)
 {
-#ifdef COMPRESS_STAT
+#ifndef COMPRESS_STAT
+    if (!stat_is_enabled()) {
+        return;
+    }
+#endif
     /* sum all statistics */
-    stat_info_t total = {
-        .count = 0,
-        .total = 0,
-        .orig_size = 0,
-        .comp_size = 0,
-    };
+    stat_info_t total;
+    stat_compress_init(&total, "total", CLOCK_THREAD_CPUTIME_ID);
     stat_sum(&total, &shared_data->off_stat);
     stat_sum(&total, &shared_data->quic_stat);
     stat_sum(&total, &shared_data->glz_stat);
@@ -1387,5 +1470,4 @@ void image_encoder_shared_stat_print(const ImageEncoderSharedData *shared_data)
     stat_print_one("LZ4      ", &shared_data->lz4_stat);
     spice_info("-------------------------------------------------------------------");
     stat_print_one("Total    ", &total);
-#endif
 }
@@ -47,6 +47,9 @@ typedef struct GlzImageRetention GlzImageRetention;
 void image_encoder_shared_init(ImageEncoderSharedData *shared_data);
 void image_encoder_shared_stat_reset(ImageEncoderSharedData *shared_data);
 void image_encoder_shared_stat_print(const ImageEncoderSharedData *shared_data);
+/* Publish the statistics of each codec in a "compress" node under @parent */
+void image_encoder_shared_stat_publish(ImageEncoderSharedData *shared_data,
+                                       SpiceServer *reds, const RedStatNode *parent);
 
 void image_encoders_init(ImageEncoders *enc, ImageEncoderSharedData *shared_data);
 void image_encoders_free(ImageEncoders *enc);
@@ -56,8 +59,6 @@ void image_encoders_free_glz_drawables_to_free(ImageEncoders* enc);
 gboolean image_encoders_glz_create(ImageEncoders *enc, uint8_t id);
 void image_encoders_glz_get_restore_data(ImageEncoders *enc,
                                          uint8_t *out_id, GlzEncDictRestoreData *out_data);
-gboolean image_encoders_glz_encode_lock(ImageEncoders *enc);
-void image_encoders_glz_encode_unlock(ImageEncoders *enc);
 void glz_retention_free_drawables(GlzImageRetention *ret);
 void glz_retention_detach_drawables(GlzImageRetention *ret);
 
@@ -158,6 +159,7 @@ struct ImageEncoderSharedData {
     stat_info_t zlib_glz_stat;
     stat_info_t jpeg_alpha_stat;
     stat_info_t lz4_stat;
+    RedStatNode stat;
 };
 
 struct ImageEncoders {
@@ -192,15 +194,42 @@ struct ImageEncoders {
     Ring glz_drawables;               // all the living lz drawable, ordered by encoding time
     Ring glz_drawables_inst_to_free;               // list of instances to be freed
     pthread_mutex_t glz_drawables_inst_to_free_lock;
+    Ring glz_drawables_to_release;    // removed from the dictionary, possibly still read by
+                                      // other encoders, ordered by removal
 };
 
+typedef struct RedSharedCompressedImage RedSharedCompressedImage;
+
 typedef struct compress_send_data_t {
     RedCompressBuf *comp_buf;
     uint32_t comp_buf_size;
     SpicePalette *lzplt_palette;
     gboolean is_lossy;
+    /* if set comp_buf is owned by this shared image and must not be freed */
+    RedSharedCompressedImage *shared;
 } compress_send_data_t;
 
+/* Compressed image which can be sent to several clients without
+ * compressing it again. Only used by the worker thread */
+struct RedSharedCompressedImage {
+    int refs;
+    /* the bitmap and the settings the data was compressed from */
+    const SpiceBitmap *src;
+    int encoding;
+    int jpeg_quality;
+    /* type and compression specific part of the image */
+    SpiceImage image;
+    compress_send_data_t comp_data;
+};
+
+/* Takes ownership of the buffers of @comp_data */
+RedSharedCompressedImage *red_shared_compressed_image_new(const SpiceBitmap *src,
+                                                          int encoding, int jpeg_quality,
+                                                          const SpiceImage *image,
+                                                          const compress_send_data_t *comp_data);
+RedSharedCompressedImage *red_shared_compressed_image_ref(RedSharedCompressedImage *shared);
+void red_shared_compressed_image_unref(RedSharedCompressedImage *shared);
+
 bool image_encoders_compress_quic(ImageEncoders *enc, SpiceImage *dest,
                                   SpiceBitmap *src, compress_send_data_t* o_comp_data);
 bool image_encoders_compress_lz(ImageEncoders *enc, SpiceImage *dest,
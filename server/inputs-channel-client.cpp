@@ -34,6 +34,11 @@ void InputsChannelClient::release_recv_buf(uint16_t type, uint32_t size, uint8_t
 {
 }
 
+bool InputsChannelClient::can_parse_in_place(uint16_t type, uint32_t size)
+{
+    return size <= sizeof(recv_buf);
+}
+
 void InputsChannelClient::on_disconnect()
 {
     get_channel()->release_keys();
@@ -38,6 +38,7 @@ private:
     virtual bool handle_message(uint16_t type, uint32_t size, void *message) override;
     virtual uint8_t *alloc_recv_buf(uint16_t type, uint32_t size) override;
     virtual void release_recv_buf(uint16_t type, uint32_t size, uint8_t *msg) override;
+    virtual bool can_parse_in_place(uint16_t type, uint32_t size) override;
     virtual void on_disconnect() override;
     virtual void send_item(RedPipeItem *base) override;
     virtual bool handle_migrate_data(uint32_t size, void *message) override;
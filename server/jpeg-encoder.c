@@ -21,6 +21,7 @@
 
 #include "red-common.h"
 #include "jpeg-encoder.h"
+#include "spice-bitmap-utils.h"
 
 struct JpegEncoderContext {
     JpegEncoderUsrContext *usr;
@@ -35,7 +36,8 @@ struct JpegEncoderContext {
         int height;
         int stride;
         unsigned int out_size;
-        void (*convert_line_to_RGB24) (void *line, int width, uint8_t **out_line);
+        /* NULL if libjpeg reads the lines as they are */
+        void (*convert_line)(uint8_t *dest, const uint8_t *src, unsigned int width);
     } cur_image;
 };
 
@@ -106,62 +108,6 @@ void jpeg_encoder_destroy(JpegEncoderContext* encoder)
     g_free(encoder);
 }
 
-static void convert_RGB16_to_RGB24(void *line, int width, uint8_t **out_line)
-{
-    uint16_t *src_line = (uint16_t *) line;
-    uint8_t *out_pix;
-    int x;
-
-    spice_assert(out_line && *out_line);
-
-    out_pix = *out_line;
-
-    for (x = 0; x < width; x++) {
-       uint16_t pixel = *src_line++;
-       pixel = GUINT16_FROM_LE(pixel);
-       *out_pix++ = ((pixel >> 7) & 0xf8) | ((pixel >> 12) & 0x7);
-       *out_pix++ = ((pixel >> 2) & 0xf8) | ((pixel >> 7) & 0x7);
-       *out_pix++ = ((pixel << 3) & 0xf8) | ((pixel >> 2) & 0x7);
-   }
-}
-
-static void convert_BGR24_to_RGB24(void *in_line, int width, uint8_t **out_line)
-{
-    int x;
-    uint8_t *out_pix;
-    uint8_t *line = (uint8_t *) in_line;
-    spice_assert(out_line && *out_line);
-
-    out_pix = *out_line;
-
-    for (x = 0; x < width; x++) {
-        *out_pix++ = line[2];
-        *out_pix++ = line[1];
-        *out_pix++ = line[0];
-        line += 3;
-    }
-}
-
-static void convert_BGRX32_to_RGB24(void *line, int width, uint8_t **out_line)
-{
-    uint32_t *src_line = (uint32_t *) line;
-    uint8_t *out_pix;
-    int x;
-
-    spice_assert(out_line && *out_line);
-
-    out_pix = *out_line;
-
-    for (x = 0; x < width; x++) {
-        uint32_t pixel = *src_line++;
-        pixel = GUINT32_FROM_LE(pixel);
-        *out_pix++ = (pixel >> 16) & 0xff;
-        *out_pix++ = (pixel >> 8) & 0xff;
-        *out_pix++ = pixel & 0xff;
-    }
-}
-
-
 #define FILL_LINES() {                                                  \
     if (lines == lines_end) {                                           \
         int n = jpeg->usr->more_lines(jpeg->usr, &lines);               \
@@ -175,24 +121,30 @@ static void convert_BGRX32_to_RGB24(void *line, int width, uint8_t **out_line)
 static void do_jpeg_encode(JpegEncoder *jpeg, uint8_t *lines, unsigned int num_lines)
 {
     uint8_t *lines_end;
-    uint8_t *RGB24_line;
+    uint8_t *converted_line = NULL;
     int stride, width;
     JSAMPROW row_pointer[1];
     width = jpeg->cur_image.width;
     stride = jpeg->cur_image.stride;
 
-    RGB24_line = g_new(uint8_t, width*3);
+    if (jpeg->cur_image.convert_line) {
+        converted_line = g_new(uint8_t, width * jpeg->cinfo.input_components);
+    }
 
     lines_end = lines + (stride * num_lines);
 
     for (;jpeg->cinfo.next_scanline < jpeg->cinfo.image_height; lines += stride) {
         FILL_LINES();
-        jpeg->cur_image.convert_line_to_RGB24(lines, width, &RGB24_line);
-        row_pointer[0] = RGB24_line;
+        if (converted_line) {
+            jpeg->cur_image.convert_line(converted_line, lines, width);
+            row_pointer[0] = converted_line;
+        } else {
+            row_pointer[0] = lines;
+        }
         jpeg_write_scanlines(&jpeg->cinfo, row_pointer, 1);
     }
 
-    g_free(RGB24_line);
+    g_free(converted_line);
 }
 
 int jpeg_encode(JpegEncoderContext *enc, int quality, JpegEncoderImageType type,
@@ -205,15 +157,35 @@ int jpeg_encode(JpegEncoderContext *enc, int quality, JpegEncoderImageType type,
     enc->cur_image.stride = stride;
     enc->cur_image.out_size = 0;
 
+    enc->cinfo.input_components = 3;
+    enc->cinfo.in_color_space = JCS_RGB;
+
     switch (type) {
     case JPEG_IMAGE_TYPE_RGB16:
-        enc->cur_image.convert_line_to_RGB24 = convert_RGB16_to_RGB24;
+#ifdef JCS_EXTENSIONS
+        enc->cinfo.input_components = 4;
+        enc->cinfo.in_color_space = JCS_EXT_BGRX;
+        enc->cur_image.convert_line = bitmap_row_rgb16_to_bgrx32;
+#else
+        enc->cur_image.convert_line = bitmap_row_rgb16_to_rgb24;
+#endif
         break;
     case JPEG_IMAGE_TYPE_BGR24:
-        enc->cur_image.convert_line_to_RGB24 = convert_BGR24_to_RGB24;
+#ifdef JCS_EXTENSIONS
+        enc->cinfo.in_color_space = JCS_EXT_LE_BGR;
+        enc->cur_image.convert_line = NULL;
+#else
+        enc->cur_image.convert_line = bitmap_row_bgr24_to_rgb24;
+#endif
         break;
     case JPEG_IMAGE_TYPE_BGRX32:
-        enc->cur_image.convert_line_to_RGB24 = convert_BGRX32_to_RGB24;
+#ifdef JCS_EXTENSIONS
+        enc->cinfo.input_components = 4;
+        enc->cinfo.in_color_space = JCS_EXT_LE_BGRX;
+        enc->cur_image.convert_line = NULL;
+#else
+        enc->cur_image.convert_line = bitmap_row_bgrx32_to_rgb24;
+#endif
         break;
     default:
         spice_error("bad image type");
@@ -221,8 +193,6 @@ int jpeg_encode(JpegEncoderContext *enc, int quality, JpegEncoderImageType type,
 
     enc->cinfo.image_width = width;
     enc->cinfo.image_height = height;
-    enc->cinfo.input_components = 3;
-    enc->cinfo.in_color_space = JCS_RGB;
     jpeg_set_defaults(&enc->cinfo);
     jpeg_set_quality(&enc->cinfo, quality, TRUE);
 
@@ -17,6 +17,7 @@
 #include <config.h>
 
 #include <inttypes.h>
+#include <atomic>
 #include <common/generated_server_marshallers.h>
 
 #include "main-channel-client.h"
@@ -49,8 +50,12 @@ struct MainChannelClientPrivate {
     uint32_t ping_id = 0;
     uint32_t net_test_id = 0;
     NetTestStage net_test_stage = NET_TEST_STAGE_INVALID;
-    uint64_t latency = 0;
-    uint64_t bitrate_per_sec = ~0;
+    /* the network values are updated by the channels of the client and
+     * read from the worker threads */
+    std::atomic<uint64_t> latency{0};
+    std::atomic<uint64_t> bitrate_per_sec{~UINT64_C(0)};
+    std::atomic<bool> network_info_initialized{false};
+    std::atomic<bool> low_bandwidth{false};
     int mig_wait_connect = 0;
     int mig_connect_ok = 0;
     int mig_wait_prev_complete = 0;
@@ -131,6 +136,12 @@ void MainChannelClient::release_recv_buf(uint16_t type, uint32_t size, uint8_t *
     }
 }
 
+bool MainChannelClient::can_parse_in_place(uint16_t type, uint32_t size)
+{
+    /* agent data is passed to the agent in its buffer */
+    return type != SPICE_MSGC_MAIN_AGENT_DATA && size <= sizeof(priv->recv_buf);
+}
+
 /*
  * When the main channel is disconnected, disconnect the entire client.
  */
@@ -353,7 +364,7 @@ void MainChannelClient::handle_pong(SpiceMsgPing *ping, uint32_t size)
     case NET_TEST_STAGE_LATENCY:
         priv->net_test_id++;
         priv->net_test_stage = NET_TEST_STAGE_RATE;
-        priv->latency = MIN(priv->latency, roundtrip);
+        priv->latency = MIN(priv->latency.load(), roundtrip);
         break;
     case NET_TEST_STAGE_RATE:
         priv->net_test_id = 0;
@@ -362,19 +373,19 @@ void MainChannelClient::handle_pong(SpiceMsgPing *ping, uint32_t size)
             red_channel_debug(get_channel(),
                               "net test: invalid values, latency %" G_GUINT64_FORMAT
                               " roundtrip %" G_GUINT64_FORMAT ". assuming high"
-                              "bandwidth", priv->latency, roundtrip);
+                              "bandwidth", priv->latency.load(), roundtrip);
             priv->latency = 0;
             priv->net_test_stage = NET_TEST_STAGE_INVALID;
             start_connectivity_monitoring(CLIENT_CONNECTIVITY_TIMEOUT);
             break;
         }
-        priv->bitrate_per_sec = (uint64_t)(NET_TEST_BYTES * 8) * 1000000
-            / (roundtrip - priv->latency);
         priv->net_test_stage = NET_TEST_STAGE_COMPLETE;
+        update_network_estimate((uint64_t)(NET_TEST_BYTES * 8) * 1000000
+                                / (roundtrip - priv->latency), priv->latency);
         red_channel_debug(get_channel(),
                           "net test: latency %f ms, bitrate %" G_GUINT64_FORMAT " bps (%f Mbps)%s",
                           (double)priv->latency / 1000,
-                          priv->bitrate_per_sec,
+                          priv->bitrate_per_sec.load(),
                           (double)priv->bitrate_per_sec / 1024 / 1024,
                           this->is_low_bandwidth() ? " LOW BANDWIDTH" : "");
         start_connectivity_monitoring(CLIENT_CONNECTIVITY_TIMEOUT);
@@ -477,13 +488,37 @@ MainChannelClient *main_channel_client_create(MainChannel *main_chan, RedClient
 
 bool MainChannelClient::is_network_info_initialized() const
 {
-    return priv->net_test_stage == NET_TEST_STAGE_COMPLETE;
+    return priv->network_info_initialized;
+}
+
+// TODO: configurable?
+#define LOW_BANDWIDTH_BITRATE (10 * 1024 * 1024)
+/* don't switch back and forth on a link close to the limit */
+#define LOW_BANDWIDTH_HYSTERESIS (LOW_BANDWIDTH_BITRATE / 4)
+
+void MainChannelClient::update_network_estimate(uint64_t bitrate_per_sec, uint64_t roundtrip_us)
+{
+    bool low_bandwidth = priv->low_bandwidth;
+
+    if (!priv->network_info_initialized) {
+        low_bandwidth = bitrate_per_sec < LOW_BANDWIDTH_BITRATE;
+    } else if (low_bandwidth) {
+        low_bandwidth = bitrate_per_sec < LOW_BANDWIDTH_BITRATE + LOW_BANDWIDTH_HYSTERESIS;
+    } else {
+        low_bandwidth = bitrate_per_sec < LOW_BANDWIDTH_BITRATE - LOW_BANDWIDTH_HYSTERESIS;
+    }
+
+    priv->bitrate_per_sec = bitrate_per_sec;
+    if (roundtrip_us) {
+        priv->latency = roundtrip_us;
+    }
+    priv->low_bandwidth = low_bandwidth;
+    priv->network_info_initialized = true;
 }
 
 bool MainChannelClient::is_low_bandwidth() const
 {
-    // TODO: configurable?
-    return priv->bitrate_per_sec < 10 * 1024 * 1024;
+    return priv->low_bandwidth;
 }
 
 uint64_t MainChannelClient::get_bitrate_per_sec() const
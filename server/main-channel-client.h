@@ -55,11 +55,18 @@ public:
     gboolean migrate_src_complete(gboolean success);
 
     /*
-     * return TRUE if network test had been completed successfully.
+     * return TRUE if the network was measured, either by the network test or
+     * by the channels of the client.
      * If FALSE, bitrate_per_sec is set to MAX_UINT64 and the roundtrip is set to 0
+     * These values can be read from any thread.
      */
     bool is_network_info_initialized() const;
     bool is_low_bandwidth() const;
+    /*
+     * Update the network values with a new estimate, @roundtrip_us is ignored
+     * if 0.
+     */
+    void update_network_estimate(uint64_t bitrate_per_sec, uint64_t roundtrip_us);
     uint64_t get_bitrate_per_sec() const;
     uint64_t get_roundtrip_ms() const;
 
@@ -84,6 +91,7 @@ public:
 protected:
     virtual uint8_t *alloc_recv_buf(uint16_t type, uint32_t size) override;
     virtual void release_recv_buf(uint16_t type, uint32_t size, uint8_t *msg) override;
+    virtual bool can_parse_in_place(uint16_t type, uint32_t size) override;
     virtual void on_disconnect() override;
     virtual bool handle_message(uint16_t type, uint32_t size, void *message) override;
     virtual void send_item(RedPipeItem *item)  override;
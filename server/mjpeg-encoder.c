@@ -25,6 +25,7 @@
 #include "red-common.h"
 #include "video-encoder.h"
 #include "utils.h"
+#include "spice-bitmap-utils.h"
 
 #define MJPEG_MAX_FPS 25
 #define MJPEG_MIN_FPS 1
@@ -70,16 +71,6 @@ static const int mjpeg_quality_samples[MJPEG_QUALITY_SAMPLE_NUM] = {20, 30, 40,
 /* The compressed buffer initial size. */
 #define MJPEG_INITIAL_BUFFER_SIZE (32 * 1024)
 
-#ifdef JCS_EXTENSIONS
-#  ifndef WORDS_BIGENDIAN
-#    define JCS_EXT_LE_BGRX JCS_EXT_BGRX
-#    define JCS_EXT_LE_BGR JCS_EXT_BGR
-#  else
-#    define JCS_EXT_LE_BGRX JCS_EXT_XRGB
-#    define JCS_EXT_LE_BGR JCS_EXT_RGB
-#  endif
-#endif
-
 enum {
     MJPEG_QUALITY_EVAL_TYPE_SET,
     MJPEG_QUALITY_EVAL_TYPE_UPGRADE,
@@ -179,7 +170,8 @@ typedef struct MJpegEncoder {
     struct jpeg_error_mgr jerr;
 
     unsigned int bytes_per_pixel; /* bytes per pixel of the input buffer */
-    void (*pixel_converter)(void *src, uint8_t *dest);
+    /* converts a row of the input buffer to encoder->row */
+    void (*row_converter)(uint8_t *dest, const uint8_t *src, unsigned int width);
 
     MJpegEncoderRateControl rate_control;
     VideoEncoderRateControlCbs cbs;
@@ -228,36 +220,6 @@ static uint8_t mjpeg_encoder_get_bytes_per_pixel(MJpegEncoder *encoder)
     return encoder->bytes_per_pixel;
 }
 
-#ifndef JCS_EXTENSIONS
-/* Pixel conversion routines */
-static void pixel_rgb24bpp_to_24(void *src_ptr, uint8_t *dest)
-{
-    uint8_t *src = src_ptr;
-    /* libjpegs stores rgb, spice/win32 stores bgr */
-    *dest++ = src[2]; /* red */
-    *dest++ = src[1]; /* green */
-    *dest++ = src[0]; /* blue */
-}
-
-static void pixel_rgb32bpp_to_24(void *src, uint8_t *dest)
-{
-    uint32_t pixel = *(uint32_t *)src;
-    pixel = GUINT32_FROM_LE(pixel);
-    *dest++ = (pixel >> 16) & 0xff;
-    *dest++ = (pixel >>  8) & 0xff;
-    *dest++ = (pixel >>  0) & 0xff;
-}
-#endif
-
-static void pixel_rgb16bpp_to_24(void *src, uint8_t *dest)
-{
-    uint16_t pixel = *(uint16_t *)src;
-    pixel = GUINT16_FROM_LE(pixel);
-    *dest++ = ((pixel >> 7) & 0xf8) | ((pixel >> 12) & 0x7);
-    *dest++ = ((pixel >> 2) & 0xf8) | ((pixel >> 7) & 0x7);
-    *dest++ = ((pixel << 3) & 0xf8) | ((pixel >> 2) & 0x7);
-}
-
 
 /* code from libjpeg 8 to handle compression to a memory buffer
  *
@@ -759,7 +721,7 @@ mjpeg_encoder_start_frame(MJpegEncoder *encoder,
 
     encoder->cinfo.in_color_space   = JCS_RGB;
     encoder->cinfo.input_components = 3;
-    encoder->pixel_converter = NULL;
+    encoder->row_converter = NULL;
 
     switch (format) {
     case SPICE_BITMAP_FMT_32BIT:
@@ -769,19 +731,26 @@ mjpeg_encoder_start_frame(MJpegEncoder *encoder,
         encoder->cinfo.in_color_space   = JCS_EXT_LE_BGRX;
         encoder->cinfo.input_components = 4;
 #else
-        encoder->pixel_converter = pixel_rgb32bpp_to_24;
+        encoder->row_converter = bitmap_row_bgrx32_to_rgb24;
 #endif
         break;
     case SPICE_BITMAP_FMT_16BIT:
         encoder->bytes_per_pixel = 2;
-        encoder->pixel_converter = pixel_rgb16bpp_to_24;
+#ifdef JCS_EXTENSIONS
+        /* the expansion to 32 bits vectorizes better than to 24 bits */
+        encoder->cinfo.in_color_space   = JCS_EXT_BGRX;
+        encoder->cinfo.input_components = 4;
+        encoder->row_converter = bitmap_row_rgb16_to_bgrx32;
+#else
+        encoder->row_converter = bitmap_row_rgb16_to_rgb24;
+#endif
         break;
     case SPICE_BITMAP_FMT_24BIT:
         encoder->bytes_per_pixel = 3;
 #ifdef JCS_EXTENSIONS
         encoder->cinfo.in_color_space = JCS_EXT_LE_BGR;
 #else
-        encoder->pixel_converter = pixel_rgb24bpp_to_24;
+        encoder->row_converter = bitmap_row_bgr24_to_rgb24;
 #endif
         break;
     default:
@@ -791,10 +760,10 @@ mjpeg_encoder_start_frame(MJpegEncoder *encoder,
 
     encoder->cinfo.image_width = src->right - src->left;
     encoder->cinfo.image_height = src->bottom - src->top;
-    if (encoder->pixel_converter != NULL) {
-        JDIMENSION stride = encoder->cinfo.image_width * 3;
+    if (encoder->row_converter != NULL) {
+        JDIMENSION stride = encoder->cinfo.image_width * encoder->cinfo.input_components;
         /* check for integer overflow */
-        if (stride < encoder->cinfo.image_width) {
+        if (stride / encoder->cinfo.input_components != encoder->cinfo.image_width) {
             return VIDEO_ENCODER_FRAME_UNSUPPORTED;
         }
         if (encoder->row_size < stride) {
@@ -821,17 +790,9 @@ static int mjpeg_encoder_encode_scanline(MJpegEncoder *encoder,
                                          size_t image_width)
 {
     unsigned int scanlines_written;
-    uint8_t *row;
 
-    row = encoder->row;
-    if (encoder->pixel_converter) {
-        unsigned int x;
-        for (x = 0; x < image_width; x++) {
-            /* src_pixels is expected to be 4 bytes aligned */
-            encoder->pixel_converter(src_pixels, row);
-            row += 3;
-            src_pixels += encoder->bytes_per_pixel;
-        }
+    if (encoder->row_converter) {
+        encoder->row_converter(encoder->row, src_pixels, image_width);
         scanlines_written = jpeg_write_scanlines(&encoder->cinfo, &encoder->row, 1);
     } else {
         scanlines_written = jpeg_write_scanlines(&encoder->cinfo, &src_pixels, 1);
@@ -16,24 +16,510 @@
 */
 #include <config.h>
 
+#include <stdlib.h>
+#include <string.h>
+
 #include "pixmap-cache.h"
 
-int pixmap_cache_unlocked_set_lossy(PixmapCache *cache, uint64_t id, int lossy)
+#define PIXMAP_CACHE_ITEMS_PER_BLOCK 256
+/* number of lockless attempts of pixmap_cache_contains() */
+#define PIXMAP_CACHE_READ_TRIES 4
+
+/* Linear probing table, at most half full so probes stay short and always
+ * end on an empty slot */
+struct PixmapCacheIndex {
+    NewCacheItem **slots;
+    uint32_t shift;
+    uint32_t n_items;
+    /* previous index, still read by pixmap_cache_contains() */
+    PixmapCacheIndex *retired;
+};
+
+static PixmapCacheIndex *pixmap_cache_index_new(uint32_t shift)
+{
+    PixmapCacheIndex *index = g_new0(PixmapCacheIndex, 1);
+
+    index->slots = g_new0(NewCacheItem *, 1u << shift);
+    index->shift = shift;
+    return index;
+}
+
+static void pixmap_cache_index_free(PixmapCacheIndex *index)
+{
+    while (index) {
+        PixmapCacheIndex *retired = index->retired;
+
+        g_free(index->slots);
+        g_free(index);
+        index = retired;
+    }
+}
+
+static inline uint32_t pixmap_cache_index_mask(const PixmapCacheIndex *index)
+{
+    return (1u << index->shift) - 1;
+}
+
+static inline uint32_t pixmap_cache_index_hash(const PixmapCacheIndex *index, uint64_t id)
+{
+    /* ids are often sequential or hashes with few significant bits */
+    return (id * UINT64_C(0x9e3779b97f4a7c15)) >> (64 - index->shift);
+}
+
+/* Return the slot holding @id or the empty slot ending its probe */
+static uint32_t pixmap_cache_index_find(const PixmapCacheIndex *index, uint64_t id)
+{
+    uint32_t mask = pixmap_cache_index_mask(index);
+    uint32_t pos = pixmap_cache_index_hash(index, id);
+
+    while (index->slots[pos] && index->slots[pos]->id != id) {
+        pos = (pos + 1) & mask;
+    }
+    return pos;
+}
+
+static inline void pixmap_cache_index_set(PixmapCacheIndex *index, uint32_t pos,
+                                          NewCacheItem *item)
+{
+    __atomic_store_n(&index->slots[pos], item, __ATOMIC_RELEASE);
+}
+
+/* Readers retry while index_seq is odd or changed during their lookup */
+static inline void pixmap_cache_write_begin(PixmapCache *cache)
+{
+    __atomic_store_n(&cache->index_seq, cache->index_seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void pixmap_cache_write_end(PixmapCache *cache)
+{
+    __atomic_store_n(&cache->index_seq, cache->index_seq + 1, __ATOMIC_RELEASE);
+}
+
+static void pixmap_cache_index_grow(PixmapCache *cache)
+{
+    PixmapCacheIndex *old_index = cache->index;
+    PixmapCacheIndex *index = pixmap_cache_index_new(old_index->shift + 1);
+    uint32_t i;
+
+    for (i = 0; i <= pixmap_cache_index_mask(old_index); i++) {
+        NewCacheItem *item = old_index->slots[i];
+
+        if (item) {
+            index->slots[pixmap_cache_index_find(index, item->id)] = item;
+        }
+    }
+    index->n_items = old_index->n_items;
+    /* lockless readers may still be using the old index */
+    index->retired = old_index;
+
+    pixmap_cache_write_begin(cache);
+    __atomic_store_n(&cache->index, index, __ATOMIC_RELEASE);
+    pixmap_cache_write_end(cache);
+}
+
+static void pixmap_cache_index_clear(PixmapCache *cache)
+{
+    PixmapCacheIndex *index = cache->index;
+    uint32_t i;
+
+    pixmap_cache_write_begin(cache);
+    for (i = 0; i <= pixmap_cache_index_mask(index); i++) {
+        pixmap_cache_index_set(index, i, NULL);
+    }
+    index->n_items = 0;
+    pixmap_cache_write_end(cache);
+}
+
+static NewCacheItem *pixmap_cache_item_alloc(PixmapCache *cache)
 {
     NewCacheItem *item;
 
-    item = cache->hash_table[BITS_CACHE_HASH_KEY(id)];
+    if (!cache->free_items) {
+        NewCacheItem *block = g_new(NewCacheItem, PIXMAP_CACHE_ITEMS_PER_BLOCK);
+        int i;
+
+        cache->item_blocks = g_slist_prepend(cache->item_blocks, block);
+        for (i = PIXMAP_CACHE_ITEMS_PER_BLOCK - 1; i >= 0; i--) {
+            block[i].next = cache->free_items;
+            cache->free_items = &block[i];
+        }
+    }
+    item = cache->free_items;
+    cache->free_items = item->next;
+    return item;
+}
+
+static void pixmap_cache_item_free(PixmapCache *cache, NewCacheItem *item)
+{
+    item->next = cache->free_items;
+    cache->free_items = item;
+}
+
+struct PixmapCachePolicyOps {
+    const char *name;
+    void (*insert)(PixmapCache *cache, NewCacheItem *item);
+    void (*hit)(PixmapCache *cache, NewCacheItem *item);
+    void (*remove)(PixmapCache *cache, NewCacheItem *item);
+    NewCacheItem *(*get_victim)(PixmapCache *cache);
+    /* takes the victim @item out of the eviction order, false if no other
+     * item can be evicted before @item is */
+    bool (*skip_victim)(PixmapCache *cache, NewCacheItem *item);
+    /* puts back the skipped items */
+    void (*restore_victims)(PixmapCache *cache);
+};
+
+static void lru_nop(PixmapCache *cache, NewCacheItem *item)
+{
+}
+
+static NewCacheItem *lru_get_victim(PixmapCache *cache)
+{
+    SPICE_VERIFY(SPICE_OFFSETOF(NewCacheItem, lru_link) == 0);
+    return SPICE_CONTAINEROF(ring_get_tail(&cache->lru), NewCacheItem, lru_link);
+}
+
+/* the items following the victim were used after it */
+static bool lru_skip_victim(PixmapCache *cache, NewCacheItem *item)
+{
+    return false;
+}
+
+static void lru_restore_victims(PixmapCache *cache)
+{
+}
+
+static const PixmapCachePolicyOps lru_policy = {
+    "lru",
+    lru_nop,
+    lru_nop,
+    lru_nop,
+    lru_get_victim,
+    lru_skip_victim,
+    lru_restore_victims,
+};
+
+static void gdsf_heap_set(PixmapCache *cache, uint32_t pos, NewCacheItem *item)
+{
+    cache->heap[pos] = item;
+    item->heap_pos = pos;
+}
+
+static void gdsf_heap_sift_up(PixmapCache *cache, NewCacheItem *item)
+{
+    uint32_t pos = item->heap_pos;
+
+    while (pos > 0) {
+        uint32_t parent = (pos - 1) / 2;
+
+        if (cache->heap[parent]->priority <= item->priority) {
+            break;
+        }
+        gdsf_heap_set(cache, pos, cache->heap[parent]);
+        pos = parent;
+    }
+    gdsf_heap_set(cache, pos, item);
+}
+
+static void gdsf_heap_sift_down(PixmapCache *cache, NewCacheItem *item)
+{
+    uint32_t pos = item->heap_pos;
+
+    for (;;) {
+        uint32_t child = pos * 2 + 1;
 
-    while (item) {
-        if (item->id == id) {
-            item->lossy = lossy;
+        if (child >= cache->heap_size) {
             break;
         }
-        item = item->next;
+        if (child + 1 < cache->heap_size &&
+            cache->heap[child + 1]->priority < cache->heap[child]->priority) {
+            child++;
+        }
+        if (item->priority <= cache->heap[child]->priority) {
+            break;
+        }
+        gdsf_heap_set(cache, pos, cache->heap[child]);
+        pos = child;
+    }
+    gdsf_heap_set(cache, pos, item);
+}
+
+/* priority = age + hits * bytes saved per pixel, in 1/1024 of byte */
+static void gdsf_update_priority(PixmapCache *cache, NewCacheItem *item)
+{
+    item->priority = cache->age +
+                     (uint64_t) item->hits * (((uint64_t) item->cost << 10) / MAX(item->size, 1));
+}
+
+static void gdsf_heap_push(PixmapCache *cache, NewCacheItem *item)
+{
+    if (cache->heap_size == cache->heap_alloc) {
+        cache->heap_alloc = MAX(cache->heap_alloc * 2, BITS_CACHE_HASH_SIZE);
+        cache->heap = g_renew(NewCacheItem *, cache->heap, cache->heap_alloc);
+    }
+    item->heap_pos = cache->heap_size++;
+    gdsf_heap_sift_up(cache, item);
+}
+
+static void gdsf_heap_remove(PixmapCache *cache, NewCacheItem *item)
+{
+    NewCacheItem *last = cache->heap[--cache->heap_size];
+
+    if (last == item) {
+        return;
+    }
+    gdsf_heap_set(cache, item->heap_pos, last);
+    gdsf_heap_sift_up(cache, last);
+    gdsf_heap_sift_down(cache, last);
+}
+
+static void gdsf_insert(PixmapCache *cache, NewCacheItem *item)
+{
+    gdsf_update_priority(cache, item);
+    gdsf_heap_push(cache, item);
+}
+
+static void gdsf_hit(PixmapCache *cache, NewCacheItem *item)
+{
+    gdsf_update_priority(cache, item);
+    /* the priority can only grow, the age does not decrease */
+    gdsf_heap_sift_down(cache, item);
+}
+
+static void gdsf_remove(PixmapCache *cache, NewCacheItem *item)
+{
+    /* items inserted later start from the priority of the evicted ones */
+    cache->age = MAX(cache->age, item->priority);
+    gdsf_heap_remove(cache, item);
+}
+
+static NewCacheItem *gdsf_get_victim(PixmapCache *cache)
+{
+    return cache->heap_size ? cache->heap[0] : NULL;
+}
+
+/* an item inserted or hit recently can still have the lowest priority,
+ * the next ones may be evictable */
+static bool gdsf_skip_victim(PixmapCache *cache, NewCacheItem *item)
+{
+    gdsf_heap_remove(cache, item);
+    item->next = cache->skipped_victims;
+    cache->skipped_victims = item;
+    return true;
+}
+
+static void gdsf_restore_victims(PixmapCache *cache)
+{
+    while (cache->skipped_victims) {
+        NewCacheItem *item = cache->skipped_victims;
+
+        cache->skipped_victims = item->next;
+        gdsf_heap_push(cache, item);
+    }
+}
+
+static const PixmapCachePolicyOps gdsf_policy = {
+    "gdsf",
+    gdsf_insert,
+    gdsf_hit,
+    gdsf_remove,
+    gdsf_get_victim,
+    gdsf_skip_victim,
+    gdsf_restore_victims,
+};
+
+/* in PixmapCachePolicy order */
+static const PixmapCachePolicyOps *const pixmap_cache_policies[PIXMAP_CACHE_N_POLICIES] = {
+    &lru_policy,
+    &gdsf_policy,
+};
+
+PixmapCachePolicy pixmap_cache_get_env_policy(void)
+{
+    const char *env = getenv(PIXMAP_CACHE_POLICY_ENV);
+    int i;
+
+    if (env == NULL) {
+        return PIXMAP_CACHE_POLICY_LRU;
+    }
+    for (i = 0; i < PIXMAP_CACHE_N_POLICIES; i++) {
+        if (strcmp(env, pixmap_cache_policies[i]->name) == 0) {
+            return (PixmapCachePolicy) i;
+        }
+    }
+    spice_warning("invalid value for %s: %s", PIXMAP_CACHE_POLICY_ENV, env);
+    return PIXMAP_CACHE_POLICY_LRU;
+}
+
+const char *pixmap_cache_policy_get_name(PixmapCachePolicy policy)
+{
+    spice_return_val_if_fail(policy < PIXMAP_CACHE_N_POLICIES, NULL);
+
+    return pixmap_cache_policies[policy]->name;
+}
+
+NewCacheItem *pixmap_cache_unlocked_lookup(PixmapCache *cache, uint64_t id)
+{
+    PixmapCacheIndex *index = cache->index;
+
+    return index->slots[pixmap_cache_index_find(index, id)];
+}
+
+NewCacheItem *pixmap_cache_unlocked_insert(PixmapCache *cache, uint64_t id,
+                                           size_t size, uint32_t cost)
+{
+    NewCacheItem *item = pixmap_cache_item_alloc(cache);
+    uint32_t pos;
+
+    if ((cache->index->n_items + 1) * 2 > pixmap_cache_index_mask(cache->index) + 1) {
+        pixmap_cache_index_grow(cache);
+    }
+
+    /* the item may have been freed while a lockless reader was looking at it */
+    __atomic_store_n(&item->id, id, __ATOMIC_RELAXED);
+    item->size = size;
+    item->lossy = FALSE;
+    item->cost = cost;
+    item->hits = 1;
+    memset(item->sync, 0, sizeof(item->sync));
+    ring_item_init(&item->lru_link);
+    ring_add(&cache->lru, &item->lru_link);
+    cache->policy_ops->insert(cache, item);
+
+    pos = pixmap_cache_index_find(cache->index, id);
+    spice_assert(cache->index->slots[pos] == NULL);
+    pixmap_cache_index_set(cache->index, pos, item);
+    cache->index->n_items++;
+    cache->items++;
+
+    return item;
+}
+
+void pixmap_cache_unlocked_remove(PixmapCache *cache, NewCacheItem *item)
+{
+    PixmapCacheIndex *index = cache->index;
+    uint32_t mask = pixmap_cache_index_mask(index);
+    uint32_t hole = pixmap_cache_index_find(index, item->id);
+    uint32_t pos = hole;
+
+    spice_assert(index->slots[hole] == item);
+
+    /* move back the following items of the probe sequence which would not
+     * be found anymore past the hole */
+    pixmap_cache_write_begin(cache);
+    for (;;) {
+        NewCacheItem *next;
+        uint32_t home;
+
+        pos = (pos + 1) & mask;
+        next = index->slots[pos];
+        if (!next) {
+            break;
+        }
+        home = pixmap_cache_index_hash(index, next->id);
+        if (((pos - home) & mask) >= ((pos - hole) & mask)) {
+            pixmap_cache_index_set(index, hole, next);
+            hole = pos;
+        }
+    }
+    pixmap_cache_index_set(index, hole, NULL);
+    pixmap_cache_write_end(cache);
+
+    index->n_items--;
+    cache->items--;
+    ring_remove(&item->lru_link);
+    cache->policy_ops->remove(cache, item);
+    pixmap_cache_item_free(cache, item);
+}
+
+void pixmap_cache_unlocked_hit(PixmapCache *cache, NewCacheItem *item)
+{
+    ring_remove(&item->lru_link);
+    ring_add(&cache->lru, &item->lru_link);
+    item->hits++;
+    cache->policy_ops->hit(cache, item);
+}
+
+NewCacheItem *pixmap_cache_unlocked_get_victim(PixmapCache *cache)
+{
+    return cache->policy_ops->get_victim(cache);
+}
+
+NewCacheItem *pixmap_cache_unlocked_get_unused_victim(PixmapCache *cache,
+                                                      uint8_t client, uint64_t serial)
+{
+    NewCacheItem *victim;
+
+    while ((victim = cache->policy_ops->get_victim(cache)) != NULL &&
+           victim->sync[client] == serial) {
+        if (!cache->policy_ops->skip_victim(cache, victim)) {
+            return NULL;
+        }
+    }
+    return victim;
+}
+
+void pixmap_cache_unlocked_end_eviction(PixmapCache *cache)
+{
+    cache->policy_ops->restore_victims(cache);
+}
+
+int pixmap_cache_unlocked_set_lossy(PixmapCache *cache, uint64_t id, int lossy)
+{
+    NewCacheItem *item = pixmap_cache_unlocked_lookup(cache, id);
+
+    if (item) {
+        item->lossy = lossy;
     }
     return !!item;
 }
 
+static int pixmap_cache_try_contains(PixmapCache *cache, uint64_t id, bool *found)
+{
+    uint32_t seq = __atomic_load_n(&cache->index_seq, __ATOMIC_ACQUIRE);
+    PixmapCacheIndex *index;
+    uint32_t mask, pos;
+
+    if (seq & 1) {
+        return FALSE;
+    }
+
+    index = __atomic_load_n(&cache->index, __ATOMIC_ACQUIRE);
+    mask = pixmap_cache_index_mask(index);
+    *found = false;
+    for (pos = pixmap_cache_index_hash(index, id);; pos = (pos + 1) & mask) {
+        NewCacheItem *item = __atomic_load_n(&index->slots[pos], __ATOMIC_ACQUIRE);
+
+        if (!item) {
+            break;
+        }
+        if (__atomic_load_n(&item->id, __ATOMIC_RELAXED) == id) {
+            *found = true;
+            break;
+        }
+    }
+
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&cache->index_seq, __ATOMIC_RELAXED) == seq;
+}
+
+bool pixmap_cache_contains(PixmapCache *cache, uint64_t id)
+{
+    bool found;
+    int i;
+
+    for (i = 0; i < PIXMAP_CACHE_READ_TRIES; i++) {
+        if (pixmap_cache_try_contains(cache, id, &found)) {
+            return found;
+        }
+    }
+
+    pthread_mutex_lock(&cache->lock);
+    found = pixmap_cache_unlocked_lookup(cache, id) != NULL;
+    pthread_mutex_unlock(&cache->lock);
+    return found;
+}
+
 void pixmap_cache_clear(PixmapCache *cache)
 {
     NewCacheItem *item;
@@ -47,9 +533,11 @@ void pixmap_cache_clear(PixmapCache *cache)
     SPICE_VERIFY(SPICE_OFFSETOF(NewCacheItem, lru_link) == 0);
     while ((item = SPICE_CONTAINEROF(ring_get_head(&cache->lru), NewCacheItem, lru_link))) {
         ring_remove(&item->lru_link);
-        g_free(item);
+        pixmap_cache_item_free(cache, item);
     }
-    memset(cache->hash_table, 0, sizeof(*cache->hash_table) * BITS_CACHE_HASH_SIZE);
+    pixmap_cache_index_clear(cache);
+    cache->heap_size = 0;
+    cache->age = 0;
 
     cache->available = cache->size;
     cache->items = 0;
@@ -67,7 +555,9 @@ bool pixmap_cache_freeze(PixmapCache *cache)
     cache->frozen_head = cache->lru.next;
     cache->frozen_tail = cache->lru.prev;
     ring_init(&cache->lru);
-    memset(cache->hash_table, 0, sizeof(*cache->hash_table) * BITS_CACHE_HASH_SIZE);
+    pixmap_cache_index_clear(cache);
+    /* the frozen items are released by pixmap_cache_clear() */
+    cache->heap_size = 0;
     cache->available = -1;
     cache->frozen = TRUE;
 
@@ -82,6 +572,10 @@ static void pixmap_cache_destroy(PixmapCache *cache)
     pthread_mutex_lock(&cache->lock);
     pixmap_cache_clear(cache);
     pthread_mutex_unlock(&cache->lock);
+
+    pixmap_cache_index_free(cache->index);
+    g_slist_free_full(cache->item_blocks, g_free);
+    g_free(cache->heap);
 }
 
 
@@ -96,7 +590,10 @@ static PixmapCache *pixmap_cache_new(RedClient *client, uint8_t id, int64_t size
     pthread_mutex_init(&cache->lock, NULL);
     cache->id = id;
     cache->refs = 1;
+    cache->index = pixmap_cache_index_new(BITS_CACHE_HASH_SHIFT);
     ring_init(&cache->lru);
+    cache->policy = pixmap_cache_get_env_policy();
+    cache->policy_ops = pixmap_cache_policies[cache->policy];
     cache->available = size;
     cache->size = size;
     cache->client = client;
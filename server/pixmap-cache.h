@@ -27,21 +27,45 @@ SPICE_BEGIN_DECLS
 
 #define MAX_CACHE_CLIENTS 4
 
+/* initial size of the index, it grows with the number of items */
 #define BITS_CACHE_HASH_SHIFT 10
 #define BITS_CACHE_HASH_SIZE (1 << BITS_CACHE_HASH_SHIFT)
-#define BITS_CACHE_HASH_MASK (BITS_CACHE_HASH_SIZE - 1)
-#define BITS_CACHE_HASH_KEY(id) ((id) & BITS_CACHE_HASH_MASK)
+
+/* Environment variable selecting the eviction policy of the caches */
+#define PIXMAP_CACHE_POLICY_ENV "SPICE_PIXMAP_CACHE_POLICY"
+
+typedef enum {
+    /* least recently used item first */
+    PIXMAP_CACHE_POLICY_LRU,
+    /* Greedy-Dual-Size-Frequency: the item whose hits saved the fewest
+     * bytes per pixel of cache first, aged so that items once popular
+     * but no longer used are eventually evicted */
+    PIXMAP_CACHE_POLICY_GDSF,
+
+    PIXMAP_CACHE_N_POLICIES
+} PixmapCachePolicy;
 
 typedef struct PixmapCache PixmapCache;
 typedef struct NewCacheItem NewCacheItem;
+typedef struct PixmapCacheIndex PixmapCacheIndex;
+typedef struct PixmapCachePolicyOps PixmapCachePolicyOps;
 
 struct NewCacheItem {
     RingItem lru_link;
+    /* next free item while in the pool, next skipped victim during an
+     * eviction */
     NewCacheItem *next;
     uint64_t id;
     uint64_t sync[MAX_CACHE_CLIENTS];
     size_t size;
     int lossy;
+
+    /* bytes sent to the client for the image, what a hit saves */
+    uint32_t cost;
+    uint32_t hits;
+    /* GDSF priority and position in the heap */
+    uint64_t priority;
+    uint32_t heap_pos;
 };
 
 struct PixmapCache {
@@ -49,8 +73,28 @@ struct PixmapCache {
     pthread_mutex_t lock;
     uint8_t id;
     uint32_t refs;
-    NewCacheItem *hash_table[BITS_CACHE_HASH_SIZE];
+    /* open addressed index of the items, modified with the lock held.
+     * pixmap_cache_contains() reads it without the lock and checks
+     * index_seq, which is odd while an item is being moved */
+    PixmapCacheIndex *index;
+    uint32_t index_seq;
+    /* items are allocated by blocks, released only with the cache */
+    GSList *item_blocks;
+    NewCacheItem *free_items;
+    /* most recently used items first, whatever the policy */
     Ring lru;
+
+    PixmapCachePolicy policy;
+    const PixmapCachePolicyOps *policy_ops;
+    /* min-heap of the items on their priority, for GDSF */
+    NewCacheItem **heap;
+    uint32_t heap_size;
+    uint32_t heap_alloc;
+    uint64_t age;
+    /* items used by the message being sent, out of the heap until the end
+     * of the eviction */
+    NewCacheItem *skipped_victims;
+
     int64_t available;
     int64_t size;
     int32_t items;
@@ -74,6 +118,32 @@ void         pixmap_cache_unref(PixmapCache *cache);
 void         pixmap_cache_clear(PixmapCache *cache);
 int          pixmap_cache_unlocked_set_lossy(PixmapCache *cache, uint64_t id, int lossy);
 bool         pixmap_cache_freeze(PixmapCache *cache);
+/* Can be called without the lock and while other threads use the cache */
+bool         pixmap_cache_contains(PixmapCache *cache, uint64_t id);
+
+PixmapCachePolicy pixmap_cache_get_env_policy(void);
+const char       *pixmap_cache_policy_get_name(PixmapCachePolicy policy);
+
+NewCacheItem *pixmap_cache_unlocked_lookup(PixmapCache *cache, uint64_t id);
+/* Add a new item for @id, which must not be in the cache. @size is the
+ * space it takes in the cache and @cost the bytes sent for it.
+ * Accounting the available space is up to the caller */
+NewCacheItem *pixmap_cache_unlocked_insert(PixmapCache *cache, uint64_t id,
+                                           size_t size, uint32_t cost);
+/* Account a use of @item */
+void          pixmap_cache_unlocked_hit(PixmapCache *cache, NewCacheItem *item);
+/* The item the policy would evict first, NULL if the cache is empty */
+NewCacheItem *pixmap_cache_unlocked_get_victim(PixmapCache *cache);
+/* The item the policy would evict first among the ones not used by the
+ * message @serial of the channel client @client, NULL if there is none.
+ * The items passed over are not returned again before
+ * pixmap_cache_unlocked_end_eviction() is called */
+NewCacheItem *pixmap_cache_unlocked_get_unused_victim(PixmapCache *cache,
+                                                      uint8_t client, uint64_t serial);
+/* Ends the evictions started with pixmap_cache_unlocked_get_unused_victim() */
+void          pixmap_cache_unlocked_end_eviction(PixmapCache *cache);
+/* Remove @item from the cache and release it */
+void          pixmap_cache_unlocked_remove(PixmapCache *cache, NewCacheItem *item);
 
 SPICE_END_DECLS
 
@@ -111,8 +111,16 @@ typedef struct IncomingMessageBuffer {
     uint32_t header_pos;
     uint8_t *msg; // data of the msg following the header. allocated by alloc_msg_buf.
     uint32_t msg_pos;
+    // data read from the socket but not consumed yet is [read_pos, read_end)
+    uint8_t *read_buf;
+    uint32_t read_pos;
+    uint32_t read_end;
 } IncomingMessageBuffer;
 
+/* size of the buffer for the data read ahead, larger reads go directly to
+ * the message buffer */
+#define READ_AHEAD_BUF_SIZE (16 * 1024)
+
 struct RedChannelClientPrivate
 {
     SPICE_CXX_GLIB_ALLOCATOR
@@ -134,6 +142,13 @@ struct RedChannelClientPrivate
         uint32_t client_generation;
         uint32_t messages_window;
         uint32_t client_window;
+        /* bounds of the adaptive window, max_window is 0 if the window is fixed */
+        uint32_t min_window;
+        uint32_t max_window;
+        /* messages sent since period_start and whether they waited for acks */
+        uint64_t period_start;
+        uint32_t period_messages;
+        bool stalled;
     } ack_data;
 
     struct {
@@ -143,6 +158,8 @@ struct RedChannelClientPrivate
         uint32_t size;
         bool blocked;
         uint64_t last_sent_serial;
+        /* zero copy writes of the stream when the message started */
+        uint32_t zerocopy_mark;
 
         struct {
             SpiceMarshaller *marshaller;
@@ -154,9 +171,20 @@ struct RedChannelClientPrivate
         } urgent;
     } send_data;
 
+    /* marshallers of messages sent without copy, their buffers must be kept
+     * until the kernel is done with them */
+    struct ZerocopyMarshaller {
+        SpiceMarshaller *marshaller;
+        uint32_t sent;
+    };
+    std::list<ZerocopyMarshaller, red::Mallocator<ZerocopyMarshaller>> zerocopy_marshallers;
+
     bool block_read;
     bool during_send;
     RedChannelClient::Pipe pipe;
+    /* sum of the size estimates of the items in pipe */
+    uint64_t pipe_bytes = 0;
+    uint64_t pipe_bytes_budget = UINT64_MAX;
 
     RedChannelCapabilities remote_caps;
     bool is_mini_header;
@@ -167,11 +195,23 @@ struct RedChannelClientPrivate
     RedChannelClientLatencyMonitor latency_monitor;
     RedChannelClientConnectivityMonitor connectivity_monitor;
 
+    /* passive estimation of the bandwidth to the client */
+    struct {
+        uint64_t period_start;
+        uint64_t period_bytes;
+        /* the socket was full during the period, the link limited the rate */
+        bool period_blocked;
+        uint64_t bits_per_sec;
+    } bandwidth;
+
     IncomingMessageBuffer incoming;
     OutgoingMessageBuffer outgoing;
+    /* resumes the parsing of the data read ahead when reading is unblocked */
+    SpiceTimer *read_ahead_timer;
 
     RedStatCounter out_messages;
     RedStatCounter out_bytes;
+    RedStatCounter ack_window;
 
     inline RedPipeItemPtr pipe_item_get();
     inline void pipe_remove(RedPipeItem *item);
@@ -179,18 +219,23 @@ struct RedChannelClientPrivate
     inline void set_message_serial(uint64_t serial);
     void pipe_clear();
     void data_sent(int n);
+    bool update_bandwidth(uint64_t now, uint32_t *roundtrip_us);
     void data_read(int n);
+    int receive(uint8_t *buf, uint32_t size);
+    int read_ahead(uint32_t size);
     inline int get_out_msg_size();
     inline int prepare_out_msg(struct iovec *vec, int vec_size, int pos);
     inline void set_blocked();
     void reset_send_data();
     void seamless_migration_done();
     void clear_sent_item();
+    void release_zerocopy_marshallers();
     void restart_ping_timer();
     void start_ping_timer(uint32_t timeout);
     void cancel_ping_timer();
     inline int urgent_marshaller_is_active();
     inline int waiting_for_ack();
+    uint32_t adapt_ack_window();
     inline void restore_main_sender();
     void watch_update_mask(int event_mask);
 };
@@ -329,6 +374,8 @@ RedChannelClientPrivate::RedChannelClientPrivate(RedChannel *init_channel,
     const RedStatNode *node = channel->get_stat_node();
     stat_init_counter(&out_messages, reds, node, "out_messages", TRUE);
     stat_init_counter(&out_bytes, reds, node, "out_bytes", TRUE);
+    stat_init_counter(&ack_window, reds, node, "ack_window", TRUE);
+    stat_set_counter(ack_window, ack_data.client_window);
 }
 
 RedChannelClientPrivate::~RedChannelClientPrivate()
@@ -339,6 +386,9 @@ RedChannelClientPrivate::~RedChannelClientPrivate()
     red_timer_remove(connectivity_monitor.timer);
     connectivity_monitor.timer = NULL;
 
+    red_timer_remove(read_ahead_timer);
+    g_free(incoming.read_buf);
+
     red_stream_free(stream);
 
     if (send_data.main.marshaller) {
@@ -349,6 +399,10 @@ RedChannelClientPrivate::~RedChannelClientPrivate()
         spice_marshaller_destroy(send_data.urgent.marshaller);
     }
 
+    for (auto& zerocopy : zerocopy_marshallers) {
+        spice_marshaller_destroy(zerocopy.marshaller);
+    }
+
     red_channel_capabilities_reset(&remote_caps);
 }
 
@@ -379,6 +433,56 @@ void RedChannelClientPrivate::data_sent(int n)
         connectivity_monitor.sent_bytes = true;
     }
     stat_inc_counter(out_bytes, n);
+    bandwidth.period_bytes += n;
+}
+
+#define BANDWIDTH_PERIOD_NS NSEC_PER_SEC
+/* below that the measured throughput is too noisy */
+#define BANDWIDTH_MIN_BYTES (64 * 1024)
+
+/*
+ * Take a sample of the bandwidth every BANDWIDTH_PERIOD_NS. If the socket
+ * was full during the period the throughput is what the link carries,
+ * otherwise the sender was limited by the application and the link can do
+ * at least what the TCP congestion window currently allows.
+ * An idle connection tells nothing about the link, the estimate is kept.
+ * Return true if the estimate was updated.
+ */
+bool RedChannelClientPrivate::update_bandwidth(uint64_t now, uint32_t *roundtrip_us)
+{
+    uint64_t elapsed = now - bandwidth.period_start;
+    uint64_t sample, tcp_rate;
+
+    if (bandwidth.period_start == 0) {
+        bandwidth.period_start = now;
+        return false;
+    }
+    if (elapsed < BANDWIDTH_PERIOD_NS) {
+        return false;
+    }
+
+    sample = 0;
+    *roundtrip_us = 0;
+    if (bandwidth.period_bytes >= BANDWIDTH_MIN_BYTES) {
+        sample = bandwidth.period_bytes * 8 * NSEC_PER_SEC / elapsed;
+        if (red_stream_get_tcp_rate(stream, &tcp_rate, roundtrip_us)) {
+            if (!bandwidth.period_blocked) {
+                sample = MAX(sample, tcp_rate);
+            }
+        } else if (!bandwidth.period_blocked) {
+            sample = 0;
+        }
+    }
+
+    bandwidth.period_start = now;
+    bandwidth.period_bytes = 0;
+    bandwidth.period_blocked = false;
+    if (sample == 0) {
+        return false;
+    }
+    bandwidth.bits_per_sec = bandwidth.bits_per_sec ?
+        (bandwidth.bits_per_sec * 3 + sample) / 4 : sample;
+    return true;
 }
 
 void RedChannelClientPrivate::data_read(int n)
@@ -402,6 +506,7 @@ inline int RedChannelClientPrivate::prepare_out_msg(struct iovec *vec, int vec_s
 inline void RedChannelClientPrivate::set_blocked()
 {
     send_data.blocked = true;
+    bandwidth.period_blocked = true;
 }
 
 inline int RedChannelClientPrivate::urgent_marshaller_is_active()
@@ -547,6 +652,7 @@ void RedChannelClient::msg_sent()
         spice_assert(priv->send_data.header.data != NULL);
         begin_send_message();
     } else {
+        on_message_sent();
         if (priv->pipe.empty()) {
             /* It is possible that the socket will become idle, so we may be able to test latency */
             priv->restart_ping_timer();
@@ -577,6 +683,7 @@ void RedChannelClientPrivate::pipe_remove(RedPipeItem *item)
 {
     auto i = find_pipe_item(pipe, item);
     if (i != pipe.end()) {
+        pipe_bytes -= item->get_size_estimate();
         pipe.erase(i);
     }
 }
@@ -637,6 +744,47 @@ inline int RedChannelClientPrivate::waiting_for_ack()
                             ack_data.client_window * 2));
 }
 
+/* minimal time between two changes of an adaptive window */
+#define ACK_WINDOW_PERIOD_NS (NSEC_PER_SEC / 2)
+
+/*
+ * Compute the ack window from the messages sent per roundtrip. The client
+ * acks a window once it received it and up to two windows can be in flight,
+ * so a window covering a roundtrip keeps the sender from waiting on a high
+ * latency link, while a slow link gets a smaller window.
+ * Return the new window, 0 if it doesn't change.
+ */
+uint32_t RedChannelClientPrivate::adapt_ack_window()
+{
+    uint64_t now, elapsed, per_roundtrip;
+    uint32_t window, current = ack_data.client_window;
+
+    if (ack_data.max_window == 0 || latency_monitor.roundtrip < 0) {
+        return 0;
+    }
+    now = spice_get_monotonic_time_ns();
+    elapsed = now - ack_data.period_start;
+    if (elapsed < ACK_WINDOW_PERIOD_NS) {
+        return 0;
+    }
+
+    per_roundtrip = (uint64_t) ack_data.period_messages * latency_monitor.roundtrip / elapsed;
+    window = CLAMP(per_roundtrip + per_roundtrip / 4, ack_data.min_window, ack_data.max_window);
+    // a window limiting the sender measures too few messages, don't shrink it
+    if ((window >= current + current / 4 && window > current) ||
+        (window <= current - current / 4 && window < current && !ack_data.stalled)) {
+        spice_debug("ack window %u -> %u, roundtrip %.2f(ms)", current, window,
+                    ((double) latency_monitor.roundtrip) / NSEC_PER_MILLISEC);
+    } else {
+        window = 0;
+    }
+
+    ack_data.period_start = now;
+    ack_data.period_messages = 0;
+    ack_data.stalled = false;
+    return window;
+}
+
 /*
  * When a connection is not alive (and we can't detect it via a socket error), we
  * reach one of these 2 states:
@@ -736,6 +884,9 @@ void RedChannelClient::start_connectivity_monitoring(uint32_t timeout_ms)
 static void red_channel_client_event(int fd, int event, RedChannelClient *rcc)
 {
     red::shared_ptr<RedChannelClient> hold_rcc(rcc);
+    /* zero copy completions are reported as socket errors, consume them
+     * even if no other event is set */
+    rcc->release_sent_buffers();
     if (event & SPICE_WATCH_EVENT_READ) {
         rcc->receive();
     }
@@ -869,6 +1020,11 @@ void RedChannelClientPrivate::watch_update_mask(int event_mask)
     red_watch_update_mask(stream->watch, event_mask);
 }
 
+static void read_ahead_resume(RedChannelClient *rcc)
+{
+    rcc->receive();
+}
+
 void RedChannelClient::block_read()
 {
     if (priv->block_read) {
@@ -885,6 +1041,15 @@ void RedChannelClient::unblock_read()
     }
     priv->block_read = false;
     priv->watch_update_mask(SPICE_WATCH_EVENT_READ|SPICE_WATCH_EVENT_WRITE);
+
+    /* the socket might have nothing more to read to wake us up */
+    if (priv->incoming.read_pos != priv->incoming.read_end) {
+        if (priv->read_ahead_timer == NULL) {
+            SpiceCoreInterfaceInternal *core = priv->channel->get_core_interface();
+            priv->read_ahead_timer = core->timer_new(read_ahead_resume, this);
+        }
+        red_timer_start(priv->read_ahead_timer, 0);
+    }
 }
 
 void RedChannelClientPrivate::seamless_migration_done()
@@ -972,6 +1137,10 @@ void RedChannelClient::handle_outgoing()
         }
         buffer->pos += n;
         priv->data_sent(n);
+        uint32_t roundtrip_us;
+        if (priv->update_bandwidth(spice_get_monotonic_time_ns(), &roundtrip_us)) {
+            on_bandwidth_estimate(priv->bandwidth.bits_per_sec, roundtrip_us);
+        }
         if (buffer->pos == buffer->size) { // finished writing data
             /* reset buffer before calling on_msg_done, since it
              * can trigger another call to RedChannelClient::handle_outgoing (when
@@ -984,11 +1153,10 @@ void RedChannelClient::handle_outgoing()
     }
 }
 
-/* return the number of bytes read. -1 in case of error */
-static int red_peer_receive(RedStream *stream, uint8_t *buf, uint32_t size)
+/* return the number of bytes read, 0 if there is nothing to read. -1 in case of error */
+static int red_peer_read(RedStream *stream, uint8_t *buf, uint32_t size)
 {
-    uint8_t *pos = buf;
-    while (size) {
+    for (;;) {
         int now;
         /* if we don't have a watch it means socket has been shutdown
          * shutdown read doesn't work as accepted - receive may return data afterward.
@@ -997,14 +1165,14 @@ static int red_peer_receive(RedStream *stream, uint8_t *buf, uint32_t size)
         if (!stream->watch) {
             return -1;
         }
-        now = red_stream_read(stream, pos, size);
+        now = red_stream_read(stream, buf, size);
         if (now <= 0) {
             if (now == 0) {
                 return -1;
             }
             spice_assert(now == -1);
             if (errno == EAGAIN) {
-                break;
+                return 0;
             } else if (errno == EINTR) {
                 continue;
             } else if (errno != EPIPE) {
@@ -1012,16 +1180,96 @@ static int red_peer_receive(RedStream *stream, uint8_t *buf, uint32_t size)
             }
             return -1;
         }
+        return now;
+    }
+}
+
+/* return the number of bytes read. -1 in case of error */
+static int red_peer_receive(RedStream *stream, uint8_t *buf, uint32_t size)
+{
+    uint8_t *pos = buf;
+    while (size) {
+        int now = red_peer_read(stream, pos, size);
+        if (now <= 0) {
+            if (now == 0) {
+                break;
+            }
+            return -1;
+        }
         size -= now;
         pos += now;
     }
     return pos - buf;
 }
 
-// TODO: this implementation, as opposed to the old implementation in red_worker,
-// does many calls to red_peer_receive and through it cb_read, and thus avoids pointer
-// arithmetic for the case where a single cb_read could return multiple messages. But
-// this is suboptimal potentially. Profile and consider fixing.
+/* Make @size bytes available in the read ahead buffer, reading as much as
+ * the socket has with each read.
+ * return the number of bytes available, which can be less. -1 in case of error */
+int RedChannelClientPrivate::read_ahead(uint32_t size)
+{
+    spice_assert(size <= READ_AHEAD_BUF_SIZE);
+    /* as red_peer_read(), don't return data once the socket was shutdown */
+    if (!stream->watch) {
+        return -1;
+    }
+    if (incoming.read_end - incoming.read_pos >= size) {
+        return incoming.read_end - incoming.read_pos;
+    }
+
+    if (incoming.read_buf == NULL) {
+        incoming.read_buf = (uint8_t *) g_malloc(READ_AHEAD_BUF_SIZE);
+    }
+    if (incoming.read_pos > 0) {
+        memmove(incoming.read_buf, incoming.read_buf + incoming.read_pos,
+                incoming.read_end - incoming.read_pos);
+        incoming.read_end -= incoming.read_pos;
+        incoming.read_pos = 0;
+    }
+    while (incoming.read_end < size) {
+        int now = red_peer_read(stream, incoming.read_buf + incoming.read_end,
+                                READ_AHEAD_BUF_SIZE - incoming.read_end);
+        if (now <= 0) {
+            if (now == 0) {
+                break;
+            }
+            return -1;
+        }
+        incoming.read_end += now;
+    }
+    return incoming.read_end;
+}
+
+/* Like red_peer_receive() but going through the read ahead buffer.
+ * return the number of bytes read. -1 in case of error */
+int RedChannelClientPrivate::receive(uint8_t *buf, uint32_t size)
+{
+    uint32_t copied;
+    int now;
+
+    if (size >= READ_AHEAD_BUF_SIZE / 2 && incoming.read_pos == incoming.read_end) {
+        return red_peer_receive(stream, buf, size);
+    }
+
+    now = read_ahead(MIN(size, READ_AHEAD_BUF_SIZE));
+    if (now < 0) {
+        return -1;
+    }
+    copied = MIN((uint32_t) now, size);
+    memcpy(buf, incoming.read_buf + incoming.read_pos, copied);
+    incoming.read_pos += copied;
+    if (copied < size && size > READ_AHEAD_BUF_SIZE && now == READ_AHEAD_BUF_SIZE) {
+        /* the rest of a large message */
+        now = red_peer_receive(stream, buf + copied, size - copied);
+        if (now < 0) {
+            return -1;
+        }
+        copied += now;
+    }
+    return copied;
+}
+
+// The data is read ahead so a single read can return multiple messages, the small
+// ones are parsed from there if the channel client allows it
 void RedChannelClient::handle_incoming()
 {
     RedStream *stream = priv->stream;
@@ -1038,15 +1286,15 @@ void RedChannelClient::handle_incoming()
 
     for (;;) {
         int ret_handle;
+        bool in_place = false;
         uint8_t *parsed;
         size_t parsed_size;
         message_destructor_t parsed_free = NULL;
         RedChannel *channel = get_channel();
 
         if (buffer->header_pos < buffer->header.header_size) {
-            bytes_read = red_peer_receive(stream,
-                                          buffer->header.data + buffer->header_pos,
-                                          buffer->header.header_size - buffer->header_pos);
+            bytes_read = priv->receive(buffer->header.data + buffer->header_pos,
+                                       buffer->header.header_size - buffer->header_pos);
             if (bytes_read == -1) {
                 disconnect();
                 return;
@@ -1061,7 +1309,21 @@ void RedChannelClient::handle_incoming()
 
         msg_size = buffer->header.get_msg_size(&buffer->header);
         msg_type = buffer->header.get_msg_type(&buffer->header);
-        if (buffer->msg_pos < msg_size) {
+        if (buffer->msg_pos < msg_size && !buffer->msg && msg_size <= READ_AHEAD_BUF_SIZE &&
+            can_parse_in_place(msg_type, msg_size)) {
+            bytes_read = priv->read_ahead(msg_size);
+            if (bytes_read == -1) {
+                disconnect();
+                return;
+            }
+            if ((uint32_t) bytes_read < msg_size) {
+                return;
+            }
+            priv->data_read(msg_size);
+            buffer->msg = buffer->read_buf + buffer->read_pos;
+            buffer->read_pos += msg_size;
+            in_place = true;
+        } else if (buffer->msg_pos < msg_size) {
             if (!buffer->msg) {
                 buffer->msg = alloc_recv_buf(msg_type, msg_size);
                 if (buffer->msg == NULL && priv->block_read) {
@@ -1076,9 +1338,8 @@ void RedChannelClient::handle_incoming()
                 }
             }
 
-            bytes_read = red_peer_receive(stream,
-                                          buffer->msg + buffer->msg_pos,
-                                          msg_size - buffer->msg_pos);
+            bytes_read = priv->receive(buffer->msg + buffer->msg_pos,
+                                       msg_size - buffer->msg_pos);
             if (bytes_read == -1) {
                 release_recv_buf(msg_type, msg_size, buffer->msg);
                 buffer->msg = NULL;
@@ -1096,7 +1357,9 @@ void RedChannelClient::handle_incoming()
                                       msg_type, &parsed_size, &parsed_free);
         if (parsed == NULL) {
             red_channel_warning(channel, "failed to parse message type %d", msg_type);
-            release_recv_buf(msg_type, msg_size, buffer->msg);
+            if (!in_place) {
+                release_recv_buf(msg_type, msg_size, buffer->msg);
+            }
             buffer->msg = NULL;
             disconnect();
             return;
@@ -1106,7 +1369,9 @@ void RedChannelClient::handle_incoming()
             parsed_free(parsed);
         }
         buffer->msg_pos = 0;
-        release_recv_buf(msg_type, msg_size, buffer->msg);
+        if (!in_place) {
+            release_recv_buf(msg_type, msg_size, buffer->msg);
+        }
         buffer->msg = NULL;
         buffer->header_pos = 0;
 
@@ -1133,11 +1398,16 @@ inline RedPipeItemPtr RedChannelClientPrivate::pipe_item_get()
 {
     RedPipeItemPtr ret;
 
-    if (send_data.blocked || waiting_for_ack() || pipe.empty()) {
+    if (send_data.blocked || pipe.empty()) {
+        return ret;
+    }
+    if (waiting_for_ack()) {
+        ack_data.stalled = true;
         return ret;
     }
     ret = std::move(pipe.back());
     pipe.pop_back();
+    pipe_bytes -= ret->get_size_estimate();
     return ret;
 }
 
@@ -1149,6 +1419,7 @@ void RedChannelClient::push()
 
     priv->during_send = TRUE;
     red::shared_ptr<RedChannelClient> hold_rcc(this);
+    priv->release_zerocopy_marshallers();
     if (is_blocked()) {
         send();
     }
@@ -1159,7 +1430,18 @@ void RedChannelClient::push()
                             "ERROR: an item waiting to be sent and not blocked");
     }
 
-    while (auto pipe_item = priv->pipe_item_get()) {
+    bool waiting_for_item = false;
+    for (;;) {
+        /* the next item holds the ones behind it until it's ready */
+        if (!is_blocked() && !priv->waiting_for_ack() && !priv->pipe.empty() &&
+            !pipe_item_is_ready(priv->pipe.back().get())) {
+            waiting_for_item = true;
+            break;
+        }
+        auto pipe_item = priv->pipe_item_get();
+        if (!pipe_item) {
+            break;
+        }
         send_any_item(pipe_item.get());
     }
     /* prepare_pipe_add() will reenable WRITE events when the priv->pipe is empty
@@ -1168,9 +1450,11 @@ void RedChannelClient::push()
      * If we don't remove WRITE if we are waiting for ack we will be keep
      * notified that we can write and we then exit (see pipe_item_get) as we
      * are waiting for the ack consuming CPU in a tight loop
+     * Same if the next item is not ready, pipe_item_is_ready() implementations
+     * push() again once it is
      */
     if ((no_item_being_sent() && priv->pipe.empty()) ||
-        priv->waiting_for_ack()) {
+        priv->waiting_for_ack() || (waiting_for_item && no_item_being_sent())) {
         priv->watch_update_mask(SPICE_WATCH_EVENT_READ);
 
         /* channel has no pending data to send so now we can flush data in
@@ -1180,11 +1464,19 @@ void RedChannelClient::push()
          * that for a long train of small messages the message that would
          * cause the client to send the ack is still in the queue
          */
-        red_stream_flush(priv->stream);
+        if (!red_stream_flush(priv->stream)) {
+            // the stream buffered data it could not send yet
+            priv->watch_update_mask(SPICE_WATCH_EVENT_READ | SPICE_WATCH_EVENT_WRITE);
+        }
     }
     priv->during_send = FALSE;
 }
 
+uint64_t RedChannelClient::get_bandwidth_estimate() const
+{
+    return priv->bandwidth.bits_per_sec;
+}
+
 int RedChannelClient::get_roundtrip_ms() const
 {
     if (priv->latency_monitor.roundtrip < 0) {
@@ -1286,6 +1578,12 @@ bool RedChannelClient::handle_message(uint16_t type, uint32_t size, void *messag
     case SPICE_MSGC_ACK:
         if (priv->ack_data.client_generation == priv->ack_data.generation) {
             priv->ack_data.messages_window -= priv->ack_data.client_window;
+            uint32_t window = priv->adapt_ack_window();
+            if (window) {
+                // the new window takes effect with the next message
+                ack_set_client_window(window);
+                pipe_add_tail(red::make_shared<RedPipeItem>(RED_PIPE_ITEM_TYPE_SET_ACK));
+            }
             priv->watch_update_mask(SPICE_WATCH_EVENT_READ|SPICE_WATCH_EVENT_WRITE);
             push();
         }
@@ -1332,6 +1630,7 @@ void RedChannelClient::begin_send_message()
     }
 
     stat_inc_counter(priv->out_messages, 1);
+    priv->send_data.zerocopy_mark = red_stream_get_zerocopy_sent(priv->stream);
 
     /* canceling the latency test timer till the nework is idle */
     priv->cancel_ping_timer();
@@ -1344,6 +1643,7 @@ void RedChannelClient::begin_send_message()
     priv->send_data.header.set_msg_serial(&priv->send_data.header,
                                                ++priv->send_data.last_sent_serial);
     priv->ack_data.messages_window++;
+    priv->ack_data.period_messages++;
     priv->send_data.header.data = NULL; /* avoid writing to this until we have a new message */
     send();
 }
@@ -1379,6 +1679,7 @@ inline bool RedChannelClient::prepare_pipe_add(RedPipeItem *item)
     if (priv->pipe.empty()) {
         priv->watch_update_mask(SPICE_WATCH_EVENT_READ | SPICE_WATCH_EVENT_WRITE);
     }
+    priv->pipe_bytes += item->get_size_estimate();
     return true;
 }
 
@@ -1471,6 +1772,33 @@ uint32_t RedChannelClient::get_pipe_size() const
     return priv->pipe.size();
 }
 
+RedChannelClient::Pipe::iterator RedChannelClient::pipe_erase(Pipe::iterator pos)
+{
+    priv->pipe_bytes -= (*pos)->get_size_estimate();
+    return priv->pipe.erase(pos);
+}
+
+uint64_t RedChannelClient::get_pipe_bytes() const
+{
+    return priv->pipe_bytes;
+}
+
+void RedChannelClient::set_pipe_bytes_budget(uint64_t budget)
+{
+    priv->pipe_bytes_budget = budget;
+}
+
+bool RedChannelClient::is_pipe_full(uint32_t max_items)
+{
+    uint64_t budget = priv->pipe_bytes_budget;
+    uint64_t channel_limit = priv->channel->get_max_pipe_bytes();
+
+    if (channel_limit) {
+        budget = MIN(budget, channel_limit);
+    }
+    return priv->pipe.size() > max_items || priv->pipe_bytes > budget;
+}
+
 RedChannelClient::Pipe& RedChannelClient::get_pipe()
 {
     return priv->pipe;
@@ -1490,9 +1818,40 @@ void RedChannelClientPrivate::clear_sent_item()
 {
     send_data.blocked = FALSE;
     send_data.size = 0;
+    if (red_stream_get_zerocopy_sent(stream) != send_data.zerocopy_mark) {
+        /* the kernel can still read the buffers of the message, resetting
+         * the marshaller would free them, use a new one meanwhile */
+        zerocopy_marshallers.push_back({send_data.marshaller,
+                                        red_stream_get_zerocopy_sent(stream)});
+        send_data.marshaller = spice_marshaller_new();
+        if (zerocopy_marshallers.back().marshaller == send_data.urgent.marshaller) {
+            send_data.urgent.marshaller = send_data.marshaller;
+        } else {
+            send_data.main.marshaller = send_data.marshaller;
+        }
+        send_data.zerocopy_mark = red_stream_get_zerocopy_sent(stream);
+        return;
+    }
     spice_marshaller_reset(send_data.marshaller);
 }
 
+void RedChannelClientPrivate::release_zerocopy_marshallers()
+{
+    /* always drain the notifications, pending ones keep the socket
+     * signalling an error */
+    uint32_t completed = red_stream_get_zerocopy_completed(stream);
+    while (!zerocopy_marshallers.empty() &&
+           (int32_t) (completed - zerocopy_marshallers.front().sent) >= 0) {
+        spice_marshaller_destroy(zerocopy_marshallers.front().marshaller);
+        zerocopy_marshallers.pop_front();
+    }
+}
+
+void RedChannelClient::release_sent_buffers()
+{
+    priv->release_zerocopy_marshallers();
+}
+
 // TODO: again - what is the context exactly? this happens in channel disconnect. but our
 // current red_channel_shutdown also closes the socket - is there a socket to close?
 // are we reading from an fd here? arghh
@@ -1500,6 +1859,7 @@ void RedChannelClientPrivate::pipe_clear()
 {
     clear_sent_item();
     pipe.clear();
+    pipe_bytes = 0;
 }
 
 void RedChannelClient::ack_zero_messages_window()
@@ -1511,6 +1871,17 @@ void RedChannelClient::ack_zero_messages_window()
 void RedChannelClient::ack_set_client_window(int client_window)
 {
     priv->ack_data.client_window = client_window;
+    stat_set_counter(priv->ack_window, client_window);
+}
+
+void RedChannelClient::ack_set_adaptive_window(uint32_t min_window, uint32_t max_window)
+{
+    spice_return_if_fail(min_window > 0 && min_window <= max_window);
+    priv->ack_data.min_window = min_window;
+    priv->ack_data.max_window = max_window;
+    priv->ack_data.period_start = spice_get_monotonic_time_ns();
+    priv->ack_data.period_messages = 0;
+    priv->ack_data.stalled = false;
 }
 
 void RedChannelClient::push_set_ack()
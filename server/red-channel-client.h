@@ -77,6 +77,9 @@ public:
 
     /* returns -1 if we don't have an estimation */
     int get_roundtrip_ms() const;
+    /* bandwidth to the client measured on this channel in bits per second,
+     * 0 if not known yet */
+    uint64_t get_bandwidth_estimate() const;
 
 protected:
     /* Checks periodically if the connection is still alive */
@@ -99,11 +102,24 @@ public:
     void pipe_add_empty_msg(int msg_type);
     bool pipe_is_empty() const;
     uint32_t get_pipe_size() const;
+    /* remove the item at @pos from the pipe, the pipe returned by get_pipe()
+     * must not be modified directly. Returns the position following @pos */
+    Pipe::iterator pipe_erase(Pipe::iterator pos);
+    /* estimated bytes of the items in the pipe, see RedPipeItem::get_size_estimate() */
+    uint64_t get_pipe_bytes() const;
+    /* set the bytes the pipe should hold, usually derived from the client bandwidth */
+    void set_pipe_bytes_budget(uint64_t budget);
+    /* whether the pipe holds more than @max_items items or more bytes than
+     * its budget (or the channel limit, see RedChannel::set_max_pipe_bytes()) */
+    bool is_pipe_full(uint32_t max_items);
     Pipe& get_pipe();
     bool is_mini_header() const;
 
     void ack_zero_messages_window();
     void ack_set_client_window(int client_window);
+    /* let the ack window follow the messages sent per roundtrip within
+     * [min_window, max_window], the client is sent the changes */
+    void ack_set_adaptive_window(uint32_t min_window, uint32_t max_window);
     void push_set_ack();
 
     bool is_blocked() const;
@@ -115,6 +131,8 @@ public:
     void push();
     void receive();
     void send();
+    /* Free the buffers of sent messages the socket no longer uses */
+    void release_sent_buffers();
     virtual void disconnect();
 
     /* Note: the valid times to call red_channel_get_marshaller are just during send_item callback. */
@@ -161,8 +179,14 @@ protected:
     virtual bool config_socket() { return true; }
     virtual uint8_t *alloc_recv_buf(uint16_t type, uint32_t size)=0;
     virtual void release_recv_buf(uint16_t type, uint32_t size, uint8_t *msg)=0;
+    /* whether a small message can be parsed from the data read ahead instead
+     * of a copy in alloc_recv_buf(), it's only valid during handle_message() */
+    virtual bool can_parse_in_place(uint16_t type, uint32_t size) { return false; }
 
     virtual void on_disconnect() {};
+    /* the bandwidth estimate was updated, @roundtrip_us is the current TCP
+     * roundtrip or 0 if not known */
+    virtual void on_bandwidth_estimate(uint64_t bits_per_sec, uint32_t roundtrip_us) {};
 
     // TODO: add ASSERTS for thread_id  in client and channel calls
     /*
@@ -170,6 +194,11 @@ protected:
      * They are called from the thread that listen to the stream events.
      */
     virtual void send_item(RedPipeItem *item) {};
+    /* whether @item can be sent now, if not the items behind it wait too and
+     * push() must be called when it becomes ready */
+    virtual bool pipe_item_is_ready(RedPipeItem *item) { return true; }
+    /* the last message marshalled by send_item has been written to the stream */
+    virtual void on_message_sent() {};
 
     virtual bool handle_migrate_data(uint32_t size, void *message) { return false; }
     virtual bool handle_migrate_data_get_serial(uint32_t size, void *message, uint64_t &serial)
@@ -117,6 +117,7 @@ struct RedChannelPrivate
     const red::shared_ptr<Dispatcher> dispatcher;
     RedsState *const reds;
     RedStatNode stat;
+    uint64_t max_pipe_bytes = 0;
 };
 
 RedChannel::RedChannel(RedsState *reds, uint32_t type, uint32_t id, CreationFlags flags,
@@ -471,6 +472,28 @@ uint32_t RedChannel::sum_pipes_size()
     return sum;
 }
 
+bool RedChannel::any_pipe_full(uint32_t max_items)
+{
+    RedChannelClient *rcc;
+
+    FOREACH_CLIENT(this, rcc) {
+        if (rcc->is_pipe_full(max_items)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void RedChannel::set_max_pipe_bytes(uint64_t max_bytes)
+{
+    priv->max_pipe_bytes = max_bytes;
+}
+
+uint64_t RedChannel::get_max_pipe_bytes() const
+{
+    return priv->max_pipe_bytes;
+}
+
 static void red_channel_disconnect_if_pending_send(RedChannel *channel)
 {
     RedChannelClient *rcc;
@@ -149,6 +149,13 @@ struct RedChannel: public red::shared_ptr_counted
     uint32_t max_pipe_size();
     /* return the max size of all the rcc pipe */
     uint32_t sum_pipes_size();
+    /* return TRUE if any client pipe is full, see RedChannelClient::is_pipe_full() */
+    bool any_pipe_full(uint32_t max_items);
+
+    /* Limit the estimated bytes queued in each client pipe, in addition to
+     * the budget of the client. 0 (default) means no limit */
+    void set_max_pipe_bytes(uint64_t max_bytes);
+    uint64_t get_max_pipe_bytes() const;
 
     GList *get_clients();
     guint get_n_clients();
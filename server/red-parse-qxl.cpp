@@ -53,6 +53,88 @@ struct RedDataChunk {
     uint8_t *data;
 };
 
+/* The data parsed for a drawable are allocated from its arena and released
+ * all at once with it. The first block of the arena is allocated along the
+ * RedDrawable, it's enough for most of the commands (fills, small texts and
+ * images), the others get additional blocks.
+ */
+#define RED_ARENA_ALIGN 8u
+#define RED_DRAWABLE_ARENA_SIZE 512u
+#define RED_ARENA_BLOCK_SIZE 4096u
+
+struct RedArenaBlock {
+    RedArenaBlock *next;
+};
+
+#define RED_ARENA_BLOCK_HEADER SPICE_ALIGN(sizeof(RedArenaBlock), RED_ARENA_ALIGN)
+
+static void *red_arena_alloc(RedDrawableArena *arena, size_t size)
+{
+    RedArenaBlock *block;
+    size_t block_size;
+    uint8_t *ptr;
+
+    spice_assert(size <= G_MAXSIZE / 2);
+    size = SPICE_ALIGN(size, RED_ARENA_ALIGN);
+    if (size <= arena->free) {
+        ptr = arena->ptr;
+        arena->ptr += size;
+        arena->free -= size;
+        return ptr;
+    }
+
+    block_size = MAX(size, RED_ARENA_BLOCK_SIZE);
+    block = (RedArenaBlock*) g_malloc(RED_ARENA_BLOCK_HEADER + block_size);
+    block->next = arena->blocks;
+    arena->blocks = block;
+    ptr = (uint8_t*) block + RED_ARENA_BLOCK_HEADER;
+    /* large allocations take a block of their own, don't lose the space
+     * left in the current one */
+    if (block_size - size > arena->free) {
+        arena->ptr = ptr + size;
+        arena->free = block_size - size;
+    }
+    return ptr;
+}
+
+static void *red_arena_alloc0(RedDrawableArena *arena, size_t size)
+{
+    return memset(red_arena_alloc(arena, size), 0, size);
+}
+
+static void red_arena_free(RedDrawableArena *arena)
+{
+    while (arena->blocks) {
+        RedArenaBlock *block = arena->blocks;
+        arena->blocks = block->next;
+        g_free(block);
+    }
+}
+
+/* Same layout as spice_chunks_new() but in the arena, the data linearized
+ * later (SPICE_CHUNKS_FLAGS_FREE) are released by red_put_image_data() */
+static SpiceChunks *red_arena_new_chunks(RedDrawableArena *arena, uint32_t num_chunks)
+{
+    SpiceChunks *chunks;
+
+    chunks = (SpiceChunks*) red_arena_alloc0(arena, sizeof(SpiceChunks) +
+                                                    sizeof(SpiceChunk) * num_chunks);
+    chunks->num_chunks = num_chunks;
+    return chunks;
+}
+
+static void red_put_image_data(SpiceChunks *chunks)
+{
+    uint32_t i;
+
+    if (chunks == NULL || !(chunks->flags & SPICE_CHUNKS_FLAGS_FREE)) {
+        return;
+    }
+    for (i = 0; i < chunks->num_chunks; i++) {
+        g_free(chunks->chunk[i].data);
+    }
+}
+
 #if 0
 static void hexdump_qxl(RedMemSlotInfo *slots, int group_id,
                         QXLPHYSICAL addr, uint8_t bytes)
@@ -232,7 +314,7 @@ void red_get_rect_ptr(SpiceRect *red, const QXLRect *qxl)
     red->right  = qxl->right;
 }
 
-static SpicePath *red_get_path(RedMemSlotInfo *slots, int group_id,
+static SpicePath *red_get_path(RedMemSlotInfo *slots, int group_id, RedDrawableArena *arena,
                                QXLPHYSICAL addr)
 {
     RedDataChunk chunks;
@@ -277,7 +359,7 @@ static SpicePath *red_get_path(RedMemSlotInfo *slots, int group_id,
         start = (QXLPathSeg*)(&start->points[count]);
     }
 
-    red = (SpicePath*) g_malloc(mem_size);
+    red = (SpicePath*) red_arena_alloc(arena, mem_size);
     red->num_segments = n_segments;
 
     start = (QXLPathSeg*)data;
@@ -314,6 +396,7 @@ static SpicePath *red_get_path(RedMemSlotInfo *slots, int group_id,
 }
 
 static SpiceClipRects *red_get_clip_rects(RedMemSlotInfo *slots, int group_id,
+                                          RedDrawableArena *arena,
                                           QXLPHYSICAL addr)
 {
     RedDataChunk chunks;
@@ -346,7 +429,7 @@ static SpiceClipRects *red_get_clip_rects(RedMemSlotInfo *slots, int group_id,
      */
     spice_assert((uint64_t) num_rects * sizeof(QXLRect) == size);
     SPICE_VERIFY(sizeof(SpiceRect) == sizeof(QXLRect));
-    red = (SpiceClipRects*) g_malloc(sizeof(*red) + num_rects * sizeof(SpiceRect));
+    red = (SpiceClipRects*) red_arena_alloc(arena, sizeof(*red) + num_rects * sizeof(SpiceRect));
     red->num_rects = num_rects;
 
     start = (QXLRect*)data;
@@ -361,6 +444,7 @@ static SpiceClipRects *red_get_clip_rects(RedMemSlotInfo *slots, int group_id,
 }
 
 static SpiceChunks *red_get_image_data_flat(RedMemSlotInfo *slots, int group_id,
+                                            RedDrawableArena *arena,
                                             QXLPHYSICAL addr, size_t size)
 {
     SpiceChunks *data;
@@ -371,7 +455,7 @@ static SpiceChunks *red_get_image_data_flat(RedMemSlotInfo *slots, int group_id,
         return NULL;
     }
 
-    data = spice_chunks_new(1);
+    data = red_arena_new_chunks(arena, 1);
     data->data_size      = size;
     data->chunk[0].data  = (uint8_t*) bitmap_virt;
     data->chunk[0].len   = size;
@@ -379,6 +463,7 @@ static SpiceChunks *red_get_image_data_flat(RedMemSlotInfo *slots, int group_id,
 }
 
 static SpiceChunks *red_get_image_data_chunked(RedMemSlotInfo *slots, int group_id,
+                                               RedDrawableArena *arena,
                                                RedDataChunk *head)
 {
     SpiceChunks *data;
@@ -389,7 +474,7 @@ static SpiceChunks *red_get_image_data_chunked(RedMemSlotInfo *slots, int group_
         i++;
     }
 
-    data = spice_chunks_new(i);
+    data = red_arena_new_chunks(arena, i);
     data->data_size = 0;
     for (i = 0, chunk = head;
          chunk != NULL && i < data->num_chunks;
@@ -444,13 +529,13 @@ static bool bitmap_consistent(SpiceBitmap *bitmap)
     return true;
 }
 
-static SpiceImage *red_get_image(RedMemSlotInfo *slots, int group_id,
+static SpiceImage *red_get_image(RedMemSlotInfo *slots, int group_id, RedDrawableArena *arena,
                                  QXLPHYSICAL addr, uint32_t flags, bool is_mask)
 {
     RedDataChunk chunks;
     QXLImage *qxl;
     SpiceImage *red = NULL;
-    SpicePalette *rp = NULL;
+    SpicePalette *rp;
     uint64_t bitmap_size, size;
     uint8_t qxl_flags;
     QXLPHYSICAL palette;
@@ -463,7 +548,7 @@ static SpiceImage *red_get_image(RedMemSlotInfo *slots, int group_id,
     if (qxl == NULL) {
         return NULL;
     }
-    red = g_new0(SpiceImage, 1);
+    red = (SpiceImage*) red_arena_alloc0(arena, sizeof(SpiceImage));
     red->descriptor.id     = qxl->descriptor.id;
     red->descriptor.type   = qxl->descriptor.type;
     red->descriptor.flags = 0;
@@ -513,7 +598,8 @@ static SpiceImage *red_get_image(RedMemSlotInfo *slots, int group_id,
                                        num_ents * sizeof(qp->ents[0]), group_id)) {
                 goto error;
             }
-            rp = (SpicePalette*) g_malloc(num_ents * sizeof(rp->ents[0]) + sizeof(*rp));
+            rp = (SpicePalette*) red_arena_alloc(arena,
+                                                 num_ents * sizeof(rp->ents[0]) + sizeof(*rp));
             rp->unique   = qp->unique;
             rp->num_ents = num_ents;
             if (flags & QXL_COMMAND_FLAG_COMPAT_16BPP) {
@@ -533,7 +619,7 @@ static SpiceImage *red_get_image(RedMemSlotInfo *slots, int group_id,
             goto error;
         }
         if (qxl_flags & QXL_BITMAP_DIRECT) {
-            red->u.bitmap.data = red_get_image_data_flat(slots, group_id,
+            red->u.bitmap.data = red_get_image_data_flat(slots, group_id, arena,
                                                          qxl->bitmap.data,
                                                          bitmap_size);
         } else {
@@ -543,7 +629,7 @@ static SpiceImage *red_get_image(RedMemSlotInfo *slots, int group_id,
                 red_put_data_chunks(&chunks);
                 goto error;
             }
-            red->u.bitmap.data = red_get_image_data_chunked(slots, group_id,
+            red->u.bitmap.data = red_get_image_data_chunked(slots, group_id, arena,
                                                             &chunks);
             red_put_data_chunks(&chunks);
         }
@@ -563,7 +649,7 @@ static SpiceImage *red_get_image(RedMemSlotInfo *slots, int group_id,
             red_put_data_chunks(&chunks);
             goto error;
         }
-        red->u.quic.data = red_get_image_data_chunked(slots, group_id,
+        red->u.quic.data = red_get_image_data_chunked(slots, group_id, arena,
                                                       &chunks);
         red_put_data_chunks(&chunks);
         break;
@@ -573,11 +659,12 @@ static SpiceImage *red_get_image(RedMemSlotInfo *slots, int group_id,
     }
     return red;
 error:
-    g_free(red);
-    g_free(rp);
+    /* the allocations are released with the drawable */
     return NULL;
 }
 
+/* The image is in the arena of the drawable, only the data linearized
+ * after the parsing need to be released */
 static void red_put_image(SpiceImage *red)
 {
     if (red == NULL)
@@ -585,17 +672,15 @@ static void red_put_image(SpiceImage *red)
 
     switch (red->descriptor.type) {
     case SPICE_IMAGE_TYPE_BITMAP:
-        g_free(red->u.bitmap.palette);
-        spice_chunks_destroy(red->u.bitmap.data);
+        red_put_image_data(red->u.bitmap.data);
         break;
     case SPICE_IMAGE_TYPE_QUIC:
-        spice_chunks_destroy(red->u.quic.data);
+        red_put_image_data(red->u.quic.data);
         break;
     }
-    g_free(red);
 }
 
-static void red_get_brush_ptr(RedMemSlotInfo *slots, int group_id,
+static void red_get_brush_ptr(RedMemSlotInfo *slots, int group_id, RedDrawableArena *arena,
                               SpiceBrush *red, QXLBrush *qxl, uint32_t flags)
 {
     red->type = qxl->type;
@@ -608,7 +693,8 @@ static void red_get_brush_ptr(RedMemSlotInfo *slots, int group_id,
         }
         break;
     case SPICE_BRUSH_TYPE_PATTERN:
-        red->u.pattern.pat = red_get_image(slots, group_id, qxl->u.pattern.pat, flags, false);
+        red->u.pattern.pat = red_get_image(slots, group_id, arena,
+                                           qxl->u.pattern.pat, flags, false);
         red_get_point_ptr(&red->u.pattern.pos, &qxl->u.pattern.pos);
         break;
     }
@@ -623,10 +709,10 @@ static void red_put_brush(SpiceBrush *red)
     }
 }
 
-static void red_get_qmask_ptr(RedMemSlotInfo *slots, int group_id,
+static void red_get_qmask_ptr(RedMemSlotInfo *slots, int group_id, RedDrawableArena *arena,
                               SpiceQMask *red, QXLQMask *qxl, uint32_t flags)
 {
-    red->bitmap = red_get_image(slots, group_id, qxl->bitmap, flags, true);
+    red->bitmap = red_get_image(slots, group_id, arena, qxl->bitmap, flags, true);
     if (red->bitmap) {
         red->flags  = qxl->flags;
         red_get_point_ptr(&red->pos, &qxl->pos);
@@ -642,12 +728,12 @@ static void red_put_qmask(SpiceQMask *red)
     red_put_image(red->bitmap);
 }
 
-static void red_get_fill_ptr(RedMemSlotInfo *slots, int group_id,
+static void red_get_fill_ptr(RedMemSlotInfo *slots, int group_id, RedDrawableArena *arena,
                              SpiceFill *red, QXLFill *qxl, uint32_t flags)
 {
-    red_get_brush_ptr(slots, group_id, &red->brush, &qxl->brush, flags);
+    red_get_brush_ptr(slots, group_id, arena, &red->brush, &qxl->brush, flags);
     red->rop_descriptor = qxl->rop_descriptor;
-    red_get_qmask_ptr(slots, group_id, &red->mask, &qxl->mask, flags);
+    red_get_qmask_ptr(slots, group_id, arena, &red->mask, &qxl->mask, flags);
 }
 
 static void red_put_fill(SpiceFill *red)
@@ -656,15 +742,15 @@ static void red_put_fill(SpiceFill *red)
     red_put_qmask(&red->mask);
 }
 
-static void red_get_opaque_ptr(RedMemSlotInfo *slots, int group_id,
+static void red_get_opaque_ptr(RedMemSlotInfo *slots, int group_id, RedDrawableArena *arena,
                                SpiceOpaque *red, QXLOpaque *qxl, uint32_t flags)
 {
-   red->src_bitmap     = red_get_image(slots, group_id, qxl->src_bitmap, flags, false);
+   red->src_bitmap     = red_get_image(slots, group_id, arena, qxl->src_bitmap, flags, false);
    red_get_rect_ptr(&red->src_area, &qxl->src_area);
-   red_get_brush_ptr(slots, group_id, &red->brush, &qxl->brush, flags);
+   red_get_brush_ptr(slots, group_id, arena, &red->brush, &qxl->brush, flags);
    red->rop_descriptor = qxl->rop_descriptor;
    red->scale_mode     = qxl->scale_mode;
-   red_get_qmask_ptr(slots, group_id, &red->mask, &qxl->mask, flags);
+   red_get_qmask_ptr(slots, group_id, arena, &red->mask, &qxl->mask, flags);
 }
 
 static void red_put_opaque(SpiceOpaque *red)
@@ -684,7 +770,8 @@ static bool red_get_copy_ptr(RedMemSlotInfo *slots, int group_id,
 
     SpiceCopy *red = &red_drawable->u.copy;
 
-    red->src_bitmap      = red_get_image(slots, group_id, qxl->src_bitmap, flags, false);
+    red->src_bitmap      = red_get_image(slots, group_id, &red_drawable->arena,
+                                         qxl->src_bitmap, flags, false);
     if (!red->src_bitmap) {
         return false;
     }
@@ -705,7 +792,7 @@ static bool red_get_copy_ptr(RedMemSlotInfo *slots, int group_id,
     }
     red->rop_descriptor  = qxl->rop_descriptor;
     red->scale_mode      = qxl->scale_mode;
-    red_get_qmask_ptr(slots, group_id, &red->mask, &qxl->mask, flags);
+    red_get_qmask_ptr(slots, group_id, &red_drawable->arena, &red->mask, &qxl->mask, flags);
     return true;
 }
 
@@ -719,11 +806,11 @@ static void red_put_copy(SpiceCopy *red)
 #define red_get_blend_ptr red_get_copy_ptr
 #define red_put_blend red_put_copy
 
-static void red_get_transparent_ptr(RedMemSlotInfo *slots, int group_id,
+static void red_get_transparent_ptr(RedMemSlotInfo *slots, int group_id, RedDrawableArena *arena,
                                     SpiceTransparent *red, QXLTransparent *qxl,
                                     uint32_t flags)
 {
-    red->src_bitmap      = red_get_image(slots, group_id, qxl->src_bitmap, flags, false);
+    red->src_bitmap      = red_get_image(slots, group_id, arena, qxl->src_bitmap, flags, false);
    red_get_rect_ptr(&red->src_area, &qxl->src_area);
    red->src_color       = qxl->src_color;
    red->true_color      = qxl->true_color;
@@ -734,22 +821,23 @@ static void red_put_transparent(SpiceTransparent *red)
     red_put_image(red->src_bitmap);
 }
 
-static void red_get_alpha_blend_ptr(RedMemSlotInfo *slots, int group_id,
+static void red_get_alpha_blend_ptr(RedMemSlotInfo *slots, int group_id, RedDrawableArena *arena,
                                     SpiceAlphaBlend *red, QXLAlphaBlend *qxl,
                                     uint32_t flags)
 {
     red->alpha_flags = qxl->alpha_flags;
     red->alpha       = qxl->alpha;
-    red->src_bitmap  = red_get_image(slots, group_id, qxl->src_bitmap, flags, false);
+    red->src_bitmap  = red_get_image(slots, group_id, arena, qxl->src_bitmap, flags, false);
     red_get_rect_ptr(&red->src_area, &qxl->src_area);
 }
 
 static void red_get_alpha_blend_ptr_compat(RedMemSlotInfo *slots, int group_id,
+                                           RedDrawableArena *arena,
                                            SpiceAlphaBlend *red, QXLCompatAlphaBlend *qxl,
                                            uint32_t flags)
 {
     red->alpha       = qxl->alpha;
-    red->src_bitmap  = red_get_image(slots, group_id, qxl->src_bitmap, flags, false);
+    red->src_bitmap  = red_get_image(slots, group_id, arena, qxl->src_bitmap, flags, false);
     red_get_rect_ptr(&red->src_area, &qxl->src_area);
 }
 
@@ -777,17 +865,17 @@ static bool get_transform(RedMemSlotInfo *slots,
     return true;
 }
 
-static void red_get_composite_ptr(RedMemSlotInfo *slots, int group_id,
+static void red_get_composite_ptr(RedMemSlotInfo *slots, int group_id, RedDrawableArena *arena,
                                   SpiceComposite *red, QXLComposite *qxl, uint32_t flags)
 {
     red->flags = qxl->flags;
 
-    red->src_bitmap = red_get_image(slots, group_id, qxl->src, flags, false);
+    red->src_bitmap = red_get_image(slots, group_id, arena, qxl->src, flags, false);
     if (get_transform(slots, group_id, qxl->src_transform, &red->src_transform))
         red->flags |= SPICE_COMPOSITE_HAS_SRC_TRANSFORM;
 
     if (qxl->mask) {
-        red->mask_bitmap = red_get_image(slots, group_id, qxl->mask, flags, false);
+        red->mask_bitmap = red_get_image(slots, group_id, arena, qxl->mask, flags, false);
         red->flags |= SPICE_COMPOSITE_HAS_MASK;
         if (get_transform(slots, group_id, qxl->mask_transform, &red->mask_transform))
             red->flags |= SPICE_COMPOSITE_HAS_MASK_TRANSFORM;
@@ -807,15 +895,15 @@ static void red_put_composite(SpiceComposite *red)
         red_put_image(red->mask_bitmap);
 }
 
-static void red_get_rop3_ptr(RedMemSlotInfo *slots, int group_id,
+static void red_get_rop3_ptr(RedMemSlotInfo *slots, int group_id, RedDrawableArena *arena,
                              SpiceRop3 *red, QXLRop3 *qxl, uint32_t flags)
 {
-   red->src_bitmap = red_get_image(slots, group_id, qxl->src_bitmap, flags, false);
+   red->src_bitmap = red_get_image(slots, group_id, arena, qxl->src_bitmap, flags, false);
    red_get_rect_ptr(&red->src_area, &qxl->src_area);
-   red_get_brush_ptr(slots, group_id, &red->brush, &qxl->brush, flags);
+   red_get_brush_ptr(slots, group_id, arena, &red->brush, &qxl->brush, flags);
    red->rop3       = qxl->rop3;
    red->scale_mode = qxl->scale_mode;
-   red_get_qmask_ptr(slots, group_id, &red->mask, &qxl->mask, flags);
+   red_get_qmask_ptr(slots, group_id, arena, &red->mask, &qxl->mask, flags);
 }
 
 static void red_put_rop3(SpiceRop3 *red)
@@ -825,10 +913,10 @@ static void red_put_rop3(SpiceRop3 *red)
     red_put_qmask(&red->mask);
 }
 
-static bool red_get_stroke_ptr(RedMemSlotInfo *slots, int group_id,
+static bool red_get_stroke_ptr(RedMemSlotInfo *slots, int group_id, RedDrawableArena *arena,
                                SpiceStroke *red, QXLStroke *qxl, uint32_t flags)
 {
-    red->path = red_get_path(slots, group_id, qxl->path);
+    red->path = red_get_path(slots, group_id, arena, qxl->path);
     if (!red->path) {
         return false;
     }
@@ -838,7 +926,8 @@ static bool red_get_stroke_ptr(RedMemSlotInfo *slots, int group_id,
         uint8_t *buf;
 
         style_nseg = qxl->attr.style_nseg;
-        red->attr.style = (SPICE_FIXED28_4*) g_malloc_n(style_nseg, sizeof(SPICE_FIXED28_4));
+        red->attr.style = (SPICE_FIXED28_4*) red_arena_alloc(arena,
+                                                             style_nseg * sizeof(SPICE_FIXED28_4));
         red->attr.style_nseg  = style_nseg;
         spice_assert(qxl->attr.style);
         buf = (uint8_t *)memslot_get_virt(slots, qxl->attr.style,
@@ -851,7 +940,7 @@ static bool red_get_stroke_ptr(RedMemSlotInfo *slots, int group_id,
         red->attr.style_nseg  = 0;
         red->attr.style       = NULL;
     }
-    red_get_brush_ptr(slots, group_id, &red->brush, &qxl->brush, flags);
+    red_get_brush_ptr(slots, group_id, arena, &red->brush, &qxl->brush, flags);
     red->fore_mode        = qxl->fore_mode;
     red->back_mode        = qxl->back_mode;
     return true;
@@ -860,13 +949,9 @@ static bool red_get_stroke_ptr(RedMemSlotInfo *slots, int group_id,
 static void red_put_stroke(SpiceStroke *red)
 {
     red_put_brush(&red->brush);
-    g_free(red->path);
-    if (red->attr.flags & SPICE_LINE_FLAGS_STYLED) {
-        g_free(red->attr.style);
-    }
 }
 
-static SpiceString *red_get_string(RedMemSlotInfo *slots, int group_id,
+static SpiceString *red_get_string(RedMemSlotInfo *slots, int group_id, RedDrawableArena *arena,
                                    QXLPHYSICAL addr)
 {
     RedDataChunk chunks;
@@ -928,7 +1013,7 @@ static SpiceString *red_get_string(RedMemSlotInfo *slots, int group_id,
     spice_assert(start <= end);
     spice_assert(glyphs == qxl_length);
 
-    red = (SpiceString*) g_malloc(red_size);
+    red = (SpiceString*) red_arena_alloc(arena, red_size);
     red->length = qxl_length;
     red->flags = qxl_flags;
 
@@ -958,28 +1043,27 @@ static SpiceString *red_get_string(RedMemSlotInfo *slots, int group_id,
     return red;
 }
 
-static void red_get_text_ptr(RedMemSlotInfo *slots, int group_id,
+static void red_get_text_ptr(RedMemSlotInfo *slots, int group_id, RedDrawableArena *arena,
                              SpiceText *red, QXLText *qxl, uint32_t flags)
 {
-   red->str = red_get_string(slots, group_id, qxl->str);
+   red->str = red_get_string(slots, group_id, arena, qxl->str);
    red_get_rect_ptr(&red->back_area, &qxl->back_area);
-   red_get_brush_ptr(slots, group_id, &red->fore_brush, &qxl->fore_brush, flags);
-   red_get_brush_ptr(slots, group_id, &red->back_brush, &qxl->back_brush, flags);
+   red_get_brush_ptr(slots, group_id, arena, &red->fore_brush, &qxl->fore_brush, flags);
+   red_get_brush_ptr(slots, group_id, arena, &red->back_brush, &qxl->back_brush, flags);
    red->fore_mode  = qxl->fore_mode;
    red->back_mode  = qxl->back_mode;
 }
 
 static void red_put_text_ptr(SpiceText *red)
 {
-    g_free(red->str);
     red_put_brush(&red->fore_brush);
     red_put_brush(&red->back_brush);
 }
 
-static void red_get_whiteness_ptr(RedMemSlotInfo *slots, int group_id,
+static void red_get_whiteness_ptr(RedMemSlotInfo *slots, int group_id, RedDrawableArena *arena,
                                   SpiceWhiteness *red, QXLWhiteness *qxl, uint32_t flags)
 {
-    red_get_qmask_ptr(slots, group_id, &red->mask, &qxl->mask, flags);
+    red_get_qmask_ptr(slots, group_id, arena, &red->mask, &qxl->mask, flags);
 }
 
 static void red_put_whiteness(SpiceWhiteness *red)
@@ -992,22 +1076,13 @@ static void red_put_whiteness(SpiceWhiteness *red)
 #define red_put_invers red_put_whiteness
 #define red_put_blackness red_put_whiteness
 
-static void red_get_clip_ptr(RedMemSlotInfo *slots, int group_id,
+static void red_get_clip_ptr(RedMemSlotInfo *slots, int group_id, RedDrawableArena *arena,
                              SpiceClip *red, QXLClip *qxl)
 {
     red->type = qxl->type;
     switch (red->type) {
     case SPICE_CLIP_TYPE_RECTS:
-        red->rects = red_get_clip_rects(slots, group_id, qxl->data);
-        break;
-    }
-}
-
-static void red_put_clip(SpiceClip *red)
-{
-    switch (red->type) {
-    case SPICE_CLIP_TYPE_RECTS:
-        g_free(red->rects);
+        red->rects = red_get_clip_rects(slots, group_id, arena, qxl->data);
         break;
     }
 }
@@ -1015,6 +1090,7 @@ static void red_put_clip(SpiceClip *red)
 static bool red_get_native_drawable(QXLInstance *qxl_instance, RedMemSlotInfo *slots, int group_id,
                                     RedDrawable *red, QXLPHYSICAL addr, uint32_t flags)
 {
+    RedDrawableArena *arena = &red->arena;
     QXLDrawable *qxl;
     int i;
 
@@ -1027,7 +1103,7 @@ static bool red_get_native_drawable(QXLInstance *qxl_instance, RedMemSlotInfo *s
     red->release_info_ext.group_id = group_id;
 
     red_get_rect_ptr(&red->bbox, &qxl->bbox);
-    red_get_clip_ptr(slots, group_id, &red->clip, &qxl->clip);
+    red_get_clip_ptr(slots, group_id, arena, &red->clip, &qxl->clip);
     red->effect           = qxl->effect;
     red->mm_time          = qxl->mm_time;
     red->self_bitmap      = qxl->self_bitmap;
@@ -1042,11 +1118,11 @@ static bool red_get_native_drawable(QXLInstance *qxl_instance, RedMemSlotInfo *s
     red->type = qxl->type;
     switch (red->type) {
     case QXL_DRAW_ALPHA_BLEND:
-        red_get_alpha_blend_ptr(slots, group_id,
+        red_get_alpha_blend_ptr(slots, group_id, arena,
                                 &red->u.alpha_blend, &qxl->u.alpha_blend, flags);
         break;
     case QXL_DRAW_BLACKNESS:
-        red_get_blackness_ptr(slots, group_id,
+        red_get_blackness_ptr(slots, group_id, arena,
                               &red->u.blackness, &qxl->u.blackness, flags);
         break;
     case QXL_DRAW_BLEND:
@@ -1057,33 +1133,33 @@ static bool red_get_native_drawable(QXLInstance *qxl_instance, RedMemSlotInfo *s
         red_get_point_ptr(&red->u.copy_bits.src_pos, &qxl->u.copy_bits.src_pos);
         break;
     case QXL_DRAW_FILL:
-        red_get_fill_ptr(slots, group_id, &red->u.fill, &qxl->u.fill, flags);
+        red_get_fill_ptr(slots, group_id, arena, &red->u.fill, &qxl->u.fill, flags);
         break;
     case QXL_DRAW_OPAQUE:
-        red_get_opaque_ptr(slots, group_id, &red->u.opaque, &qxl->u.opaque, flags);
+        red_get_opaque_ptr(slots, group_id, arena, &red->u.opaque, &qxl->u.opaque, flags);
         break;
     case QXL_DRAW_INVERS:
-        red_get_invers_ptr(slots, group_id, &red->u.invers, &qxl->u.invers, flags);
+        red_get_invers_ptr(slots, group_id, arena, &red->u.invers, &qxl->u.invers, flags);
         break;
     case QXL_DRAW_NOP:
         break;
     case QXL_DRAW_ROP3:
-        red_get_rop3_ptr(slots, group_id, &red->u.rop3, &qxl->u.rop3, flags);
+        red_get_rop3_ptr(slots, group_id, arena, &red->u.rop3, &qxl->u.rop3, flags);
         break;
     case QXL_DRAW_COMPOSITE:
-        red_get_composite_ptr(slots, group_id, &red->u.composite, &qxl->u.composite, flags);
+        red_get_composite_ptr(slots, group_id, arena, &red->u.composite, &qxl->u.composite, flags);
         break;
     case QXL_DRAW_STROKE:
-        return red_get_stroke_ptr(slots, group_id, &red->u.stroke, &qxl->u.stroke, flags);
+        return red_get_stroke_ptr(slots, group_id, arena, &red->u.stroke, &qxl->u.stroke, flags);
     case QXL_DRAW_TEXT:
-        red_get_text_ptr(slots, group_id, &red->u.text, &qxl->u.text, flags);
+        red_get_text_ptr(slots, group_id, arena, &red->u.text, &qxl->u.text, flags);
         break;
     case QXL_DRAW_TRANSPARENT:
-        red_get_transparent_ptr(slots, group_id,
+        red_get_transparent_ptr(slots, group_id, arena,
                                 &red->u.transparent, &qxl->u.transparent, flags);
         break;
     case QXL_DRAW_WHITENESS:
-        red_get_whiteness_ptr(slots, group_id,
+        red_get_whiteness_ptr(slots, group_id, arena,
                               &red->u.whiteness, &qxl->u.whiteness, flags);
         break;
     default:
@@ -1096,6 +1172,7 @@ static bool red_get_native_drawable(QXLInstance *qxl_instance, RedMemSlotInfo *s
 static bool red_get_compat_drawable(QXLInstance *qxl_instance, RedMemSlotInfo *slots, int group_id,
                                     RedDrawable *red, QXLPHYSICAL addr, uint32_t flags)
 {
+    RedDrawableArena *arena = &red->arena;
     QXLCompatDrawable *qxl;
 
     qxl = (QXLCompatDrawable *)memslot_get_virt(slots, addr, sizeof(*qxl), group_id);
@@ -1107,7 +1184,7 @@ static bool red_get_compat_drawable(QXLInstance *qxl_instance, RedMemSlotInfo *s
     red->release_info_ext.group_id = group_id;
 
     red_get_rect_ptr(&red->bbox, &qxl->bbox);
-    red_get_clip_ptr(slots, group_id, &red->clip, &qxl->clip);
+    red_get_clip_ptr(slots, group_id, arena, &red->clip, &qxl->clip);
     red->effect           = qxl->effect;
     red->mm_time          = qxl->mm_time;
 
@@ -1121,11 +1198,11 @@ static bool red_get_compat_drawable(QXLInstance *qxl_instance, RedMemSlotInfo *s
     red->type = qxl->type;
     switch (red->type) {
     case QXL_DRAW_ALPHA_BLEND:
-        red_get_alpha_blend_ptr_compat(slots, group_id,
+        red_get_alpha_blend_ptr_compat(slots, group_id, arena,
                                        &red->u.alpha_blend, &qxl->u.alpha_blend, flags);
         break;
     case QXL_DRAW_BLACKNESS:
-        red_get_blackness_ptr(slots, group_id,
+        red_get_blackness_ptr(slots, group_id, arena,
                               &red->u.blackness, &qxl->u.blackness, flags);
         break;
     case QXL_DRAW_BLEND:
@@ -1143,30 +1220,30 @@ static bool red_get_compat_drawable(QXLInstance *qxl_instance, RedMemSlotInfo *s
             (red->bbox.bottom - red->bbox.top);
         break;
     case QXL_DRAW_FILL:
-        red_get_fill_ptr(slots, group_id, &red->u.fill, &qxl->u.fill, flags);
+        red_get_fill_ptr(slots, group_id, arena, &red->u.fill, &qxl->u.fill, flags);
         break;
     case QXL_DRAW_OPAQUE:
-        red_get_opaque_ptr(slots, group_id, &red->u.opaque, &qxl->u.opaque, flags);
+        red_get_opaque_ptr(slots, group_id, arena, &red->u.opaque, &qxl->u.opaque, flags);
         break;
     case QXL_DRAW_INVERS:
-        red_get_invers_ptr(slots, group_id, &red->u.invers, &qxl->u.invers, flags);
+        red_get_invers_ptr(slots, group_id, arena, &red->u.invers, &qxl->u.invers, flags);
         break;
     case QXL_DRAW_NOP:
         break;
     case QXL_DRAW_ROP3:
-        red_get_rop3_ptr(slots, group_id, &red->u.rop3, &qxl->u.rop3, flags);
+        red_get_rop3_ptr(slots, group_id, arena, &red->u.rop3, &qxl->u.rop3, flags);
         break;
     case QXL_DRAW_STROKE:
-        return red_get_stroke_ptr(slots, group_id, &red->u.stroke, &qxl->u.stroke, flags);
+        return red_get_stroke_ptr(slots, group_id, arena, &red->u.stroke, &qxl->u.stroke, flags);
     case QXL_DRAW_TEXT:
-        red_get_text_ptr(slots, group_id, &red->u.text, &qxl->u.text, flags);
+        red_get_text_ptr(slots, group_id, arena, &red->u.text, &qxl->u.text, flags);
         break;
     case QXL_DRAW_TRANSPARENT:
-        red_get_transparent_ptr(slots, group_id,
+        red_get_transparent_ptr(slots, group_id, arena,
                                 &red->u.transparent, &qxl->u.transparent, flags);
         break;
     case QXL_DRAW_WHITENESS:
-        red_get_whiteness_ptr(slots, group_id,
+        red_get_whiteness_ptr(slots, group_id, arena,
                               &red->u.whiteness, &qxl->u.whiteness, flags);
         break;
     default:
@@ -1191,9 +1268,10 @@ static bool red_get_drawable(QXLInstance *qxl, RedMemSlotInfo *slots, int group_
 
 static void red_put_drawable(RedDrawable *red)
 {
-    red_put_clip(&red->clip);
     if (red->self_bitmap_image) {
-        red_put_image(red->self_bitmap_image);
+        /* not parsed, allocated by the display channel */
+        spice_chunks_destroy(red->self_bitmap_image->u.bitmap.data);
+        g_free(red->self_bitmap_image);
     }
     switch (red->type) {
     case QXL_DRAW_ALPHA_BLEND:
@@ -1245,9 +1323,14 @@ RedDrawable *red_drawable_new(QXLInstance *qxl, RedMemSlotInfo *slots,
                               int group_id, QXLPHYSICAL addr,
                               uint32_t flags)
 {
-    RedDrawable *red = g_new0(RedDrawable, 1);
+    /* the first block of the arena follows the drawable */
+    const size_t arena_offset = SPICE_ALIGN(sizeof(RedDrawable), RED_ARENA_ALIGN);
+    RedDrawable *red = (RedDrawable*) g_malloc(arena_offset + RED_DRAWABLE_ARENA_SIZE);
 
+    memset(red, 0, sizeof(*red));
     red->refs = 1;
+    red->arena.ptr = (uint8_t*) red + arena_offset;
+    red->arena.free = RED_DRAWABLE_ARENA_SIZE;
 
     if (!red_get_drawable(qxl, slots, group_id, red, addr, flags)) {
        red_drawable_unref(red);
@@ -1269,6 +1352,7 @@ void red_drawable_unref(RedDrawable *red_drawable)
         return;
     }
     red_put_drawable(red_drawable);
+    red_arena_free(&red_drawable->arena);
     g_free(red_drawable);
 }
 
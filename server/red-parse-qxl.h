@@ -23,9 +23,19 @@
 
 #include "red-common.h"
 #include "memslot.h"
+#include "frame-trace.h"
 
 SPICE_BEGIN_DECLS
 
+typedef struct RedArenaBlock RedArenaBlock;
+
+/* memory of the data parsed for a drawable, released with it */
+typedef struct RedDrawableArena {
+    uint8_t *ptr;
+    size_t free;
+    RedArenaBlock *blocks;
+} RedDrawableArena;
+
 typedef struct RedDrawable {
     int refs;
     QXLInstance *qxl;
@@ -59,6 +69,8 @@ typedef struct RedDrawable {
         SpiceWhiteness whiteness;
         SpiceComposite composite;
     } u;
+    FrameTrace trace;
+    RedDrawableArena arena;
 } RedDrawable;
 
 typedef struct RedUpdateCmd {
@@ -25,6 +25,12 @@ RedPipeItem::RedPipeItem(int init_type):
 {
 }
 
+size_t RedPipeItem::get_size_estimate() const
+{
+    /* most of the items are small control messages */
+    return 64;
+}
+
 static void marshaller_unref_pipe_item(uint8_t *, void *opaque)
 {
     RedPipeItem *item = (RedPipeItem*) opaque;
@@ -62,6 +62,13 @@ struct RedPipeItem: public red::shared_ptr_counted
     const int type;
 
     void add_to_marshaller(SpiceMarshaller *m, uint8_t *data, size_t size);
+
+    /**
+     * Estimation of the bytes the item will produce when sent, used to limit
+     * the data queued in the pipes (see RedChannelClient::is_pipe_full()).
+     * Must not change while the item is in a pipe.
+     */
+    virtual size_t get_size_estimate() const;
 };
 
 typedef red::shared_ptr<RedPipeItem> RedPipeItemPtr;
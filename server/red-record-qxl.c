@@ -19,6 +19,7 @@
 
 #include <inttypes.h>
 #include <pthread.h>
+#include <signal.h>
 #include <glib.h>
 
 #include "red-common.h"
@@ -27,11 +28,45 @@
 #include "zlib-encoder.h"
 #include "red-record-qxl.h"
 
+// compatibility for FreeBSD
+#ifdef HAVE_PTHREAD_NP_H
+#include <pthread_np.h>
+#define pthread_setname_np pthread_set_name_np
+#endif
+
+/* the worker waits for the writer thread above this */
+#define RED_RECORD_MAX_QUEUED_BYTES (256 * 1024 * 1024)
+
+/* Data of the version 2 record being built */
+typedef struct RecordBlob {
+    GByteArray *data;
+    GArray *relocs;
+    GArray *surface_ids;
+    uint32_t extra_size;
+} RecordBlob;
+
+typedef struct RecordBuffer {
+    size_t size;
+    uint8_t data[];
+} RecordBuffer;
+
 struct RedRecord {
     FILE *fd;
     pthread_mutex_t lock;
     unsigned int counter;
     gint refs;
+    unsigned int version;
+
+    /* version 2 only, protected by lock */
+    RecordBlob blob;
+    pthread_t writer;
+    /* signaled when a buffer is queued or on quit */
+    pthread_cond_t queue_cond;
+    /* signaled when the writer thread consumed a buffer */
+    pthread_cond_t space_cond;
+    GQueue queue;
+    size_t queued_bytes;
+    bool quit;
 };
 
 #if 0
@@ -753,6 +788,583 @@ static void red_record_cursor_cmd(FILE *fd, RedMemSlotInfo *slots, int group_id,
     }
 }
 
+/*
+ * Version 2: each command is copied in a single buffer, pointers
+ * are replaced by offsets in that buffer so the replay only has to
+ * relocate them.
+ */
+
+static uint32_t record_blob_append_raw(RecordBlob *blob, const void *data, size_t size)
+{
+    uint32_t offset = blob->data->len;
+
+    g_byte_array_append(blob->data, (const guint8 *) data, size);
+    return offset;
+}
+
+static uint32_t record_blob_append(RecordBlob *blob, const void *data, size_t size)
+{
+    static const uint8_t padding[8] = { 0, };
+
+    record_blob_append_raw(blob, padding, SPICE_ALIGN(blob->data->len, 8) - blob->data->len);
+    return record_blob_append_raw(blob, data, size);
+}
+
+/* Reserve @size bytes of zeroed memory after the data, the data can't be
+ * appended anymore */
+static uint32_t record_blob_reserve(RecordBlob *blob, size_t size)
+{
+    uint32_t offset = SPICE_ALIGN(blob->data->len, 8);
+
+    blob->extra_size = offset - blob->data->len + size;
+    return offset;
+}
+
+static void record_blob_get(RecordBlob *blob, uint32_t offset, void *dest, size_t size)
+{
+    memcpy(dest, blob->data->data + offset, size);
+}
+
+static QXLPHYSICAL record_blob_get_addr(RecordBlob *blob, uint32_t field)
+{
+    QXLPHYSICAL addr;
+
+    record_blob_get(blob, field, &addr, sizeof(addr));
+    return addr;
+}
+
+static void record_blob_set_addr(RecordBlob *blob, uint32_t field, QXLPHYSICAL addr)
+{
+    memcpy(blob->data->data + field, &addr, sizeof(addr));
+}
+
+/* Make the pointer at @field point to @target in the replay */
+static void record_blob_reloc(RecordBlob *blob, uint32_t field, uint32_t target)
+{
+    record_blob_set_addr(blob, field, target);
+    g_array_append_val(blob->relocs, field);
+}
+
+static void record_blob_surface_id(RecordBlob *blob, uint32_t field, bool is_new)
+{
+    uint32_t entry = field | (is_new ? RED_RECORD_SURFACE_ID_NEW : 0);
+
+    g_array_append_val(blob->surface_ids, entry);
+}
+
+/* Append the data of the chunks following the chunk copied at @chunk_offset
+ * and turn it into a single chunk. The chunk must be the last bytes of the blob. */
+static size_t record_blob_chunks(RecordBlob *blob, RedMemSlotInfo *slots, int group_id,
+                                 int memslot_id, QXLDataChunk *qxl, uint32_t chunk_offset)
+{
+    QXLDataChunk chunk = { 0, };
+
+    for (;;) {
+        memslot_validate_virt(slots, (intptr_t)qxl->data, memslot_id, qxl->data_size, group_id);
+        record_blob_append_raw(blob, qxl->data, qxl->data_size);
+        chunk.data_size += qxl->data_size;
+        if (!qxl->next_chunk) {
+            break;
+        }
+        memslot_id = memslot_get_id(slots, qxl->next_chunk);
+        qxl = (QXLDataChunk*)memslot_get_virt(slots, qxl->next_chunk, sizeof(*qxl), group_id);
+    }
+    memcpy(blob->data->data + chunk_offset, &chunk, sizeof(chunk));
+    return chunk.data_size;
+}
+
+/* Copy a structure of @size bytes ending with a QXLDataChunk at @chunk_offset */
+static uint32_t record_blob_chunked(RecordBlob *blob, RedMemSlotInfo *slots, int group_id,
+                                    QXLPHYSICAL addr, size_t size, size_t chunk_offset,
+                                    size_t *data_size)
+{
+    uint8_t *qxl = (uint8_t *)memslot_get_virt(slots, addr, size, group_id);
+    uint32_t offset = record_blob_append(blob, qxl, size);
+    size_t chunks_size;
+
+    chunks_size = record_blob_chunks(blob, slots, group_id, memslot_get_id(slots, addr),
+                                     (QXLDataChunk *)(qxl + chunk_offset), offset + chunk_offset);
+    if (data_size) {
+        *data_size = chunks_size;
+    }
+    return offset;
+}
+
+static void record_blob_flat(RecordBlob *blob, RedMemSlotInfo *slots, int group_id,
+                             uint32_t field, size_t size)
+{
+    QXLPHYSICAL addr = record_blob_get_addr(blob, field);
+    uint32_t offset;
+
+    if (!addr) {
+        return;
+    }
+    offset = record_blob_append(blob, memslot_get_virt(slots, addr, size, group_id), size);
+    record_blob_reloc(blob, field, offset);
+}
+
+static void record_blob_image(RecordBlob *blob, RedMemSlotInfo *slots, int group_id,
+                              uint32_t field)
+{
+    QXLPHYSICAL addr = record_blob_get_addr(blob, field);
+    QXLImage *qxl;
+    QXLDataChunk *chunk;
+    size_t bitmap_size, size;
+    uint32_t offset, data_offset;
+
+    if (!addr) {
+        return;
+    }
+
+    qxl = (QXLImage *)memslot_get_virt(slots, addr, sizeof(*qxl), group_id);
+    switch (qxl->descriptor.type) {
+    case SPICE_IMAGE_TYPE_BITMAP:
+        offset = record_blob_append(blob, qxl, sizeof(*qxl));
+        record_blob_reloc(blob, field, offset);
+        if (qxl->bitmap.palette) {
+            QXLPalette *qp;
+            uint16_t num_ents;
+
+            qp = (QXLPalette *)memslot_get_virt(slots, qxl->bitmap.palette,
+                                                sizeof(*qp), group_id);
+            num_ents = qp->num_ents;
+            memslot_validate_virt(slots, (intptr_t)qp->ents,
+                                  memslot_get_id(slots, qxl->bitmap.palette),
+                                  num_ents * sizeof(qp->ents[0]), group_id);
+            data_offset = record_blob_append(blob, qp, sizeof(*qp) +
+                                             num_ents * sizeof(qp->ents[0]));
+            memcpy(blob->data->data + data_offset + offsetof(QXLPalette, num_ents),
+                   &num_ents, sizeof(num_ents));
+            record_blob_reloc(blob, offset + offsetof(QXLImage, bitmap.palette), data_offset);
+        }
+        bitmap_size = qxl->bitmap.y * qxl->bitmap.stride;
+        if (qxl->bitmap.flags & QXL_BITMAP_DIRECT) {
+            data_offset = record_blob_append(blob, memslot_get_virt(slots, qxl->bitmap.data,
+                                                                    bitmap_size, group_id),
+                                             bitmap_size);
+        } else {
+            chunk = (QXLDataChunk *)memslot_get_virt(slots, qxl->bitmap.data,
+                                                     sizeof(*chunk), group_id);
+            data_offset = record_blob_append(blob, chunk, sizeof(*chunk));
+            size = record_blob_chunks(blob, slots, group_id,
+                                      memslot_get_id(slots, qxl->bitmap.data),
+                                      chunk, data_offset);
+            spice_assert(size == bitmap_size);
+        }
+        record_blob_reloc(blob, offset + offsetof(QXLImage, bitmap.data), data_offset);
+        break;
+    case SPICE_IMAGE_TYPE_SURFACE:
+        offset = record_blob_append(blob, qxl, sizeof(*qxl));
+        record_blob_reloc(blob, field, offset);
+        record_blob_surface_id(blob, offset + offsetof(QXLImage, surface_image.surface_id),
+                               false);
+        break;
+    case SPICE_IMAGE_TYPE_QUIC:
+        /* the chunk is embedded in the image */
+        size = offsetof(QXLImage, quic.data) + sizeof(QXLDataChunk);
+        offset = record_blob_append(blob, qxl, size);
+        record_blob_reloc(blob, field, offset);
+        size = record_blob_chunks(blob, slots, group_id, memslot_get_id(slots, addr),
+                                  (QXLDataChunk *)qxl->quic.data,
+                                  offset + offsetof(QXLImage, quic.data));
+        spice_assert(size == qxl->quic.data_size);
+        break;
+    default:
+        spice_error("unknown type %d", qxl->descriptor.type);
+    }
+}
+
+static void record_blob_brush(RecordBlob *blob, RedMemSlotInfo *slots, int group_id,
+                              uint32_t offset)
+{
+    QXLBrush qxl;
+
+    record_blob_get(blob, offset, &qxl, sizeof(qxl));
+    if (qxl.type == SPICE_BRUSH_TYPE_PATTERN) {
+        record_blob_image(blob, slots, group_id, offset + offsetof(QXLBrush, u.pattern.pat));
+    }
+}
+
+static void record_blob_qmask(RecordBlob *blob, RedMemSlotInfo *slots, int group_id,
+                              uint32_t offset)
+{
+    record_blob_image(blob, slots, group_id, offset + offsetof(QXLQMask, bitmap));
+}
+
+static void record_blob_stroke(RecordBlob *blob, RedMemSlotInfo *slots, int group_id,
+                               uint32_t offset)
+{
+    QXLStroke qxl;
+    uint32_t path;
+
+    record_blob_get(blob, offset, &qxl, sizeof(qxl));
+    path = record_blob_chunked(blob, slots, group_id, qxl.path,
+                               sizeof(QXLPath), offsetof(QXLPath, chunk), NULL);
+    record_blob_reloc(blob, offset + offsetof(QXLStroke, path), path);
+    if (qxl.attr.flags & SPICE_LINE_FLAGS_STYLED) {
+        spice_assert(qxl.attr.style);
+        record_blob_flat(blob, slots, group_id, offset + offsetof(QXLStroke, attr.style),
+                         qxl.attr.style_nseg * sizeof(QXLFIXED));
+    }
+    record_blob_brush(blob, slots, group_id, offset + offsetof(QXLStroke, brush));
+}
+
+static void record_blob_text(RecordBlob *blob, RedMemSlotInfo *slots, int group_id,
+                             uint32_t offset)
+{
+    QXLText qxl;
+    QXLString *str;
+    uint32_t str_offset;
+    size_t size;
+
+    record_blob_get(blob, offset, &qxl, sizeof(qxl));
+    str_offset = record_blob_chunked(blob, slots, group_id, qxl.str,
+                                     sizeof(QXLString), offsetof(QXLString, chunk), &size);
+    str = (QXLString *)memslot_get_virt(slots, qxl.str, sizeof(*str), group_id);
+    spice_assert(size == str->data_size);
+    record_blob_reloc(blob, offset + offsetof(QXLText, str), str_offset);
+    record_blob_brush(blob, slots, group_id, offset + offsetof(QXLText, fore_brush));
+    record_blob_brush(blob, slots, group_id, offset + offsetof(QXLText, back_brush));
+}
+
+static void record_blob_clip(RecordBlob *blob, RedMemSlotInfo *slots, int group_id,
+                             uint32_t offset)
+{
+    QXLClip qxl;
+    uint32_t rects;
+
+    record_blob_get(blob, offset, &qxl, sizeof(qxl));
+    if (qxl.type == SPICE_CLIP_TYPE_RECTS) {
+        rects = record_blob_chunked(blob, slots, group_id, qxl.data, sizeof(QXLClipRects),
+                                    offsetof(QXLClipRects, chunk), NULL);
+        record_blob_reloc(blob, offset + offsetof(QXLClip, data), rects);
+    }
+}
+
+static void record_blob_composite(RecordBlob *blob, RedMemSlotInfo *slots, int group_id,
+                                  uint32_t offset)
+{
+    record_blob_image(blob, slots, group_id, offset + offsetof(QXLComposite, src));
+    record_blob_flat(blob, slots, group_id, offset + offsetof(QXLComposite, src_transform),
+                     sizeof(SpiceTransform));
+    record_blob_image(blob, slots, group_id, offset + offsetof(QXLComposite, mask));
+    record_blob_flat(blob, slots, group_id, offset + offsetof(QXLComposite, mask_transform),
+                     sizeof(SpiceTransform));
+}
+
+/* @offset is the one of the union of the drawable */
+static void record_blob_draw(RecordBlob *blob, RedMemSlotInfo *slots, int group_id,
+                             uint8_t type, uint32_t offset, bool compat)
+{
+    switch (type) {
+    case QXL_DRAW_ALPHA_BLEND:
+        record_blob_image(blob, slots, group_id, offset +
+                          (compat ? offsetof(QXLCompatAlphaBlend, src_bitmap) :
+                                    offsetof(QXLAlphaBlend, src_bitmap)));
+        break;
+    case QXL_DRAW_BLACKNESS:
+    case QXL_DRAW_INVERS:
+    case QXL_DRAW_WHITENESS:
+        /* the mask is the only field of these */
+        record_blob_qmask(blob, slots, group_id, offset);
+        break;
+    case QXL_DRAW_BLEND:
+        record_blob_image(blob, slots, group_id, offset + offsetof(QXLBlend, src_bitmap));
+        record_blob_qmask(blob, slots, group_id, offset + offsetof(QXLBlend, mask));
+        break;
+    case QXL_DRAW_COPY:
+        record_blob_image(blob, slots, group_id, offset + offsetof(QXLCopy, src_bitmap));
+        record_blob_qmask(blob, slots, group_id, offset + offsetof(QXLCopy, mask));
+        break;
+    case QXL_COPY_BITS:
+    case QXL_DRAW_NOP:
+        break;
+    case QXL_DRAW_FILL:
+        record_blob_brush(blob, slots, group_id, offset + offsetof(QXLFill, brush));
+        record_blob_qmask(blob, slots, group_id, offset + offsetof(QXLFill, mask));
+        break;
+    case QXL_DRAW_OPAQUE:
+        record_blob_image(blob, slots, group_id, offset + offsetof(QXLOpaque, src_bitmap));
+        record_blob_brush(blob, slots, group_id, offset + offsetof(QXLOpaque, brush));
+        record_blob_qmask(blob, slots, group_id, offset + offsetof(QXLOpaque, mask));
+        break;
+    case QXL_DRAW_ROP3:
+        record_blob_image(blob, slots, group_id, offset + offsetof(QXLRop3, src_bitmap));
+        record_blob_brush(blob, slots, group_id, offset + offsetof(QXLRop3, brush));
+        record_blob_qmask(blob, slots, group_id, offset + offsetof(QXLRop3, mask));
+        break;
+    case QXL_DRAW_STROKE:
+        record_blob_stroke(blob, slots, group_id, offset);
+        break;
+    case QXL_DRAW_TEXT:
+        record_blob_text(blob, slots, group_id, offset);
+        break;
+    case QXL_DRAW_TRANSPARENT:
+        record_blob_image(blob, slots, group_id,
+                          offset + offsetof(QXLTransparent, src_bitmap));
+        break;
+    case QXL_DRAW_COMPOSITE:
+        if (!compat) {
+            record_blob_composite(blob, slots, group_id, offset);
+            break;
+        }
+        /* fall through */
+    default:
+        spice_error("unknown type %d", type);
+        break;
+    }
+}
+
+static void record_blob_drawable(RecordBlob *blob, RedMemSlotInfo *slots, int group_id,
+                                 QXLPHYSICAL addr, uint32_t flags)
+{
+    uint32_t offset;
+    int i;
+
+    if (flags & QXL_COMMAND_FLAG_COMPAT) {
+        QXLCompatDrawable *qxl;
+
+        qxl = (QXLCompatDrawable *)memslot_get_virt(slots, addr, sizeof(*qxl), group_id);
+        offset = record_blob_append(blob, qxl, sizeof(*qxl));
+        record_blob_clip(blob, slots, group_id, offset + offsetof(QXLCompatDrawable, clip));
+        record_blob_draw(blob, slots, group_id, qxl->type,
+                         offset + offsetof(QXLCompatDrawable, u), true);
+        return;
+    }
+
+    QXLDrawable *qxl;
+
+    qxl = (QXLDrawable *)memslot_get_virt(slots, addr, sizeof(*qxl), group_id);
+    offset = record_blob_append(blob, qxl, sizeof(*qxl));
+    record_blob_surface_id(blob, offset + offsetof(QXLDrawable, surface_id), false);
+    for (i = 0; i < 3; i++) {
+        record_blob_surface_id(blob, offset + offsetof(QXLDrawable, surfaces_dest) +
+                               i * sizeof(qxl->surfaces_dest[0]), false);
+    }
+    record_blob_clip(blob, slots, group_id, offset + offsetof(QXLDrawable, clip));
+    record_blob_draw(blob, slots, group_id, qxl->type,
+                     offset + offsetof(QXLDrawable, u), false);
+}
+
+static void record_blob_surface_cmd(RecordBlob *blob, RedMemSlotInfo *slots, int group_id,
+                                    QXLPHYSICAL addr)
+{
+    QXLSurfaceCmd *qxl;
+    uint32_t offset, data;
+    uint32_t field;
+    size_t size;
+
+    qxl = (QXLSurfaceCmd *)memslot_get_virt(slots, addr, sizeof(*qxl), group_id);
+    offset = record_blob_append(blob, qxl, sizeof(*qxl));
+    field = offset + offsetof(QXLSurfaceCmd, u.surface_create.data);
+
+    switch (qxl->type) {
+    case QXL_SURFACE_CMD_CREATE:
+        record_blob_surface_id(blob, offset + offsetof(QXLSurfaceCmd, surface_id), true);
+        size = qxl->u.surface_create.height * abs(qxl->u.surface_create.stride);
+        if ((qxl->flags & QXL_SURF_FLAG_KEEP_DATA) != 0) {
+            data = record_blob_append(blob, memslot_get_virt(slots, qxl->u.surface_create.data,
+                                                             size, group_id), size);
+        } else {
+            data = record_blob_reserve(blob, size);
+        }
+        record_blob_reloc(blob, field, data);
+        break;
+    case QXL_SURFACE_CMD_DESTROY:
+        record_blob_surface_id(blob, offset + offsetof(QXLSurfaceCmd, surface_id), false);
+        record_blob_set_addr(blob, field, 0);
+        break;
+    }
+}
+
+static void record_blob_cursor_cmd(RecordBlob *blob, RedMemSlotInfo *slots, int group_id,
+                                   QXLPHYSICAL addr)
+{
+    QXLCursorCmd *qxl;
+    uint32_t offset, cursor;
+
+    qxl = (QXLCursorCmd *)memslot_get_virt(slots, addr, sizeof(*qxl), group_id);
+    offset = record_blob_append(blob, qxl, sizeof(*qxl));
+    if (qxl->type == QXL_CURSOR_SET) {
+        cursor = record_blob_chunked(blob, slots, group_id, qxl->u.set.shape,
+                                     sizeof(QXLCursor), offsetof(QXLCursor, chunk), NULL);
+        record_blob_reloc(blob, offset + offsetof(QXLCursorCmd, u.set.shape), cursor);
+    }
+}
+
+static void record_blob_command(RecordBlob *blob, RedMemSlotInfo *slots,
+                                const QXLCommandExt *ext_cmd)
+{
+    int group_id = ext_cmd->group_id;
+    QXLPHYSICAL addr = ext_cmd->cmd.data;
+
+    switch (ext_cmd->cmd.type) {
+    case QXL_CMD_DRAW:
+        record_blob_drawable(blob, slots, group_id, addr, ext_cmd->flags);
+        break;
+    case QXL_CMD_UPDATE: {
+        QXLUpdateCmd *qxl;
+        uint32_t offset;
+
+        qxl = (QXLUpdateCmd *)memslot_get_virt(slots, addr, sizeof(*qxl), group_id);
+        offset = record_blob_append(blob, qxl, sizeof(*qxl));
+        record_blob_surface_id(blob, offset + offsetof(QXLUpdateCmd, surface_id), false);
+        break;
+    }
+    case QXL_CMD_MESSAGE: {
+        QXLMessage *qxl;
+
+        /* see red_record_message() about the size of the data */
+        qxl = (QXLMessage *)memslot_get_virt(slots, addr, sizeof(*qxl), group_id);
+        record_blob_append(blob, qxl, sizeof(*qxl));
+        record_blob_append_raw(blob, qxl->data, strlen((char*)qxl->data) + 1);
+        break;
+    }
+    case QXL_CMD_SURFACE:
+        record_blob_surface_cmd(blob, slots, group_id, addr);
+        break;
+    case QXL_CMD_CURSOR:
+        record_blob_cursor_cmd(blob, slots, group_id, addr);
+        break;
+    }
+}
+
+static void record_blob_reset(RecordBlob *blob)
+{
+    g_byte_array_set_size(blob->data, 0);
+    g_array_set_size(blob->relocs, 0);
+    g_array_set_size(blob->surface_ids, 0);
+    blob->extra_size = 0;
+}
+
+/* must be called with the record lock held */
+static void red_record_queue_buffer(RedRecord *record, RecordBuffer *buffer)
+{
+    while (record->queued_bytes > RED_RECORD_MAX_QUEUED_BYTES) {
+        pthread_cond_wait(&record->space_cond, &record->lock);
+    }
+    g_queue_push_tail(&record->queue, buffer);
+    record->queued_bytes += buffer->size;
+    pthread_cond_signal(&record->queue_cond);
+}
+
+/* Queue the blob as a record, must be called with the record lock held */
+static void red_record_queue_blob(RedRecord *record, RedRecordEvent what,
+                                  uint32_t type, uint32_t flags)
+{
+    RecordBlob *blob = &record->blob;
+    RedRecordHeader header;
+    RecordBuffer *buffer;
+    size_t relocs_size = blob->relocs->len * sizeof(uint32_t);
+    size_t surface_ids_size = blob->surface_ids->len * sizeof(uint32_t);
+    uint8_t *p;
+
+    header.size = relocs_size + surface_ids_size + blob->data->len;
+    header.counter = record->counter++;
+    header.what = what;
+    header.type = type;
+    header.flags = flags;
+    header.n_relocs = blob->relocs->len;
+    header.n_surface_ids = blob->surface_ids->len;
+    header.extra_size = blob->extra_size;
+    header.timestamp = spice_get_monotonic_time_ns();
+
+    buffer = (RecordBuffer *)g_malloc(sizeof(RecordBuffer) + sizeof(header) + header.size);
+    buffer->size = sizeof(header) + header.size;
+    p = buffer->data;
+    memcpy(p, &header, sizeof(header));
+    p += sizeof(header);
+    memcpy(p, blob->relocs->data, relocs_size);
+    p += relocs_size;
+    memcpy(p, blob->surface_ids->data, surface_ids_size);
+    p += surface_ids_size;
+    memcpy(p, blob->data->data, blob->data->len);
+
+    record_blob_reset(blob);
+    red_record_queue_buffer(record, buffer);
+}
+
+static void *red_record_writer_main(void *opaque)
+{
+    RedRecord *record = (RedRecord *) opaque;
+    bool write_failed = false;
+
+    pthread_mutex_lock(&record->lock);
+    for (;;) {
+        while (g_queue_is_empty(&record->queue) && !record->quit) {
+            pthread_cond_wait(&record->queue_cond, &record->lock);
+        }
+        /* the queue is flushed before quitting */
+        RecordBuffer *buffer = (RecordBuffer *) g_queue_pop_head(&record->queue);
+        if (!buffer) {
+            break;
+        }
+        pthread_mutex_unlock(&record->lock);
+
+        if (fwrite(buffer->data, buffer->size, 1, record->fd) != 1 && !write_failed) {
+            spice_warning("failed to write to the recording file");
+            write_failed = true;
+        }
+
+        pthread_mutex_lock(&record->lock);
+        record->queued_bytes -= buffer->size;
+        pthread_cond_signal(&record->space_cond);
+        g_free(buffer);
+    }
+    pthread_mutex_unlock(&record->lock);
+
+    return NULL;
+}
+
+static void red_record_writer_start(RedRecord *record)
+{
+    int r;
+
+    record->blob.data = g_byte_array_new();
+    record->blob.relocs = g_array_new(FALSE, FALSE, sizeof(uint32_t));
+    record->blob.surface_ids = g_array_new(FALSE, FALSE, sizeof(uint32_t));
+    pthread_cond_init(&record->queue_cond, NULL);
+    pthread_cond_init(&record->space_cond, NULL);
+    g_queue_init(&record->queue);
+
+#ifndef _WIN32
+    sigset_t thread_sig_mask;
+    sigset_t curr_sig_mask;
+
+    /* signals must be handled by the application threads */
+    sigfillset(&thread_sig_mask);
+    sigdelset(&thread_sig_mask, SIGILL);
+    sigdelset(&thread_sig_mask, SIGFPE);
+    sigdelset(&thread_sig_mask, SIGSEGV);
+    pthread_sigmask(SIG_SETMASK, &thread_sig_mask, &curr_sig_mask);
+#endif
+    r = pthread_create(&record->writer, NULL, red_record_writer_main, record);
+#ifndef _WIN32
+    pthread_sigmask(SIG_SETMASK, &curr_sig_mask, NULL);
+#endif
+    if (r) {
+        spice_error("failed to create the recording thread %d", r);
+    }
+#if !defined(__APPLE__)
+    pthread_setname_np(record->writer, "SPICE Record");
+#endif
+}
+
+static void red_record_writer_stop(RedRecord *record)
+{
+    pthread_mutex_lock(&record->lock);
+    record->quit = true;
+    pthread_cond_signal(&record->queue_cond);
+    pthread_mutex_unlock(&record->lock);
+    pthread_join(record->writer, NULL);
+
+    pthread_cond_destroy(&record->space_cond);
+    pthread_cond_destroy(&record->queue_cond);
+    g_byte_array_free(record->blob.data, TRUE);
+    g_array_free(record->blob.relocs, TRUE);
+    g_array_free(record->blob.surface_ids, TRUE);
+}
+
 void red_record_primary_surface_create(RedRecord *record,
                                        QXLDevSurfaceCreate* surface,
                                        uint8_t *line_0)
@@ -760,6 +1372,19 @@ void red_record_primary_surface_create(RedRecord *record,
     FILE *fd = record->fd;
 
     pthread_mutex_lock(&record->lock);
+    if (record->version == 2) {
+        RecordBlob *blob = &record->blob;
+        size_t size = abs(surface->stride) * surface->height;
+        uint32_t field = offsetof(QXLDevSurfaceCreate, mem);
+        uint32_t data;
+
+        record_blob_append(blob, surface, sizeof(*surface));
+        data = line_0 ? record_blob_append(blob, line_0, size) : record_blob_reserve(blob, size);
+        record_blob_reloc(blob, field, data);
+        red_record_queue_blob(record, RED_RECORD_EVENT_PRIMARY_SURFACE, 0, 0);
+        pthread_mutex_unlock(&record->lock);
+        return;
+    }
     fprintf(fd, "%d %d %d %d\n", surface->width, surface->height,
         surface->stride, surface->format);
     fprintf(fd, "%d %d %d %d\n", surface->position, surface->mouse_mode,
@@ -783,6 +1408,11 @@ static void red_record_event_unlocked(RedRecord *record, int what, uint32_t type
 void red_record_event(RedRecord *record, int what, uint32_t type)
 {
     pthread_mutex_lock(&record->lock);
+    if (record->version == 2) {
+        red_record_queue_blob(record, (RedRecordEvent) what, type, 0);
+        pthread_mutex_unlock(&record->lock);
+        return;
+    }
     red_record_event_unlocked(record, what, type);
     pthread_mutex_unlock(&record->lock);
 }
@@ -793,6 +1423,12 @@ void red_record_qxl_command(RedRecord *record, RedMemSlotInfo *slots,
     FILE *fd = record->fd;
 
     pthread_mutex_lock(&record->lock);
+    if (record->version == 2) {
+        record_blob_command(&record->blob, slots, &ext_cmd);
+        red_record_queue_blob(record, RED_RECORD_EVENT_COMMAND, ext_cmd.cmd.type, ext_cmd.flags);
+        pthread_mutex_unlock(&record->lock);
+        return;
+    }
     red_record_event_unlocked(record, 0, ext_cmd.cmd.type);
 
     switch (ext_cmd.cmd.type) {
@@ -832,12 +1468,21 @@ static void child_output_setup(gpointer user_data)
 
 RedRecord *red_record_new(const char *filename)
 {
-    static const char header[] = "SPICE_REPLAY 1\n";
-
-    const char *filter;
+    const char *filter, *format;
+    char header[32];
+    unsigned int version = 2;
     FILE *f;
     RedRecord *record;
 
+    format = getenv(RED_RECORD_FORMAT_ENV);
+    if (format) {
+        if (strcmp(format, "1") == 0) {
+            version = 1;
+        } else if (strcmp(format, "2") != 0) {
+            spice_warning("invalid value for %s: %s", RED_RECORD_FORMAT_ENV, format);
+        }
+    }
+
     f = fopen(filename, "wb+");
     if (!f) {
         spice_error("failed to open recording file %s", filename);
@@ -877,15 +1522,20 @@ RedRecord *red_record_new(const char *filename)
 #endif
     }
 
-    if (fwrite(header, sizeof(header)-1, 1, f) != 1) {
+    snprintf(header, sizeof(header), "SPICE_REPLAY %u\n", version);
+    if (fwrite(header, strlen(header), 1, f) != 1) {
         spice_error("failed to write replay header");
     }
 
-    record = g_new(RedRecord, 1);
+    record = g_new0(RedRecord, 1);
     record->refs = 1;
     record->fd = f;
     record->counter = 0;
+    record->version = version;
     pthread_mutex_init(&record->lock, NULL);
+    if (version == 2) {
+        red_record_writer_start(record);
+    }
     return record;
 }
 
@@ -900,6 +1550,9 @@ void red_record_unref(RedRecord *record)
     if (!record || !g_atomic_int_dec_and_test(&record->refs)) {
         return;
     }
+    if (record->version == 2) {
+        red_record_writer_stop(record);
+    }
     fclose(record->fd);
     pthread_mutex_destroy(&record->lock);
     g_free(record);
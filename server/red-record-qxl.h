@@ -29,6 +29,46 @@ SPICE_BEGIN_DECLS
 
 typedef struct RedRecord RedRecord;
 
+/* Format of the recording, selected with SPICE_WORKER_RECORD_FORMAT.
+ * Version 1 is a text format, version 2 (the default) is a binary format
+ * made of length prefixed records meant to be replayed with mmap().
+ */
+#define RED_RECORD_FORMAT_ENV "SPICE_WORKER_RECORD_FORMAT"
+
+typedef enum {
+    RED_RECORD_EVENT_COMMAND = 0,
+    RED_RECORD_EVENT_DEV_INPUT = 1,
+    /* version 2 only, follows the RED_WORKER_MESSAGE_CREATE_PRIMARY_SURFACE
+     * event with the QXLDevSurfaceCreate and the content of the surface */
+    RED_RECORD_EVENT_PRIMARY_SURFACE = 2,
+} RedRecordEvent;
+
+/* Set in a surface id entry if the id is allocated by the command */
+#define RED_RECORD_SURFACE_ID_NEW (1u << 31)
+
+/* Header of each record of a version 2 file, in host byte order.
+ * It is followed by:
+ * - n_relocs offsets of the QXLPHYSICAL fields of the data, each holding
+ *   the offset in the data it points to;
+ * - n_surface_ids offsets of the surface id fields of the data, possibly
+ *   with RED_RECORD_SURFACE_ID_NEW;
+ * - the data, the QXL structure of the command first, followed by all
+ *   the structures it references with their chunks merged in a single one.
+ * extra_size bytes of zeroed memory are to be allocated after the data, they
+ * can be referenced by the relocations.
+ */
+typedef struct RedRecordHeader {
+    uint32_t size; /* bytes following the header */
+    uint32_t counter;
+    uint32_t what; /* RedRecordEvent */
+    uint32_t type; /* QXL command type or RedWorkerMessage */
+    uint32_t flags; /* QXLCommandExt flags */
+    uint32_t n_relocs;
+    uint32_t n_surface_ids;
+    uint32_t extra_size;
+    uint64_t timestamp;
+} RedRecordHeader;
+
 /**
  * Create a new structure to handle recording.
  * This function never returns NULL.
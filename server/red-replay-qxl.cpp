@@ -21,6 +21,10 @@
 #include <zlib.h>
 #include <pthread.h>
 #include <glib.h>
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
 
 #include "reds.h"
 #include "red-qxl.h"
@@ -28,6 +32,7 @@
 #include "red-common.h"
 #include "memslot.h"
 #include "red-parse-qxl.h"
+#include "red-record-qxl.h"
 
 #define QXLPHYSICAL_FROM_PTR(ptr) ((QXLPHYSICAL)(uintptr_t)(ptr))
 #define QXLPHYSICAL_TO_PTR(phy) ((void*)(uintptr_t)(phy))
@@ -39,6 +44,7 @@ typedef enum {
 
 struct SpiceReplay {
     FILE *fd;
+    unsigned int version;
     gboolean error;
     int counter;
     bool created_primary;
@@ -54,6 +60,13 @@ struct SpiceReplay {
 
     pthread_mutex_t mutex;
     pthread_cond_t cond;
+
+    /* version 2, the file is read with fd if it can't be mapped */
+    uint8_t *map;
+    size_t map_size;
+    size_t pos;
+    uint32_t *tables;
+    size_t tables_size;
 };
 
 static ssize_t replay_fread(SpiceReplay *replay, uint8_t *buf, size_t size)
@@ -291,6 +304,107 @@ static replay_t read_binary(SpiceReplay *replay, const char *prefix, size_t *siz
     return replay_fscanf(replay, "\n");
 }
 
+static bool replay_v2_read(SpiceReplay *replay, void *buf, size_t size)
+{
+    if (replay->error) {
+        return false;
+    }
+    if (size == 0) {
+        return true;
+    }
+    if (!replay->map) {
+        replay_fread(replay, (uint8_t *) buf, size);
+        return !replay->error;
+    }
+    if (replay->map_size - replay->pos < size) {
+        replay->error = TRUE;
+        return false;
+    }
+    memcpy(buf, replay->map + replay->pos, size);
+    replay->pos += size;
+    return true;
+}
+
+/*
+ * Read the next record of a version 2 file.
+ * The data is returned in a single allocation, after @prefix_size bytes
+ * left to the caller, with its pointers and surface ids fixed up.
+ * The caller must free it with g_free().
+ */
+static uint8_t *replay_v2_read_record(SpiceReplay *replay, RedRecordHeader *header,
+                                      size_t prefix_size)
+{
+    size_t n_entries, tables_size, data_size, alloc_size;
+    uint8_t *mem, *data;
+    uint32_t i;
+
+    if (!replay_v2_read(replay, header, sizeof(*header))) {
+        return NULL;
+    }
+    n_entries = (size_t) header->n_relocs + header->n_surface_ids;
+    tables_size = n_entries * sizeof(uint32_t);
+    if (header->size < tables_size) {
+        replay->error = TRUE;
+        return NULL;
+    }
+    data_size = header->size - tables_size;
+    if (tables_size > replay->tables_size) {
+        replay->tables = (uint32_t *) g_realloc(replay->tables, tables_size);
+        replay->tables_size = tables_size;
+    }
+    if (!replay_v2_read(replay, replay->tables, tables_size)) {
+        return NULL;
+    }
+
+    prefix_size = SPICE_ALIGN(prefix_size, 8);
+    alloc_size = prefix_size + data_size + header->extra_size;
+    mem = (uint8_t *) g_malloc(alloc_size);
+    data = mem + prefix_size;
+    if (!replay_v2_read(replay, data, data_size)) {
+        g_free(mem);
+        return NULL;
+    }
+    memset(data + data_size, 0, header->extra_size);
+
+    for (i = 0; i < header->n_relocs; i++) {
+        uint32_t field = replay->tables[i];
+        QXLPHYSICAL addr;
+
+        if (field > data_size || data_size - field < sizeof(addr)) {
+            goto error;
+        }
+        memcpy(&addr, data + field, sizeof(addr));
+        if (addr > data_size + header->extra_size) {
+            goto error;
+        }
+        addr = QXLPHYSICAL_FROM_PTR(data + addr);
+        memcpy(data + field, &addr, sizeof(addr));
+    }
+    for (i = 0; i < header->n_surface_ids; i++) {
+        uint32_t entry = replay->tables[header->n_relocs + i];
+        uint32_t field = entry & ~RED_RECORD_SURFACE_ID_NEW;
+        uint32_t id;
+
+        if (field > data_size || data_size - field < sizeof(id)) {
+            goto error;
+        }
+        memcpy(&id, data + field, sizeof(id));
+        if (entry & RED_RECORD_SURFACE_ID_NEW) {
+            id = replay_id_new(replay, id);
+        } else {
+            id = replay_id_get(replay, id);
+        }
+        memcpy(data + field, &id, sizeof(id));
+    }
+    return mem;
+
+error:
+    g_warning("%d: invalid record", replay->counter);
+    replay->error = TRUE;
+    g_free(mem);
+    return NULL;
+}
+
 static ssize_t red_replay_data_chunks(SpiceReplay *replay, const char *prefix,
                                       uint8_t **mem, size_t base_size)
 {
@@ -1264,19 +1378,36 @@ static void replay_handle_create_primary(QXLInstance *instance, SpiceReplay *rep
     }
     replay->created_primary = TRUE;
 
-    replay_fscanf(replay, "%d %d %d %d\n", &surface.width, &surface.height,
-        &surface.stride, &surface.format);
-    replay_fscanf(replay, "%d %d %d %d\n", &surface.position, &surface.mouse_mode,
-        &surface.flags, &surface.type);
-    if (replay->error) {
-        return;
+    if (replay->version == 2) {
+        RedRecordHeader header;
+
+        mem = replay_v2_read_record(replay, &header, 0);
+        if (!mem) {
+            return;
+        }
+        if (header.what != RED_RECORD_EVENT_PRIMARY_SURFACE || header.size < sizeof(surface)) {
+            g_warning("%d: missing primary surface", replay->counter);
+            replay->error = TRUE;
+            g_free(mem);
+            return;
+        }
+        /* the surface memory follows the structure in mem */
+        memcpy(&surface, mem, sizeof(surface));
+    } else {
+        replay_fscanf(replay, "%d %d %d %d\n", &surface.width, &surface.height,
+            &surface.stride, &surface.format);
+        replay_fscanf(replay, "%d %d %d %d\n", &surface.position, &surface.mouse_mode,
+            &surface.flags, &surface.type);
+        if (replay->error) {
+            return;
+        }
+        read_binary(replay, "data", &size, &mem, 0);
+        replay->allocated = g_list_remove(replay->allocated, mem);
+        surface.mem = QXLPHYSICAL_FROM_PTR(mem);
     }
-    read_binary(replay, "data", &size, &mem, 0);
     surface.group_id = 0;
     g_free(replay->primary_mem);
-    replay->allocated = g_list_remove(replay->allocated, mem);
     replay->primary_mem = mem;
-    surface.mem = QXLPHYSICAL_FROM_PTR(mem);
     spice_qxl_create_primary_surface(instance, 0, &surface);
 }
 
@@ -1308,6 +1439,58 @@ static void replay_handle_dev_input(QXLInstance *instance, SpiceReplay *replay,
     }
 }
 
+static QXLCommandExt *replay_v2_next_cmd(SpiceReplay *replay, QXLInstance *instance)
+{
+    RedRecordHeader header;
+    QXLCommandExt *cmd;
+    uint8_t *mem;
+
+    for (;;) {
+        mem = replay_v2_read_record(replay, &header, sizeof(QXLCommandExt));
+        if (!mem) {
+            return NULL;
+        }
+        if (header.what == RED_RECORD_EVENT_COMMAND) {
+            break;
+        }
+        g_free(mem);
+        if (header.what == RED_RECORD_EVENT_DEV_INPUT) {
+            replay_handle_dev_input(instance, replay, (RedWorkerMessage) header.type);
+        }
+    }
+
+    /* the command is followed by its data in the same allocation */
+    cmd = (QXLCommandExt *) mem;
+    cmd->cmd.type = header.type;
+    cmd->cmd.data = QXLPHYSICAL_FROM_PTR(mem + SPICE_ALIGN(sizeof(QXLCommandExt), 8));
+    cmd->cmd.padding = 0;
+    cmd->group_id = 0;
+    cmd->flags = header.flags;
+    spice_debug("command %" G_GUINT64_FORMAT ", %d", header.timestamp, cmd->cmd.type);
+
+#ifndef _WIN32
+    /* keep the position up to date for the callers tracking the progress */
+    if (replay->map) {
+        fseek(replay->fd, replay->pos, SEEK_SET);
+    }
+#endif
+    return cmd;
+}
+
+static void replay_set_release_info(QXLCommandExt *cmd)
+{
+    QXLReleaseInfo *info;
+
+    switch (cmd->cmd.type) {
+    case QXL_CMD_DRAW:
+    case QXL_CMD_UPDATE:
+    case QXL_CMD_SURFACE:
+    case QXL_CMD_CURSOR:
+        info = (QXLReleaseInfo*) QXLPHYSICAL_TO_PTR(cmd->cmd.data);
+        info->id = (uintptr_t)cmd;
+    }
+}
+
 /*
  * NOTE: This reads from a saved file and performs all io actions, calling the
  * dispatcher, until it sees a command, at which point it returns it.
@@ -1323,6 +1506,15 @@ SPICE_GNUC_VISIBLE QXLCommandExt* spice_replay_next_cmd(SpiceReplay *replay,
     int what = -1;
     int counter;
 
+    if (replay->version == 2) {
+        cmd = replay_v2_next_cmd(replay, instance);
+        if (cmd) {
+            replay_set_release_info(cmd);
+            replay->counter++;
+        }
+        return cmd;
+    }
+
     while (what != 0) {
         replay_fscanf(replay, "event %d %d %d %" SCNu64 "\n", &counter,
                             &what, &type, &timestamp);
@@ -1360,15 +1552,7 @@ SPICE_GNUC_VISIBLE QXLCommandExt* spice_replay_next_cmd(SpiceReplay *replay,
         goto error;
     }
 
-    QXLReleaseInfo *info;
-    switch (cmd->cmd.type) {
-    case QXL_CMD_DRAW:
-    case QXL_CMD_UPDATE:
-    case QXL_CMD_SURFACE:
-    case QXL_CMD_CURSOR:
-        info = (QXLReleaseInfo*) QXLPHYSICAL_TO_PTR(cmd->cmd.data);
-        info->id = (uintptr_t)cmd;
-    }
+    replay_set_release_info(cmd);
 
     /* all buffer allocated will be used by the caller but
      * free the list of buffer allocated to avoid to free on next calls */
@@ -1396,6 +1580,18 @@ SPICE_GNUC_VISIBLE void spice_replay_free_cmd(SpiceReplay *replay, QXLCommandExt
     spice_return_if_fail(replay);
     spice_return_if_fail(cmd);
 
+    if (replay->version == 2) {
+        if (cmd->cmd.type == QXL_CMD_SURFACE) {
+            QXLSurfaceCmd *qxl = (QXLSurfaceCmd*) QXLPHYSICAL_TO_PTR(cmd->cmd.data);
+            if (qxl->type == QXL_SURFACE_CMD_DESTROY) {
+                replay_id_free(replay, qxl->surface_id);
+            }
+        }
+        /* the data of the command is in the same allocation */
+        g_free(cmd);
+        return;
+    }
+
     switch (cmd->cmd.type) {
     case QXL_CMD_DRAW: {
         // FIXME: compat flag must be saved somewhere...
@@ -1432,12 +1628,14 @@ SPICE_GNUC_VISIBLE
 SpiceReplay *spice_replay_new(FILE *file, int nsurfaces)
 {
     unsigned int version = 0;
+    char line[32];
     SpiceReplay *replay;
 
     spice_return_val_if_fail(file != NULL, NULL);
 
-    if (fscanf(file, "SPICE_REPLAY %u\n", &version) == 1) {
-        if (version != 1) {
+    /* don't let scanf skip the binary data following the header */
+    if (fgets(line, sizeof(line), file) && sscanf(line, "SPICE_REPLAY %u", &version) == 1) {
+        if (version != 1 && version != 2) {
             spice_warning("Replay file version unsupported");
             return NULL;
         }
@@ -1450,6 +1648,24 @@ SpiceReplay *spice_replay_new(FILE *file, int nsurfaces)
 
     replay->error = FALSE;
     replay->fd = file;
+    replay->version = version;
+#ifndef _WIN32
+    if (version == 2) {
+        struct stat st;
+        void *map;
+
+        /* fall back to reading the file, for instance for a pipe */
+        if (fstat(fileno(file), &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+            map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(file), 0);
+            if (map != MAP_FAILED) {
+                madvise(map, st.st_size, MADV_SEQUENTIAL);
+                replay->map = (uint8_t *) map;
+                replay->map_size = st.st_size;
+                replay->pos = ftell(file);
+            }
+        }
+    }
+#endif
     replay->created_primary = FALSE;
     pthread_mutex_init(&replay->mutex, NULL);
     pthread_cond_init(&replay->cond, NULL);
@@ -1476,6 +1692,12 @@ SPICE_GNUC_VISIBLE void spice_replay_free(SpiceReplay *replay)
     g_array_free(replay->id_map_inv, TRUE);
     g_array_free(replay->id_free, TRUE);
     g_free(replay->primary_mem);
+#ifndef _WIN32
+    if (replay->map) {
+        munmap(replay->map, replay->map_size);
+    }
+#endif
+    g_free(replay->tables);
     fclose(replay->fd);
     g_free(replay);
 }
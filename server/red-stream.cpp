@@ -24,6 +24,9 @@
 #include <netdb.h>
 #include <sys/socket.h>
 #include <netinet/tcp.h>
+#ifdef __linux__
+#include <linux/errqueue.h>
+#endif
 #else
 #include <ws2tcpip.h>
 #endif
@@ -97,6 +100,11 @@ struct RedStreamPrivate {
     bool use_cork;
     bool corked;
 
+    /* number of MSG_ZEROCOPY writes done and completed, as counted by the kernel */
+    bool zerocopy;
+    uint32_t zerocopy_sent;
+    uint32_t zerocopy_completed;
+
     ssize_t (*read)(RedStream *s, void *buf, size_t nbyte);
     ssize_t (*write)(RedStream *s, const void *buf, size_t nbyte);
     ssize_t (*writev)(RedStream *s, const struct iovec *iov, int iovcnt);
@@ -122,8 +130,39 @@ static inline int socket_set_cork(int socket, int enabled)
 }
 #endif
 
+#if defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY)
+#define HAVE_ZEROCOPY 1
+
+/* writes smaller than that are copied, pinning the pages would cost more */
+#define ZEROCOPY_MIN_SIZE (16 * 1024)
+
+static ssize_t stream_writev_zerocopy(RedStream *s, const struct iovec *iov, int iovcnt)
+{
+    struct msghdr msg;
+    ssize_t n;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = (struct iovec *) iov;
+    msg.msg_iovlen = iovcnt;
+    n = sendmsg(s->socket, &msg, MSG_ZEROCOPY | MSG_NOSIGNAL);
+    if (n > 0) {
+        s->priv->zerocopy_sent++;
+    } else if (n < 0 && errno == ENOBUFS) {
+        /* out of memory to track the pinned pages, copy this one */
+        n = socket_writev(s->socket, iov, iovcnt);
+    }
+    return n;
+}
+#endif
+
 static ssize_t stream_write_cb(RedStream *s, const void *buf, size_t size)
 {
+#ifdef HAVE_ZEROCOPY
+    if (s->priv->zerocopy && size >= ZEROCOPY_MIN_SIZE) {
+        struct iovec iov = { (void *) buf, size };
+        return stream_writev_zerocopy(s, &iov, 1);
+    }
+#endif
     return socket_write(s->socket, buf, size);
 }
 
@@ -142,7 +181,15 @@ static ssize_t stream_writev_cb(RedStream *s, const struct iovec *iov, int iovcn
         for (i = 0; i < tosend; i++) {
             expected += iov[i].iov_len;
         }
+#ifdef HAVE_ZEROCOPY
+        if (s->priv->zerocopy && expected >= ZEROCOPY_MIN_SIZE) {
+            n = stream_writev_zerocopy(s, iov, tosend);
+        } else {
+            n = socket_writev(s->socket, iov, tosend);
+        }
+#else
         n = socket_writev(s->socket, iov, tosend);
+#endif
         if (n <= expected) {
             if (n > 0)
                 ret += n;
@@ -254,6 +301,11 @@ bool red_stream_write_all(RedStream *stream, const void *in_buf, size_t n)
 
 bool red_stream_set_auto_flush(RedStream *s, bool auto_flush)
 {
+    /* websocket frames small messages together until flushed */
+    if (s->priv->ws) {
+        websocket_set_batching(s->priv->ws, !auto_flush);
+    }
+
     if (s->priv->use_cork == !auto_flush) {
         return true;
     }
@@ -273,12 +325,18 @@ bool red_stream_set_auto_flush(RedStream *s, bool auto_flush)
     return true;
 }
 
-void red_stream_flush(RedStream *s)
+bool red_stream_flush(RedStream *s)
 {
+    bool flushed = true;
+
+    if (s->priv->ws && websocket_flush(s->priv->ws) < 0 && errno == EAGAIN) {
+        flushed = false;
+    }
     if (s->priv->corked) {
         socket_set_cork(s->socket, 0);
         socket_set_cork(s->socket, 1);
     }
+    return flushed;
 }
 
 #if HAVE_SASL
@@ -347,6 +405,26 @@ int red_stream_get_no_delay(RedStream *stream)
     return red_socket_get_no_delay(stream->socket);
 }
 
+bool red_stream_get_tcp_rate(RedStream *stream, uint64_t *bits_per_sec, uint32_t *roundtrip_us)
+{
+#if defined(__linux__) && defined(TCP_INFO)
+    struct tcp_info info;
+    socklen_t len = sizeof(info);
+
+    if (getsockopt(stream->socket, IPPROTO_TCP, TCP_INFO, &info, &len) != 0 ||
+        info.tcpi_rtt == 0 || info.tcpi_snd_cwnd == 0) {
+        return false;
+    }
+    /* a congestion window of data per smoothed roundtrip */
+    *bits_per_sec = (uint64_t) info.tcpi_snd_cwnd * info.tcpi_snd_mss * 8 * 1000000 /
+                    info.tcpi_rtt;
+    *roundtrip_us = info.tcpi_rtt;
+    return true;
+#else
+    return false;
+#endif
+}
+
 #ifndef _WIN32
 int red_stream_send_msgfd(RedStream *stream, int fd)
 {
@@ -513,6 +591,21 @@ static void red_stream_disable_writev(RedStream *stream)
     stream->priv->writev = NULL;
 }
 
+/* If the kernel took over the encryption of the records sent, data can be
+ * written directly to the socket, so also with writev.
+ * Reading still goes through OpenSSL which handles the non data records. */
+static void red_stream_ssl_check_ktls(RedStream *stream)
+{
+#ifdef SSL_OP_ENABLE_KTLS
+    if (!BIO_get_ktls_send(SSL_get_wbio(stream->priv->ssl))) {
+        return;
+    }
+    spice_debug("using kernel TLS to send on socket %d", stream->socket);
+    stream->priv->write = stream_write_cb;
+    stream->priv->writev = stream_writev_cb;
+#endif
+}
+
 RedStreamSslStatus red_stream_ssl_accept(RedStream *stream)
 {
     int ssl_error;
@@ -520,6 +613,7 @@ RedStreamSslStatus red_stream_ssl_accept(RedStream *stream)
 
     return_code = SSL_accept(stream->priv->ssl);
     if (return_code == 1) {
+        red_stream_ssl_check_ktls(stream);
         return RED_STREAM_SSL_STATUS_OK;
     }
 
@@ -1179,6 +1273,67 @@ static ssize_t stream_websocket_writev(RedStream *s, const struct iovec *iov, in
     return websocket_writev(s->priv->ws, (struct iovec *) iov, iovcnt, WEBSOCKET_BINARY_FINAL);
 }
 
+bool red_stream_enable_zerocopy(RedStream *stream)
+{
+#ifdef HAVE_ZEROCOPY
+    int enabled = 1;
+
+    /* only plain sockets hand the written buffers to the kernel, kernel TLS
+     * sockets can't send this way */
+    if (stream->priv->writev != stream_writev_cb || stream->priv->ws || stream->priv->ssl) {
+        return false;
+    }
+    if (setsockopt(stream->socket, SOL_SOCKET, SO_ZEROCOPY, &enabled, sizeof(enabled)) != 0) {
+        spice_debug("zero copy not supported on socket %d: %s", stream->socket, strerror(errno));
+        return false;
+    }
+    stream->priv->zerocopy = true;
+    return true;
+#else
+    return false;
+#endif
+}
+
+uint32_t red_stream_get_zerocopy_sent(RedStream *stream)
+{
+    return stream->priv->zerocopy_sent;
+}
+
+uint32_t red_stream_get_zerocopy_completed(RedStream *stream)
+{
+#ifdef HAVE_ZEROCOPY
+    if (!stream->priv->zerocopy) {
+        return stream->priv->zerocopy_completed;
+    }
+
+    /* the notifications are queued on the socket error queue */
+    for (;;) {
+        char control[CMSG_SPACE(sizeof(struct sock_extended_err)) * 4];
+        struct msghdr msg;
+        struct cmsghdr *cmsg;
+
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(stream->socket, &msg, MSG_ERRQUEUE) < 0) {
+            break;
+        }
+        for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            struct sock_extended_err *serr = (struct sock_extended_err *) CMSG_DATA(cmsg);
+
+            if (serr->ee_errno != 0 || serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+                continue;
+            }
+            /* writes [ee_info, ee_data] completed, TCP completes them in order */
+            if ((int32_t) (serr->ee_data + 1 - stream->priv->zerocopy_completed) > 0) {
+                stream->priv->zerocopy_completed = serr->ee_data + 1;
+            }
+        }
+    }
+#endif
+    return stream->priv->zerocopy_completed;
+}
+
 /*
     If we detect that a newly opened stream appears to be using
     the WebSocket protocol, we will put in place cover functions
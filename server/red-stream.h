@@ -69,6 +69,10 @@ int red_stream_get_family(const RedStream *stream);
 bool red_stream_is_plain_unix(const RedStream *stream);
 bool red_stream_set_no_delay(RedStream *stream, bool no_delay);
 int red_stream_get_no_delay(RedStream *stream);
+/* Rate the kernel lets the connection send at (congestion window per
+ * smoothed roundtrip) in bits per second, and that roundtrip.
+ * Returns false if this is not a TCP connection or the system doesn't tell */
+bool red_stream_get_tcp_rate(RedStream *stream, uint64_t *bits_per_sec, uint32_t *roundtrip_us);
 #ifndef _WIN32
 int red_stream_send_msgfd(RedStream *stream, int fd);
 #endif
@@ -90,8 +94,29 @@ bool red_stream_set_auto_flush(RedStream *stream, bool auto_flush);
  * Flush data to the underlying socket.
  * Calling this function on a stream with auto flush set has
  * no result.
+ *
+ * Returns false if some data is still buffered in the stream,
+ * in which case it should be flushed again once writable.
+ */
+bool red_stream_flush(RedStream *stream);
+
+/* Environment variable enabling zero copy sends on the display channels */
+#define RED_STREAM_ZEROCOPY_ENV "SPICE_ZEROCOPY"
+
+/**
+ * Let the kernel send large writes from the written buffers instead of
+ * copying them (MSG_ZEROCOPY). Only plain TCP sockets support it.
+ * The buffers of such writes must be kept unchanged until
+ * red_stream_get_zerocopy_completed() reaches the value
+ * red_stream_get_zerocopy_sent() had after them, comparing as serial
+ * numbers.
+ *
+ * Returns false if zero copy can't be used on this stream.
  */
-void red_stream_flush(RedStream *stream);
+bool red_stream_enable_zerocopy(RedStream *stream);
+uint32_t red_stream_get_zerocopy_sent(RedStream *stream);
+/* Also processes the pending notifications of the socket */
+uint32_t red_stream_get_zerocopy_completed(RedStream *stream);
 
 bool red_stream_is_websocket(RedStream *stream, const void *buf, size_t len);
 
@@ -76,11 +76,15 @@ struct RedWorker {
     RedMemSlotInfo mem_slots;
 
     uint32_t process_display_generation;
+    uint32_t frame_trace_id;
     RedStatNode stat;
     RedStatCounter wakeup_counter;
     RedStatCounter command_counter;
     RedStatCounter full_loop_counter;
     RedStatCounter total_loop_counter;
+    RedStatCounter cpu_time_counter;
+    /* largest display client pipe after each command */
+    stat_info_t pipe_depth;
 
     bool driver_cap_monitors_config;
 
@@ -115,7 +119,7 @@ static int red_process_cursor(RedWorker *worker, int *ring_is_empty)
     }
 
     *ring_is_empty = FALSE;
-    while (worker->cursor_channel->max_pipe_size() <= MAX_PIPE_SIZE) {
+    while (!worker->cursor_channel->any_pipe_full(MAX_PIPE_SIZE)) {
         if (!red_qxl_get_cursor_command(worker->qxl, &ext_cmd)) {
             *ring_is_empty = TRUE;
             if (worker->cursor_poll_tries < CMD_RING_POLL_RETRIES) {
@@ -176,7 +180,9 @@ static int red_process_display(RedWorker *worker, int *ring_is_empty)
 
     worker->process_display_generation++;
     *ring_is_empty = FALSE;
-    while (worker->display_channel->max_pipe_size() <= MAX_PIPE_SIZE) {
+    while (!worker->display_channel->any_pipe_full(MAX_PIPE_SIZE)) {
+        stat_time_t fetch_time;
+
         if (!red_qxl_get_command(worker->qxl, &ext_cmd)) {
             *ring_is_empty = TRUE;
             if (worker->display_poll_tries < CMD_RING_POLL_RETRIES) {
@@ -188,6 +194,7 @@ static int red_process_display(RedWorker *worker, int *ring_is_empty)
             worker->display_poll_tries++;
             return n;
         }
+        fetch_time = frame_trace_now();
 
         if (worker->record) {
             red_record_qxl_command(worker->record, &worker->mem_slots, ext_cmd);
@@ -203,6 +210,7 @@ static int red_process_display(RedWorker *worker, int *ring_is_empty)
                                             ext_cmd.flags); // returns with 1 ref
 
             if (red_drawable != NULL) {
+                frame_trace_begin(&red_drawable->trace, ++worker->frame_trace_id, fetch_time);
                 display_channel_process_draw(worker->display_channel, red_drawable,
                                              worker->process_display_generation);
                 red_drawable_unref(red_drawable);
@@ -248,6 +256,9 @@ static int red_process_display(RedWorker *worker, int *ring_is_empty)
             spice_error("bad command type");
         }
         n++;
+        if (stat_is_enabled()) {
+            stat_info_add(&worker->pipe_depth, worker->display_channel->max_pipe_size(), 0, 0);
+        }
         if (worker->display_channel->all_blocked()
             || spice_get_monotonic_time_ns() - start > NSEC_PER_SEC / 100) {
             worker->event_timeout = 0;
@@ -261,8 +272,8 @@ static int red_process_display(RedWorker *worker, int *ring_is_empty)
 
 static bool red_process_is_blocked(RedWorker *worker)
 {
-    return worker->cursor_channel->max_pipe_size() > MAX_PIPE_SIZE ||
-           worker->display_channel->max_pipe_size() > MAX_PIPE_SIZE;
+    return worker->cursor_channel->any_pipe_full(MAX_PIPE_SIZE) ||
+           worker->display_channel->any_pipe_full(MAX_PIPE_SIZE);
 }
 
 typedef int (*red_process_t)(RedWorker *worker, int *ring_is_empty);
@@ -288,7 +299,7 @@ static void flush_commands(RedWorker *worker, RedChannel *red_channel,
         end_time = spice_get_monotonic_time_ns() + COMMON_CLIENT_TIMEOUT;
         for (;;) {
             red_channel->push();
-            if (red_channel->max_pipe_size() <= MAX_PIPE_SIZE) {
+            if (!red_channel->any_pipe_full(MAX_PIPE_SIZE)) {
                 break;
             }
             red_channel->receive();
@@ -999,6 +1010,9 @@ static gboolean worker_source_dispatch(GSource *source, GSourceFunc callback,
     red_process_cursor(worker, &ring_is_empty);
     red_process_display(worker, &ring_is_empty);
 
+    if (stat_is_enabled()) {
+        stat_set_counter(worker->cpu_time_counter, stat_now(CLOCK_THREAD_CPUTIME_ID));
+    }
     return TRUE;
 }
 
@@ -1009,6 +1023,24 @@ static GSourceFuncs worker_source_funcs = {
     .dispatch = worker_source_dispatch,
 };
 
+/* optional limit of the bytes queued to each client of @channel */
+static void set_max_pipe_bytes_from_env(RedChannel *channel, const char *env_name)
+{
+    const char *env = getenv(env_name);
+    char *end;
+    guint64 max_bytes;
+
+    if (env == NULL) {
+        return;
+    }
+    max_bytes = g_ascii_strtoull(env, &end, 10);
+    if (end == env || *end != '\0') {
+        spice_warning("invalid value for %s: %s", env_name, env);
+        return;
+    }
+    channel->set_max_pipe_bytes(max_bytes);
+}
+
 RedWorker* red_worker_new(QXLInstance *qxl)
 {
     QXLDevInitInfo init_info;
@@ -1041,6 +1073,9 @@ RedWorker* red_worker_new(QXLInstance *qxl)
     stat_init_counter(&worker->command_counter, reds, &worker->stat, "commands", TRUE);
     stat_init_counter(&worker->full_loop_counter, reds, &worker->stat, "full_loops", TRUE);
     stat_init_counter(&worker->total_loop_counter, reds, &worker->stat, "total_loops", TRUE);
+    stat_init_counter(&worker->cpu_time_counter, reds, &worker->stat, "cpu_time_ns", TRUE);
+    stat_value_init(&worker->pipe_depth, "pipe_depth");
+    stat_info_publish(&worker->pipe_depth, reds, &worker->stat);
 
     worker->dispatch_watch = dispatcher->create_watch(&worker->core);
     spice_assert(worker->dispatch_watch != NULL);
@@ -1063,6 +1098,7 @@ RedWorker* red_worker_new(QXLInstance *qxl)
                                                 &worker->core, dispatcher).get(); // XXX
     channel = worker->cursor_channel;
     channel->init_stat_node(&worker->stat, "cursor_channel");
+    set_max_pipe_bytes_from_env(channel, "SPICE_CURSOR_MAX_PIPE_BYTES");
 
     // TODO: handle seamless migration. Temp, setting migrate to FALSE
     worker->display_channel = display_channel_new(reds, qxl, &worker->core, dispatcher,
@@ -1072,6 +1108,8 @@ RedWorker* red_worker_new(QXLInstance *qxl)
                                                   init_info.n_surfaces).get(); // XXX
     channel = worker->display_channel;
     channel->init_stat_node(&worker->stat, "display_channel");
+    display_channel_publish_stats(worker->display_channel);
+    set_max_pipe_bytes_from_env(channel, "SPICE_DISPLAY_MAX_PIPE_BYTES");
     display_channel_set_image_compression(worker->display_channel,
                                           spice_server_get_image_compression(reds));
 
@@ -1087,7 +1125,8 @@ static void *red_worker_main(void *arg)
     pthread_setname_np("SPICE Worker");
 #endif
     SPICE_VERIFY(MAX_PIPE_SIZE > WIDE_CLIENT_ACK_WINDOW &&
-           MAX_PIPE_SIZE > NARROW_CLIENT_ACK_WINDOW); //ensure wakeup by ack message
+           MAX_PIPE_SIZE > NARROW_CLIENT_ACK_WINDOW &&
+           MAX_PIPE_SIZE > MAX_CLIENT_ACK_WINDOW); //ensure wakeup by ack message
 
     worker->cursor_channel->reset_thread_id();
     worker->display_channel->reset_thread_id();
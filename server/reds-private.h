@@ -117,9 +117,8 @@ struct RedsState {
 
     SSL_CTX *ctx;
 
-#ifdef RED_STATISTICS
+    /* NULL unless the statistics are enabled */
     RedStatFile *stat_file;
-#endif
     int allow_multiple_clients;
     bool late_initialization_done;
 
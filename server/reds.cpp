@@ -78,7 +78,7 @@
 #include "net-utils.h"
 #include "red-stream-device.h"
 
-#define REDS_MAX_STAT_NODES 100
+#define REDS_MAX_STAT_NODES 1024
 
 static void reds_client_monitors_config(RedsState *reds, VDAgentMonitorsConfig *monitors_config);
 static gboolean reds_use_client_monitors_config(RedsState *reds);
@@ -88,6 +88,9 @@ static void reds_set_video_codecs(RedsState *reds, GArray *video_codecs);
  * server */
 #define SPICE_DEBUG_ALLOW_MC_ENV "SPICE_DEBUG_ALLOW_MC"
 
+/* Let the kernel encrypt the TLS records sent when it can (kTLS) */
+#define SPICE_KTLS_ENV "SPICE_KTLS"
+
 #define REDS_TOKENS_TO_SEND 5
 #define REDS_VDI_PORT_NUM_RECEIVE_BUFFS 5
 
@@ -275,12 +278,15 @@ static void reds_link_free(RedLinkInfo *link)
     g_free(link);
 }
 
-#ifdef RED_STATISTICS
-
 void stat_init_node(RedStatNode *node, SpiceServer *reds, const RedStatNode *parent,
                     const char *name, int visible)
 {
     StatNodeRef parent_ref = parent ? parent->ref : INVALID_STAT_REF;
+
+    if (!reds->stat_file) {
+        node->ref = INVALID_STAT_REF;
+        return;
+    }
     node->ref = stat_file_add_node(reds->stat_file, parent_ref, name, visible);
 }
 
@@ -296,6 +302,11 @@ void stat_init_counter(RedStatCounter *counter, SpiceServer *reds,
                        const RedStatNode *parent, const char *name, int visible)
 {
     StatNodeRef parent_ref = parent ? parent->ref : INVALID_STAT_REF;
+
+    if (!reds->stat_file) {
+        counter->counter = NULL;
+        return;
+    }
     counter->counter =
         stat_file_add_counter(reds->stat_file, parent_ref, name, visible);
 }
@@ -308,7 +319,17 @@ void stat_remove_counter(SpiceServer *reds, RedStatCounter *counter)
     }
 }
 
-#endif
+static void reds_stat_file_init(RedsState *reds)
+{
+    reds->stat_file = stat_file_new(REDS_MAX_STAT_NODES);
+    if (!reds->stat_file) {
+        return;
+    }
+    /* Create an initial node. This will be the 0 node making easier
+     * to initialize node references.
+     */
+    stat_file_add_node(reds->stat_file, INVALID_STAT_REF, "default_channel", TRUE);
+}
 
 void reds_register_channel(RedsState *reds, RedChannel *channel)
 {
@@ -2768,6 +2789,15 @@ static int reds_init_ssl(RedsState *reds)
     }
 
     SSL_CTX_set_options(reds->ctx, ssl_options);
+    if (g_strcmp0(getenv(SPICE_KTLS_ENV), "1") == 0) {
+#ifdef SSL_OP_ENABLE_KTLS
+        /* OpenSSL falls back to user space encryption if the kernel or the
+         * negotiated cipher don't support it */
+        SSL_CTX_set_options(reds->ctx, SSL_OP_ENABLE_KTLS);
+#else
+        spice_warning("kernel TLS is not supported by this OpenSSL version");
+#endif
+    }
 #if HAVE_DECL_SSL_CTX_SET_ECDH_AUTO || defined(SSL_CTX_set_ecdh_auto)
     SSL_CTX_set_ecdh_auto(reds->ctx, 1);
 #endif
@@ -2822,9 +2852,9 @@ static int reds_init_ssl(RedsState *reds)
 
 static void reds_cleanup(RedsState *reds)
 {
-#ifdef RED_STATISTICS
-    stat_file_unlink(reds->stat_file);
-#endif
+    if (reds->stat_file) {
+        stat_file_unlink(reds->stat_file);
+    }
 }
 
 SPICE_DESTRUCTOR_FUNC(reds_exit)
@@ -3459,11 +3489,7 @@ SPICE_GNUC_VISIBLE SpiceServer *spice_server_new(void)
     reds->config->agent_file_xfer = TRUE;
     reds->config->exit_on_disconnect = FALSE;
 #ifdef RED_STATISTICS
-    reds->stat_file = stat_file_new(REDS_MAX_STAT_NODES);
-    /* Create an initial node. This will be the 0 node making easier
-     * to initialize node references.
-     */
-    stat_file_add_node(reds->stat_file, INVALID_STAT_REF, "default_channel", TRUE);
+    reds_stat_file_init(reds);
 #endif
     reds->listen_socket = -1;
     reds->secure_listen_socket = -1;
@@ -3744,9 +3770,7 @@ SPICE_GNUC_VISIBLE void spice_server_destroy(SpiceServer *reds)
     spice_buffer_free(&reds->client_monitors_config);
     red_record_unref(reds->record);
     reds_cleanup(reds);
-#ifdef RED_STATISTICS
     stat_file_free(reds->stat_file);
-#endif
 
     reds_config_free(reds->config);
     delete reds;
@@ -4068,6 +4092,23 @@ SPICE_GNUC_VISIBLE int spice_server_set_playback_compression(SpiceServer *reds,
     return 0;
 }
 
+SPICE_GNUC_VISIBLE int spice_server_set_statistics(SpiceServer *reds, int enable)
+{
+    if (enable && !reds->stat_file) {
+        /* objects registered their counters already */
+        if (reds->main_channel) {
+            spice_warning("statistics file must be created before spice_server_init");
+        } else {
+            reds_stat_file_init(reds);
+        }
+    }
+    stat_set_enabled(enable);
+    if (enable && !reds->stat_file) {
+        return -1;
+    }
+    return 0;
+}
+
 SPICE_GNUC_VISIBLE int spice_server_set_agent_mouse(SpiceServer *reds, int enable)
 {
     reds->config->agent_mouse = enable;
@@ -109,6 +109,7 @@ public:
     virtual bool config_socket() override;
     virtual uint8_t *alloc_recv_buf(uint16_t type, uint32_t size) override;
     virtual void release_recv_buf(uint16_t type, uint32_t size, uint8_t *msg) override;
+    virtual bool can_parse_in_place(uint16_t type, uint32_t size) override;
     virtual void migrate() override;
 
 private:
@@ -774,6 +775,13 @@ SndChannelClient::release_recv_buf(uint16_t type, uint32_t size, uint8_t *msg)
     }
 }
 
+bool
+SndChannelClient::can_parse_in_place(uint16_t type, uint32_t size)
+{
+    /* record data is copied to RecordChannelClient::samples */
+    return size <= sizeof(receive_buf);
+}
+
 static void snd_set_command(SndChannelClient *client, uint32_t command)
 {
     if (!client) {
@@ -18,6 +18,12 @@
 #include <config.h>
 
 #include <sys/stat.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) && !defined(WORDS_BIGENDIAN)
+#include <arm_neon.h>
+#define BITMAP_ROW_NEON
+#endif
 
 #include "spice-bitmap-utils.h"
 
@@ -307,3 +313,116 @@ write_err:
     remove(file_str);
 }
 #endif
+
+/* expand the 5 bits components to 8 bits, replicating the high bits */
+#define RGB16_R(pixel) ((((pixel) >> 7) & 0xf8) | (((pixel) >> 12) & 0x7))
+#define RGB16_G(pixel) ((((pixel) >> 2) & 0xf8) | (((pixel) >> 7) & 0x7))
+#define RGB16_B(pixel) ((((pixel) << 3) & 0xf8) | (((pixel) >> 2) & 0x7))
+
+static inline uint16_t get_16le(const uint8_t *ptr)
+{
+    return ptr[0] | (ptr[1] << 8);
+}
+
+void bitmap_row_rgb16_to_bgrx32(uint8_t *dest, const uint8_t *src, unsigned int width)
+{
+#if defined(__SSE2__)
+    const __m128i mask5 = _mm_set1_epi16(0x1f);
+    for (; width >= 8; width -= 8, src += 16, dest += 32) {
+        __m128i pixels = _mm_loadu_si128((const __m128i *) src);
+        __m128i r = _mm_and_si128(_mm_srli_epi16(pixels, 10), mask5);
+        __m128i g = _mm_and_si128(_mm_srli_epi16(pixels, 5), mask5);
+        __m128i b = _mm_and_si128(pixels, mask5);
+        r = _mm_or_si128(_mm_slli_epi16(r, 3), _mm_srli_epi16(r, 2));
+        g = _mm_or_si128(_mm_slli_epi16(g, 3), _mm_srli_epi16(g, 2));
+        b = _mm_or_si128(_mm_slli_epi16(b, 3), _mm_srli_epi16(b, 2));
+        // b | g << 8 and r | 0 << 8 interleaved give b, g, r, 0
+        __m128i bg = _mm_or_si128(b, _mm_slli_epi16(g, 8));
+        _mm_storeu_si128((__m128i *) dest, _mm_unpacklo_epi16(bg, r));
+        _mm_storeu_si128((__m128i *) (dest + 16), _mm_unpackhi_epi16(bg, r));
+    }
+#elif defined(BITMAP_ROW_NEON)
+    for (; width >= 8; width -= 8, src += 16, dest += 32) {
+        uint16x8_t pixels = vld1q_u16((const uint16_t *) src);
+        uint8x8x4_t out;
+        uint8x8_t r = vmovn_u16(vshrq_n_u16(pixels, 10));
+        uint8x8_t g = vmovn_u16(vshrq_n_u16(pixels, 5));
+        uint8x8_t b = vmovn_u16(pixels);
+        r = vshl_n_u8(r, 3);
+        g = vshl_n_u8(g, 3);
+        b = vshl_n_u8(b, 3);
+        out.val[0] = vorr_u8(b, vshr_n_u8(b, 5));
+        out.val[1] = vorr_u8(g, vshr_n_u8(g, 5));
+        out.val[2] = vorr_u8(r, vshr_n_u8(r, 5));
+        out.val[3] = vdup_n_u8(0);
+        vst4_u8(dest, out);
+    }
+#endif
+    for (; width; width--, src += 2, dest += 4) {
+        uint16_t pixel = get_16le(src);
+        dest[0] = RGB16_B(pixel);
+        dest[1] = RGB16_G(pixel);
+        dest[2] = RGB16_R(pixel);
+        dest[3] = 0;
+    }
+}
+
+void bitmap_row_rgb16_to_rgb24(uint8_t *dest, const uint8_t *src, unsigned int width)
+{
+#if defined(BITMAP_ROW_NEON)
+    for (; width >= 8; width -= 8, src += 16, dest += 24) {
+        uint16x8_t pixels = vld1q_u16((const uint16_t *) src);
+        uint8x8x3_t out;
+        uint8x8_t r = vshl_n_u8(vmovn_u16(vshrq_n_u16(pixels, 10)), 3);
+        uint8x8_t g = vshl_n_u8(vmovn_u16(vshrq_n_u16(pixels, 5)), 3);
+        uint8x8_t b = vshl_n_u8(vmovn_u16(pixels), 3);
+        out.val[0] = vorr_u8(r, vshr_n_u8(r, 5));
+        out.val[1] = vorr_u8(g, vshr_n_u8(g, 5));
+        out.val[2] = vorr_u8(b, vshr_n_u8(b, 5));
+        vst3_u8(dest, out);
+    }
+#endif
+    for (; width; width--, src += 2, dest += 3) {
+        uint16_t pixel = get_16le(src);
+        dest[0] = RGB16_R(pixel);
+        dest[1] = RGB16_G(pixel);
+        dest[2] = RGB16_B(pixel);
+    }
+}
+
+void bitmap_row_bgr24_to_rgb24(uint8_t *dest, const uint8_t *src, unsigned int width)
+{
+#if defined(BITMAP_ROW_NEON)
+    for (; width >= 16; width -= 16, src += 48, dest += 48) {
+        uint8x16x3_t pixels = vld3q_u8(src);
+        uint8x16_t b = pixels.val[0];
+        pixels.val[0] = pixels.val[2];
+        pixels.val[2] = b;
+        vst3q_u8(dest, pixels);
+    }
+#endif
+    for (; width; width--, src += 3, dest += 3) {
+        dest[0] = src[2];
+        dest[1] = src[1];
+        dest[2] = src[0];
+    }
+}
+
+void bitmap_row_bgrx32_to_rgb24(uint8_t *dest, const uint8_t *src, unsigned int width)
+{
+#if defined(BITMAP_ROW_NEON)
+    for (; width >= 16; width -= 16, src += 64, dest += 48) {
+        uint8x16x4_t pixels = vld4q_u8(src);
+        uint8x16x3_t out;
+        out.val[0] = pixels.val[2];
+        out.val[1] = pixels.val[1];
+        out.val[2] = pixels.val[0];
+        vst3q_u8(dest, out);
+    }
+#endif
+    for (; width; width--, src += 4, dest += 3) {
+        dest[0] = src[2];
+        dest[1] = src[1];
+        dest[2] = src[0];
+    }
+}
@@ -92,6 +92,24 @@ void dump_bitmap(SpiceBitmap *bitmap);
 
 int spice_bitmap_from_surface_type(uint32_t surface_format);
 
+/* Conversions of a row of @width pixels to the layouts taken by libjpeg.
+ * The 16 bits (x555) and 32 bits pixels are little endian, the output
+ * components are in memory order. */
+void bitmap_row_rgb16_to_bgrx32(uint8_t *dest, const uint8_t *src, unsigned int width);
+void bitmap_row_rgb16_to_rgb24(uint8_t *dest, const uint8_t *src, unsigned int width);
+void bitmap_row_bgr24_to_rgb24(uint8_t *dest, const uint8_t *src, unsigned int width);
+void bitmap_row_bgrx32_to_rgb24(uint8_t *dest, const uint8_t *src, unsigned int width);
+
+/* libjpeg color spaces of the little endian 32 and 24 bits pixels, only
+ * available with JCS_EXTENSIONS */
+#ifndef WORDS_BIGENDIAN
+#  define JCS_EXT_LE_BGRX JCS_EXT_BGRX
+#  define JCS_EXT_LE_BGR JCS_EXT_BGR
+#else
+#  define JCS_EXT_LE_BGRX JCS_EXT_XRGB
+#  define JCS_EXT_LE_BGR JCS_EXT_RGB
+#endif
+
 SPICE_END_DECLS
 
 #endif /* SPICE_BITMAP_UTILS_H_ */
@@ -155,6 +155,18 @@ const char *spice_server_get_video_codecs(SpiceServer *s);
  */
 void spice_server_free_video_codecs(SpiceServer *s, const char *video_codecs);
 int spice_server_set_playback_compression(SpiceServer *s, int enable);
+
+/**
+ * Enables or disables the collection of the statistics (timings with
+ * latency histograms, compression ratios) of the server.
+ * The first time they are enabled a shared memory file readable by
+ * reds_stat is created. This must be done before spice_server_init()
+ * so the counters of all the channels are published, later calls can
+ * only switch the collection on and off.
+ *
+ * Returns -1 if the statistics can't be published.
+ */
+int spice_server_set_statistics(SpiceServer *s, int enable);
 int spice_server_set_agent_mouse(SpiceServer *s, int enable);
 int spice_server_set_agent_copypaste(SpiceServer *s, int enable);
 int spice_server_set_agent_file_xfer(SpiceServer *s, int enable);
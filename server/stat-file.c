@@ -235,4 +235,47 @@ void stat_file_remove_counter(RedStatFile *stat_file, uint64_t *counter)
 {
     stat_file_remove(stat_file, SPICE_CONTAINEROF(counter, SpiceStatNode, value));
 }
+#else /* _WIN32 */
+#include <common/log.h>
+
+#include "stat-file.h"
+
+/* no shared memory, statistics are not published */
+RedStatFile *stat_file_new(unsigned int max_nodes)
+{
+    return NULL;
+}
+
+void stat_file_free(RedStatFile *stat_file)
+{
+}
+
+void stat_file_unlink(RedStatFile *file_stat)
+{
+}
+
+const char *stat_file_get_shm_name(RedStatFile *stat_file)
+{
+    return NULL;
+}
+
+StatNodeRef stat_file_add_node(RedStatFile *stat_file, StatNodeRef parent,
+                               const char *name, int visible)
+{
+    return INVALID_STAT_REF;
+}
+
+uint64_t *stat_file_add_counter(RedStatFile *stat_file, StatNodeRef parent,
+                                const char *name, int visible)
+{
+    return NULL;
+}
+
+void stat_file_remove_node(RedStatFile *stat_file, StatNodeRef ref)
+{
+}
+
+void stat_file_remove_counter(RedStatFile *stat_file, uint64_t *counter)
+{
+}
 #endif
@@ -0,0 +1,171 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2020 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#include <config.h>
+
+#include <string.h>
+
+#include "stat.h"
+
+#ifdef RED_STATISTICS
+int red_stat_enabled = 1;
+#else
+int red_stat_enabled = 0;
+#endif
+
+static const char *const stat_info_counter_names[STAT_INFO_N_COUNTERS] = {
+    [STAT_INFO_COUNTER_COUNT] = "count",
+    [STAT_INFO_COUNTER_TOTAL] = "total_ns",
+    [STAT_INFO_COUNTER_MAX] = "max_ns",
+    [STAT_INFO_COUNTER_P50] = "p50_ns",
+    [STAT_INFO_COUNTER_P99] = "p99_ns",
+    [STAT_INFO_COUNTER_ORIG_SIZE] = "orig_bytes",
+    [STAT_INFO_COUNTER_COMP_SIZE] = "comp_bytes",
+    [STAT_INFO_COUNTER_RATIO] = "ratio_percent",
+    [STAT_INFO_COUNTER_THROUGHPUT] = "orig_kbytes_per_sec",
+};
+
+static const char *const stat_value_counter_names[STAT_INFO_COUNTER_ORIG_SIZE] = {
+    [STAT_INFO_COUNTER_COUNT] = "count",
+    [STAT_INFO_COUNTER_TOTAL] = "total",
+    [STAT_INFO_COUNTER_MAX] = "max",
+    [STAT_INFO_COUNTER_P50] = "p50",
+    [STAT_INFO_COUNTER_P99] = "p99",
+};
+
+void stat_set_enabled(int enabled)
+{
+    g_atomic_int_set(&red_stat_enabled, !!enabled);
+}
+
+static unsigned int stat_histogram_bucket(stat_time_t time)
+{
+    unsigned int bucket;
+
+    if (time == 0) {
+        return 0;
+    }
+    bucket = 64 - __builtin_clzll(time);
+    return MIN(bucket, STAT_HISTOGRAM_BUCKETS - 1);
+}
+
+static void stat_info_update_counters(stat_info_t *info)
+{
+    RedStatCounter *counters = info->counters;
+
+    stat_set_counter(counters[STAT_INFO_COUNTER_COUNT], info->count);
+    stat_set_counter(counters[STAT_INFO_COUNTER_TOTAL], info->total);
+    stat_set_counter(counters[STAT_INFO_COUNTER_MAX], info->max);
+    stat_set_counter(counters[STAT_INFO_COUNTER_P50], stat_info_get_percentile(info, 50));
+    stat_set_counter(counters[STAT_INFO_COUNTER_P99], stat_info_get_percentile(info, 99));
+    if (!info->compress) {
+        return;
+    }
+    stat_set_counter(counters[STAT_INFO_COUNTER_ORIG_SIZE], info->orig_size);
+    stat_set_counter(counters[STAT_INFO_COUNTER_COMP_SIZE], info->comp_size);
+    stat_set_counter(counters[STAT_INFO_COUNTER_RATIO],
+                     info->orig_size ? info->comp_size * 100 / info->orig_size : 0);
+    /* bytes per ns to KB/s */
+    stat_set_counter(counters[STAT_INFO_COUNTER_THROUGHPUT],
+                     info->total ? info->orig_size * 1000 * 1000 / info->total : 0);
+}
+
+void stat_reset(stat_info_t *info)
+{
+    info->count = info->max = info->total = 0;
+    info->min = ~(stat_time_t)0;
+    info->orig_size = info->comp_size = 0;
+    memset(info->histogram, 0, sizeof(info->histogram));
+    stat_info_update_counters(info);
+}
+
+void stat_init(stat_info_t *info, const char *name, clockid_t clock)
+{
+    memset(info, 0, sizeof(*info));
+    info->name = name;
+    info->clock = clock;
+    info->node.ref = INVALID_STAT_REF;
+    stat_reset(info);
+}
+
+void stat_compress_init(stat_info_t *info, const char *name, clockid_t clock)
+{
+    stat_init(info, name, clock);
+    info->compress = TRUE;
+}
+
+void stat_value_init(stat_info_t *info, const char *name)
+{
+    stat_init(info, name, CLOCK_MONOTONIC);
+    info->values = TRUE;
+}
+
+void stat_info_add(stat_info_t *info, stat_time_t time,
+                   uint64_t orig_size, uint64_t comp_size)
+{
+    ++info->count;
+    info->total += time;
+    info->max = MAX(info->max, time);
+    info->min = MIN(info->min, time);
+    info->orig_size += orig_size;
+    info->comp_size += comp_size;
+    info->histogram[stat_histogram_bucket(time)]++;
+
+    if (info->node.ref != INVALID_STAT_REF) {
+        stat_info_update_counters(info);
+    }
+}
+
+stat_time_t stat_info_get_percentile(const stat_info_t *info, unsigned int percent)
+{
+    uint64_t target = ((uint64_t) info->count * percent + 99) / 100;
+    uint64_t seen = 0;
+    unsigned int bucket;
+
+    if (info->count == 0) {
+        return 0;
+    }
+    for (bucket = 0; bucket < STAT_HISTOGRAM_BUCKETS - 1; bucket++) {
+        seen += info->histogram[bucket];
+        if (seen >= target) {
+            break;
+        }
+    }
+    if (bucket == 0) {
+        return 0;
+    }
+    return MIN(((stat_time_t) 1 << bucket) - 1, info->max);
+}
+
+void stat_info_publish(stat_info_t *info, SpiceServer *reds, const RedStatNode *parent)
+{
+    int i;
+
+    stat_init_node(&info->node, reds, parent, info->name, TRUE);
+    if (info->node.ref == INVALID_STAT_REF) {
+        return;
+    }
+    for (i = 0; i < STAT_INFO_N_COUNTERS; i++) {
+        if (i >= STAT_INFO_COUNTER_ORIG_SIZE && !info->compress) {
+            break;
+        }
+        stat_init_counter(&info->counters[i], reds, &info->node,
+                          info->values ? stat_value_counter_names[i] :
+                                         stat_info_counter_names[i], TRUE);
+    }
+    stat_info_update_counters(info);
+}
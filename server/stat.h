@@ -27,20 +27,15 @@
 SPICE_BEGIN_DECLS
 
 typedef struct {
-#ifdef RED_STATISTICS
     uint64_t *counter;
-#endif
-    uint8_t dummy_empty_field[0]; /* C/C++ compatibility */
 } RedStatCounter;
 
 typedef struct {
-#ifdef RED_STATISTICS
     uint32_t ref;
-#endif
-    uint8_t dummy_empty_field[0]; /* C/C++ compatibility */
 } RedStatNode;
 
-#ifdef RED_STATISTICS
+/* Nodes and counters are published in the statistics file of @reds,
+ * if any, see spice_server_set_statistics() */
 void stat_init_node(RedStatNode *node, SpiceServer *reds,
                     const RedStatNode *parent, const char *name, int visible);
 void stat_remove_node(SpiceServer *reds, RedStatNode *node);
@@ -48,40 +43,32 @@ void stat_init_counter(RedStatCounter *counter, SpiceServer *reds,
                        const RedStatNode *parent, const char *name, int visible);
 void stat_remove_counter(SpiceServer *reds, RedStatCounter *counter);
 
-#else
-
 static inline void
-stat_init_node(RedStatNode *node, SpiceServer *reds,
-               const RedStatNode *parent, const char *name, int visible)
+stat_inc_counter(RedStatCounter counter, uint64_t value)
 {
+    if (counter.counter) {
+        *(counter.counter) += value;
+    }
 }
 
 static inline void
-stat_remove_node(SpiceServer *reds, RedStatNode *node)
+stat_set_counter(RedStatCounter counter, uint64_t value)
 {
+    if (counter.counter) {
+        *(counter.counter) = value;
+    }
 }
 
-static inline void
-stat_init_counter(RedStatCounter *counter, SpiceServer *reds,
-                  const RedStatNode *parent, const char *name, int visible)
-{
-}
+/* Timing statistics are collected only while enabled at runtime, unless
+ * RED_WORKER_STAT or COMPRESS_STAT force them at build time */
+extern int red_stat_enabled;
 
-static inline void
-stat_remove_counter(SpiceServer *reds, RedStatCounter *counter)
+static inline int stat_is_enabled(void)
 {
+    return g_atomic_int_get(&red_stat_enabled);
 }
-#endif /* RED_STATISTICS */
 
-static inline void
-stat_inc_counter(RedStatCounter counter, uint64_t value)
-{
-#ifdef RED_STATISTICS
-    if (counter.counter) {
-        *(counter.counter) += value;
-    }
-#endif
-}
+void stat_set_enabled(int enabled);
 
 typedef uint64_t stat_time_t;
 
@@ -94,87 +81,88 @@ static inline stat_time_t stat_now(clockid_t clock_id)
 }
 
 typedef struct {
-#if defined(RED_WORKER_STAT) || defined(COMPRESS_STAT)
+    /* 0 if the statistics were disabled when the operation started */
     stat_time_t time;
-#endif
-    uint8_t dummy_empty_field[0]; /* C/C++ compatibility */
 } stat_start_time_t;
 
-#if defined(RED_WORKER_STAT) || defined(COMPRESS_STAT)
 static inline double stat_cpu_time_to_sec(stat_time_t time)
 {
     return (double)time / (1000 * 1000 * 1000);
 }
-#endif
 
+/* Durations are counted in log2 buckets of nanoseconds, the bucket n
+ * holds the durations in [2^(n-1), 2^n) */
+#define STAT_HISTOGRAM_BUCKETS 48
+
+typedef enum {
+    STAT_INFO_COUNTER_COUNT,
+    STAT_INFO_COUNTER_TOTAL,
+    STAT_INFO_COUNTER_MAX,
+    STAT_INFO_COUNTER_P50,
+    STAT_INFO_COUNTER_P99,
+    /* compression only */
+    STAT_INFO_COUNTER_ORIG_SIZE,
+    STAT_INFO_COUNTER_COMP_SIZE,
+    STAT_INFO_COUNTER_RATIO,
+    STAT_INFO_COUNTER_THROUGHPUT,
+
+    STAT_INFO_N_COUNTERS
+} StatInfoCounter;
+
+/* Each stat_info_t is updated by a single thread */
 typedef struct {
-#if defined(RED_WORKER_STAT) || defined(COMPRESS_STAT)
     const char *name;
     clockid_t clock;
+    int compress;
+    /* values which are not durations, see stat_value_init() */
+    int values;
     uint32_t count;
     stat_time_t max;
     stat_time_t min;
     stat_time_t total;
-#ifdef COMPRESS_STAT
     uint64_t orig_size;
     uint64_t comp_size;
-#endif
-#endif
-    uint8_t dummy_empty_field[0]; /* C/C++ compatibility */
+    uint32_t histogram[STAT_HISTOGRAM_BUCKETS];
+
+    /* see stat_info_publish() */
+    RedStatNode node;
+    RedStatCounter counters[STAT_INFO_N_COUNTERS];
 } stat_info_t;
 
-static inline void stat_start_time_init(G_GNUC_UNUSED stat_start_time_t *tm,
-                                        G_GNUC_UNUSED const stat_info_t *info)
+void stat_reset(stat_info_t *info);
+void stat_init(stat_info_t *info, const char *name, clockid_t clock);
+void stat_compress_init(stat_info_t *info, const char *name, clockid_t clock);
+/* Track values other than durations, like queue lengths, with
+ * stat_info_add(). Their counters are named without unit. */
+void stat_value_init(stat_info_t *info, const char *name);
+/* Account an operation which took @time and compressed @orig_size bytes
+ * into @comp_size bytes */
+void stat_info_add(stat_info_t *info, stat_time_t time,
+                   uint64_t orig_size, uint64_t comp_size);
+/* Upper bound of the duration of @percent % of the operations */
+stat_time_t stat_info_get_percentile(const stat_info_t *info, unsigned int percent);
+/* Publish @info as a node named after it under @parent, its counters are
+ * then updated as the operations are accounted */
+void stat_info_publish(stat_info_t *info, SpiceServer *reds, const RedStatNode *parent);
+
+static inline void stat_start_time_init(stat_start_time_t *tm, const stat_info_t *info)
 {
 #if defined(RED_WORKER_STAT) || defined(COMPRESS_STAT)
     tm->time = stat_now(info->clock);
+#else
+    tm->time = stat_is_enabled() ? stat_now(info->clock) : 0;
 #endif
 }
 
-static inline void stat_reset(G_GNUC_UNUSED stat_info_t *info)
-{
-#if defined(RED_WORKER_STAT) || defined(COMPRESS_STAT)
-    info->count = info->max = info->total = 0;
-    info->min = ~(stat_time_t)0;
-#ifdef COMPRESS_STAT
-    info->orig_size = info->comp_size = 0;
-#endif
-#endif
-}
-
-static inline void stat_init(G_GNUC_UNUSED stat_info_t *info,
-                             G_GNUC_UNUSED const char *name,
-                             G_GNUC_UNUSED clockid_t clock)
-{
-#if defined(RED_WORKER_STAT) || defined(COMPRESS_STAT)
-    info->name = name;
-    info->clock = clock;
-    stat_reset(info);
-#endif
-}
-
-static inline void stat_compress_init(G_GNUC_UNUSED stat_info_t *info,
-                                      G_GNUC_UNUSED const char *name,
-                                      G_GNUC_UNUSED clockid_t clock)
-{
-    stat_init(info, name, clock);
-}
-
-static inline void stat_compress_add(G_GNUC_UNUSED stat_info_t *info,
-                                     G_GNUC_UNUSED stat_start_time_t start,
-                                     G_GNUC_UNUSED int orig_size,
-                                     G_GNUC_UNUSED int comp_size)
+static inline void stat_compress_add(stat_info_t *info, stat_start_time_t start,
+                                     int orig_size, int comp_size)
 {
-#ifdef COMPRESS_STAT
-    stat_time_t time;
-    ++info->count;
-    time = stat_now(info->clock) - start.time;
-    info->total += time;
-    info->max = MAX(info->max, time);
-    info->min = MIN(info->min, time);
-    info->orig_size += orig_size;
-    info->comp_size += comp_size;
+#ifndef COMPRESS_STAT
+    if (!start.time || !stat_is_enabled()) {
+        return;
+    }
 #endif
+    stat_info_add(info, stat_now(info->clock) - start.time, orig_size, comp_size);
 }
 
 static inline double stat_byte_to_mega(uint64_t size)
@@ -182,17 +170,14 @@ static inline double stat_byte_to_mega(uint64_t size)
     return (double)size / (1000 * 1000);
 }
 
-static inline void stat_add(G_GNUC_UNUSED stat_info_t *info,
-                            G_GNUC_UNUSED stat_start_time_t start)
+static inline void stat_add(stat_info_t *info, stat_start_time_t start)
 {
-#ifdef RED_WORKER_STAT
-    stat_time_t time;
-    ++info->count;
-    time = stat_now(info->clock) - start.time;
-    info->total += time;
-    info->max = MAX(info->max, time);
-    info->min = MIN(info->min, time);
+#ifndef RED_WORKER_STAT
+    if (!start.time || !stat_is_enabled()) {
+        return;
+    }
 #endif
+    stat_info_add(info, stat_now(info->clock) - start.time, 0, 0);
 }
 
 SPICE_END_DECLS
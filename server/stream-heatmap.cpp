@@ -0,0 +1,181 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2020 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#include <config.h>
+
+#include <string.h>
+#include <glib.h>
+
+#include "stream-heatmap.h"
+
+#define CELL_SIZE (1u << STREAM_HEATMAP_CELL_SHIFT)
+
+void stream_heatmap_init(StreamHeatmap *heatmap, uint32_t width, uint32_t height,
+                         red_time_t max_delta)
+{
+    heatmap->width = width;
+    heatmap->height = height;
+    heatmap->cells_x = (width + CELL_SIZE - 1) >> STREAM_HEATMAP_CELL_SHIFT;
+    heatmap->cells_y = (height + CELL_SIZE - 1) >> STREAM_HEATMAP_CELL_SHIFT;
+    heatmap->max_delta = max_delta;
+    heatmap->cells = g_new0(StreamHeatmapCell, heatmap->cells_x * heatmap->cells_y);
+    heatmap->stack = g_new(uint32_t, heatmap->cells_x * heatmap->cells_y);
+    heatmap->mark = 0;
+}
+
+void stream_heatmap_destroy(StreamHeatmap *heatmap)
+{
+    g_free(heatmap->cells);
+    g_free(heatmap->stack);
+    heatmap->cells = NULL;
+    heatmap->stack = NULL;
+    heatmap->cells_x = heatmap->cells_y = 0;
+    heatmap->width = heatmap->height = 0;
+}
+
+void stream_heatmap_clear(StreamHeatmap *heatmap)
+{
+    memset(heatmap->cells, 0, sizeof(StreamHeatmapCell) * heatmap->cells_x * heatmap->cells_y);
+    heatmap->mark = 0;
+}
+
+/* compute the range of cells touched by @rect, returns FALSE if none */
+static bool stream_heatmap_get_cells(const StreamHeatmap *heatmap, const SpiceRect *rect,
+                                     uint32_t *x1, uint32_t *y1, uint32_t *x2, uint32_t *y2)
+{
+    int64_t left = MAX(rect->left, 0);
+    int64_t top = MAX(rect->top, 0);
+    int64_t right = MIN((int64_t) rect->right, (int64_t) heatmap->width);
+    int64_t bottom = MIN((int64_t) rect->bottom, (int64_t) heatmap->height);
+
+    if (left >= right || top >= bottom) {
+        return FALSE;
+    }
+    *x1 = left >> STREAM_HEATMAP_CELL_SHIFT;
+    *y1 = top >> STREAM_HEATMAP_CELL_SHIFT;
+    *x2 = (right - 1) >> STREAM_HEATMAP_CELL_SHIFT;
+    *y2 = (bottom - 1) >> STREAM_HEATMAP_CELL_SHIFT;
+    return TRUE;
+}
+
+void stream_heatmap_update(StreamHeatmap *heatmap, const SpiceRect *rect, red_time_t time)
+{
+    uint32_t x1, y1, x2, y2;
+
+    if (!stream_heatmap_get_cells(heatmap, rect, &x1, &y1, &x2, &y2)) {
+        return;
+    }
+    for (uint32_t y = y1; y <= y2; y++) {
+        StreamHeatmapCell *row = heatmap->cells + y * heatmap->cells_x;
+        for (uint32_t x = x1; x <= x2; x++) {
+            StreamHeatmapCell *cell = &row[x];
+
+            if (cell->frames == 0 || time - cell->last_time > heatmap->max_delta) {
+                cell->frames = 1;
+                cell->first_frame_time = cell->frame_time = time;
+            } else if (time - cell->frame_time >= STREAM_HEATMAP_FRAME_DELTA) {
+                cell->frames++;
+                cell->frame_time = time;
+            }
+            cell->last_time = time;
+        }
+    }
+}
+
+static inline bool cell_is_hot(const StreamHeatmap *heatmap, const StreamHeatmapCell *cell,
+                               red_time_t now, uint32_t min_frames)
+{
+    return cell->frames >= min_frames && now - cell->last_time <= heatmap->max_delta;
+}
+
+bool stream_heatmap_get_hot_area(StreamHeatmap *heatmap, const SpiceRect *rect,
+                                 red_time_t now, uint32_t min_frames,
+                                 SpiceRect *area, uint32_t *frames,
+                                 red_time_t *first_frame_time)
+{
+    uint32_t x1, y1, x2, y2;
+    uint32_t n_stack = 0;
+
+    if (!stream_heatmap_get_cells(heatmap, rect, &x1, &y1, &x2, &y2)) {
+        return FALSE;
+    }
+
+    if (++heatmap->mark == 0) {
+        for (uint32_t i = 0; i < heatmap->cells_x * heatmap->cells_y; i++) {
+            heatmap->cells[i].mark = 0;
+        }
+        heatmap->mark = 1;
+    }
+
+    *frames = UINT32_MAX;
+    *first_frame_time = 0;
+    for (uint32_t y = y1; y <= y2; y++) {
+        StreamHeatmapCell *row = heatmap->cells + y * heatmap->cells_x;
+        for (uint32_t x = x1; x <= x2; x++) {
+            StreamHeatmapCell *cell = &row[x];
+
+            if (!cell_is_hot(heatmap, cell, now, min_frames)) {
+                return FALSE;
+            }
+            *frames = MIN(*frames, cell->frames);
+            *first_frame_time = MAX(*first_frame_time, cell->first_frame_time);
+            cell->mark = heatmap->mark;
+            heatmap->stack[n_stack++] = y * heatmap->cells_x + x;
+        }
+    }
+
+    /* grow the area to the hot cells around */
+    while (n_stack) {
+        uint32_t index = heatmap->stack[--n_stack];
+        uint32_t x = index % heatmap->cells_x;
+        uint32_t y = index / heatmap->cells_x;
+        uint32_t neighbours[4];
+        int n_neighbours = 0;
+
+        x1 = MIN(x1, x);
+        y1 = MIN(y1, y);
+        x2 = MAX(x2, x);
+        y2 = MAX(y2, y);
+
+        if (x > 0) {
+            neighbours[n_neighbours++] = index - 1;
+        }
+        if (x + 1 < heatmap->cells_x) {
+            neighbours[n_neighbours++] = index + 1;
+        }
+        if (y > 0) {
+            neighbours[n_neighbours++] = index - heatmap->cells_x;
+        }
+        if (y + 1 < heatmap->cells_y) {
+            neighbours[n_neighbours++] = index + heatmap->cells_x;
+        }
+        for (int i = 0; i < n_neighbours; i++) {
+            StreamHeatmapCell *cell = &heatmap->cells[neighbours[i]];
+
+            if (cell->mark != heatmap->mark && cell_is_hot(heatmap, cell, now, min_frames)) {
+                cell->mark = heatmap->mark;
+                heatmap->stack[n_stack++] = neighbours[i];
+            }
+        }
+    }
+
+    area->left = x1 << STREAM_HEATMAP_CELL_SHIFT;
+    area->top = y1 << STREAM_HEATMAP_CELL_SHIFT;
+    area->right = MIN((x2 + 1) << STREAM_HEATMAP_CELL_SHIFT, heatmap->width);
+    area->bottom = MIN((y2 + 1) << STREAM_HEATMAP_CELL_SHIFT, heatmap->height);
+    return TRUE;
+}
@@ -0,0 +1,78 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2020 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef STREAM_HEATMAP_H_
+#define STREAM_HEATMAP_H_
+
+#include <stdint.h>
+#include <common/draw.h>
+
+#include "utils.h"
+
+SPICE_BEGIN_DECLS
+
+/* Size of a heatmap cell, in pixels, as power of 2 */
+#define STREAM_HEATMAP_CELL_SHIFT 5
+/* updates of a cell closer than that are parts of the same frame */
+#define STREAM_HEATMAP_FRAME_DELTA (NSEC_PER_SEC / 60)
+
+typedef struct StreamHeatmapCell {
+    red_time_t first_frame_time; /* start of the sequence of frames */
+    red_time_t frame_time;       /* start of the last frame */
+    red_time_t last_time;        /* last update */
+    uint32_t frames;
+    uint32_t mark;
+} StreamHeatmapCell;
+
+/* A coarse grid over a surface counting, for each cell, the successive
+ * frames which updated it. A sequence of frames ends when a cell is not
+ * updated for more than @max_delta.
+ *
+ * Unlike the trace of drawables, the geometry of the updates doesn't matter:
+ * a video painted in tiles of changing size, or with several drawables per
+ * frame, still heats the same cells.
+ */
+typedef struct StreamHeatmap {
+    uint32_t width;     /* surface width, in pixels */
+    uint32_t height;    /* surface height, in pixels */
+    uint32_t cells_x;
+    uint32_t cells_y;
+    red_time_t max_delta;
+    StreamHeatmapCell *cells;
+    /* used to find the hot area around a rectangle */
+    uint32_t *stack;
+    uint32_t mark;
+} StreamHeatmap;
+
+void stream_heatmap_init(StreamHeatmap *heatmap, uint32_t width, uint32_t height,
+                         red_time_t max_delta);
+void stream_heatmap_destroy(StreamHeatmap *heatmap);
+void stream_heatmap_clear(StreamHeatmap *heatmap);
+void stream_heatmap_update(StreamHeatmap *heatmap, const SpiceRect *rect, red_time_t time);
+/* Returns TRUE if all the cells of @rect had at least @min_frames frames.
+ * In this case @area is set to the bounding box of the hot cells connected
+ * to @rect, @frames and @first_frame_time describe the sequence of frames
+ * of @rect. */
+bool stream_heatmap_get_hot_area(StreamHeatmap *heatmap, const SpiceRect *rect,
+                                 red_time_t now, uint32_t min_frames,
+                                 SpiceRect *area, uint32_t *frames,
+                                 red_time_t *first_frame_time);
+
+SPICE_END_DECLS
+
+#endif /* STREAM_HEATMAP_H_ */
@@ -0,0 +1,151 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2020 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#include <config.h>
+
+#include <glib.h>
+#include <common/log.h>
+
+#include "surface-grid.h"
+
+#define CELL_SIZE (1u << SURFACE_GRID_CELL_SHIFT)
+
+void surface_grid_init(SurfaceGrid *grid, uint32_t width, uint32_t height)
+{
+    grid->width = width;
+    grid->height = height;
+    grid->cells_x = (width + CELL_SIZE - 1) >> SURFACE_GRID_CELL_SHIFT;
+    grid->cells_y = (height + CELL_SIZE - 1) >> SURFACE_GRID_CELL_SHIFT;
+    grid->cells = g_new0(GPtrArray *, grid->cells_x * grid->cells_y);
+    grid->stamp = 0;
+}
+
+void surface_grid_destroy(SurfaceGrid *grid)
+{
+    for (uint32_t i = 0; i < grid->cells_x * grid->cells_y; i++) {
+        if (grid->cells[i]) {
+            g_ptr_array_free(grid->cells[i], TRUE);
+        }
+    }
+    g_free(grid->cells);
+    grid->cells = NULL;
+    grid->cells_x = grid->cells_y = 0;
+    grid->width = grid->height = 0;
+}
+
+/* compute the range of cells touched by @rect, returns FALSE if none */
+static bool surface_grid_get_cells(const SurfaceGrid *grid, const SpiceRect *rect,
+                                   uint32_t *x1, uint32_t *y1, uint32_t *x2, uint32_t *y2)
+{
+    if (rect->left >= rect->right || rect->top >= rect->bottom || !grid->cells_x || !grid->cells_y) {
+        return FALSE;
+    }
+    /* the parts outside the surface go to the cells at its border */
+    *x1 = CLAMP((int64_t) rect->left, 0, (int64_t) grid->width - 1) >> SURFACE_GRID_CELL_SHIFT;
+    *y1 = CLAMP((int64_t) rect->top, 0, (int64_t) grid->height - 1) >> SURFACE_GRID_CELL_SHIFT;
+    *x2 = CLAMP((int64_t) rect->right - 1, 0, (int64_t) grid->width - 1) >> SURFACE_GRID_CELL_SHIFT;
+    *y2 = CLAMP((int64_t) rect->bottom - 1, 0, (int64_t) grid->height - 1) >> SURFACE_GRID_CELL_SHIFT;
+    return TRUE;
+}
+
+void surface_grid_add(SurfaceGrid *grid, SurfaceGridItem *item, const SpiceRect *rect)
+{
+    uint32_t x1, y1, x2, y2;
+
+    item->grid = grid;
+    item->rect = *rect;
+    item->stamp = grid->stamp;
+    if (!surface_grid_get_cells(grid, rect, &x1, &y1, &x2, &y2)) {
+        return;
+    }
+    for (uint32_t y = y1; y <= y2; y++) {
+        GPtrArray **row = grid->cells + y * grid->cells_x;
+        for (uint32_t x = x1; x <= x2; x++) {
+            if (!row[x]) {
+                row[x] = g_ptr_array_new();
+            }
+            g_ptr_array_add(row[x], item);
+        }
+    }
+}
+
+void surface_grid_remove(SurfaceGridItem *item)
+{
+    SurfaceGrid *grid = item->grid;
+    uint32_t x1, y1, x2, y2;
+
+    if (!grid) {
+        return;
+    }
+    item->grid = NULL;
+    if (!surface_grid_get_cells(grid, &item->rect, &x1, &y1, &x2, &y2)) {
+        return;
+    }
+    for (uint32_t y = y1; y <= y2; y++) {
+        GPtrArray **row = grid->cells + y * grid->cells_x;
+        for (uint32_t x = x1; x <= x2; x++) {
+            bool removed = row[x] && g_ptr_array_remove_fast(row[x], item);
+            spice_warn_if_fail(removed);
+        }
+    }
+}
+
+bool surface_grid_intersects(const SurfaceGrid *grid, const SpiceRect *rect)
+{
+    uint32_t x1, y1, x2, y2;
+
+    if (!surface_grid_get_cells(grid, rect, &x1, &y1, &x2, &y2)) {
+        return FALSE;
+    }
+    for (uint32_t y = y1; y <= y2; y++) {
+        GPtrArray * const *row = grid->cells + y * grid->cells_x;
+        for (uint32_t x = x1; x <= x2; x++) {
+            if (row[x] && row[x]->len) {
+                return TRUE;
+            }
+        }
+    }
+    return FALSE;
+}
+
+void surface_grid_foreach(SurfaceGrid *grid, const SpiceRect *rect,
+                          SurfaceGridFunc func, void *opaque)
+{
+    uint32_t x1, y1, x2, y2;
+
+    if (!surface_grid_get_cells(grid, rect, &x1, &y1, &x2, &y2)) {
+        return;
+    }
+    /* items touching several cells are reported in the first one */
+    grid->stamp++;
+    for (uint32_t y = y1; y <= y2; y++) {
+        GPtrArray **row = grid->cells + y * grid->cells_x;
+        for (uint32_t x = x1; x <= x2; x++) {
+            if (!row[x]) {
+                continue;
+            }
+            for (guint i = 0; i < row[x]->len; i++) {
+                SurfaceGridItem *item = (SurfaceGridItem *) g_ptr_array_index(row[x], i);
+
+                if (item->stamp != grid->stamp) {
+                    item->stamp = grid->stamp;
+                    func(item, opaque);
+                }
+            }
+        }
+    }
+}
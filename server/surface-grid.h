@@ -0,0 +1,80 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2020 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef SURFACE_GRID_H_
+#define SURFACE_GRID_H_
+
+#include <stdint.h>
+#include <glib.h>
+#include <common/draw.h>
+
+SPICE_BEGIN_DECLS
+
+/* Size of a grid cell, in pixels, as power of 2 */
+#define SURFACE_GRID_CELL_SHIFT 6
+
+typedef struct SurfaceGrid SurfaceGrid;
+
+/* Entry of an item in a SurfaceGrid, embedded in the item */
+typedef struct SurfaceGridItem {
+    /* grid the item was added to, if any */
+    SurfaceGrid *grid;
+    /* rectangle the item was added with */
+    SpiceRect rect;
+    /* last lookup which reported the item */
+    uint64_t stamp;
+} SurfaceGridItem;
+
+/* A uniform grid over a surface listing, for each cell, the items of the
+ * surface tree with a bounding box touching the cell, so that lookups only
+ * visit the items near an area.
+ *
+ * The index is conservative: items are registered with a bounding box that
+ * contains their region for all their life (regions of tree items only
+ * shrink), so all the items intersecting an area are reported by a lookup
+ * while a reported item may not intersect it. Areas outside the surface are
+ * accounted to the cells at its border.
+ */
+struct SurfaceGrid {
+    uint32_t width;     /* surface width, in pixels */
+    uint32_t height;    /* surface height, in pixels */
+    uint32_t cells_x;
+    uint32_t cells_y;
+    /* items of each cell, allocated when the first item is added */
+    GPtrArray **cells;
+    /* incremented at each lookup to report the items once */
+    uint64_t stamp;
+};
+
+typedef void (*SurfaceGridFunc)(SurfaceGridItem *item, void *opaque);
+
+void surface_grid_init(SurfaceGrid *grid, uint32_t width, uint32_t height);
+void surface_grid_destroy(SurfaceGrid *grid);
+void surface_grid_add(SurfaceGrid *grid, SurfaceGridItem *item, const SpiceRect *rect);
+/* Removes @item from the grid it was added to, if any */
+void surface_grid_remove(SurfaceGridItem *item);
+/* Returns FALSE if no item can intersect @rect */
+bool surface_grid_intersects(const SurfaceGrid *grid, const SpiceRect *rect);
+/* Calls @func once for each item which may intersect @rect, in no
+ * particular order. @func must not add or remove items */
+void surface_grid_foreach(SurfaceGrid *grid, const SpiceRect *rect,
+                          SurfaceGridFunc func, void *opaque);
+
+SPICE_END_DECLS
+
+#endif /* SURFACE_GRID_H_ */
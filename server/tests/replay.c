@@ -17,6 +17,13 @@
 */
 
 /* Replay a previously recorded file (via SPICE_WORKER_RECORD_FILENAME)
+ *
+ * With --benchmark the file is replayed as fast as possible and the
+ * throughput and the server statistics (worker CPU time, per codec bytes
+ * and time, pipe depth...) are written as JSON. Use --sink to have an
+ * in-process client drain the display channel, so the images are also
+ * encoded and sent. Streaming defaults to off in this mode so that runs
+ * of the same file are comparable.
  */
 
 #include <config.h>
@@ -30,14 +37,21 @@
 #include <pthread.h>
 #ifndef _WIN32
 #include <sys/wait.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #endif
 #include <fcntl.h>
+#include <inttypes.h>
 #include <glib.h>
 #include <pthread.h>
 
 #include <spice/macros.h>
+#include <spice/stats.h>
 #include "test-display-base.h"
 #include "test-glib-compat.h"
+#ifndef _WIN32
+#include "sink-client.h"
+#endif
 #include <common/log.h>
 
 static SpiceCoreInterface *core;
@@ -48,7 +62,12 @@ static QXLInstance display_sin;
 static gint slow = 0;
 static gint skip = 0;
 static gboolean print_count = FALSE;
+static gboolean benchmark_mode = FALSE;
+/* the end markers were queued */
+static gboolean replay_ended = FALSE;
+static int exit_status = 0;
 static guint ncommands = 0;
+static gint64 start_time = 0;
 static GPid client_pid;
 static GMainLoop *loop = NULL;
 static GAsyncQueue *display_queue = NULL;
@@ -58,6 +77,10 @@ static long total_size;
 static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
 static GSource *fill_source = NULL;
 
+static GMutex flush_lock;
+static GCond flush_cond;
+static gboolean flushed = FALSE;
+
 
 #define MEM_SLOT_GROUP_ID 0
 
@@ -108,16 +131,20 @@ static gboolean fill_queue_idle(gpointer user_data)
     gboolean keep = FALSE;
     gboolean wakeup = FALSE;
 
-    while ((g_async_queue_length(display_queue) +
+    while (!replay_ended &&
+           (g_async_queue_length(display_queue) +
             g_async_queue_length(cursor_queue)) < 50) {
         QXLCommandExt *cmd = spice_replay_next_cmd(replay, &display_sin);
         if (!cmd) {
             g_async_queue_push(display_queue, GINT_TO_POINTER(-1));
             g_async_queue_push(cursor_queue, GINT_TO_POINTER(-1));
+            replay_ended = TRUE;
             break;
         }
 
-        ++ncommands;
+        if (++ncommands == 1) {
+            start_time = g_get_monotonic_time();
+        }
 
         if (slow && (ncommands > skip)) {
             g_usleep(slow);
@@ -173,7 +200,11 @@ static int get_command_from(QXLInstance *qin, QXLCommandExt *ext, GAsyncQueue *q
 
     cmd = (QXLCommandExt*) g_async_queue_try_pop(queue);
     if (GPOINTER_TO_INT(cmd) == -1) {
-        g_main_loop_quit(loop);
+        /* the benchmark covers all the display commands, the cursor
+         * queue ends first */
+        if (!benchmark_mode || queue == display_queue) {
+            g_main_loop_quit(loop);
+        }
         return FALSE;
     }
 
@@ -243,6 +274,27 @@ static int flush_resources(QXLInstance *qin)
     return TRUE;
 }
 
+// called from red_worker thread
+static void async_complete(QXLInstance *qin, uint64_t cookie)
+{
+    g_mutex_lock(&flush_lock);
+    flushed = TRUE;
+    g_cond_signal(&flush_cond);
+    g_mutex_unlock(&flush_lock);
+}
+
+/* wait for the worker to process and draw all the commands it fetched */
+static void flush_worker(void)
+{
+    spice_qxl_flush_surfaces_async(&display_sin, 0);
+
+    g_mutex_lock(&flush_lock);
+    while (!flushed) {
+        g_cond_wait(&flush_cond, &flush_lock);
+    }
+    g_mutex_unlock(&flush_lock);
+}
+
 static QXLInterface display_sif = {
     .base = {
         .type = SPICE_INTERFACE_QXL,
@@ -261,6 +313,7 @@ static QXLInterface display_sif = {
     .req_cursor_notification = req_cursor_notification,
     .notify_update = notify_update,
     .flush_resources = flush_resources,
+    .async_complete = async_complete,
 };
 
 static void replay_channel_event(int event, SpiceChannelEventInfo *info)
@@ -271,6 +324,15 @@ static void replay_channel_event(int event, SpiceChannelEventInfo *info)
     }
 }
 
+#ifndef _WIN32
+static void sink_client_error(gpointer opaque)
+{
+    g_printerr("sink client failed to link or was disconnected\n");
+    exit_status = 1;
+    g_main_loop_quit(loop);
+}
+#endif
+
 static gboolean start_client(gchar *cmd, GError **error)
 {
     gboolean retval;
@@ -298,6 +360,107 @@ static gboolean progress_timer(gpointer user_data)
     return TRUE;
 }
 
+static void print_json_string(FILE *out, const char *str)
+{
+    fputc('"', out);
+    for (; *str; str++) {
+        if (*str == '"' || *str == '\\') {
+            fprintf(out, "\\%c", *str);
+        } else if ((unsigned char) *str < 0x20) {
+            fprintf(out, "\\u%04x", (unsigned char) *str);
+        } else {
+            fputc(*str, out);
+        }
+    }
+    fputc('"', out);
+}
+
+#ifndef _WIN32
+static void print_stat_nodes(FILE *out, const SpiceStatNode *nodes, uint32_t max_nodes,
+                             uint32_t index, int depth)
+{
+    gboolean first = TRUE;
+
+    for (; index < max_nodes; index = nodes[index].next_sibling_index) {
+        const SpiceStatNode *node = &nodes[index];
+
+        if (!(node->flags & SPICE_STAT_NODE_FLAG_ENABLED)) {
+            continue;
+        }
+        fprintf(out, "%s\n%*s", first ? "" : ",", (depth + 1) * 2, "");
+        first = FALSE;
+        print_json_string(out, node->name);
+        if (node->flags & SPICE_STAT_NODE_FLAG_VALUE) {
+            fprintf(out, ": %" PRIu64, node->value);
+        } else {
+            fprintf(out, ": {");
+            print_stat_nodes(out, nodes, max_nodes, node->first_child_index, depth + 1);
+            fprintf(out, "\n%*s}", (depth + 1) * 2, "");
+        }
+    }
+}
+
+/* dump the statistics file of this process, see spice_server_set_statistics() */
+static void print_stats(FILE *out)
+{
+    gchar *name = g_strdup_printf(SPICE_STAT_SHM_NAME, getpid());
+    SpiceStat *reds_stat = (SpiceStat *) MAP_FAILED;
+    struct stat st;
+    int fd;
+
+    fd = shm_open(name, O_RDONLY, 0444);
+    g_free(name);
+    if (fd >= 0 && fstat(fd, &st) == 0 && st.st_size >= (off_t) sizeof(SpiceStat)) {
+        reds_stat = (SpiceStat *) mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    if (reds_stat == (SpiceStat *) MAP_FAILED || reds_stat->magic != SPICE_STAT_MAGIC) {
+        g_warning("statistics not available");
+        fprintf(out, "{}");
+    } else {
+        uint32_t max_nodes = (st.st_size - sizeof(SpiceStat)) / sizeof(SpiceStatNode);
+
+        fprintf(out, "{");
+        print_stat_nodes(out, reds_stat->nodes, max_nodes, reds_stat->root_index, 1);
+        fprintf(out, "\n  }");
+    }
+    if (reds_stat != (SpiceStat *) MAP_FAILED) {
+        munmap(reds_stat, st.st_size);
+    }
+}
+#endif
+
+static void print_benchmark(const char *filename, const char *replay_file,
+                            const char *client, gint64 end_time, uint64_t client_bytes)
+{
+    double elapsed = ncommands ? (end_time - start_time) / 1e6 : 0;
+    FILE *out = stdout;
+
+    if (strcmp(filename, "-") != 0 && (out = fopen(filename, "w")) == NULL) {
+        g_printerr("error opening %s\n", filename);
+        return;
+    }
+
+    fprintf(out, "{\n  \"file\": ");
+    print_json_string(out, replay_file);
+    fprintf(out, ",\n  \"client\": \"%s\"", client);
+    fprintf(out, ",\n  \"commands\": %u", ncommands);
+    fprintf(out, ",\n  \"elapsed_sec\": %.6f", elapsed);
+    fprintf(out, ",\n  \"commands_per_sec\": %.1f", elapsed > 0 ? ncommands / elapsed : 0);
+    fprintf(out, ",\n  \"client_bytes\": %" PRIu64, client_bytes);
+#ifndef _WIN32
+    fprintf(out, ",\n  \"stats\": ");
+    print_stats(out);
+#endif
+    fprintf(out, "\n}\n");
+
+    if (out != stdout) {
+        fclose(out);
+    }
+}
+
 static void free_queue(GAsyncQueue *queue)
 {
     for (;;) {
@@ -319,8 +482,17 @@ int main(int argc, char **argv)
     GOptionContext *context = NULL;
     gchar *client = NULL, *codecs = NULL, **file = NULL;
     gint port = 5000, compression = SPICE_IMAGE_COMPRESSION_AUTO_GLZ;
-    gint streaming = SPICE_STREAM_VIDEO_FILTER;
+    /* the default depends on --benchmark */
+    gint streaming = -1;
     gboolean wait = FALSE;
+    gchar *benchmark = NULL, *replay_file = NULL;
+    const char *client_type = "none";
+    uint64_t client_bytes = 0;
+    gint64 end_time;
+#ifndef _WIN32
+    gboolean sink = FALSE;
+    SinkClient *sink_client = NULL;
+#endif
     gint tls_port = 0;
     gchar *cacert_file = NULL, *cert_file = NULL, *key_file = NULL;
 
@@ -329,13 +501,17 @@ int main(int argc, char **argv)
     GOptionEntry entries[] = {
         { "client", 'c', 0, G_OPTION_ARG_STRING, &client, "Client", "CMD" },
         { "compression", 'C', 0, G_OPTION_ARG_INT, &compression, "Compression (default 2)", "INT" },
-        { "streaming", 'S', 0, G_OPTION_ARG_INT, &streaming, "Streaming (default 3)", "INT" },
+        { "streaming", 'S', 0, G_OPTION_ARG_INT, &streaming, "Streaming (default 3, 1 with --benchmark)", "INT" },
         { "video-codecs", 'v', 0, G_OPTION_ARG_STRING, &codecs, "Video codecs", "STRING" },
         { "port", 'p', 0, G_OPTION_ARG_INT, &port, "Server port (default 5000)", "PORT" },
         { "wait", 'w', 0, G_OPTION_ARG_NONE, &wait, "Wait for client", NULL },
         { "slow", 's', 0, G_OPTION_ARG_INT, &slow, "Slow down replay. Delays USEC microseconds before each command", "USEC" },
         { "skip", 0, 0, G_OPTION_ARG_INT, &skip, "Skip 'slow' for the first n commands", NULL },
         { "count", 0, 0, G_OPTION_ARG_NONE, &print_count, "Print the number of commands processed", NULL },
+        { "benchmark", 'b', 0, G_OPTION_ARG_FILENAME, &benchmark, "Replay as fast as possible and write statistics as JSON to FILE (- for stdout)", "FILE" },
+#ifndef _WIN32
+        { "sink", 0, 0, G_OPTION_ARG_NONE, &sink, "Connect an in-process client which drains the channels", NULL },
+#endif
         { "tls-port", 0, 0, G_OPTION_ARG_INT, &tls_port, "Secure server port", "PORT" },
         { "cacert-file", 0, 0, G_OPTION_ARG_FILENAME, &cacert_file, "TLS CA certificate", "FILE" },
         { "cert-file", 0, 0, G_OPTION_ARG_FILENAME, &cert_file, "TLS server certificate", "FILE" },
@@ -383,6 +559,11 @@ int main(int argc, char **argv)
         g_printerr("invalid compression value\n");
         exit(1);
     }
+    benchmark_mode = benchmark != NULL;
+    if (streaming == -1) {
+        /* stream detection depends on timing, it would make runs differ */
+        streaming = benchmark ? SPICE_STREAM_VIDEO_OFF : SPICE_STREAM_VIDEO_FILTER;
+    }
     if (streaming < 0 || streaming == SPICE_STREAM_VIDEO_INVALID) {
         g_printerr("invalid streaming value\n");
         exit(1);
@@ -400,6 +581,7 @@ int main(int argc, char **argv)
         g_printerr("error opening %s\n", file[0]);
         exit(1);
     }
+    replay_file = g_strdup(file[0]);
     g_strfreev(file);
     file = NULL;
 #ifndef _WIN32
@@ -425,6 +607,9 @@ int main(int argc, char **argv)
     core->channel_event = replay_channel_event;
 
     server = spice_server_new();
+    if (benchmark && spice_server_set_statistics(server, TRUE) != 0) {
+        g_warning("could not enable statistics");
+    }
     spice_server_set_image_compression(server, (SpiceImageCompression) compression);
     spice_server_set_streaming_video(server, streaming);
 
@@ -448,10 +633,12 @@ int main(int argc, char **argv)
     g_free(key_file);
     cacert_file = cert_file = key_file = NULL;
 
-    spice_server_set_port(server, port);
     spice_server_set_noauth(server);
-
-    g_print("listening on port %d (insecure)\n", port);
+    /* the benchmark is headless unless a client is expected */
+    if (!benchmark || client || wait) {
+        spice_server_set_port(server, port);
+        g_print("listening on port %d (insecure)\n", port);
+    }
     spice_server_init(server, core);
 
     display_sin.base.sif = &display_sif.base;
@@ -460,9 +647,17 @@ int main(int argc, char **argv)
     if (client) {
         start_client(client, &error);
         wait = TRUE;
+        client_type = "external";
         g_free(client);
         client = NULL;
     }
+#ifndef _WIN32
+    if (sink) {
+        sink_client = sink_client_new(server, sink_client_error, NULL);
+        wait = TRUE;
+        client_type = "sink";
+    }
+#endif
 
     if (!wait) {
         started = TRUE;
@@ -471,10 +666,29 @@ int main(int argc, char **argv)
 
     loop = g_main_loop_new(basic_event_loop_get_context(), FALSE);
     g_main_loop_run(loop);
+    if (benchmark && exit_status == 0) {
+        flush_worker();
+    }
+    end_time = g_get_monotonic_time();
 
     if (print_count)
         g_print("Counted %d commands\n", ncommands);
 
+#ifndef _WIN32
+    if (sink_client && exit_status == 0) {
+        /* the last images are still being encoded and sent */
+        end_time = MAX(end_time, sink_client_wait_idle(sink_client, 100));
+        client_bytes = sink_client_get_bytes(sink_client);
+    }
+#endif
+    if (benchmark && exit_status == 0) {
+        print_benchmark(benchmark, replay_file, client_type, end_time, client_bytes);
+    }
+
+#ifndef _WIN32
+    /* closed before the server so its channels are not reported as failed */
+    sink_client_free(sink_client);
+#endif
     spice_server_destroy(server);
     free_queue(display_queue);
     free_queue(cursor_queue);
@@ -482,6 +696,8 @@ int main(int argc, char **argv)
 
     g_main_loop_unref(loop);
     basic_event_loop_destroy();
+    g_free(benchmark);
+    g_free(replay_file);
 
-    return 0;
+    return exit_status;
 }
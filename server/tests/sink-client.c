@@ -0,0 +1,473 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2020 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#include <config.h>
+
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stdbool.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <openssl/rsa.h>
+#include <openssl/x509.h>
+
+#include <spice/protocol.h>
+#include <common/log.h>
+
+#include "basic-event-loop.h"
+#include "sink-client.h"
+
+#include <spice/start-packed.h>
+typedef struct SPICE_ATTR_PACKED SinkLinkMessage {
+    SpiceLinkHeader header;
+    SpiceLinkMess mess;
+    uint32_t common_caps;
+} SinkLinkMessage;
+
+typedef struct SPICE_ATTR_PACKED SinkDisplayInit {
+    uint8_t pixmap_cache_id;
+    int64_t pixmap_cache_size;
+    uint8_t glz_dictionary_id;
+    int32_t glz_dictionary_window_size;
+} SinkDisplayInit;
+#include <spice/end-packed.h>
+
+/* same defaults as spice-gtk, in pixels */
+#define SINK_PIXMAP_CACHE_SIZE (32 * 1024 * 1024 / 4)
+#define SINK_GLZ_WINDOW_SIZE (16 * 1024 * 1024 / 4)
+
+enum {
+    SINK_CHANNEL_MAIN,
+    SINK_CHANNEL_DISPLAY,
+
+    SINK_N_CHANNELS
+};
+
+typedef struct SinkChannel {
+    int fd;
+    /* the server end, given to spice_server_add_client() */
+    int server_fd;
+    bool linked;
+
+    SpiceMiniDataHeader header;
+    size_t header_pos;
+    uint32_t msg_pos;
+    /* start of the current message, enough for the ones we answer */
+    uint8_t msg[16];
+
+    uint32_t ack_window;
+    uint32_t ack_count;
+} SinkChannel;
+
+struct SinkClient {
+    SpiceServer *server;
+    GThread *thread;
+    SinkChannel channels[SINK_N_CHANNELS];
+    uint32_t connection_id;
+    SinkClientErrorFunc error_func;
+    gpointer error_opaque;
+    /* set by sink_client_free(), the channels are closed on purpose */
+    gint closing;
+
+    GMutex lock;
+    uint64_t bytes;
+    gint64 last_activity;
+};
+
+static bool sink_readwrite_all(int fd, void *buf, size_t len, bool do_write)
+{
+    size_t pos = 0;
+
+    while (pos < len) {
+        ssize_t n;
+
+        if (do_write) {
+            n = write(fd, (uint8_t *) buf + pos, len - pos);
+        } else {
+            n = read(fd, (uint8_t *) buf + pos, len - pos);
+            if (n == 0) {
+                return false;
+            }
+        }
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            return false;
+        }
+        pos += n;
+    }
+    return true;
+}
+
+static bool sink_read_all(int fd, void *buf, size_t len)
+{
+    return sink_readwrite_all(fd, buf, len, false);
+}
+
+static bool sink_write_all(int fd, const void *buf, size_t len)
+{
+    return sink_readwrite_all(fd, (void *) buf, len, true);
+}
+
+static bool sink_send_ticket(int fd, const SpiceLinkReply *reply)
+{
+    const uint8_t *key = reply->pub_key;
+    EVP_PKEY *pubkey;
+    RSA *rsa;
+    uint8_t *ticket;
+    int size;
+    bool ret = false;
+
+    pubkey = d2i_PUBKEY(NULL, &key, sizeof(reply->pub_key));
+    if (!pubkey) {
+        return false;
+    }
+    rsa = EVP_PKEY_get1_RSA(pubkey);
+    EVP_PKEY_free(pubkey);
+    if (!rsa) {
+        return false;
+    }
+    size = RSA_size(rsa);
+    ticket = g_malloc(size);
+    /* empty password, the server does not check it with noauth */
+    if (RSA_public_encrypt(1, (const uint8_t *) "", ticket, rsa,
+                           RSA_PKCS1_OAEP_PADDING) == size) {
+        ret = sink_write_all(fd, ticket, size);
+    }
+    g_free(ticket);
+    RSA_free(rsa);
+
+    return ret;
+}
+
+static bool sink_link(int fd, uint8_t channel_type, uint32_t connection_id)
+{
+    SinkLinkMessage link = {
+        .header = {
+            .magic = GUINT32_TO_LE(SPICE_MAGIC),
+            .major_version = GUINT32_TO_LE(SPICE_VERSION_MAJOR),
+            .minor_version = GUINT32_TO_LE(SPICE_VERSION_MINOR),
+            .size = GUINT32_TO_LE(sizeof(SpiceLinkMess) + sizeof(uint32_t)),
+        },
+        .mess = {
+            .connection_id = GUINT32_TO_LE(connection_id),
+            .channel_type = channel_type,
+            .channel_id = 0,
+            .num_common_caps = GUINT32_TO_LE(1),
+            .num_channel_caps = 0,
+            .caps_offset = GUINT32_TO_LE(sizeof(SpiceLinkMess)),
+        },
+        .common_caps = GUINT32_TO_LE(1u << SPICE_COMMON_CAP_MINI_HEADER),
+    };
+    SpiceLinkHeader header;
+    uint8_t *reply;
+    uint32_t result;
+    bool ret = false;
+
+    if (!sink_write_all(fd, &link, sizeof(link)) ||
+        !sink_read_all(fd, &header, sizeof(header))) {
+        return false;
+    }
+    if (GUINT32_FROM_LE(header.magic) != SPICE_MAGIC ||
+        GUINT32_FROM_LE(header.size) < sizeof(SpiceLinkReply)) {
+        return false;
+    }
+
+    reply = g_malloc(GUINT32_FROM_LE(header.size));
+    if (sink_read_all(fd, reply, GUINT32_FROM_LE(header.size)) &&
+        GUINT32_FROM_LE(((SpiceLinkReply *) reply)->error) == SPICE_LINK_ERR_OK &&
+        sink_send_ticket(fd, (SpiceLinkReply *) reply) &&
+        sink_read_all(fd, &result, sizeof(result))) {
+        ret = GUINT32_FROM_LE(result) == SPICE_LINK_ERR_OK;
+    }
+    g_free(reply);
+
+    return ret;
+}
+
+static bool sink_channel_send(SinkChannel *channel, uint16_t type,
+                              const void *data, uint32_t size)
+{
+    SpiceMiniDataHeader header = {
+        .type = GUINT16_TO_LE(type),
+        .size = GUINT32_TO_LE(size),
+    };
+
+    return sink_write_all(channel->fd, &header, sizeof(header)) &&
+           (size == 0 || sink_write_all(channel->fd, data, size));
+}
+
+static gboolean sink_add_display_client(gpointer opaque)
+{
+    SinkClient *sink = opaque;
+
+    spice_server_add_client(sink->server, sink->channels[SINK_CHANNEL_DISPLAY].server_fd, 0);
+    return G_SOURCE_REMOVE;
+}
+
+static bool sink_link_display(SinkClient *sink)
+{
+    SinkChannel *channel = &sink->channels[SINK_CHANNEL_DISPLAY];
+    SinkDisplayInit init = {
+        .pixmap_cache_id = 1,
+        .pixmap_cache_size = GINT64_TO_LE(SINK_PIXMAP_CACHE_SIZE),
+        .glz_dictionary_id = 1,
+        .glz_dictionary_window_size = GINT32_TO_LE(SINK_GLZ_WINDOW_SIZE),
+    };
+    GSource *source;
+
+    /* spice_server_add_client() is not thread safe */
+    source = g_idle_source_new();
+    g_source_set_callback(source, sink_add_display_client, sink, NULL);
+    g_source_attach(source, basic_event_loop_get_context());
+    g_source_unref(source);
+
+    if (!sink_link(channel->fd, SPICE_CHANNEL_DISPLAY, sink->connection_id)) {
+        spice_warning("sink client: display channel link failed");
+        return false;
+    }
+    channel->linked = true;
+    return sink_channel_send(channel, SPICE_MSGC_DISPLAY_INIT, &init, sizeof(init));
+}
+
+static bool sink_channel_handle_message(SinkClient *sink, SinkChannel *channel)
+{
+    uint16_t type = GUINT16_FROM_LE(channel->header.type);
+    uint32_t size = GUINT32_FROM_LE(channel->header.size);
+    bool ret = true;
+
+    switch (type) {
+    case SPICE_MSG_SET_ACK:
+        if (size >= 8) {
+            uint32_t generation;
+
+            memcpy(&generation, channel->msg, sizeof(generation));
+            memcpy(&channel->ack_window, channel->msg + 4, sizeof(channel->ack_window));
+            channel->ack_window = GUINT32_FROM_LE(channel->ack_window);
+            channel->ack_count = 0;
+            return sink_channel_send(channel, SPICE_MSGC_ACK_SYNC,
+                                     &generation, sizeof(generation));
+        }
+        break;
+    case SPICE_MSG_PING:
+        /* id and timestamp, the optional data is not echoed */
+        if (size >= 12) {
+            ret = sink_channel_send(channel, SPICE_MSGC_PONG, channel->msg, 12);
+        }
+        break;
+    case SPICE_MSG_MAIN_INIT:
+        if (channel == &sink->channels[SINK_CHANNEL_MAIN] && size >= 4 &&
+            !sink->channels[SINK_CHANNEL_DISPLAY].linked) {
+            memcpy(&sink->connection_id, channel->msg, sizeof(sink->connection_id));
+            sink->connection_id = GUINT32_FROM_LE(sink->connection_id);
+            ret = sink_link_display(sink);
+        }
+        break;
+    }
+
+    if (ret && channel->ack_window && ++channel->ack_count == channel->ack_window) {
+        channel->ack_count = 0;
+        ret = sink_channel_send(channel, SPICE_MSGC_ACK, NULL, 0);
+    }
+    return ret;
+}
+
+static bool sink_channel_parse(SinkClient *sink, SinkChannel *channel,
+                               const uint8_t *data, size_t len)
+{
+    while (len > 0) {
+        size_t n;
+
+        if (channel->header_pos < sizeof(channel->header)) {
+            n = MIN(len, sizeof(channel->header) - channel->header_pos);
+            memcpy((uint8_t *) &channel->header + channel->header_pos, data, n);
+            channel->header_pos += n;
+            channel->msg_pos = 0;
+        } else {
+            n = MIN(len, GUINT32_FROM_LE(channel->header.size) - channel->msg_pos);
+            if (channel->msg_pos < sizeof(channel->msg)) {
+                memcpy(channel->msg + channel->msg_pos, data,
+                       MIN(n, sizeof(channel->msg) - channel->msg_pos));
+            }
+            channel->msg_pos += n;
+        }
+        data += n;
+        len -= n;
+
+        if (channel->header_pos == sizeof(channel->header) &&
+            channel->msg_pos == GUINT32_FROM_LE(channel->header.size)) {
+            channel->header_pos = 0;
+            if (!sink_channel_handle_message(sink, channel)) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+static gboolean sink_report_error(gpointer opaque)
+{
+    SinkClient *sink = opaque;
+
+    sink->error_func(sink->error_opaque);
+    return G_SOURCE_REMOVE;
+}
+
+static gpointer sink_client_thread(gpointer opaque)
+{
+    SinkClient *sink = opaque;
+    uint8_t *buf = g_malloc(64 * 1024);
+
+    /* the server handles the link from its main loop */
+    if (!sink_link(sink->channels[SINK_CHANNEL_MAIN].fd, SPICE_CHANNEL_MAIN, 0)) {
+        spice_warning("sink client: main channel link failed");
+        goto end;
+    }
+    sink->channels[SINK_CHANNEL_MAIN].linked = true;
+
+    for (;;) {
+        struct pollfd fds[SINK_N_CHANNELS];
+        int i, n_fds = 0;
+
+        for (i = 0; i < SINK_N_CHANNELS; i++) {
+            if (sink->channels[i].linked) {
+                fds[n_fds].fd = sink->channels[i].fd;
+                fds[n_fds].events = POLLIN;
+                n_fds++;
+            }
+        }
+        if (poll(fds, n_fds, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+
+        for (i = 0; i < n_fds; i++) {
+            SinkChannel *channel = sink->channels[0].fd == fds[i].fd ?
+                &sink->channels[0] : &sink->channels[1];
+            ssize_t len;
+
+            if (!fds[i].revents) {
+                continue;
+            }
+            len = read(channel->fd, buf, 64 * 1024);
+            if (len < 0 && errno == EINTR) {
+                continue;
+            }
+            if (len <= 0) {
+                goto end;
+            }
+
+            g_mutex_lock(&sink->lock);
+            sink->bytes += len;
+            sink->last_activity = g_get_monotonic_time();
+            g_mutex_unlock(&sink->lock);
+
+            if (!sink_channel_parse(sink, channel, buf, len)) {
+                goto end;
+            }
+        }
+    }
+
+end:
+    /* a channel failed to link or was closed by the server, nothing will
+     * be received anymore, don't let the caller wait for it */
+    if (!g_atomic_int_get(&sink->closing) && sink->error_func) {
+        GSource *source = g_idle_source_new();
+        g_source_set_callback(source, sink_report_error, sink, NULL);
+        g_source_attach(source, basic_event_loop_get_context());
+        g_source_unref(source);
+    }
+    g_free(buf);
+    return NULL;
+}
+
+SinkClient *sink_client_new(SpiceServer *server, SinkClientErrorFunc error_func,
+                            gpointer error_opaque)
+{
+    SinkClient *sink = g_new0(SinkClient, 1);
+    int i;
+
+    sink->server = server;
+    sink->error_func = error_func;
+    sink->error_opaque = error_opaque;
+    g_mutex_init(&sink->lock);
+    sink->last_activity = g_get_monotonic_time();
+    for (i = 0; i < SINK_N_CHANNELS; i++) {
+        int sv[2];
+
+        if (socketpair(AF_LOCAL, SOCK_STREAM, 0, sv) < 0) {
+            spice_error("socketpair failed %s", strerror(errno));
+        }
+        sink->channels[i].fd = sv[0];
+        sink->channels[i].server_fd = sv[1];
+    }
+
+    spice_server_add_client(server, sink->channels[SINK_CHANNEL_MAIN].server_fd, 0);
+    sink->thread = g_thread_new("sink-client", sink_client_thread, sink);
+
+    return sink;
+}
+
+gint64 sink_client_wait_idle(SinkClient *sink, unsigned int idle_ms)
+{
+    for (;;) {
+        gint64 last;
+
+        g_mutex_lock(&sink->lock);
+        last = sink->last_activity;
+        g_mutex_unlock(&sink->lock);
+
+        if (g_get_monotonic_time() - last >= (gint64) idle_ms * 1000) {
+            return last;
+        }
+        g_usleep(idle_ms * 1000 / 4);
+    }
+}
+
+uint64_t sink_client_get_bytes(SinkClient *sink)
+{
+    uint64_t bytes;
+
+    g_mutex_lock(&sink->lock);
+    bytes = sink->bytes;
+    g_mutex_unlock(&sink->lock);
+
+    return bytes;
+}
+
+void sink_client_free(SinkClient *sink)
+{
+    int i;
+
+    if (!sink) {
+        return;
+    }
+    g_atomic_int_set(&sink->closing, TRUE);
+    for (i = 0; i < SINK_N_CHANNELS; i++) {
+        shutdown(sink->channels[i].fd, SHUT_RDWR);
+    }
+    g_thread_join(sink->thread);
+    for (i = 0; i < SINK_N_CHANNELS; i++) {
+        close(sink->channels[i].fd);
+    }
+    g_mutex_clear(&sink->lock);
+    g_free(sink);
+}
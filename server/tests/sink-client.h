@@ -0,0 +1,50 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2020 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+/* Minimal in-process client which connects the main and display channels
+ * of a server through socket pairs and drains everything it receives.
+ * It only answers the messages the server needs to keep sending (ACKs and
+ * pings), nothing is decoded or rendered.
+ */
+#ifndef SINK_CLIENT_H
+#define SINK_CLIENT_H
+
+#include <stdint.h>
+#include <glib.h>
+#include <spice.h>
+
+SPICE_BEGIN_DECLS
+
+typedef struct SinkClient SinkClient;
+
+/* Called from the main loop if the channels of the client can't be linked
+ * or are closed by the server */
+typedef void (*SinkClientErrorFunc)(gpointer opaque);
+
+/* Connect a client to @server, must be called from the thread running
+ * the server main loop after spice_server_init() */
+SinkClient *sink_client_new(SpiceServer *server, SinkClientErrorFunc error_func,
+                            gpointer error_opaque);
+/* Wait until nothing was received for @idle_ms, return the monotonic time
+ * in microseconds of the last data received */
+gint64 sink_client_wait_idle(SinkClient *sink, unsigned int idle_ms);
+uint64_t sink_client_get_bytes(SinkClient *sink);
+void sink_client_free(SinkClient *sink);
+
+SPICE_END_DECLS
+
+#endif /* SINK_CLIENT_H */
@@ -50,11 +50,7 @@ void TEST_NAME(void)
     stat_info_t info;
     stat_start_time_t start_time;
 
-#if !defined(COMPRESS_STAT) && !defined(RED_WORKER_STAT)
-    SPICE_VERIFY(sizeof(start_time) == 0);
-    SPICE_VERIFY(sizeof(info) == 0);
-#endif
-
+    stat_set_enabled(FALSE);
     stat_init(&info, "test", CLOCK_MONOTONIC);
     stat_start_time_init(&start_time, &info);
     usleep(2000);
@@ -65,6 +61,9 @@ void TEST_NAME(void)
     g_assert_cmpuint(info.min, ==, info.max);
     g_assert_cmpuint(info.min, >=, 2000000);
     g_assert_cmpuint(info.min, <, 100000000);
+#else
+    /* disabled at runtime */
+    g_assert_cmpuint(info.count, ==, 0);
 #endif
 
     stat_reset(&info);
@@ -84,5 +83,22 @@ void TEST_NAME(void)
     g_assert_cmpuint(info.total, >=, 5000000);
     g_assert_cmpuint(info.orig_size, ==, 1100);
     g_assert_cmpuint(info.comp_size, ==, 550);
+#else
+    g_assert_cmpuint(info.count, ==, 0);
 #endif
+
+    /* enabled at runtime */
+    stat_set_enabled(TRUE);
+    stat_init(&info, "test", CLOCK_MONOTONIC);
+    stat_start_time_init(&start_time, &info);
+    usleep(2000);
+    stat_add(&info, start_time);
+    stat_info_add(&info, 1000, 0, 0);
+    g_assert_cmpuint(info.count, ==, 2);
+    g_assert_cmpuint(info.max, >=, 2000000);
+    g_assert_cmpuint(info.min, ==, 1000);
+    /* 1000 ns is in the [512, 1024) bucket */
+    g_assert_cmpuint(stat_info_get_percentile(&info, 50), ==, 1023);
+    g_assert_cmpuint(stat_info_get_percentile(&info, 99), ==, info.max);
+    stat_set_enabled(FALSE);
 }
@@ -0,0 +1,108 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2020 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+/**
+ * Test the row conversions used to feed libjpeg against per pixel ones
+ */
+
+#include <config.h>
+#include <string.h>
+
+#include "test-glib-compat.h"
+#include "spice-bitmap-utils.h"
+
+/* enough for the vector loops and their tails */
+#define MAX_WIDTH 70
+
+static uint8_t src[MAX_WIDTH * 4 + 1];
+static uint8_t dest[MAX_WIDTH * 4 + 1];
+
+static void fill_random(void)
+{
+    for (size_t i = 0; i < sizeof(src); i++) {
+        src[i] = g_test_rand_int_range(0, 256);
+    }
+}
+
+static uint8_t expand5(unsigned int value)
+{
+    value &= 0x1f;
+    return (value << 3) | (value >> 2);
+}
+
+static void test_rgb16(void)
+{
+    for (unsigned int width = 0; width <= MAX_WIDTH; width++) {
+        fill_random();
+
+        memset(dest, 0xaa, sizeof(dest));
+        bitmap_row_rgb16_to_bgrx32(dest, src, width);
+        for (unsigned int x = 0; x < width; x++) {
+            uint16_t pixel = src[x * 2] | (src[x * 2 + 1] << 8);
+            g_assert_cmpuint(dest[x * 4], ==, expand5(pixel));
+            g_assert_cmpuint(dest[x * 4 + 1], ==, expand5(pixel >> 5));
+            g_assert_cmpuint(dest[x * 4 + 2], ==, expand5(pixel >> 10));
+            g_assert_cmpuint(dest[x * 4 + 3], ==, 0);
+        }
+        g_assert_cmpuint(dest[width * 4], ==, 0xaa);
+
+        memset(dest, 0xaa, sizeof(dest));
+        bitmap_row_rgb16_to_rgb24(dest, src, width);
+        for (unsigned int x = 0; x < width; x++) {
+            uint16_t pixel = src[x * 2] | (src[x * 2 + 1] << 8);
+            g_assert_cmpuint(dest[x * 3], ==, expand5(pixel >> 10));
+            g_assert_cmpuint(dest[x * 3 + 1], ==, expand5(pixel >> 5));
+            g_assert_cmpuint(dest[x * 3 + 2], ==, expand5(pixel));
+        }
+        g_assert_cmpuint(dest[width * 3], ==, 0xaa);
+    }
+}
+
+static void test_bgr(void)
+{
+    for (unsigned int width = 0; width <= MAX_WIDTH; width++) {
+        fill_random();
+
+        memset(dest, 0xaa, sizeof(dest));
+        bitmap_row_bgr24_to_rgb24(dest, src, width);
+        for (unsigned int x = 0; x < width; x++) {
+            g_assert_cmpuint(dest[x * 3], ==, src[x * 3 + 2]);
+            g_assert_cmpuint(dest[x * 3 + 1], ==, src[x * 3 + 1]);
+            g_assert_cmpuint(dest[x * 3 + 2], ==, src[x * 3]);
+        }
+        g_assert_cmpuint(dest[width * 3], ==, 0xaa);
+
+        memset(dest, 0xaa, sizeof(dest));
+        bitmap_row_bgrx32_to_rgb24(dest, src, width);
+        for (unsigned int x = 0; x < width; x++) {
+            g_assert_cmpuint(dest[x * 3], ==, src[x * 4 + 2]);
+            g_assert_cmpuint(dest[x * 3 + 1], ==, src[x * 4 + 1]);
+            g_assert_cmpuint(dest[x * 3 + 2], ==, src[x * 4]);
+        }
+        g_assert_cmpuint(dest[width * 3], ==, 0xaa);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_func("/server/bitmap-row-convert/rgb16", test_rgb16);
+    g_test_add_func("/server/bitmap-row-convert/bgr", test_bgr);
+
+    return g_test_run();
+}
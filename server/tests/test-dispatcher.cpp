@@ -113,11 +113,49 @@ static void *thread_proc(void *arg)
     return NULL;
 }
 
-static void test_dispatcher(TestFixture *fixture, gconstpointer user_data)
+// big message, the size is not aligned to test ring wrapping
+struct BigMsg {
+    uint64_t num;
+    uint8_t data[1001];
+};
+
+static void big_msg_check(void *, BigMsg *msg)
+{
+    g_assert_cmpint(msg->num, ==, num);
+    for (unsigned i = 0; i < sizeof(msg->data); ++i) {
+        g_assert_cmpint(msg->data[i], ==, (uint8_t) (msg->num + i));
+    }
+    ++num;
+}
+
+static void big_msg_end(void *, BigMsg *msg)
+{
+    g_assert_cmpint(num, ==, iterations * 10);
+    basic_event_loop_quit();
+}
+
+static void *thread_proc_big(void *arg)
+{
+    // send without ACK to fill the message ring
+    for (unsigned n = 0; n < iterations * 10; ++n) {
+        BigMsg msg;
+        msg.num = n;
+        for (unsigned i = 0; i < sizeof(msg.data); ++i) {
+            msg.data[i] = n + i;
+        }
+        dispatcher->send_message_custom(big_msg_check, &msg, false);
+    }
+
+    BigMsg msg{};
+    dispatcher->send_message_custom(big_msg_end, &msg, true);
+    return NULL;
+}
+
+static void run_dispatcher_test(void *(*proc)(void *), gconstpointer user_data)
 {
     pthread_t th;
 
-    g_assert_cmpint(pthread_create(&th, NULL, thread_proc, (void *) user_data), ==, 0);
+    g_assert_cmpint(pthread_create(&th, NULL, proc, (void *) user_data), ==, 0);
 
     // start all test
     alarm(20);
@@ -127,6 +165,16 @@ static void test_dispatcher(TestFixture *fixture, gconstpointer user_data)
     pthread_join(th, NULL);
 }
 
+static void test_dispatcher(TestFixture *fixture, gconstpointer user_data)
+{
+    run_dispatcher_test(thread_proc, user_data);
+}
+
+static void test_dispatcher_ring_full(TestFixture *fixture, gconstpointer user_data)
+{
+    run_dispatcher_test(thread_proc_big, user_data);
+}
+
 int main(int argc, char *argv[])
 {
     g_test_init(&argc, &argv, NULL);
@@ -136,6 +184,8 @@ int main(int argc, char *argv[])
         iterations = atoi(argv[1]);
     }
 
+    g_test_add("/server/dispatcher/ring-full", TestFixture, NULL, test_dispatcher_setup,
+               test_dispatcher_ring_full, test_dispatcher_teardown);
     for (int i = 0; i <= 10; ++i) {
         char name[64];
         sprintf(name, "/server/dispatcher/%d", i);
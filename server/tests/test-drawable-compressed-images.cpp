@@ -0,0 +1,78 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2020 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+/**
+ * Test the lifetime of the images compressed for the clients of a drawable
+ */
+
+#include <config.h>
+#include <string.h>
+
+#include "test-glib-compat.h"
+#include "display-channel-private.h"
+
+static void test_release_after_last_client(void)
+{
+    Drawable drawable;
+    SpiceBitmap bitmap;
+    SpiceImage image;
+    compress_send_data_t comp_data;
+    RedSharedCompressedImage *shared;
+    // the pipe items are only used as list entries
+    RedDrawablePipeItem *first = (RedDrawablePipeItem *) GINT_TO_POINTER(1);
+    RedDrawablePipeItem *second = (RedDrawablePipeItem *) GINT_TO_POINTER(2);
+
+    memset(&drawable, 0, sizeof(drawable));
+    memset(&bitmap, 0, sizeof(bitmap));
+    memset(&image, 0, sizeof(image));
+    memset(&comp_data, 0, sizeof(comp_data));
+
+    // the drawable is queued to two clients
+    drawable.pipes = g_list_prepend(drawable.pipes, first);
+    drawable.pipes = g_list_prepend(drawable.pipes, second);
+
+    // the first client compressed the image for both
+    image.descriptor.type = SPICE_IMAGE_TYPE_QUIC;
+    shared = red_shared_compressed_image_new(&bitmap, IMAGE_ENCODER_JOB_QUIC, 0,
+                                             &image, &comp_data);
+    drawable.compressed_images = g_list_prepend(drawable.compressed_images, shared);
+    // reference held by the message being sent
+    red_shared_compressed_image_ref(shared);
+
+    // the second client still needs the data
+    drawable_remove_pipe_item(&drawable, first);
+    g_assert_nonnull(drawable.compressed_images);
+    g_assert_cmpint(shared->refs, ==, 2);
+
+    // the second client sent the item, the drawable drops the data
+    drawable_remove_pipe_item(&drawable, second);
+    g_assert_null(drawable.pipes);
+    g_assert_null(drawable.compressed_images);
+    g_assert_cmpint(shared->refs, ==, 1);
+
+    red_shared_compressed_image_unref(shared);
+}
+
+int main(int argc, char *argv[])
+{
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_func("/server/drawable-compressed-images/release-after-last-client",
+                    test_release_after_last_client);
+
+    return g_test_run();
+}
@@ -99,6 +99,55 @@ static void timer_not_twice(void *opaque)
     core->timer_cancel(twice_timers_cancel[1]);
 }
 
+#ifndef _WIN32
+static int watch_fds[2];
+static SpiceWatch *watch;
+static int watch_reads, watch_writes;
+
+static void watch_func(int fd, int event, void *opaque)
+{
+    char c;
+
+    spice_assert(fd == watch_fds[0]);
+    if (event & SPICE_WATCH_EVENT_READ) {
+        spice_assert(read(fd, &c, 1) == 1);
+        ++watch_reads;
+        /* the socket is writable, only that event must come now */
+        core->watch_update_mask(watch, SPICE_WATCH_EVENT_WRITE);
+    }
+    if (event & SPICE_WATCH_EVENT_WRITE) {
+        spice_assert(watch_reads == 1);
+        ++watch_writes;
+        /* check we can remove a watch inside its callback */
+        core->watch_remove(watch);
+        watch = NULL;
+        g_main_loop_quit(loop);
+    }
+}
+
+static void test_watches(void)
+{
+    core = basic_event_loop_init();
+    loop = g_main_loop_new(basic_event_loop_get_context(), FALSE);
+    watch_reads = watch_writes = 0;
+
+    spice_assert(socketpair(AF_UNIX, SOCK_STREAM, 0, watch_fds) == 0);
+    watch = core->watch_add(watch_fds[0], SPICE_WATCH_EVENT_READ, watch_func, NULL);
+    spice_assert(watch != NULL);
+    spice_assert(write(watch_fds[1], "x", 1) == 1);
+
+    alarm(1);
+    g_main_loop_run(loop);
+    alarm(0);
+    spice_assert(watch_reads == 1 && watch_writes == 1);
+
+    g_main_loop_unref(loop);
+    loop = NULL;
+    close(watch_fds[0]);
+    close(watch_fds[1]);
+    basic_event_loop_destroy();
+}
+#endif
 
 int main(int argc, char **argv)
 {
@@ -172,5 +221,9 @@ int main(int argc, char **argv)
 
     basic_event_loop_destroy();
 
+#ifndef _WIN32
+    test_watches();
+#endif
+
     return 0;
 }
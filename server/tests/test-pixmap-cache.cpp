@@ -0,0 +1,254 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2020 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+/**
+ * Test the index of PixmapCache
+ */
+
+#include <config.h>
+#include <stdlib.h>
+
+#include "test-glib-compat.h"
+#include "pixmap-cache.h"
+
+// enough items to grow the index several times
+#define N_ITEMS (BITS_CACHE_HASH_SIZE * 8)
+
+static PixmapCache *cache_new(void)
+{
+    // the client is only used to find the cache
+    return pixmap_cache_get((RedClient *) GINT_TO_POINTER(1), 0, INT64_MAX);
+}
+
+static uint64_t item_id(unsigned i)
+{
+    // close ids collide in the low bits, like images from the same source
+    return ((uint64_t) i << 32) | (i & 0xf);
+}
+
+static void test_insert_lookup(void)
+{
+    PixmapCache *cache = cache_new();
+    unsigned i;
+
+    pthread_mutex_lock(&cache->lock);
+    for (i = 0; i < N_ITEMS; i++) {
+        NewCacheItem *item = pixmap_cache_unlocked_insert(cache, item_id(i), i + 1, 1);
+        g_assert_cmpuint(item->id, ==, item_id(i));
+    }
+    g_assert_cmpint(cache->items, ==, N_ITEMS);
+    for (i = 0; i < N_ITEMS; i++) {
+        NewCacheItem *item = pixmap_cache_unlocked_lookup(cache, item_id(i));
+        g_assert_nonnull(item);
+        g_assert_cmpuint(item->size, ==, i + 1);
+    }
+    g_assert_null(pixmap_cache_unlocked_lookup(cache, item_id(N_ITEMS)));
+    pthread_mutex_unlock(&cache->lock);
+
+    g_assert_true(pixmap_cache_contains(cache, item_id(0)));
+    g_assert_false(pixmap_cache_contains(cache, item_id(N_ITEMS)));
+
+    pixmap_cache_unref(cache);
+}
+
+static void test_remove(void)
+{
+    PixmapCache *cache = cache_new();
+    unsigned i;
+
+    pthread_mutex_lock(&cache->lock);
+    for (i = 0; i < N_ITEMS; i++) {
+        pixmap_cache_unlocked_insert(cache, item_id(i), 1, 1);
+    }
+    // removing items must not hide the ones probed past them
+    for (i = 0; i < N_ITEMS; i += 3) {
+        pixmap_cache_unlocked_remove(cache, pixmap_cache_unlocked_lookup(cache, item_id(i)));
+    }
+    for (i = 0; i < N_ITEMS; i++) {
+        NewCacheItem *item = pixmap_cache_unlocked_lookup(cache, item_id(i));
+        if (i % 3 == 0) {
+            g_assert_null(item);
+        } else {
+            g_assert_nonnull(item);
+            g_assert_cmpuint(item->id, ==, item_id(i));
+        }
+    }
+    g_assert_cmpint(cache->items, ==, N_ITEMS - (N_ITEMS + 2) / 3);
+
+    // removed items are reused
+    for (i = 0; i < N_ITEMS; i += 3) {
+        pixmap_cache_unlocked_insert(cache, item_id(i), 1, 1);
+    }
+    g_assert_cmpint(cache->items, ==, N_ITEMS);
+
+    pixmap_cache_clear(cache);
+    g_assert_cmpint(cache->items, ==, 0);
+    g_assert_null(pixmap_cache_unlocked_lookup(cache, item_id(1)));
+    pthread_mutex_unlock(&cache->lock);
+
+    pixmap_cache_unref(cache);
+}
+
+static void test_lru(void)
+{
+    PixmapCache *cache = cache_new();
+    NewCacheItem *tail;
+
+    pthread_mutex_lock(&cache->lock);
+    pixmap_cache_unlocked_insert(cache, 1, 1, 1);
+    pixmap_cache_unlocked_insert(cache, 2, 1, 1);
+    pixmap_cache_unlocked_insert(cache, 3, 1, 1);
+
+    tail = SPICE_CONTAINEROF(ring_get_tail(&cache->lru), NewCacheItem, lru_link);
+    g_assert_cmpuint(tail->id, ==, 1);
+    g_assert_true(pixmap_cache_unlocked_get_victim(cache) == tail);
+    pixmap_cache_unlocked_remove(cache, tail);
+    pixmap_cache_unlocked_hit(cache, pixmap_cache_unlocked_lookup(cache, 2));
+    tail = SPICE_CONTAINEROF(ring_get_tail(&cache->lru), NewCacheItem, lru_link);
+    g_assert_cmpuint(tail->id, ==, 3);
+    g_assert_true(pixmap_cache_unlocked_get_victim(cache) == tail);
+    pthread_mutex_unlock(&cache->lock);
+
+    pixmap_cache_unref(cache);
+}
+
+static void test_gdsf(void)
+{
+    PixmapCache *cache;
+    NewCacheItem *victim;
+    unsigned i;
+
+    g_setenv(PIXMAP_CACHE_POLICY_ENV, "gdsf", TRUE);
+    cache = cache_new();
+    g_unsetenv(PIXMAP_CACHE_POLICY_ENV);
+    g_assert_cmpint(cache->policy, ==, PIXMAP_CACHE_POLICY_GDSF);
+
+    pthread_mutex_lock(&cache->lock);
+    // same pixels, the image sent with fewer bytes goes first
+    for (i = 0; i < 16; i++) {
+        pixmap_cache_unlocked_insert(cache, i, 100, 1000 + (i * 7 % 16) * 100);
+    }
+    victim = pixmap_cache_unlocked_get_victim(cache);
+    g_assert_cmpuint(victim->id, ==, 0);
+    pixmap_cache_unlocked_remove(cache, victim);
+    victim = pixmap_cache_unlocked_get_victim(cache);
+    g_assert_cmpuint(victim->cost, ==, 1100);
+
+    // hits protect an item even if it's cheaper to resend
+    pixmap_cache_unlocked_hit(cache, victim);
+    pixmap_cache_unlocked_hit(cache, victim);
+    g_assert_true(pixmap_cache_unlocked_get_victim(cache) != victim);
+
+    // the victims come out in priority order
+    uint64_t priority = 0;
+    while ((victim = pixmap_cache_unlocked_get_victim(cache)) != NULL) {
+        g_assert_cmpuint(victim->priority, >=, priority);
+        priority = victim->priority;
+        pixmap_cache_unlocked_remove(cache, victim);
+    }
+    g_assert_cmpint(cache->items, ==, 0);
+
+    // items added after evictions start above the evicted priorities
+    NewCacheItem *item = pixmap_cache_unlocked_insert(cache, 100, 100, 1);
+    g_assert_cmpuint(item->priority, >, priority);
+    pthread_mutex_unlock(&cache->lock);
+
+    pixmap_cache_unref(cache);
+}
+
+static void test_gdsf_unused_victim(void)
+{
+    PixmapCache *cache;
+    NewCacheItem *used, *victim;
+    unsigned i;
+
+    g_setenv(PIXMAP_CACHE_POLICY_ENV, "gdsf", TRUE);
+    cache = cache_new();
+    g_unsetenv(PIXMAP_CACHE_POLICY_ENV);
+
+    pthread_mutex_lock(&cache->lock);
+    for (i = 0; i < 4; i++) {
+        pixmap_cache_unlocked_insert(cache, i, 100, 1000 + i * 100);
+    }
+    // the lowest priority item was added by the message being sent
+    used = pixmap_cache_unlocked_lookup(cache, 0);
+    used->sync[1] = 7;
+    g_assert_true(pixmap_cache_unlocked_get_victim(cache) == used);
+
+    // the next ones are evicted instead
+    victim = pixmap_cache_unlocked_get_unused_victim(cache, 1, 7);
+    g_assert_nonnull(victim);
+    g_assert_cmpuint(victim->id, ==, 1);
+    pixmap_cache_unlocked_remove(cache, victim);
+    victim = pixmap_cache_unlocked_get_unused_victim(cache, 1, 7);
+    g_assert_nonnull(victim);
+    g_assert_cmpuint(victim->id, ==, 2);
+    pixmap_cache_unlocked_remove(cache, victim);
+    pixmap_cache_unlocked_end_eviction(cache);
+
+    // the item was used by a previous message
+    g_assert_true(pixmap_cache_unlocked_get_unused_victim(cache, 1, 8) == used);
+    pixmap_cache_unlocked_end_eviction(cache);
+
+    // fails only when all the items are used
+    pixmap_cache_unlocked_lookup(cache, 3)->sync[1] = 7;
+    g_assert_null(pixmap_cache_unlocked_get_unused_victim(cache, 1, 7));
+    pixmap_cache_unlocked_end_eviction(cache);
+
+    // the skipped items are back in priority order
+    g_assert_true(pixmap_cache_unlocked_get_victim(cache) == used);
+    pixmap_cache_unlocked_remove(cache, used);
+    victim = pixmap_cache_unlocked_get_victim(cache);
+    g_assert_cmpuint(victim->id, ==, 3);
+    pixmap_cache_unlocked_remove(cache, victim);
+    g_assert_null(pixmap_cache_unlocked_get_victim(cache));
+    pthread_mutex_unlock(&cache->lock);
+
+    pixmap_cache_unref(cache);
+}
+
+static void test_lru_unused_victim(void)
+{
+    PixmapCache *cache = cache_new();
+
+    pthread_mutex_lock(&cache->lock);
+    pixmap_cache_unlocked_insert(cache, 1, 1, 1);
+    pixmap_cache_unlocked_insert(cache, 2, 1, 1);
+    // the least recently used item is used, so are all the others
+    pixmap_cache_unlocked_lookup(cache, 1)->sync[0] = 3;
+    g_assert_null(pixmap_cache_unlocked_get_unused_victim(cache, 0, 3));
+    pixmap_cache_unlocked_end_eviction(cache);
+    g_assert_cmpuint(pixmap_cache_unlocked_get_unused_victim(cache, 0, 4)->id, ==, 1);
+    pixmap_cache_unlocked_end_eviction(cache);
+    pthread_mutex_unlock(&cache->lock);
+
+    pixmap_cache_unref(cache);
+}
+
+int main(int argc, char *argv[])
+{
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_func("/server/pixmap-cache/insert-lookup", test_insert_lookup);
+    g_test_add_func("/server/pixmap-cache/remove", test_remove);
+    g_test_add_func("/server/pixmap-cache/lru", test_lru);
+    g_test_add_func("/server/pixmap-cache/gdsf", test_gdsf);
+    g_test_add_func("/server/pixmap-cache/gdsf-unused-victim", test_gdsf_unused_victim);
+    g_test_add_func("/server/pixmap-cache/lru-unused-victim", test_lru_unused_victim);
+
+    return g_test_run();
+}
@@ -287,6 +287,55 @@ static void test_circular_small_chunks(void)
     memslot_info_destroy(&mem_info);
 }
 
+static void test_fill_command_clip(void)
+{
+    static const uint32_t num_rects[] = { 1, 100, 1000 };
+    RedMemSlotInfo mem_info;
+    RedDrawable *red;
+    QXLDrawable qxl;
+    QXLClipRects *clip;
+    QXLRect *rects;
+    unsigned int i, n;
+
+    init_meminfo(&mem_info);
+
+    /* the clip rectangles fit in the first block of the arena or not */
+    for (i = 0; i < G_N_ELEMENTS(num_rects); i++) {
+        clip = (QXLClipRects*) create_chunk(SPICE_OFFSETOF(QXLClipRects, chunk),
+                                            num_rects[i] * sizeof(QXLRect), NULL, 0);
+        clip->num_rects = num_rects[i];
+        rects = (QXLRect*) clip->chunk.data;
+        for (n = 0; n < num_rects[i]; n++) {
+            rects[n].left = n;
+            rects[n].top = 0;
+            rects[n].right = n + 1;
+            rects[n].bottom = 1;
+        }
+
+        memset(&qxl, 0, sizeof(qxl));
+        qxl.type = QXL_DRAW_FILL;
+        qxl.bbox.right = num_rects[i];
+        qxl.bbox.bottom = 1;
+        qxl.clip.type = SPICE_CLIP_TYPE_RECTS;
+        qxl.clip.data = to_physical(clip);
+        qxl.surfaces_dest[0] = qxl.surfaces_dest[1] = qxl.surfaces_dest[2] = -1;
+        qxl.u.fill.brush.type = SPICE_BRUSH_TYPE_SOLID;
+        qxl.u.fill.brush.u.color = 0xff0000;
+
+        red = red_drawable_new(NULL, &mem_info, 0, to_physical(&qxl), 0);
+        g_assert_nonnull(red);
+        g_assert_cmpuint(red->clip.rects->num_rects, ==, num_rects[i]);
+        for (n = 0; n < num_rects[i]; n++) {
+            g_assert_cmpint(red->clip.rects->rects[n].left, ==, n);
+            g_assert_cmpint(red->clip.rects->rects[n].right, ==, n + 1);
+        }
+        g_assert_cmpuint(red->u.fill.brush.u.color, ==, 0xff0000);
+        red_drawable_unref(red);
+        g_free(clip);
+    }
+
+    memslot_info_destroy(&mem_info);
+}
 
 int main(int argc, char *argv[])
 {
@@ -324,5 +373,8 @@ int main(int argc, char *argv[])
     /* a circular list of small chunks should not be a problems */
     g_test_add_func("/server/qxl-parsing/circular-small-chunks", test_circular_small_chunks);
 
+    /* the clip of a drawable should be parsed whatever its size */
+    g_test_add_func("/server/qxl-parsing/fill-command-clip", test_fill_command_clip);
+
     return g_test_run();
 }
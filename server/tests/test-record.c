@@ -21,8 +21,10 @@
 #include <config.h>
 
 #include <unistd.h>
+#include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
+#include <stddef.h>
 
 #include "test-glib-compat.h"
 #include "red-record-qxl.h"
@@ -30,15 +32,68 @@
 #define OUTPUT_FILENAME "rec1.txt"
 
 static void
-test_record(bool compress)
+check_v2_content(FILE *f)
+{
+    RedRecordHeader header;
+    QXLDevSurfaceCreate surface;
+    uint8_t data[16];
+    unsigned int i;
+
+    g_assert_cmpint(fread(&header, sizeof(header), 1, f), ==, 1);
+    g_assert_cmpint(header.what, ==, RED_RECORD_EVENT_DEV_INPUT);
+    g_assert_cmpint(header.type, ==, 123);
+    g_assert_cmpint(header.size, ==, 0);
+
+    g_assert_cmpint(fread(&header, sizeof(header), 1, f), ==, 1);
+    g_assert_cmpint(header.what, ==, RED_RECORD_EVENT_PRIMARY_SURFACE);
+    g_assert_cmpint(header.n_relocs, ==, 1);
+    g_assert_cmpint(header.n_surface_ids, ==, 0);
+    g_assert_cmpint(header.extra_size, ==, 0);
+    g_assert_cmpint(header.size, ==, sizeof(uint32_t) + SPICE_ALIGN(sizeof(surface), 8) +
+                    sizeof(data));
+
+    uint32_t reloc;
+    g_assert_cmpint(fread(&reloc, sizeof(reloc), 1, f), ==, 1);
+    g_assert_cmpint(reloc, ==, offsetof(QXLDevSurfaceCreate, mem));
+
+    g_assert_cmpint(fread(&surface, sizeof(surface), 1, f), ==, 1);
+    g_assert_cmpint(surface.width, ==, 2);
+    g_assert_cmpint(surface.height, ==, 2);
+    g_assert_cmpint(surface.mem, ==, SPICE_ALIGN(sizeof(surface), 8));
+    for (i = sizeof(surface); i < surface.mem; i++) {
+        g_assert_cmpint(fgetc(f), ==, 0);
+    }
+    g_assert_cmpint(fread(data, sizeof(data), 1, f), ==, 1);
+    for (i = 0; i < sizeof(data); i++) {
+        g_assert_cmpint(data[i], ==, i);
+    }
+
+    g_assert_cmpint(fgetc(f), ==, EOF);
+}
+
+static void
+test_record(bool compress, const char *format)
 {
     RedRecord *rec;
     const char *fn = OUTPUT_FILENAME;
+    uint8_t data[16];
+    QXLDevSurfaceCreate surface = {
+        .width = 2,
+        .height = 2,
+        .stride = 8,
+        .format = SPICE_SURFACE_FMT_32_xRGB,
+    };
+    unsigned int i;
+
+    for (i = 0; i < sizeof(data); i++) {
+        data[i] = i;
+    }
 
     g_unsetenv("SPICE_WORKER_RECORD_FILTER");
     if (compress) {
         g_setenv("SPICE_WORKER_RECORD_FILTER", "gzip", 1);
     }
+    g_setenv(RED_RECORD_FORMAT_ENV, format, 1);
 
     // delete possible stale test output
     unlink(fn);
@@ -56,6 +111,9 @@ test_record(bool compress)
 
     // record something
     red_record_event(rec, 1, 123);
+    if (strcmp(format, "2") == 0) {
+        red_record_primary_surface_create(rec, &surface, data);
+    }
 
     red_record_unref(rec);
 
@@ -92,14 +150,19 @@ test_record(bool compress)
     int version;
     g_assert_nonnull(fgets(line, sizeof(line), f));
     g_assert_cmpint(sscanf(line, "SPICE_REPLAY %d", &version), ==, 1);
+    g_assert_cmpint(version, ==, atoi(format));
 
-    int w, t;
-    g_assert_nonnull(fgets(line, sizeof(line), f));
-    g_assert_cmpint(sscanf(line, "event %*d %d %d", &w, &t), ==, 2);
-    g_assert_cmpint(w, ==, 1);
-    g_assert_cmpint(t, ==, 123);
+    if (version == 2) {
+        check_v2_content(f);
+    } else {
+        int w, t;
+        g_assert_nonnull(fgets(line, sizeof(line), f));
+        g_assert_cmpint(sscanf(line, "event %*d %d %d", &w, &t), ==, 2);
+        g_assert_cmpint(w, ==, 1);
+        g_assert_cmpint(t, ==, 123);
 
-    g_assert_null(fgets(line, sizeof(line), f));
+        g_assert_null(fgets(line, sizeof(line), f));
+    }
 
     if (!compress) {
         fclose(f);
@@ -114,10 +177,12 @@ test_record(bool compress)
 int
 main(void)
 {
-    test_record(false);
+    test_record(false, "1");
+    test_record(false, "2");
     // TODO implement on Windows
 #ifndef _WIN32
-    test_record(true);
+    test_record(true, "1");
+    test_record(true, "2");
 #endif
     return 0;
 }
@@ -0,0 +1,142 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2020 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+/**
+ * Test the detection of hot areas by StreamHeatmap
+ */
+
+#include <config.h>
+
+#include "test-glib-compat.h"
+#include "stream-heatmap.h"
+
+#define WIDTH 1024
+#define HEIGHT 768
+#define MAX_DELTA (NSEC_PER_SEC / 5)
+#define FRAME_DELTA (NSEC_PER_SEC / 25)
+#define MIN_FRAMES 20
+
+static SpiceRect make_rect(int32_t left, int32_t top, int32_t right, int32_t bottom)
+{
+    SpiceRect rect;
+
+    rect.left = left;
+    rect.top = top;
+    rect.right = right;
+    rect.bottom = bottom;
+    return rect;
+}
+
+static void test_tiles(void)
+{
+    StreamHeatmap heatmap;
+    SpiceRect video = make_rect(100, 100, 420, 340);
+    SpiceRect area;
+    uint32_t frames;
+    red_time_t first_frame_time, time = NSEC_PER_SEC;
+
+    stream_heatmap_init(&heatmap, WIDTH, HEIGHT, MAX_DELTA);
+
+    // each frame is painted in 4 tiles of changing size
+    for (int i = 0; i < MIN_FRAMES; i++, time += FRAME_DELTA) {
+        int32_t split_x = 200 + (i % 5) * 40;
+        int32_t split_y = 150 + (i % 3) * 50;
+        SpiceRect tiles[] = {
+            make_rect(video.left, video.top, split_x, split_y),
+            make_rect(split_x, video.top, video.right, split_y),
+            make_rect(video.left, split_y, split_x, video.bottom),
+            make_rect(split_x, split_y, video.right, video.bottom),
+        };
+
+        g_assert_false(stream_heatmap_get_hot_area(&heatmap, &tiles[0], time, MIN_FRAMES,
+                                                   &area, &frames, &first_frame_time));
+        for (auto &tile : tiles) {
+            stream_heatmap_update(&heatmap, &tile, time);
+        }
+    }
+
+    SpiceRect tile = make_rect(250, 200, 300, 250);
+    g_assert_true(stream_heatmap_get_hot_area(&heatmap, &tile, time, MIN_FRAMES,
+                                              &area, &frames, &first_frame_time));
+    g_assert_cmpuint(frames, ==, MIN_FRAMES);
+    g_assert_cmpint(first_frame_time, ==, NSEC_PER_SEC);
+    // the area is the video aligned to the cells
+    g_assert_cmpint(area.left, <=, video.left);
+    g_assert_cmpint(area.left, >, video.left - (1 << STREAM_HEATMAP_CELL_SHIFT));
+    g_assert_cmpint(area.top, <=, video.top);
+    g_assert_cmpint(area.top, >, video.top - (1 << STREAM_HEATMAP_CELL_SHIFT));
+    g_assert_cmpint(area.right, >=, video.right);
+    g_assert_cmpint(area.right, <, video.right + (1 << STREAM_HEATMAP_CELL_SHIFT));
+    g_assert_cmpint(area.bottom, >=, video.bottom);
+    g_assert_cmpint(area.bottom, <, video.bottom + (1 << STREAM_HEATMAP_CELL_SHIFT));
+
+    // the video stopped
+    time += MAX_DELTA + 1;
+    g_assert_false(stream_heatmap_get_hot_area(&heatmap, &tile, time, MIN_FRAMES,
+                                               &area, &frames, &first_frame_time));
+    stream_heatmap_update(&heatmap, &video, time);
+    g_assert_false(stream_heatmap_get_hot_area(&heatmap, &tile, time, MIN_FRAMES,
+                                               &area, &frames, &first_frame_time));
+
+    stream_heatmap_destroy(&heatmap);
+}
+
+static void test_same_frame(void)
+{
+    StreamHeatmap heatmap;
+    SpiceRect rect = make_rect(0, 0, 200, 200);
+    SpiceRect area;
+    uint32_t frames;
+    red_time_t first_frame_time, time = NSEC_PER_SEC;
+
+    stream_heatmap_init(&heatmap, WIDTH, HEIGHT, MAX_DELTA);
+
+    // updates close in time are a single frame
+    for (int i = 0; i < MIN_FRAMES * 2; i++) {
+        stream_heatmap_update(&heatmap, &rect, time + i);
+    }
+    g_assert_true(stream_heatmap_get_hot_area(&heatmap, &rect, time, 1,
+                                              &area, &frames, &first_frame_time));
+    g_assert_cmpuint(frames, ==, 1);
+
+    for (int i = 1; i < MIN_FRAMES; i++) {
+        stream_heatmap_update(&heatmap, &rect, time + i * FRAME_DELTA);
+    }
+    time += (MIN_FRAMES - 1) * FRAME_DELTA;
+    g_assert_true(stream_heatmap_get_hot_area(&heatmap, &rect, time, MIN_FRAMES,
+                                              &area, &frames, &first_frame_time));
+    // not hot if some cells are not updated
+    SpiceRect larger = make_rect(0, 0, 300, 200);
+    g_assert_false(stream_heatmap_get_hot_area(&heatmap, &larger, time, MIN_FRAMES,
+                                               &area, &frames, &first_frame_time));
+
+    stream_heatmap_clear(&heatmap);
+    g_assert_false(stream_heatmap_get_hot_area(&heatmap, &rect, time, 1,
+                                               &area, &frames, &first_frame_time));
+
+    stream_heatmap_destroy(&heatmap);
+}
+
+int main(int argc, char *argv[])
+{
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_func("/server/stream-heatmap/tiles", test_tiles);
+    g_test_add_func("/server/stream-heatmap/same-frame", test_same_frame);
+
+    return g_test_run();
+}
@@ -0,0 +1,185 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2020 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+/**
+ * Test the SurfaceGrid index of the surface tree items
+ */
+
+#include <config.h>
+
+#include "test-glib-compat.h"
+#include "surface-grid.h"
+
+#define CELL_SIZE (1 << SURFACE_GRID_CELL_SHIFT)
+
+typedef struct TestItem {
+    SurfaceGridItem grid_item;
+    int reported;
+} TestItem;
+
+static void set_rect(SpiceRect *rect, int32_t left, int32_t top, int32_t right, int32_t bottom)
+{
+    rect->left = left;
+    rect->top = top;
+    rect->right = right;
+    rect->bottom = bottom;
+}
+
+static void count_item(SurfaceGridItem *grid_item, void *opaque)
+{
+    TestItem *item = SPICE_CONTAINEROF(grid_item, TestItem, grid_item);
+
+    item->reported++;
+    (*(int *) opaque)++;
+}
+
+// returns the number of items reported for @rect, each item counting the
+// times it was reported
+static int lookup(SurfaceGrid *grid, int32_t left, int32_t top, int32_t right, int32_t bottom)
+{
+    SpiceRect rect;
+    int count = 0;
+
+    set_rect(&rect, left, top, right, bottom);
+    surface_grid_foreach(grid, &rect, count_item, &count);
+    return count;
+}
+
+static bool intersects(SurfaceGrid *grid, int32_t left, int32_t top, int32_t right, int32_t bottom)
+{
+    SpiceRect rect;
+
+    set_rect(&rect, left, top, right, bottom);
+    return surface_grid_intersects(grid, &rect);
+}
+
+static void add(SurfaceGrid *grid, TestItem *item,
+                int32_t left, int32_t top, int32_t right, int32_t bottom)
+{
+    SpiceRect rect;
+
+    set_rect(&rect, left, top, right, bottom);
+    item->reported = 0;
+    surface_grid_add(grid, &item->grid_item, &rect);
+}
+
+static void test_add_remove(void)
+{
+    SurfaceGrid grid;
+    TestItem small, wide;
+
+    surface_grid_init(&grid, 4 * CELL_SIZE, 2 * CELL_SIZE);
+    g_assert_false(intersects(&grid, 0, 0, 4 * CELL_SIZE, 2 * CELL_SIZE));
+
+    add(&grid, &small, 10, 10, 20, 20);
+    g_assert_true(intersects(&grid, 0, 0, CELL_SIZE, CELL_SIZE));
+    // the items are only known at the cell level
+    g_assert_true(intersects(&grid, 30, 30, 40, 40));
+    g_assert_false(intersects(&grid, CELL_SIZE, 0, 2 * CELL_SIZE, CELL_SIZE));
+    g_assert_false(intersects(&grid, 0, CELL_SIZE, CELL_SIZE, 2 * CELL_SIZE));
+    // empty rectangles don't intersect anything
+    g_assert_false(intersects(&grid, 15, 15, 15, 20));
+
+    // an item touching several cells is reported once
+    add(&grid, &wide, CELL_SIZE - 4, 0, 2 * CELL_SIZE + 4, 10);
+    g_assert_cmpint(lookup(&grid, 0, 0, 4 * CELL_SIZE, 2 * CELL_SIZE), ==, 2);
+    g_assert_cmpint(small.reported, ==, 1);
+    g_assert_cmpint(wide.reported, ==, 1);
+    // only the items of the cells of the area are visited
+    g_assert_cmpint(lookup(&grid, 2 * CELL_SIZE, 0, 2 * CELL_SIZE + 1, 1), ==, 1);
+    g_assert_cmpint(small.reported, ==, 1);
+    g_assert_cmpint(wide.reported, ==, 2);
+    g_assert_cmpint(lookup(&grid, 3 * CELL_SIZE, 0, 4 * CELL_SIZE, 2 * CELL_SIZE), ==, 0);
+
+    surface_grid_remove(&small.grid_item);
+    g_assert_cmpint(lookup(&grid, 0, 0, CELL_SIZE, CELL_SIZE), ==, 1);
+    g_assert_cmpint(small.reported, ==, 1);
+    g_assert_true(intersects(&grid, 0, 0, CELL_SIZE, CELL_SIZE));
+    // removing twice is harmless
+    surface_grid_remove(&small.grid_item);
+
+    surface_grid_remove(&wide.grid_item);
+    g_assert_false(intersects(&grid, 0, 0, 4 * CELL_SIZE, 2 * CELL_SIZE));
+    g_assert_cmpint(lookup(&grid, 0, 0, 4 * CELL_SIZE, 2 * CELL_SIZE), ==, 0);
+
+    surface_grid_destroy(&grid);
+}
+
+static void test_outside(void)
+{
+    SurfaceGrid grid;
+    TestItem item;
+
+    surface_grid_init(&grid, 4 * CELL_SIZE, 2 * CELL_SIZE);
+
+    // the areas outside the surface are accounted to the border cells
+    add(&grid, &item, -50, -50, -10, -10);
+    g_assert_true(intersects(&grid, -20, -20, -15, -15));
+    g_assert_cmpint(lookup(&grid, 0, 0, 1, 1), ==, 1);
+    g_assert_false(intersects(&grid, CELL_SIZE, 0, 4 * CELL_SIZE, 2 * CELL_SIZE));
+    g_assert_false(intersects(&grid, 4 * CELL_SIZE + 10, 0, 4 * CELL_SIZE + 20, 10));
+    surface_grid_remove(&item.grid_item);
+    g_assert_false(intersects(&grid, -20, -20, -15, -15));
+
+    add(&grid, &item, 4 * CELL_SIZE - 1, 2 * CELL_SIZE - 1, 10000, 10000);
+    g_assert_true(intersects(&grid, 5000, 5000, 5001, 5001));
+    g_assert_false(intersects(&grid, 0, 0, 3 * CELL_SIZE, 2 * CELL_SIZE));
+    surface_grid_remove(&item.grid_item);
+
+    surface_grid_destroy(&grid);
+}
+
+// a copy-bits drawable is indexed with its destination while its shadow is
+// indexed with the source rectangle of the copy
+static void test_copy_bits(void)
+{
+    SurfaceGrid grid;
+    TestItem dest, shadow;
+
+    surface_grid_init(&grid, 4 * CELL_SIZE, 2 * CELL_SIZE);
+
+    add(&grid, &dest, 2 * CELL_SIZE, 0, 3 * CELL_SIZE, CELL_SIZE);
+    add(&grid, &shadow, 0, CELL_SIZE, CELL_SIZE, 2 * CELL_SIZE);
+
+    g_assert_cmpint(lookup(&grid, 10, CELL_SIZE + 10, 20, CELL_SIZE + 20), ==, 1);
+    g_assert_cmpint(shadow.reported, ==, 1);
+    g_assert_cmpint(dest.reported, ==, 0);
+    g_assert_cmpint(lookup(&grid, 2 * CELL_SIZE + 10, 10, 2 * CELL_SIZE + 20, 20), ==, 1);
+    g_assert_cmpint(dest.reported, ==, 1);
+    g_assert_cmpint(shadow.reported, ==, 1);
+    // nothing was drawn or copied between the two rectangles
+    g_assert_false(intersects(&grid, CELL_SIZE, 0, 2 * CELL_SIZE, 2 * CELL_SIZE));
+
+    // once the copy is drawn the source area is free
+    surface_grid_remove(&shadow.grid_item);
+    g_assert_false(intersects(&grid, 0, CELL_SIZE, CELL_SIZE, 2 * CELL_SIZE));
+    g_assert_true(intersects(&grid, 2 * CELL_SIZE, 0, 3 * CELL_SIZE, CELL_SIZE));
+    surface_grid_remove(&dest.grid_item);
+
+    surface_grid_destroy(&grid);
+}
+
+int main(int argc, char *argv[])
+{
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_func("/server/surface-grid/add-remove", test_add_remove);
+    g_test_add_func("/server/surface-grid/outside", test_outside);
+    g_test_add_func("/server/surface-grid/copy-bits", test_copy_bits);
+
+    return g_test_run();
+}
@@ -0,0 +1,170 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2020 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+/**
+ * Test the frame cache of VideoEncoderGroup
+ */
+
+#include <config.h>
+#include <string.h>
+
+#include "test-glib-compat.h"
+#include "video-encoder.h"
+
+// frames kept by the group, see GROUP_CACHED_FRAMES
+#define CACHED_FRAMES 4
+
+static int encoded_frames;
+static int bitmap_refs;
+
+static void bitmap_ref(gpointer data)
+{
+    bitmap_refs++;
+}
+
+static void bitmap_unref(gpointer data)
+{
+    bitmap_refs--;
+}
+
+static void fake_buffer_free(VideoBuffer *buffer)
+{
+    g_free(buffer->data);
+    g_free(buffer);
+}
+
+static VideoEncodeResults fake_encode_frame(VideoEncoder *encoder, uint32_t frame_mm_time,
+                                            const SpiceBitmap *bitmap,
+                                            const SpiceRect *src, int top_down,
+                                            gpointer bitmap_opaque, VideoBuffer **outbuf)
+{
+    VideoBuffer *buffer = g_new0(VideoBuffer, 1);
+    int *index = g_new(int, 1);
+
+    // the data identifies the compression
+    *index = encoded_frames;
+    buffer->data = (uint8_t *) index;
+    buffer->size = sizeof(*index);
+    buffer->free = fake_buffer_free;
+    *outbuf = buffer;
+    encoded_frames++;
+    return VIDEO_ENCODER_FRAME_ENCODE_DONE;
+}
+
+static void fake_destroy(VideoEncoder *encoder)
+{
+    g_free(encoder);
+}
+
+static VideoEncoder *fake_encoder_new(SpiceVideoCodecType codec_type,
+                                      uint64_t starting_bit_rate,
+                                      VideoEncoderRateControlCbs *cbs,
+                                      bitmap_ref_t bitmap_ref,
+                                      bitmap_unref_t bitmap_unref)
+{
+    VideoEncoder *encoder = g_new0(VideoEncoder, 1);
+
+    encoder->destroy = fake_destroy;
+    encoder->encode_frame = fake_encode_frame;
+    encoder->codec_type = codec_type;
+    return encoder;
+}
+
+static uint32_t get_roundtrip_ms(void *opaque)
+{
+    return 10;
+}
+
+static uint32_t get_source_fps(void *opaque)
+{
+    return 25;
+}
+
+// encodes the frame @frame_mm_time of the bitmap @opaque,
+// returns the index of the compression which produced it
+static int encode(VideoEncoder *encoder, uint32_t frame_mm_time, int opaque)
+{
+    SpiceBitmap bitmap = {};
+    SpiceRect src = {};
+    VideoBuffer *buffer = NULL;
+    int index;
+
+    g_assert_cmpint(encoder->encode_frame(encoder, frame_mm_time, &bitmap, &src, TRUE,
+                                          GINT_TO_POINTER(opaque), &buffer),
+                    ==, VIDEO_ENCODER_FRAME_ENCODE_DONE);
+    g_assert_nonnull(buffer);
+    g_assert_cmpuint(buffer->size, ==, sizeof(index));
+    memcpy(&index, buffer->data, sizeof(index));
+    buffer->free(buffer);
+    return index;
+}
+
+static void test_shared_cache(void)
+{
+    VideoEncoderRateControlCbs cbs = {};
+    VideoEncoderGroup *group;
+    VideoEncoder *first, *second;
+    int i;
+
+    encoded_frames = 0;
+    bitmap_refs = 0;
+    cbs.get_roundtrip_ms = get_roundtrip_ms;
+    cbs.get_source_fps = get_source_fps;
+
+    group = video_encoder_group_new(fake_encoder_new, SPICE_VIDEO_CODEC_TYPE_MJPEG, 0,
+                                    bitmap_ref, bitmap_unref);
+    g_assert_nonnull(group);
+    first = video_encoder_group_join(group, &cbs);
+    second = video_encoder_group_join(group, &cbs);
+    video_encoder_group_unref(group);
+
+    // the same frame is compressed once for both clients
+    g_assert_cmpint(encode(first, 100, 1), ==, 0);
+    g_assert_cmpint(encode(second, 100, 1), ==, 0);
+    g_assert_cmpint(encoded_frames, ==, 1);
+
+    // the first client moves ahead, the cache only keeps its last frames
+    for (i = 1; i <= CACHED_FRAMES; i++) {
+        g_assert_cmpint(encode(first, 100 + i * 40, 1 + i), ==, i);
+    }
+    g_assert_cmpint(encoded_frames, ==, CACHED_FRAMES + 1);
+    g_assert_cmpint(bitmap_refs, ==, CACHED_FRAMES);
+
+    // the second client fell behind, its frame is compressed again
+    // without replacing the frames the first client sent
+    g_assert_cmpint(encode(second, 100, 1), ==, CACHED_FRAMES + 1);
+    g_assert_cmpint(encoded_frames, ==, CACHED_FRAMES + 2);
+    g_assert_cmpint(bitmap_refs, ==, CACHED_FRAMES);
+    for (i = 1; i <= CACHED_FRAMES; i++) {
+        g_assert_cmpint(encode(second, 100 + i * 40, 1 + i), ==, i);
+    }
+    g_assert_cmpint(encoded_frames, ==, CACHED_FRAMES + 2);
+
+    first->destroy(first);
+    second->destroy(second);
+    // the group released the cached bitmaps
+    g_assert_cmpint(bitmap_refs, ==, 0);
+}
+
+int main(int argc, char *argv[])
+{
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_func("/server/video-encoder-group/shared-cache", test_shared_cache);
+
+    return g_test_run();
+}
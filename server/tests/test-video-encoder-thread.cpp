@@ -0,0 +1,294 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2020 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+/**
+ * Test the frames of the encoder thread wrapper, see video_encoder_thread_new()
+ */
+
+#include <config.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "test-glib-compat.h"
+#include "video-encoder.h"
+
+// frames waiting for the thread, see MAX_QUEUED_FRAMES
+#define MAX_QUEUED_FRAMES 2
+// a running frame, the waiting frames and one more
+#define N_FRAMES (MAX_QUEUED_FRAMES + 2)
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+// the fake encoder compresses frames while less than @allowed_frames
+// were compressed, it waits otherwise
+static int allowed_frames;
+static int started_frames;
+static int encoded_frames;
+static int server_frame_drops;
+static int done_frames;
+static int bitmap_refs;
+static int buffers;
+
+static void bitmap_ref(gpointer data)
+{
+    g_atomic_int_inc(&bitmap_refs);
+}
+
+static void bitmap_unref(gpointer data)
+{
+    g_atomic_int_add(&bitmap_refs, -1);
+}
+
+static void fake_buffer_free(VideoBuffer *buffer)
+{
+    g_free(buffer);
+    g_atomic_int_add(&buffers, -1);
+}
+
+static VideoEncodeResults fake_encode_frame(VideoEncoder *encoder, uint32_t frame_mm_time,
+                                            const SpiceBitmap *bitmap,
+                                            const SpiceRect *src, int top_down,
+                                            gpointer bitmap_opaque, VideoBuffer **outbuf)
+{
+    VideoBuffer *buffer;
+
+    pthread_mutex_lock(&lock);
+    started_frames++;
+    pthread_cond_broadcast(&cond);
+    while (encoded_frames >= allowed_frames) {
+        pthread_cond_wait(&cond, &lock);
+    }
+    encoded_frames++;
+    pthread_mutex_unlock(&lock);
+
+    buffer = g_new0(VideoBuffer, 1);
+    buffer->free = fake_buffer_free;
+    g_atomic_int_inc(&buffers);
+    *outbuf = buffer;
+    return VIDEO_ENCODER_FRAME_ENCODE_DONE;
+}
+
+static void fake_notify_server_frame_drop(VideoEncoder *encoder)
+{
+    pthread_mutex_lock(&lock);
+    server_frame_drops++;
+    pthread_mutex_unlock(&lock);
+}
+
+static uint64_t fake_get_bit_rate(VideoEncoder *encoder)
+{
+    return 1000000;
+}
+
+static void fake_get_stats(VideoEncoder *encoder, VideoEncoderStats *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+}
+
+static void fake_destroy(VideoEncoder *encoder)
+{
+    g_free(encoder);
+}
+
+static VideoEncoder *fake_encoder_new(SpiceVideoCodecType codec_type,
+                                      uint64_t starting_bit_rate,
+                                      VideoEncoderRateControlCbs *cbs,
+                                      bitmap_ref_t bitmap_ref,
+                                      bitmap_unref_t bitmap_unref)
+{
+    VideoEncoder *encoder = g_new0(VideoEncoder, 1);
+
+    encoder->destroy = fake_destroy;
+    encoder->encode_frame = fake_encode_frame;
+    encoder->notify_server_frame_drop = fake_notify_server_frame_drop;
+    encoder->get_bit_rate = fake_get_bit_rate;
+    encoder->get_stats = fake_get_stats;
+    encoder->codec_type = codec_type;
+    return encoder;
+}
+
+static void frame_done(void *opaque)
+{
+    g_assert_true(opaque == &done_frames);
+    g_atomic_int_inc(&done_frames);
+}
+
+static VideoEncoder *thread_encoder_new(void)
+{
+    VideoEncoderRateControlCbs cbs = {};
+    VideoEncoder *encoder;
+
+    pthread_mutex_lock(&lock);
+    allowed_frames = started_frames = encoded_frames = server_frame_drops = 0;
+    pthread_mutex_unlock(&lock);
+    done_frames = bitmap_refs = buffers = 0;
+
+    encoder = video_encoder_thread_new(fake_encoder_new, SPICE_VIDEO_CODEC_TYPE_MJPEG, 0, &cbs,
+                                       bitmap_ref, bitmap_unref, frame_done, &done_frames);
+    g_assert_nonnull(encoder);
+    g_assert_nonnull(encoder->submit_frame);
+    return encoder;
+}
+
+static VideoEncoderFrame *submit(VideoEncoder *encoder, uint32_t frame_mm_time)
+{
+    SpiceBitmap bitmap = {};
+    SpiceRect src = {};
+
+    return encoder->submit_frame(encoder, frame_mm_time, &bitmap, &src, TRUE, NULL);
+}
+
+static void allow_frames(int n_frames)
+{
+    pthread_mutex_lock(&lock);
+    allowed_frames = n_frames;
+    pthread_cond_broadcast(&cond);
+    pthread_mutex_unlock(&lock);
+}
+
+// waits for the thread to be compressing its @n_frames th frame
+static void wait_started_frames(int n_frames)
+{
+    pthread_mutex_lock(&lock);
+    while (started_frames < n_frames) {
+        pthread_cond_wait(&cond, &lock);
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+static VideoEncodeResults complete(VideoEncoderFrame *frame)
+{
+    VideoBuffer *outbuf = NULL;
+    VideoEncodeResults result = video_encoder_frame_complete(frame, &outbuf);
+
+    if (result == VIDEO_ENCODER_FRAME_ENCODE_DONE) {
+        g_assert_nonnull(outbuf);
+        outbuf->free(outbuf);
+    } else {
+        g_assert_null(outbuf);
+    }
+    return result;
+}
+
+static void test_drop_oldest(void)
+{
+    VideoEncoder *encoder = thread_encoder_new();
+    VideoEncoderFrame *frames[N_FRAMES];
+    int i;
+
+    // the first frame keeps the thread busy
+    frames[0] = submit(encoder, 0);
+    wait_started_frames(1);
+    for (i = 1; i <= MAX_QUEUED_FRAMES; i++) {
+        frames[i] = submit(encoder, i * 40);
+        g_assert_false(video_encoder_frame_is_done(frames[i]));
+    }
+
+    // one frame too many, the oldest waiting one is dropped
+    frames[i] = submit(encoder, i * 40);
+    g_assert_true(video_encoder_frame_is_done(frames[1]));
+    g_assert_cmpint(complete(frames[1]), ==, VIDEO_ENCODER_FRAME_DROP);
+    g_assert_false(video_encoder_frame_is_done(frames[0]));
+
+    allow_frames(N_FRAMES);
+    g_assert_cmpint(complete(frames[0]), ==, VIDEO_ENCODER_FRAME_ENCODE_DONE);
+    for (i = 2; i < N_FRAMES; i++) {
+        g_assert_cmpint(complete(frames[i]), ==, VIDEO_ENCODER_FRAME_ENCODE_DONE);
+    }
+    // the drop was reported to the encoder by the thread before the
+    // next frame
+    g_assert_cmpint(server_frame_drops, ==, 1);
+    g_assert_cmpint(encoded_frames, ==, N_FRAMES - 1);
+    g_assert_cmpint(done_frames, ==, N_FRAMES - 1);
+
+    encoder->destroy(encoder);
+    g_assert_cmpint(bitmap_refs, ==, 0);
+    g_assert_cmpint(buffers, ==, 0);
+}
+
+static void test_release(void)
+{
+    VideoEncoder *encoder = thread_encoder_new();
+    VideoEncoderFrame *running, *queued, *done;
+    int n_buffers;
+
+    running = submit(encoder, 0);
+    wait_started_frames(1);
+    queued = submit(encoder, 40);
+    g_assert_cmpint(bitmap_refs, ==, 2);
+
+    // a queued frame is released at once and never compressed
+    video_encoder_frame_release(queued);
+    g_assert_cmpint(bitmap_refs, ==, 1);
+
+    // a running frame is released once compressed
+    video_encoder_frame_release(running);
+    g_assert_cmpint(bitmap_refs, ==, 1);
+    allow_frames(2);
+
+    // a done frame is released with its buffer
+    done = submit(encoder, 80);
+    while (!video_encoder_frame_is_done(done)) {
+        g_usleep(1000);
+    }
+    n_buffers = buffers;
+    video_encoder_frame_release(done);
+    g_assert_cmpint(buffers, ==, n_buffers - 1);
+    g_assert_cmpint(encoded_frames, ==, 2);
+    g_assert_cmpint(done_frames, ==, 2);
+
+    encoder->destroy(encoder);
+    g_assert_cmpint(bitmap_refs, ==, 0);
+    g_assert_cmpint(buffers, ==, 0);
+}
+
+static void test_complete_after_destroy(void)
+{
+    VideoEncoder *encoder = thread_encoder_new();
+    VideoEncoderFrame *running, *queued;
+    VideoEncodeResults result;
+
+    running = submit(encoder, 0);
+    wait_started_frames(1);
+    queued = submit(encoder, 40);
+
+    // the running frame is finished before the thread stops, the queued
+    // one is either compressed before or dropped
+    allow_frames(2);
+    encoder->destroy(encoder);
+
+    g_assert_true(video_encoder_frame_is_done(running));
+    g_assert_true(video_encoder_frame_is_done(queued));
+    g_assert_cmpint(complete(running), ==, VIDEO_ENCODER_FRAME_ENCODE_DONE);
+    result = complete(queued);
+    g_assert_true(result == VIDEO_ENCODER_FRAME_ENCODE_DONE ||
+                  result == VIDEO_ENCODER_FRAME_DROP);
+    g_assert_cmpint(bitmap_refs, ==, 0);
+    g_assert_cmpint(buffers, ==, 0);
+}
+
+int main(int argc, char *argv[])
+{
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_func("/server/video-encoder-thread/drop-oldest", test_drop_oldest);
+    g_test_add_func("/server/video-encoder-thread/release", test_release);
+    g_test_add_func("/server/video-encoder-thread/complete-after-destroy",
+                    test_complete_after_destroy);
+
+    return g_test_run();
+}
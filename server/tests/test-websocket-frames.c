@@ -0,0 +1,356 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2020 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+/**
+ * Test the framing of RedsWebSocket over an in memory stream,
+ * test-websocket checks the protocol against the Autobahn Test Suite
+ */
+
+#include <config.h>
+#include <string.h>
+#include <errno.h>
+
+#include "test-glib-compat.h"
+#include "websocket.h"
+
+#define MAX_PAYLOAD 100
+
+typedef struct {
+    GByteArray *in;
+    // bytes of @in the client sent so far
+    size_t in_avail;
+    size_t in_pos;
+    // bytes accepted by each read or write, 0 for no limit
+    size_t max_read;
+    size_t max_write;
+    GByteArray *out;
+} FakeStream;
+
+static ssize_t fake_read(void *opaque, void *buf, size_t nbyte)
+{
+    FakeStream *stream = opaque;
+    size_t len = MIN(nbyte, stream->in_avail - stream->in_pos);
+
+    if (stream->max_read) {
+        len = MIN(len, stream->max_read);
+    }
+    if (len == 0) {
+        errno = EAGAIN;
+        return -1;
+    }
+    memcpy(buf, stream->in->data + stream->in_pos, len);
+    stream->in_pos += len;
+    return len;
+}
+
+static ssize_t fake_write(void *opaque, const void *buf, size_t nbyte)
+{
+    FakeStream *stream = opaque;
+    size_t len = stream->max_write ? MIN(nbyte, stream->max_write) : nbyte;
+
+    g_byte_array_append(stream->out, buf, len);
+    return len;
+}
+
+static ssize_t fake_writev(void *opaque, struct iovec *iov, int iovcnt)
+{
+    FakeStream *stream = opaque;
+    ssize_t written = 0;
+    int i;
+
+    for (i = 0; i < iovcnt; i++) {
+        size_t len = iov[i].iov_len;
+
+        if (stream->max_write) {
+            len = MIN(len, stream->max_write - written);
+        }
+        g_byte_array_append(stream->out, iov[i].iov_base, len);
+        written += len;
+        if (len < iov[i].iov_len) {
+            break;
+        }
+    }
+    return written;
+}
+
+static RedsWebSocket *websocket_connect(FakeStream *stream)
+{
+    static const char request[] =
+        "GET / HTTP/1.1\r\n"
+        "Host: localhost\r\n"
+        "Upgrade: websocket\r\n"
+        "Connection: Upgrade\r\n"
+        "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+        "Sec-WebSocket-Protocol: binary\r\n"
+        "\r\n";
+    RedsWebSocket *ws;
+
+    memset(stream, 0, sizeof(*stream));
+    stream->in = g_byte_array_new();
+    stream->out = g_byte_array_new();
+    g_byte_array_append(stream->in, (const uint8_t *) request, strlen(request));
+    stream->in_avail = stream->in->len;
+
+    ws = websocket_new("", 0, stream, fake_read, fake_write, fake_writev);
+    g_assert_nonnull(ws);
+    g_assert_cmpuint(stream->out->len, >, 13);
+    g_assert_cmpint(memcmp(stream->out->data, "HTTP/1.1 101 ", 13), ==, 0);
+
+    g_byte_array_set_size(stream->in, 0);
+    g_byte_array_set_size(stream->out, 0);
+    stream->in_avail = stream->in_pos = 0;
+    return ws;
+}
+
+static void websocket_disconnect(RedsWebSocket *ws, FakeStream *stream)
+{
+    websocket_free(ws);
+    g_byte_array_free(stream->in, TRUE);
+    g_byte_array_free(stream->out, TRUE);
+}
+
+// append a binary frame sent by the client, masked as clients must
+static void client_send(FakeStream *stream, const uint8_t *payload, size_t len)
+{
+    static const uint8_t mask[4] = { 0x12, 0x34, 0x56, 0x78 };
+    uint8_t header[8];
+    size_t header_len = 2;
+    size_t i;
+
+    header[0] = WEBSOCKET_BINARY_FINAL;
+    if (len < 126) {
+        header[1] = 0x80 | len;
+    } else {
+        header[1] = 0x80 | 126;
+        header[2] = len >> 8;
+        header[3] = len & 0xff;
+        header_len = 4;
+    }
+    memcpy(header + header_len, mask, sizeof(mask));
+    g_byte_array_append(stream->in, header, header_len + sizeof(mask));
+    for (i = 0; i < len; i++) {
+        uint8_t byte = payload[i] ^ mask[i % 4];
+        g_byte_array_append(stream->in, &byte, 1);
+    }
+    stream->in_avail = stream->in->len;
+}
+
+// check that @stream->out starts with a frame of @payload, consumes it
+static void check_server_frame(FakeStream *stream, const uint8_t *payload, size_t len)
+{
+    const uint8_t *data = stream->out->data;
+    size_t header_len = 2;
+    size_t frame_len;
+
+    g_assert_cmpuint(stream->out->len, >=, 2);
+    g_assert_cmpuint(data[0], ==, WEBSOCKET_BINARY_FINAL);
+    // the server does not mask
+    g_assert_cmpuint(data[1] & 0x80, ==, 0);
+    frame_len = data[1] & 0x7f;
+    if (frame_len == 126) {
+        g_assert_cmpuint(stream->out->len, >=, 4);
+        frame_len = (data[2] << 8) | data[3];
+        header_len = 4;
+    }
+    g_assert_cmpuint(frame_len, ==, len);
+    g_assert_cmpuint(stream->out->len, >=, header_len + len);
+    g_assert_cmpint(memcmp(data + header_len, payload, len), ==, 0);
+    g_byte_array_remove_range(stream->out, 0, header_len + len);
+}
+
+static void fill_payload(uint8_t *payload, size_t len)
+{
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        payload[i] = g_test_rand_int_range(0, 256);
+    }
+}
+
+static void test_unmask(void)
+{
+    uint8_t payload[MAX_PAYLOAD];
+    // one more byte to read at odd addresses
+    uint8_t buf[MAX_PAYLOAD + 1];
+    size_t len, chunk;
+
+    // reads of @chunk bytes unmask from offsets of the frame which are
+    // not multiples of the mask or vector sizes
+    for (len = 1; len < MAX_PAYLOAD; len++) {
+        for (chunk = 1; chunk <= 33; chunk += 4) {
+            FakeStream stream;
+            RedsWebSocket *ws = websocket_connect(&stream);
+            unsigned flags;
+            size_t pos = 0;
+
+            fill_payload(payload, len);
+            client_send(&stream, payload, len);
+            while (pos < len) {
+                int rc = websocket_read(ws, buf + 1 + pos, MIN(chunk, len - pos), &flags);
+                g_assert_cmpint(rc, >, 0);
+                pos += rc;
+            }
+            g_assert_cmpuint(flags, ==, WEBSOCKET_BINARY_FINAL);
+            g_assert_cmpint(memcmp(buf + 1, payload, len), ==, 0);
+
+            websocket_disconnect(ws, &stream);
+        }
+    }
+}
+
+static void test_split_header(void)
+{
+    FakeStream stream;
+    RedsWebSocket *ws = websocket_connect(&stream);
+    uint8_t payload[300];
+    uint8_t buf[sizeof(payload)];
+    size_t header_pos;
+    unsigned flags;
+    int rc;
+
+    // 16 bits length, the header takes 8 bytes
+    fill_payload(payload, sizeof(payload));
+    client_send(&stream, payload, sizeof(payload));
+
+    // the header is received a byte at a time, nothing to read yet
+    for (header_pos = 1; header_pos < 8; header_pos++) {
+        stream.in_avail = header_pos;
+        errno = 0;
+        rc = websocket_read(ws, buf, sizeof(buf), &flags);
+        g_assert_cmpint(rc, ==, -1);
+        g_assert_cmpint(errno, ==, EAGAIN);
+        g_assert_cmpuint(stream.in_pos, ==, header_pos);
+    }
+
+    stream.in_avail = stream.in->len;
+    rc = websocket_read(ws, buf, sizeof(buf), &flags);
+    g_assert_cmpint(rc, ==, sizeof(payload));
+    g_assert_cmpuint(flags, ==, WEBSOCKET_BINARY_FINAL);
+    g_assert_cmpint(memcmp(buf, payload, sizeof(payload)), ==, 0);
+
+    websocket_disconnect(ws, &stream);
+}
+
+static void test_frames_in_one_read(void)
+{
+    FakeStream stream;
+    RedsWebSocket *ws = websocket_connect(&stream);
+    uint8_t payloads[3][MAX_PAYLOAD];
+    static const size_t lens[3] = { 17, 1, MAX_PAYLOAD };
+    uint8_t buf[MAX_PAYLOAD * 3];
+    unsigned flags;
+    int i;
+
+    for (i = 0; i < 3; i++) {
+        fill_payload(payloads[i], lens[i]);
+        client_send(&stream, payloads[i], lens[i]);
+    }
+
+    // all the frames are available, a read returns one of them
+    for (i = 0; i < 3; i++) {
+        int rc = websocket_read(ws, buf, sizeof(buf), &flags);
+        g_assert_cmpint(rc, ==, lens[i]);
+        g_assert_cmpuint(flags, ==, WEBSOCKET_BINARY_FINAL);
+        g_assert_cmpint(memcmp(buf, payloads[i], lens[i]), ==, 0);
+    }
+    g_assert_cmpuint(stream.in_pos, ==, stream.in->len);
+    g_assert_cmpint(websocket_read(ws, buf, sizeof(buf), &flags), ==, -1);
+
+    websocket_disconnect(ws, &stream);
+}
+
+static void test_partial_header_write(void)
+{
+    FakeStream stream;
+    RedsWebSocket *ws = websocket_connect(&stream);
+    uint8_t payload[200];
+    struct iovec iov[2];
+    size_t sent = 0;
+
+    // the 4 bytes header is written in several calls
+    fill_payload(payload, sizeof(payload));
+    stream.max_write = 3;
+    while (sent < sizeof(payload)) {
+        int rc;
+
+        iov[0].iov_base = payload + sent;
+        iov[0].iov_len = MIN(50, sizeof(payload) - sent);
+        iov[1].iov_base = payload + sent + iov[0].iov_len;
+        iov[1].iov_len = sizeof(payload) - sent - iov[0].iov_len;
+        rc = websocket_writev(ws, iov, iov[1].iov_len ? 2 : 1, WEBSOCKET_BINARY_FINAL);
+        if (rc == -1) {
+            g_assert_cmpint(errno, ==, EAGAIN);
+            continue;
+        }
+        g_assert_cmpint(rc, >, 0);
+        sent += rc;
+    }
+    check_server_frame(&stream, payload, sizeof(payload));
+    g_assert_cmpuint(stream.out->len, ==, 0);
+
+    websocket_disconnect(ws, &stream);
+}
+
+static void test_batching(void)
+{
+    FakeStream stream;
+    RedsWebSocket *ws = websocket_connect(&stream);
+    uint8_t payload[MAX_PAYLOAD * 3];
+    uint8_t big[300];
+    size_t pos;
+
+    websocket_set_batching(ws, true);
+
+    // small messages are reported written but kept
+    fill_payload(payload, sizeof(payload));
+    for (pos = 0; pos < sizeof(payload); pos += MAX_PAYLOAD) {
+        g_assert_cmpint(websocket_write(ws, payload + pos, MAX_PAYLOAD, WEBSOCKET_BINARY_FINAL),
+                        ==, MAX_PAYLOAD);
+    }
+    g_assert_cmpuint(stream.out->len, ==, 0);
+
+    // and sent in a single frame
+    g_assert_cmpint(websocket_flush(ws), ==, 1);
+    check_server_frame(&stream, payload, sizeof(payload));
+    g_assert_cmpuint(stream.out->len, ==, 0);
+
+    // the batched messages go before the next message not batched
+    g_assert_cmpint(websocket_write(ws, payload, MAX_PAYLOAD, WEBSOCKET_BINARY_FINAL),
+                    ==, MAX_PAYLOAD);
+    fill_payload(big, sizeof(big));
+    websocket_set_batching(ws, false);
+    g_assert_cmpint(websocket_write(ws, big, sizeof(big), WEBSOCKET_BINARY_FINAL),
+                    ==, sizeof(big));
+    check_server_frame(&stream, payload, MAX_PAYLOAD);
+    check_server_frame(&stream, big, sizeof(big));
+    g_assert_cmpuint(stream.out->len, ==, 0);
+
+    websocket_disconnect(ws, &stream);
+}
+
+int main(int argc, char *argv[])
+{
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_func("/server/websocket/unmask", test_unmask);
+    g_test_add_func("/server/websocket/split-header", test_split_header);
+    g_test_add_func("/server/websocket/frames-in-one-read", test_frames_in_one_read);
+    g_test_add_func("/server/websocket/partial-header-write", test_partial_header_write);
+    g_test_add_func("/server/websocket/batching", test_batching);
+
+    return g_test_run();
+}
@@ -200,6 +200,7 @@ Shadow* shadow_new(DrawItem *item, const SpicePoint *delta)
     region_clone(&shadow->base.rgn, &item->base.rgn);
     region_offset(&shadow->base.rgn, delta->x, delta->y);
     ring_item_init(&shadow->base.siblings_link);
+    shadow->base.grid_item.grid = NULL;
     region_init(&shadow->on_hold);
     item->shadow = shadow;
 
@@ -217,9 +218,12 @@ Container* container_new(DrawItem *item)
 
     container->base.type = TREE_ITEM_TYPE_CONTAINER;
     container->base.container = item->base.container;
+    /* the container takes the place of the item */
+    container->base.seq = item->base.seq;
     item->base.container = container;
     item->container_root = TRUE;
     region_clone(&container->base.rgn, &item->base.rgn);
+    container->base.grid_item.grid = NULL;
     ring_item_init(&container->base.siblings_link);
     ring_add_after(&container->base.siblings_link, &item->base.siblings_link);
     ring_remove(&item->base.siblings_link);
@@ -234,6 +238,7 @@ void container_free(Container *container)
     spice_return_if_fail(ring_is_empty(&container->items));
 
     ring_remove(&container->base.siblings_link);
+    surface_grid_remove(&container->base.grid_item);
     region_destroy(&container->base.rgn);
     g_free(container);
 }
@@ -251,6 +256,7 @@ void container_cleanup(Container *container)
             ring_remove(&item->siblings_link);
             ring_add_after(&item->siblings_link, &container->base.siblings_link);
             item->container = container->base.container;
+            item->seq = container->base.seq;
         }
         container_free(container);
         container = next;
@@ -304,6 +310,7 @@ void draw_item_remove_shadow(DrawItem *item)
     shadow = item->shadow;
     item->shadow = NULL;
     ring_remove(&shadow->base.siblings_link);
+    surface_grid_remove(&shadow->base.grid_item);
     region_destroy(&shadow->base.rgn);
     region_destroy(&shadow->on_hold);
     g_free(shadow);
@@ -24,6 +24,7 @@
 #include <common/ring.h>
 
 #include "spice-bitmap-utils.h"
+#include "surface-grid.h"
 
 SPICE_BEGIN_DECLS
 
@@ -50,6 +51,11 @@ struct TreeItem {
      * tree, this region may be modified to exclude the portion of the item
      * that is obscured by other items */
     QRegion rgn;
+    /* order of the item among its siblings, decreasing from the head of the
+     * ring to its tail */
+    uint64_t seq;
+    /* entry of the item in the grid of its surface */
+    SurfaceGridItem grid_item;
 };
 
 /* A region "below" a copy, or the src region of the copy */
@@ -0,0 +1,334 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2020 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Clients of a stream sharing a VideoEncoder.
+ *
+ * Each client gets its own VideoEncoder which forwards to the shared one.
+ * The clients send the frames at different times, the last compressed
+ * frames are kept so that each one is only compressed for the first client
+ * sending it. The rate control callbacks of the shared encoder aggregate
+ * the ones of the clients, so it adapts to the slowest of them.
+ */
+
+#include <config.h>
+
+#include <string.h>
+#include <glib.h>
+
+#include "red-common.h"
+#include "video-encoder.h"
+
+/* frames kept for the clients late compared to the others */
+#define GROUP_CACHED_FRAMES 4
+
+/* a compressed frame, referenced by the cache and the clients sending it */
+typedef struct GroupFrameBuffer {
+    gint refs;
+    VideoBuffer *buffer;
+} GroupFrameBuffer;
+
+typedef struct GroupCachedFrame {
+    gpointer bitmap_opaque; /* NULL if unused */
+    uint32_t frame_mm_time;
+    VideoEncodeResults result;
+    GroupFrameBuffer *buffer;
+} GroupCachedFrame;
+
+/* the buffer returned to a client */
+typedef struct GroupVideoBuffer {
+    VideoBuffer base;
+    GroupFrameBuffer *buffer;
+} GroupVideoBuffer;
+
+typedef struct GroupMemberEncoder GroupMemberEncoder;
+
+struct VideoEncoderGroup {
+    int refs;
+    VideoEncoder *encoder;
+    bitmap_ref_t bitmap_ref;
+    bitmap_unref_t bitmap_unref;
+
+    GList *members;
+    GroupCachedFrame frames[GROUP_CACHED_FRAMES];
+};
+
+struct GroupMemberEncoder {
+    VideoEncoder base;
+    VideoEncoderGroup *group;
+    VideoEncoderRateControlCbs cbs;
+};
+
+static void group_frame_buffer_unref(GroupFrameBuffer *buffer)
+{
+    if (!buffer || !g_atomic_int_dec_and_test(&buffer->refs)) {
+        return;
+    }
+    buffer->buffer->free(buffer->buffer);
+    g_free(buffer);
+}
+
+static void group_video_buffer_free(VideoBuffer *video_buffer)
+{
+    GroupVideoBuffer *buffer = SPICE_CONTAINEROF(video_buffer, GroupVideoBuffer, base);
+
+    group_frame_buffer_unref(buffer->buffer);
+    g_free(buffer);
+}
+
+static void group_cached_frame_clear(VideoEncoderGroup *group, GroupCachedFrame *frame)
+{
+    if (!frame->bitmap_opaque) {
+        return;
+    }
+    group_frame_buffer_unref(frame->buffer);
+    if (group->bitmap_unref) {
+        group->bitmap_unref(frame->bitmap_opaque);
+    }
+    memset(frame, 0, sizeof(*frame));
+}
+
+void video_encoder_group_unref(VideoEncoderGroup *group)
+{
+    if (!group || --group->refs != 0) {
+        return;
+    }
+    spice_assert(group->members == NULL);
+    for (auto &frame : group->frames) {
+        group_cached_frame_clear(group, &frame);
+    }
+    group->encoder->destroy(group->encoder);
+    g_free(group);
+}
+
+static GroupCachedFrame *video_encoder_group_find_frame(VideoEncoderGroup *group,
+                                                        uint32_t frame_mm_time,
+                                                        gpointer bitmap_opaque)
+{
+    for (auto &frame : group->frames) {
+        /* the cache references the bitmap, its address is not reused */
+        if (frame.bitmap_opaque == bitmap_opaque && frame.frame_mm_time == frame_mm_time) {
+            return &frame;
+        }
+    }
+    return NULL;
+}
+
+/* Returns the entry to replace by a frame of @frame_mm_time, NULL if the
+ * frame is older than all the cached ones: the clients ahead already sent
+ * it, replacing a frame they didn't send yet would compress it twice */
+static GroupCachedFrame *video_encoder_group_get_free_frame(VideoEncoderGroup *group,
+                                                            uint32_t frame_mm_time)
+{
+    GroupCachedFrame *oldest = NULL;
+
+    for (auto &frame : group->frames) {
+        if (!frame.bitmap_opaque) {
+            return &frame;
+        }
+        if (!oldest || (int32_t) (frame.frame_mm_time - oldest->frame_mm_time) < 0) {
+            oldest = &frame;
+        }
+    }
+    if ((int32_t) (frame_mm_time - oldest->frame_mm_time) < 0) {
+        return NULL;
+    }
+    group_cached_frame_clear(group, oldest);
+    return oldest;
+}
+
+static VideoEncodeResults group_member_encode_frame(VideoEncoder *video_encoder,
+                                                    uint32_t frame_mm_time,
+                                                    const SpiceBitmap *bitmap,
+                                                    const SpiceRect *src, int top_down,
+                                                    gpointer bitmap_opaque,
+                                                    VideoBuffer **outbuf)
+{
+    GroupMemberEncoder *member = SPICE_CONTAINEROF(video_encoder, GroupMemberEncoder, base);
+    VideoEncoderGroup *group = member->group;
+    GroupCachedFrame *frame;
+
+    frame = video_encoder_group_find_frame(group, frame_mm_time, bitmap_opaque);
+    if (!frame && bitmap_opaque) {
+        frame = video_encoder_group_get_free_frame(group, frame_mm_time);
+    }
+    if (!frame) {
+        /* not shared with the other clients */
+        return group->encoder->encode_frame(group->encoder, frame_mm_time, bitmap,
+                                            src, top_down, bitmap_opaque, outbuf);
+    }
+    if (!frame->bitmap_opaque) {
+        VideoBuffer *buffer = NULL;
+
+        frame->result = group->encoder->encode_frame(group->encoder, frame_mm_time, bitmap,
+                                                     src, top_down, bitmap_opaque, &buffer);
+        frame->bitmap_opaque = bitmap_opaque;
+        frame->frame_mm_time = frame_mm_time;
+        if (group->bitmap_ref) {
+            group->bitmap_ref(bitmap_opaque);
+        }
+        if (frame->result == VIDEO_ENCODER_FRAME_ENCODE_DONE) {
+            frame->buffer = g_new(GroupFrameBuffer, 1);
+            frame->buffer->refs = 1;
+            frame->buffer->buffer = buffer;
+        }
+    }
+
+    if (frame->result == VIDEO_ENCODER_FRAME_ENCODE_DONE) {
+        GroupVideoBuffer *buffer = g_new0(GroupVideoBuffer, 1);
+
+        g_atomic_int_inc(&frame->buffer->refs);
+        buffer->buffer = frame->buffer;
+        buffer->base.data = frame->buffer->buffer->data;
+        buffer->base.size = frame->buffer->buffer->size;
+        buffer->base.free = group_video_buffer_free;
+        *outbuf = &buffer->base;
+    }
+    return frame->result;
+}
+
+static void group_member_client_stream_report(VideoEncoder *video_encoder,
+                                              uint32_t num_frames, uint32_t num_drops,
+                                              uint32_t start_frame_mm_time,
+                                              uint32_t end_frame_mm_time,
+                                              int32_t end_frame_delay, uint32_t audio_delay)
+{
+    GroupMemberEncoder *member = SPICE_CONTAINEROF(video_encoder, GroupMemberEncoder, base);
+    VideoEncoder *encoder = member->group->encoder;
+
+    /* the reports of all the clients are taken, so the bit rate is lowered
+     * as soon as one of them falls behind */
+    encoder->client_stream_report(encoder, num_frames, num_drops, start_frame_mm_time,
+                                  end_frame_mm_time, end_frame_delay, audio_delay);
+}
+
+static void group_member_notify_server_frame_drop(VideoEncoder *video_encoder)
+{
+    GroupMemberEncoder *member = SPICE_CONTAINEROF(video_encoder, GroupMemberEncoder, base);
+    VideoEncoder *encoder = member->group->encoder;
+
+    encoder->notify_server_frame_drop(encoder);
+}
+
+static uint64_t group_member_get_bit_rate(VideoEncoder *video_encoder)
+{
+    GroupMemberEncoder *member = SPICE_CONTAINEROF(video_encoder, GroupMemberEncoder, base);
+    VideoEncoder *encoder = member->group->encoder;
+
+    return encoder->get_bit_rate(encoder);
+}
+
+static void group_member_get_stats(VideoEncoder *video_encoder, VideoEncoderStats *stats)
+{
+    GroupMemberEncoder *member = SPICE_CONTAINEROF(video_encoder, GroupMemberEncoder, base);
+    VideoEncoder *encoder = member->group->encoder;
+
+    encoder->get_stats(encoder, stats);
+}
+
+static void group_member_destroy(VideoEncoder *video_encoder)
+{
+    GroupMemberEncoder *member = SPICE_CONTAINEROF(video_encoder, GroupMemberEncoder, base);
+    VideoEncoderGroup *group = member->group;
+
+    group->members = g_list_remove(group->members, member);
+    g_free(member);
+    video_encoder_group_unref(group);
+}
+
+/* rate control callbacks of the shared encoder */
+
+static uint32_t group_get_roundtrip_ms(void *opaque)
+{
+    VideoEncoderGroup *group = (VideoEncoderGroup *) opaque;
+    uint32_t roundtrip = 0;
+
+    for (GList *l = group->members; l; l = l->next) {
+        GroupMemberEncoder *member = (GroupMemberEncoder *) l->data;
+        roundtrip = MAX(roundtrip, member->cbs.get_roundtrip_ms(member->cbs.opaque));
+    }
+    return roundtrip;
+}
+
+static uint32_t group_get_source_fps(void *opaque)
+{
+    VideoEncoderGroup *group = (VideoEncoderGroup *) opaque;
+    uint32_t fps = 0;
+
+    for (GList *l = group->members; l; l = l->next) {
+        GroupMemberEncoder *member = (GroupMemberEncoder *) l->data;
+        fps = MAX(fps, member->cbs.get_source_fps(member->cbs.opaque));
+    }
+    return fps;
+}
+
+static void group_update_client_playback_delay(void *opaque, uint32_t delay_ms)
+{
+    VideoEncoderGroup *group = (VideoEncoderGroup *) opaque;
+
+    for (GList *l = group->members; l; l = l->next) {
+        GroupMemberEncoder *member = (GroupMemberEncoder *) l->data;
+        if (member->cbs.update_client_playback_delay) {
+            member->cbs.update_client_playback_delay(member->cbs.opaque, delay_ms);
+        }
+    }
+}
+
+VideoEncoderGroup *video_encoder_group_new(new_video_encoder_t create,
+                                           SpiceVideoCodecType codec_type,
+                                           uint64_t starting_bit_rate,
+                                           bitmap_ref_t bitmap_ref,
+                                           bitmap_unref_t bitmap_unref)
+{
+    VideoEncoderGroup *group = g_new0(VideoEncoderGroup, 1);
+    VideoEncoderRateControlCbs cbs;
+
+    cbs.opaque = group;
+    cbs.get_roundtrip_ms = group_get_roundtrip_ms;
+    cbs.get_source_fps = group_get_source_fps;
+    cbs.update_client_playback_delay = group_update_client_playback_delay;
+
+    group->refs = 1;
+    group->bitmap_ref = bitmap_ref;
+    group->bitmap_unref = bitmap_unref;
+    group->encoder = create(codec_type, starting_bit_rate, &cbs, bitmap_ref, bitmap_unref);
+    if (!group->encoder) {
+        g_free(group);
+        return NULL;
+    }
+    return group;
+}
+
+VideoEncoder *video_encoder_group_join(VideoEncoderGroup *group, VideoEncoderRateControlCbs *cbs)
+{
+    GroupMemberEncoder *member = g_new0(GroupMemberEncoder, 1);
+
+    member->group = group;
+    group->refs++;
+    member->cbs = *cbs;
+    group->members = g_list_prepend(group->members, member);
+
+    member->base.destroy = group_member_destroy;
+    member->base.encode_frame = group_member_encode_frame;
+    member->base.client_stream_report = group_member_client_stream_report;
+    member->base.notify_server_frame_drop = group_member_notify_server_frame_drop;
+    member->base.get_bit_rate = group_member_get_bit_rate;
+    member->base.get_stats = group_member_get_stats;
+    member->base.codec_type = group->encoder->codec_type;
+
+    return &member->base;
+}
@@ -0,0 +1,553 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2020 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* A VideoEncoder compressing the frames of another encoder in a thread.
+ *
+ * The frames are submitted by the worker thread when they are queued to the
+ * client pipe and completed when the pipe item is sent. Only the thread
+ * calls the wrapped encoder: the rate control requests of the worker are
+ * recorded and applied by the thread between two frames, the bit rate and
+ * the statistics are published by the thread after each frame. The rate
+ * control callbacks the wrapped encoder makes are either harmless reads or
+ * deferred to the worker.
+ */
+
+#include <config.h>
+
+#include <signal.h>
+#include <pthread.h>
+#include <glib.h>
+
+#include "red-common.h"
+#include "video-encoder.h"
+
+// compatibility for FreeBSD
+#ifdef HAVE_PTHREAD_NP_H
+#include <pthread_np.h>
+#define pthread_setname_np pthread_set_name_np
+#endif
+
+/* frames waiting for the thread, the oldest is dropped past that */
+#define MAX_QUEUED_FRAMES 2
+
+typedef struct ThreadVideoEncoder ThreadVideoEncoder;
+
+typedef struct ClientStreamReport {
+    uint32_t num_frames;
+    uint32_t num_drops;
+    uint32_t start_frame_mm_time;
+    uint32_t end_frame_mm_time;
+    int32_t end_frame_delay;
+    uint32_t audio_delay;
+} ClientStreamReport;
+
+typedef enum {
+    FRAME_STATE_QUEUED,
+    FRAME_STATE_RUNNING,
+    FRAME_STATE_DONE,
+} FrameState;
+
+struct VideoEncoderFrame {
+    ThreadVideoEncoder *encoder;
+    GList link;
+    FrameState state;
+    /* the owner doesn't want the frame anymore */
+    bool released;
+
+    uint32_t frame_mm_time;
+    SpiceBitmap bitmap;
+    SpiceRect src;
+    int top_down;
+    gpointer bitmap_opaque;
+
+    VideoEncodeResults result;
+    VideoBuffer *outbuf;
+};
+
+struct ThreadVideoEncoder {
+    VideoEncoder base;
+    /* one for the encoder and one for each frame */
+    gint refs;
+
+    /* only used by the thread once it is started */
+    VideoEncoder *encoder;
+    VideoEncoderRateControlCbs cbs;
+    bitmap_ref_t bitmap_ref;
+    bitmap_unref_t bitmap_unref;
+
+    pthread_t thread;
+    bool thread_started;
+    pthread_mutex_t lock;
+    /* signaled when a frame or a rate control request is queued or the
+     * thread must stop */
+    pthread_cond_t queue_cond;
+    /* signaled when a frame is done */
+    pthread_cond_t done_cond;
+    GQueue queue;
+    /* frames released while running, their bitmap must be unreferenced
+     * by the worker */
+    GQueue released;
+    bool quit;
+
+    /* rate control requests for the thread */
+    uint32_t server_frame_drops;
+    GQueue client_stream_reports;
+    /* state of the encoder after the last frame */
+    uint64_t bit_rate;
+    VideoEncoderStats stats;
+
+    /* called by the thread when a frame is done */
+    video_encoder_frame_done_t frame_done;
+    void *frame_done_opaque;
+
+    /* playback delay requested by the encoder from the thread */
+    bool playback_delay_pending;
+    uint32_t playback_delay;
+};
+
+static void thread_video_encoder_unref(ThreadVideoEncoder *encoder)
+{
+    if (!g_atomic_int_dec_and_test(&encoder->refs)) {
+        return;
+    }
+    pthread_cond_destroy(&encoder->done_cond);
+    pthread_cond_destroy(&encoder->queue_cond);
+    pthread_mutex_destroy(&encoder->lock);
+    /* the requests made after the thread stopped */
+    g_list_free_full(encoder->client_stream_reports.head, g_free);
+    g_free(encoder);
+}
+
+/* must be called from the worker thread */
+static void video_encoder_frame_free(VideoEncoderFrame *frame)
+{
+    ThreadVideoEncoder *encoder = frame->encoder;
+
+    if (frame->outbuf) {
+        frame->outbuf->free(frame->outbuf);
+    }
+    if (encoder->bitmap_unref) {
+        encoder->bitmap_unref(frame->bitmap_opaque);
+    }
+    g_free(frame);
+    thread_video_encoder_unref(encoder);
+}
+
+/* Complete the work the thread can't do, from the worker thread */
+static void thread_video_encoder_flush(ThreadVideoEncoder *encoder)
+{
+    GList *link;
+    bool playback_delay_pending;
+    uint32_t playback_delay;
+
+    pthread_mutex_lock(&encoder->lock);
+    link = encoder->released.head;
+    g_queue_init(&encoder->released);
+    playback_delay_pending = encoder->playback_delay_pending;
+    playback_delay = encoder->playback_delay;
+    encoder->playback_delay_pending = false;
+    pthread_mutex_unlock(&encoder->lock);
+
+    while (link) {
+        VideoEncoderFrame *frame = (VideoEncoderFrame *) link->data;
+        link = link->next;
+        video_encoder_frame_free(frame);
+    }
+    if (playback_delay_pending && !encoder->quit) {
+        encoder->cbs.update_client_playback_delay(encoder->cbs.opaque, playback_delay);
+    }
+}
+
+/* Applies the rate control requests made by the worker since the last
+ * frame, from the thread */
+static void thread_video_encoder_apply_requests(ThreadVideoEncoder *encoder,
+                                                uint32_t server_frame_drops, GList *reports)
+{
+    VideoEncoder *video_encoder = encoder->encoder;
+
+    while (server_frame_drops--) {
+        video_encoder->notify_server_frame_drop(video_encoder);
+    }
+    while (reports) {
+        ClientStreamReport *report = (ClientStreamReport *) reports->data;
+        GList *next = reports->next;
+
+        video_encoder->client_stream_report(video_encoder, report->num_frames,
+                                            report->num_drops, report->start_frame_mm_time,
+                                            report->end_frame_mm_time,
+                                            report->end_frame_delay, report->audio_delay);
+        g_free(report);
+        g_list_free_1(reports);
+        reports = next;
+    }
+}
+
+static void *thread_video_encoder_main(void *opaque)
+{
+    ThreadVideoEncoder *encoder = (ThreadVideoEncoder *) opaque;
+    VideoEncoder *video_encoder = encoder->encoder;
+
+    pthread_mutex_lock(&encoder->lock);
+    for (;;) {
+        while (g_queue_is_empty(&encoder->queue) && !encoder->server_frame_drops &&
+               g_queue_is_empty(&encoder->client_stream_reports) && !encoder->quit) {
+            pthread_cond_wait(&encoder->queue_cond, &encoder->lock);
+        }
+        if (encoder->quit) {
+            break;
+        }
+
+        uint32_t server_frame_drops = encoder->server_frame_drops;
+        GList *reports = encoder->client_stream_reports.head;
+        encoder->server_frame_drops = 0;
+        g_queue_init(&encoder->client_stream_reports);
+
+        GList *link = g_queue_pop_head_link(&encoder->queue);
+        VideoEncoderFrame *frame = link ? (VideoEncoderFrame *) link->data : NULL;
+        if (frame) {
+            frame->state = FRAME_STATE_RUNNING;
+        }
+        pthread_mutex_unlock(&encoder->lock);
+
+        thread_video_encoder_apply_requests(encoder, server_frame_drops, reports);
+        if (frame) {
+            frame->result = video_encoder->encode_frame(video_encoder, frame->frame_mm_time,
+                                                        &frame->bitmap, &frame->src,
+                                                        frame->top_down, frame->bitmap_opaque,
+                                                        &frame->outbuf);
+        }
+        uint64_t bit_rate = video_encoder->get_bit_rate(video_encoder);
+        VideoEncoderStats stats;
+        video_encoder->get_stats(video_encoder, &stats);
+
+        pthread_mutex_lock(&encoder->lock);
+        encoder->bit_rate = bit_rate;
+        encoder->stats = stats;
+        if (frame) {
+            frame->state = FRAME_STATE_DONE;
+            if (frame->released) {
+                g_queue_push_tail_link(&encoder->released, &frame->link);
+            }
+            pthread_cond_broadcast(&encoder->done_cond);
+            if (encoder->frame_done) {
+                encoder->frame_done(encoder->frame_done_opaque);
+            }
+        }
+    }
+    pthread_mutex_unlock(&encoder->lock);
+
+    return NULL;
+}
+
+static void thread_video_encoder_destroy(VideoEncoder *video_encoder)
+{
+    ThreadVideoEncoder *encoder = SPICE_CONTAINEROF(video_encoder, ThreadVideoEncoder, base);
+    GList *link;
+
+    pthread_mutex_lock(&encoder->lock);
+    encoder->quit = true;
+    pthread_cond_broadcast(&encoder->queue_cond);
+    pthread_mutex_unlock(&encoder->lock);
+    if (encoder->thread_started) {
+        pthread_join(encoder->thread, NULL);
+    }
+
+    /* the frames not started are dropped, their owners still have to
+     * release them */
+    pthread_mutex_lock(&encoder->lock);
+    while ((link = g_queue_pop_head_link(&encoder->queue))) {
+        VideoEncoderFrame *frame = (VideoEncoderFrame *) link->data;
+        frame->state = FRAME_STATE_DONE;
+        frame->result = VIDEO_ENCODER_FRAME_DROP;
+    }
+    pthread_mutex_unlock(&encoder->lock);
+    thread_video_encoder_flush(encoder);
+
+    encoder->encoder->destroy(encoder->encoder);
+    encoder->encoder = NULL;
+    thread_video_encoder_unref(encoder);
+}
+
+static VideoEncodeResults thread_video_encoder_encode_frame(VideoEncoder *video_encoder,
+                                                            uint32_t frame_mm_time,
+                                                            const SpiceBitmap *bitmap,
+                                                            const SpiceRect *src, int top_down,
+                                                            gpointer bitmap_opaque,
+                                                            VideoBuffer **outbuf)
+{
+    VideoEncoderFrame *frame = video_encoder->submit_frame(video_encoder, frame_mm_time,
+                                                           bitmap, src, top_down,
+                                                           bitmap_opaque);
+    return video_encoder_frame_complete(frame, outbuf);
+}
+
+static VideoEncoderFrame *thread_video_encoder_submit_frame(VideoEncoder *video_encoder,
+                                                            uint32_t frame_mm_time,
+                                                            const SpiceBitmap *bitmap,
+                                                            const SpiceRect *src, int top_down,
+                                                            gpointer bitmap_opaque)
+{
+    ThreadVideoEncoder *encoder = SPICE_CONTAINEROF(video_encoder, ThreadVideoEncoder, base);
+    VideoEncoderFrame *frame;
+
+    thread_video_encoder_flush(encoder);
+
+    frame = g_new0(VideoEncoderFrame, 1);
+    frame->encoder = encoder;
+    g_atomic_int_inc(&encoder->refs);
+    frame->link.data = frame;
+    frame->frame_mm_time = frame_mm_time;
+    frame->bitmap = *bitmap;
+    frame->src = *src;
+    frame->top_down = top_down;
+    frame->bitmap_opaque = bitmap_opaque;
+    if (encoder->bitmap_ref) {
+        encoder->bitmap_ref(bitmap_opaque);
+    }
+
+    pthread_mutex_lock(&encoder->lock);
+    if (g_queue_get_length(&encoder->queue) >= MAX_QUEUED_FRAMES) {
+        GList *link = g_queue_pop_head_link(&encoder->queue);
+        VideoEncoderFrame *oldest = (VideoEncoderFrame *) link->data;
+
+        oldest->state = FRAME_STATE_DONE;
+        oldest->result = VIDEO_ENCODER_FRAME_DROP;
+        pthread_cond_broadcast(&encoder->done_cond);
+        encoder->server_frame_drops++;
+    }
+    g_queue_push_tail_link(&encoder->queue, &frame->link);
+    pthread_cond_signal(&encoder->queue_cond);
+    pthread_mutex_unlock(&encoder->lock);
+    return frame;
+}
+
+VideoEncoder *video_encoder_frame_get_encoder(VideoEncoderFrame *frame)
+{
+    /* the frame keeps the memory of the encoder, the address can't be
+     * reused by another encoder */
+    return &frame->encoder->base;
+}
+
+gboolean video_encoder_frame_is_done(VideoEncoderFrame *frame)
+{
+    ThreadVideoEncoder *encoder = frame->encoder;
+    gboolean done;
+
+    pthread_mutex_lock(&encoder->lock);
+    done = frame->state == FRAME_STATE_DONE;
+    pthread_mutex_unlock(&encoder->lock);
+    return done;
+}
+
+VideoEncodeResults video_encoder_frame_complete(VideoEncoderFrame *frame, VideoBuffer **outbuf)
+{
+    ThreadVideoEncoder *encoder = frame->encoder;
+    VideoEncodeResults result;
+
+    pthread_mutex_lock(&encoder->lock);
+    while (frame->state != FRAME_STATE_DONE) {
+        pthread_cond_wait(&encoder->done_cond, &encoder->lock);
+    }
+    pthread_mutex_unlock(&encoder->lock);
+
+    result = frame->result;
+    *outbuf = frame->outbuf;
+    frame->outbuf = NULL;
+    thread_video_encoder_flush(encoder);
+    video_encoder_frame_free(frame);
+    return result;
+}
+
+void video_encoder_frame_release(VideoEncoderFrame *frame)
+{
+    if (!frame) {
+        return;
+    }
+
+    ThreadVideoEncoder *encoder = frame->encoder;
+
+    pthread_mutex_lock(&encoder->lock);
+    switch (frame->state) {
+    case FRAME_STATE_QUEUED:
+        g_queue_unlink(&encoder->queue, &frame->link);
+        break;
+    case FRAME_STATE_RUNNING:
+        /* freed by the next flush */
+        frame->released = true;
+        frame = NULL;
+        break;
+    case FRAME_STATE_DONE:
+        break;
+    }
+    pthread_mutex_unlock(&encoder->lock);
+
+    if (frame) {
+        video_encoder_frame_free(frame);
+    }
+}
+
+static void thread_video_encoder_client_stream_report(VideoEncoder *video_encoder,
+                                                      uint32_t num_frames, uint32_t num_drops,
+                                                      uint32_t start_frame_mm_time,
+                                                      uint32_t end_frame_mm_time,
+                                                      int32_t end_frame_delay,
+                                                      uint32_t audio_delay)
+{
+    ThreadVideoEncoder *encoder = SPICE_CONTAINEROF(video_encoder, ThreadVideoEncoder, base);
+    ClientStreamReport *report = g_new(ClientStreamReport, 1);
+
+    report->num_frames = num_frames;
+    report->num_drops = num_drops;
+    report->start_frame_mm_time = start_frame_mm_time;
+    report->end_frame_mm_time = end_frame_mm_time;
+    report->end_frame_delay = end_frame_delay;
+    report->audio_delay = audio_delay;
+
+    pthread_mutex_lock(&encoder->lock);
+    g_queue_push_tail(&encoder->client_stream_reports, report);
+    pthread_cond_signal(&encoder->queue_cond);
+    pthread_mutex_unlock(&encoder->lock);
+    thread_video_encoder_flush(encoder);
+}
+
+static void thread_video_encoder_notify_server_frame_drop(VideoEncoder *video_encoder)
+{
+    ThreadVideoEncoder *encoder = SPICE_CONTAINEROF(video_encoder, ThreadVideoEncoder, base);
+
+    pthread_mutex_lock(&encoder->lock);
+    encoder->server_frame_drops++;
+    pthread_cond_signal(&encoder->queue_cond);
+    pthread_mutex_unlock(&encoder->lock);
+}
+
+static uint64_t thread_video_encoder_get_bit_rate(VideoEncoder *video_encoder)
+{
+    ThreadVideoEncoder *encoder = SPICE_CONTAINEROF(video_encoder, ThreadVideoEncoder, base);
+    uint64_t bit_rate;
+
+    pthread_mutex_lock(&encoder->lock);
+    bit_rate = encoder->bit_rate;
+    pthread_mutex_unlock(&encoder->lock);
+    return bit_rate;
+}
+
+static void thread_video_encoder_get_stats(VideoEncoder *video_encoder, VideoEncoderStats *stats)
+{
+    ThreadVideoEncoder *encoder = SPICE_CONTAINEROF(video_encoder, ThreadVideoEncoder, base);
+
+    pthread_mutex_lock(&encoder->lock);
+    *stats = encoder->stats;
+    pthread_mutex_unlock(&encoder->lock);
+}
+
+/* Called by the wrapped encoder, possibly from the thread: the client is
+ * informed from the worker thread */
+static void thread_video_encoder_update_client_playback_delay(void *opaque, uint32_t delay_ms)
+{
+    ThreadVideoEncoder *encoder = (ThreadVideoEncoder *) opaque;
+
+    pthread_mutex_lock(&encoder->lock);
+    encoder->playback_delay_pending = true;
+    encoder->playback_delay = delay_ms;
+    pthread_mutex_unlock(&encoder->lock);
+}
+
+VideoEncoder *video_encoder_thread_new(new_video_encoder_t create,
+                                       SpiceVideoCodecType codec_type,
+                                       uint64_t starting_bit_rate,
+                                       VideoEncoderRateControlCbs *cbs,
+                                       bitmap_ref_t bitmap_ref,
+                                       bitmap_unref_t bitmap_unref,
+                                       video_encoder_frame_done_t frame_done,
+                                       void *frame_done_opaque)
+{
+    ThreadVideoEncoder *encoder = g_new0(ThreadVideoEncoder, 1);
+    VideoEncoderRateControlCbs thread_cbs;
+    int r;
+
+    encoder->refs = 1;
+    pthread_mutex_init(&encoder->lock, NULL);
+    pthread_cond_init(&encoder->queue_cond, NULL);
+    pthread_cond_init(&encoder->done_cond, NULL);
+    g_queue_init(&encoder->queue);
+    g_queue_init(&encoder->released);
+    g_queue_init(&encoder->client_stream_reports);
+    encoder->bitmap_ref = bitmap_ref;
+    encoder->bitmap_unref = bitmap_unref;
+    encoder->frame_done = frame_done;
+    encoder->frame_done_opaque = frame_done_opaque;
+
+    /* the roundtrip and the source fps are read as they are */
+    thread_cbs = *cbs;
+    if (cbs->update_client_playback_delay) {
+        encoder->cbs = *cbs;
+        thread_cbs.opaque = encoder;
+        thread_cbs.update_client_playback_delay =
+            thread_video_encoder_update_client_playback_delay;
+    }
+    /* the encoder is only given the bitmaps for the time of encode_frame() */
+    encoder->encoder = create(codec_type, starting_bit_rate, &thread_cbs, NULL, NULL);
+    if (!encoder->encoder) {
+        thread_video_encoder_unref(encoder);
+        return NULL;
+    }
+    encoder->bit_rate = encoder->encoder->get_bit_rate(encoder->encoder);
+    encoder->encoder->get_stats(encoder->encoder, &encoder->stats);
+
+#ifndef _WIN32
+    sigset_t thread_sig_mask;
+    sigset_t curr_sig_mask;
+
+    /* signals must be handled by the application threads */
+    sigfillset(&thread_sig_mask);
+    sigdelset(&thread_sig_mask, SIGILL);
+    sigdelset(&thread_sig_mask, SIGFPE);
+    sigdelset(&thread_sig_mask, SIGSEGV);
+    pthread_sigmask(SIG_SETMASK, &thread_sig_mask, &curr_sig_mask);
+#endif
+    r = pthread_create(&encoder->thread, NULL, thread_video_encoder_main, encoder);
+#ifndef _WIN32
+    pthread_sigmask(SIG_SETMASK, &curr_sig_mask, NULL);
+#endif
+    if (r) {
+        spice_warning("create video encoder thread failed %d", r);
+        VideoEncoder *sync_encoder = encoder->encoder;
+        if (cbs->update_client_playback_delay) {
+            /* the encoder calls back into this wrapper, start again */
+            sync_encoder->destroy(sync_encoder);
+            sync_encoder = create(codec_type, starting_bit_rate, cbs, bitmap_ref, bitmap_unref);
+        }
+        thread_video_encoder_unref(encoder);
+        return sync_encoder;
+    }
+#if !defined(__APPLE__)
+    pthread_setname_np(encoder->thread, "SPICE Video");
+#endif
+    encoder->thread_started = true;
+
+    encoder->base.destroy = thread_video_encoder_destroy;
+    encoder->base.encode_frame = thread_video_encoder_encode_frame;
+    encoder->base.submit_frame = thread_video_encoder_submit_frame;
+    encoder->base.client_stream_report = thread_video_encoder_client_stream_report;
+    encoder->base.notify_server_frame_drop = thread_video_encoder_notify_server_frame_drop;
+    encoder->base.get_bit_rate = thread_video_encoder_get_bit_rate;
+    encoder->base.get_stats = thread_video_encoder_get_stats;
+    encoder->base.codec_type = encoder->encoder->codec_type;
+
+    return &encoder->base;
+}
@@ -56,6 +56,8 @@ typedef struct VideoEncoderStats {
     double avg_quality;
 } VideoEncoderStats;
 
+typedef struct VideoEncoderFrame VideoEncoderFrame;
+
 typedef struct VideoEncoder VideoEncoder;
 struct VideoEncoder {
     /* Releases the video encoder's resources */
@@ -84,6 +86,21 @@ struct VideoEncoder {
                                        const SpiceRect *src, int top_down,
                                        gpointer bitmap_opaque, VideoBuffer** outbuf);
 
+    /* Asynchronous variant of encode_frame(), NULL if the encoder only
+     * compresses frames in the caller's thread.
+     *
+     * Queues the frame to be compressed by the thread of the encoder. The
+     * bitmap is referenced with bitmap_ref() until the frame is released.
+     * If too many frames are waiting the oldest one is dropped, like with
+     * notify_server_frame_drop().
+     *
+     * @return:        The queued frame, see video_encoder_frame_complete().
+     */
+    VideoEncoderFrame* (*submit_frame)(VideoEncoder *encoder, uint32_t frame_mm_time,
+                                       const SpiceBitmap *bitmap,
+                                       const SpiceRect *src, int top_down,
+                                       gpointer bitmap_opaque);
+
     /*
      * Bit rate control methods.
      */
@@ -208,6 +225,60 @@ VideoEncoder* gstreamer_encoder_new(SpiceVideoCodecType codec_type,
                                     bitmap_unref_t bitmap_unref);
 #endif
 
+/* Environment variable, "1" compresses the MJPEG streams in a thread of their
+ * own instead of the worker thread */
+#define VIDEO_ENCODER_THREAD_ENV "SPICE_VIDEO_ENCODER_THREAD"
+
+typedef void (*video_encoder_frame_done_t)(void *opaque);
+
+/* Instantiates the encoder with @create and runs it in a thread of its own,
+ * the returned encoder implements submit_frame().
+ * The encoder must not keep references to the bitmaps past encode_frame().
+ * @frame_done, if not NULL, is called from the thread each time a frame is
+ * compressed, so that the owner can complete it without polling.
+ */
+VideoEncoder* video_encoder_thread_new(new_video_encoder_t create,
+                                       SpiceVideoCodecType codec_type,
+                                       uint64_t starting_bit_rate,
+                                       VideoEncoderRateControlCbs *cbs,
+                                       bitmap_ref_t bitmap_ref,
+                                       bitmap_unref_t bitmap_unref,
+                                       video_encoder_frame_done_t frame_done,
+                                       void *frame_done_opaque);
+/* The encoder @frame was submitted to, even if it was destroyed since */
+VideoEncoder* video_encoder_frame_get_encoder(VideoEncoderFrame *frame);
+/* Whether video_encoder_frame_complete() would not wait */
+gboolean video_encoder_frame_is_done(VideoEncoderFrame *frame);
+/* Waits for @frame to be compressed and releases it. The result is the one
+ * of encode_frame(). Can be used after the encoder is destroyed. */
+VideoEncodeResults video_encoder_frame_complete(VideoEncoderFrame *frame,
+                                                VideoBuffer **outbuf);
+/* Releases @frame without waiting for it, NULL is ignored */
+void video_encoder_frame_release(VideoEncoderFrame *frame);
+
+/* Environment variable, "1" lets the clients of a stream share its MJPEG
+ * encoders. It takes precedence over VIDEO_ENCODER_THREAD_ENV, the frames
+ * of the shared encoders are compressed in the worker thread. */
+#define VIDEO_ENCODER_SHARED_ENV "SPICE_VIDEO_ENCODER_SHARED"
+
+/* An encoder instantiated with @create shared by several clients, each
+ * frame is compressed once for all of them.
+ * Only for codecs without inter frames: the clients don't all send the
+ * same frames.
+ */
+typedef struct VideoEncoderGroup VideoEncoderGroup;
+VideoEncoderGroup* video_encoder_group_new(new_video_encoder_t create,
+                                           SpiceVideoCodecType codec_type,
+                                           uint64_t starting_bit_rate,
+                                           bitmap_ref_t bitmap_ref,
+                                           bitmap_unref_t bitmap_unref);
+/* NULL is ignored */
+void video_encoder_group_unref(VideoEncoderGroup *group);
+/* Returns the encoder of a new client of @group, it keeps a reference to
+ * the group. The rate control follows the slowest client. */
+VideoEncoder* video_encoder_group_join(VideoEncoderGroup *group,
+                                       VideoEncoderRateControlCbs *cbs);
+
 
 typedef struct RedVideoCodec {
     new_video_encoder_t create;
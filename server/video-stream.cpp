@@ -116,6 +116,10 @@ void video_stream_stop(DisplayChannel *display, VideoStream *stream)
         dcc->pipe_add(video_stream_destroy_item_new(stream_agent));
         video_stream_agent_stats_print(stream_agent);
     }
+    /* the clients still sending frames keep their encoder group */
+    for (auto &group : stream->encoder_groups) {
+        g_clear_pointer(&group, video_encoder_group_unref);
+    }
     display->priv->streams_size_total -= stream->width * stream->height;
     ring_remove(&stream->link);
     video_stream_unref(display, stream);
@@ -240,6 +244,11 @@ static bool is_next_stream_frame(const Drawable *candidate,
             candidate_src->bottom - candidate_src->top != other_src_height) {
             return FALSE;
         }
+    } else if (stream && !rect_is_empty(&stream->hot_area)) {
+        /* any frame inside the hot area, sent as a sized frame */
+        if (!rect_contains(&stream->hot_area, &red_drawable->bbox)) {
+            return FALSE;
+        }
     } else {
         if (!rect_contains(&red_drawable->bbox, other_dest)) {
             return FALSE;
@@ -320,6 +329,15 @@ void video_stream_detach_drawable(VideoStream *stream)
     stream->current = NULL;
 }
 
+bool video_stream_is_sized_frame(const VideoStream *stream, const RedDrawable *red_drawable)
+{
+    const SpiceCopy *copy = &red_drawable->u.copy;
+
+    return (copy->src_area.right - copy->src_area.left != stream->width) ||
+           (copy->src_area.bottom - copy->src_area.top != stream->height) ||
+           !rect_is_equal(&red_drawable->bbox, &stream->dest_area);
+}
+
 static void before_reattach_stream(DisplayChannel *display,
                                    VideoStream *stream, Drawable *new_frame)
 {
@@ -389,6 +407,8 @@ static void display_channel_create_stream(DisplayChannel *display, Drawable *dra
     stream->width = src_rect->right - src_rect->left;
     stream->height = src_rect->bottom - src_rect->top;
     stream->dest_area = drawable->red_drawable->bbox;
+    memset(&stream->hot_area, 0, sizeof(stream->hot_area));
+    memset(stream->encoder_groups, 0, sizeof(stream->encoder_groups));
     stream->refs = 1;
     SpiceBitmap *bitmap = &drawable->red_drawable->u.copy.src_bitmap->u.bitmap;
     stream->top_down = !!(bitmap->flags & SPICE_BITMAP_FLAGS_TOP_DOWN);
@@ -486,6 +506,73 @@ GArray *video_stream_parse_preferred_codecs(SpiceMsgcDisplayPreferredVideoCodecT
     return client;
 }
 
+static void video_stream_attach_next_frame(DisplayChannel *display,
+                                           VideoStream *stream, Drawable *drawable)
+{
+    if (stream->current) {
+        stream->current->streamable = FALSE; //prevent item trace
+        before_reattach_stream(display, stream, drawable);
+        video_stream_detach_drawable(stream);
+    }
+    attach_stream(display, drawable, stream);
+}
+
+/* The drawable didn't match any stream or trace, start a stream if it's
+ * in an area of the primary surface updated at video rate whatever the
+ * geometry of the updates */
+static void video_stream_heatmap_try_start(DisplayChannel *display, Drawable *drawable)
+{
+    DisplayChannelClient *dcc;
+    RingItem *item;
+    SpiceRect hot_area;
+    uint32_t frames;
+    red_time_t first_frame_time;
+
+    if (!stream_heatmap_get_hot_area(&display->priv->stream_heatmap,
+                                     &drawable->red_drawable->bbox,
+                                     drawable->creation_time,
+                                     RED_STREAM_FRAMES_START_CONDITION,
+                                     &hot_area, &frames, &first_frame_time)) {
+        return;
+    }
+
+    /* frames of such streams don't match the stream geometry */
+    FOREACH_DCC(display, dcc) {
+        if (!dcc->test_remote_cap(SPICE_DISPLAY_CAP_SIZED_STREAM)) {
+            return;
+        }
+    }
+
+    update_copy_graduality(display, drawable);
+    if (drawable->copy_bitmap_graduality == BITMAP_GRADUAL_LOW) {
+        return;
+    }
+
+    /* the video moved or grew */
+    FOREACH_STREAMS(display, item) {
+        VideoStream *stream = SPICE_CONTAINEROF(item, VideoStream, link);
+
+        if (!rect_is_empty(&stream->hot_area) && rect_intersects(&stream->hot_area, &hot_area)) {
+            rect_union(&stream->hot_area, &hot_area);
+            if (is_next_stream_frame(drawable, stream->width, stream->height,
+                                     &stream->dest_area, stream->last_time, stream, TRUE)) {
+                video_stream_attach_next_frame(display, stream, drawable);
+            }
+            return;
+        }
+    }
+
+    drawable->first_frame_time = first_frame_time;
+    drawable->frames_count = frames;
+    display_channel_create_stream(display, drawable);
+    if (drawable->stream) {
+        drawable->stream->hot_area = hot_area;
+        spice_debug("stream %d found by heatmap (%d, %d) (%d, %d)",
+                    display_channel_get_video_stream_id(display, drawable->stream),
+                    hot_area.left, hot_area.top, hot_area.right, hot_area.bottom);
+    }
+}
+
 /* TODO: document the difference between the 2 functions below */
 void video_stream_trace_update(DisplayChannel *display, Drawable *drawable)
 {
@@ -493,6 +580,11 @@ void video_stream_trace_update(DisplayChannel *display, Drawable *drawable)
     ItemTrace *trace_end;
     RingItem *item;
 
+    if (drawable->streamable) {
+        stream_heatmap_update(&display->priv->stream_heatmap,
+                              &drawable->red_drawable->bbox, drawable->creation_time);
+    }
+
     if (drawable->stream || !drawable->streamable || drawable->frames_count) {
         return;
     }
@@ -507,12 +599,7 @@ void video_stream_trace_update(DisplayChannel *display, Drawable *drawable)
                                                   stream,
                                                   TRUE);
         if (is_next_frame) {
-            if (stream->current) {
-                stream->current->streamable = FALSE; //prevent item trace
-                before_reattach_stream(display, stream, drawable);
-                video_stream_detach_drawable(stream);
-            }
-            attach_stream(display, drawable, stream);
+            video_stream_attach_next_frame(display, stream, drawable);
             return;
         }
     }
@@ -531,6 +618,8 @@ void video_stream_trace_update(DisplayChannel *display, Drawable *drawable)
             }
         }
     }
+
+    video_stream_heatmap_try_start(display, drawable);
 }
 
 void video_stream_maintenance(DisplayChannel *display,
@@ -704,8 +793,59 @@ static void bitmap_unref(gpointer data)
     red_drawable_unref(red_drawable);
 }
 
+static VideoEncoder* video_stream_join_encoder_group(DisplayChannelClient *dcc,
+                                                     VideoStream *stream,
+                                                     uint64_t starting_bit_rate,
+                                                     VideoEncoderRateControlCbs *cbs)
+{
+    /* the clients on a slow link share another encoder, so that they don't
+     * lower the quality for the others */
+    VideoEncoderGroup **group = &stream->encoder_groups[dcc_is_low_bandwidth(dcc) ? 1 : 0];
+
+    if (!*group) {
+        *group = video_encoder_group_new(mjpeg_encoder_new, SPICE_VIDEO_CODEC_TYPE_MJPEG,
+                                         starting_bit_rate, bitmap_ref, bitmap_unref);
+        if (!*group) {
+            return NULL;
+        }
+    }
+    return video_encoder_group_join(*group, cbs);
+}
+
+static VideoEncoder* video_encoder_new(DisplayChannelClient *dcc, VideoStream *stream,
+                                      new_video_encoder_t create,
+                                      SpiceVideoCodecType codec_type,
+                                      uint64_t starting_bit_rate,
+                                      VideoEncoderRateControlCbs *cbs)
+{
+    /* the other encoders keep references to the bitmaps and have inter
+     * frames, the clients can't share them */
+    if (create == mjpeg_encoder_new) {
+        if (g_strcmp0(getenv(VIDEO_ENCODER_SHARED_ENV), "1") == 0) {
+            static gsize warned = 0;
+
+            if (g_once_init_enter(&warned)) {
+                if (g_strcmp0(getenv(VIDEO_ENCODER_THREAD_ENV), "1") == 0) {
+                    spice_warning(VIDEO_ENCODER_SHARED_ENV " is set, "
+                                  VIDEO_ENCODER_THREAD_ENV " is ignored");
+                }
+                g_once_init_leave(&warned, 1);
+            }
+            return video_stream_join_encoder_group(dcc, stream, starting_bit_rate, cbs);
+        }
+        if (g_strcmp0(getenv(VIDEO_ENCODER_THREAD_ENV), "1") == 0 &&
+            dcc_video_frame_wakeup_init(dcc)) {
+            return video_encoder_thread_new(create, codec_type, starting_bit_rate, cbs,
+                                            bitmap_ref, bitmap_unref,
+                                            dcc_video_frame_done, dcc);
+        }
+    }
+    return create(codec_type, starting_bit_rate, cbs, bitmap_ref, bitmap_unref);
+}
+
 /* A helper for dcc_create_stream(). */
 static VideoEncoder* dcc_create_video_encoder(DisplayChannelClient *dcc,
+                                              VideoStream *stream,
                                               uint64_t starting_bit_rate,
                                               VideoEncoderRateControlCbs *cbs)
 {
@@ -728,7 +868,9 @@ static VideoEncoder* dcc_create_video_encoder(DisplayChannelClient *dcc,
             continue;
         }
 
-        VideoEncoder* video_encoder = video_codec->create(video_codec->type, starting_bit_rate, cbs, bitmap_ref, bitmap_unref);
+        VideoEncoder* video_encoder = video_encoder_new(dcc, stream, video_codec->create,
+                                                        video_codec->type,
+                                                        starting_bit_rate, cbs);
         if (video_encoder) {
             return video_encoder;
         }
@@ -736,7 +878,8 @@ static VideoEncoder* dcc_create_video_encoder(DisplayChannelClient *dcc,
 
     /* Try to use the builtin MJPEG video encoder as a fallback */
     if (!client_has_multi_codec || dcc->test_remote_cap(SPICE_DISPLAY_CAP_CODEC_MJPEG)) {
-        return mjpeg_encoder_new(SPICE_VIDEO_CODEC_TYPE_MJPEG, starting_bit_rate, cbs, bitmap_ref, bitmap_unref);
+        return video_encoder_new(dcc, stream, mjpeg_encoder_new, SPICE_VIDEO_CODEC_TYPE_MJPEG,
+                                 starting_bit_rate, cbs);
     }
 
     return NULL;
@@ -762,7 +905,7 @@ void dcc_create_stream(DisplayChannelClient *dcc, VideoStream *stream)
     video_cbs.update_client_playback_delay = update_client_playback_delay;
 
     uint64_t initial_bit_rate = get_initial_bit_rate(dcc, stream);
-    agent->video_encoder = dcc_create_video_encoder(dcc, initial_bit_rate, &video_cbs);
+    agent->video_encoder = dcc_create_video_encoder(dcc, stream, initial_bit_rate, &video_cbs);
     dcc->pipe_add(video_stream_create_item_new(agent));
 
     if (dcc->test_remote_cap(SPICE_DISPLAY_CAP_STREAM_REPORT)) {
@@ -803,6 +946,14 @@ RedUpgradeItem::RedUpgradeItem(Drawable *init_drawable):
     drawable->refs++;
 }
 
+size_t RedUpgradeItem::get_size_estimate() const
+{
+    const SpiceRect *bbox = &drawable->red_drawable->bbox;
+
+    /* a lossless image of the whole area is sent */
+    return (size_t) (bbox->right - bbox->left) * (bbox->bottom - bbox->top) * 4;
+}
+
 /*
  * after dcc_detach_stream_gracefully is called for all the display channel clients,
  * video_stream_detach_drawable should be called. See comment (1).
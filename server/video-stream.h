@@ -114,6 +114,13 @@ struct VideoStream {
     int width;
     int height;
     SpiceRect dest_area;
+    /* area of the surface found hot by the heatmap, frames inside it are
+     * accepted whatever their geometry. Empty for streams found by the
+     * trace of drawables */
+    SpiceRect hot_area;
+    /* encoders shared by the clients, by bandwidth class, see
+     * VIDEO_ENCODER_SHARED_ENV */
+    VideoEncoderGroup *encoder_groups[2];
     int top_down;
     VideoStream *next;
     RingItem link;
@@ -138,6 +145,8 @@ GArray *video_stream_parse_preferred_codecs(SpiceMsgcDisplayPreferredVideoCodecT
 void video_stream_agent_stop(VideoStreamAgent *agent);
 
 void video_stream_detach_drawable(VideoStream *stream);
+/* Whether the frame must be sent with SPICE_MSG_DISPLAY_STREAM_DATA_SIZED */
+bool video_stream_is_sized_frame(const VideoStream *stream, const RedDrawable *red_drawable);
 
 SPICE_END_DECLS
 
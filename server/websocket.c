@@ -31,6 +31,11 @@
 #endif
 
 #include <glib.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 
 #include <common/log.h>
 #include <common/mem.h>
@@ -70,6 +75,14 @@
 #define MAX_CONTROL_DATA 125
 #define CONTROL_HDR_LEN 2
 
+/* While batching, messages up to WEBSOCKET_BATCH_MAX_COPY bytes are copied
+ * and sent together in a frame of up to WEBSOCKET_BATCH_SIZE bytes */
+#define WEBSOCKET_BATCH_SIZE (64 * 1024)
+#define WEBSOCKET_BATCH_MAX_COPY (8 * 1024)
+
+/* iovec entries for a frame before allocating them */
+#define WEBSOCKET_IOV_STACK 64
+
 typedef struct {
     uint8_t raw_pos;
     union {
@@ -105,6 +118,13 @@ struct RedsWebSocket {
     WebSocketControl pong;
     WebSocketControl pending_pong;
 
+    /* small messages waiting to be sent as a single frame */
+    bool batching;
+    bool batch_frame_started;
+    uint8_t *batch;
+    size_t batch_len;
+    size_t batch_sent;
+
     void *raw_stream;
     websocket_read_cb_t raw_read;
     websocket_write_cb_t raw_write;
@@ -315,13 +335,50 @@ static bool websocket_get_frame_header(websocket_frame_t *frame)
     return true;
 }
 
+/* Unmask @size bytes at @buf, @offset being their position in the frame payload.
+ * The buffer can have any alignment and a frame can be unmasked in several calls */
+static void websocket_unmask(uint8_t *buf, size_t size, const uint8_t mask[4], uint64_t offset)
+{
+    uint8_t rotated[4];
+    uint32_t mask32;
+    uint64_t mask64;
+    size_t i;
+
+    // rotate the mask so that it applies from buf, blocks below are multiple of 4 bytes
+    for (i = 0; i < 4; i++) {
+        rotated[i] = mask[(offset + i) % 4];
+    }
+    memcpy(&mask32, rotated, sizeof(mask32));
+
+#if defined(__SSE2__)
+    __m128i mask128 = _mm_set1_epi32(mask32);
+    for (; size >= 16; size -= 16, buf += 16) {
+        __m128i data = _mm_loadu_si128((const __m128i *) buf);
+        _mm_storeu_si128((__m128i *) buf, _mm_xor_si128(data, mask128));
+    }
+#elif defined(__ARM_NEON)
+    uint8x16_t mask128 = vreinterpretq_u8_u32(vdupq_n_u32(mask32));
+    for (; size >= 16; size -= 16, buf += 16) {
+        vst1q_u8(buf, veorq_u8(vld1q_u8(buf), mask128));
+    }
+#endif
+
+    mask64 = ((uint64_t) mask32 << 32) | mask32;
+    for (; size >= 8; size -= 8, buf += 8) {
+        uint64_t data;
+        memcpy(&data, buf, sizeof(data));
+        data ^= mask64;
+        memcpy(buf, &data, sizeof(data));
+    }
+    for (i = 0; i < size; i++) {
+        buf[i] ^= rotated[i % 4];
+    }
+}
+
 static void relay_data(uint8_t* buf, size_t size, websocket_frame_t *frame)
 {
     if (frame->masked) {
-        size_t i;
-        for (i = 0; i < size; i++) {
-            *buf++ ^= frame->mask[(frame->relayed + i) % 4];
-        }
+        websocket_unmask(buf, size, frame->mask, frame->relayed);
     }
 }
 
@@ -587,18 +644,16 @@ static int send_pending_data(RedsWebSocket *ws)
 }
 
 /* Write a WebSocket frame with the enclosed data out. */
-int websocket_writev(RedsWebSocket *ws, const struct iovec *iov, int iovcnt, unsigned flags)
+static int websocket_writev_frame(RedsWebSocket *ws, const struct iovec *iov, int iovcnt,
+                                  unsigned flags)
 {
     uint64_t len;
     int rc;
+    struct iovec iov_stack[WEBSOCKET_IOV_STACK];
     struct iovec *iov_out;
     int iov_out_cnt;
     int i;
 
-    if (ws->closed) {
-        errno = EPIPE;
-        return -1;
-    }
     rc = send_pending_data(ws);
     if (rc <= 0) {
         return rc;
@@ -617,7 +672,8 @@ int websocket_writev(RedsWebSocket *ws, const struct iovec *iov, int iovcnt, uns
     }
 
     iov_out_cnt = iovcnt + 1;
-    iov_out = g_malloc(iov_out_cnt * sizeof(*iov_out));
+    iov_out = iov_out_cnt <= G_N_ELEMENTS(iov_stack) ?
+        iov_stack : g_new(struct iovec, iov_out_cnt);
 
     for (i = 0, len = 0; i < iovcnt; i++) {
         len += iov[i].iov_len;
@@ -629,7 +685,9 @@ int websocket_writev(RedsWebSocket *ws, const struct iovec *iov, int iovcnt, uns
     iov_out[0].iov_len = ws->write_header_len;
     iov_out[0].iov_base = ws->write_header;
     rc = ws->raw_writev(ws->raw_stream, iov_out, iov_out_cnt);
-    g_free(iov_out);
+    if (iov_out != iov_stack) {
+        g_free(iov_out);
+    }
     if (rc <= 0) {
         ws->write_header_len = 0;
         return rc;
@@ -637,7 +695,7 @@ int websocket_writev(RedsWebSocket *ws, const struct iovec *iov, int iovcnt, uns
 
     /* this can happen if we can't write the header */
     if (SPICE_UNLIKELY(rc < ws->write_header_len)) {
-        ws->write_header_pos = ws->write_header_len - rc;
+        ws->write_header_pos = rc;
         errno = EAGAIN;
         return -1;
     }
@@ -652,6 +710,69 @@ int websocket_writev(RedsWebSocket *ws, const struct iovec *iov, int iovcnt, uns
     return rc;
 }
 
+/* Send the batched messages, returns 1 once all were sent */
+static int websocket_send_batch(RedsWebSocket *ws)
+{
+    while (ws->batch_sent < ws->batch_len) {
+        struct iovec iov;
+        int rc;
+
+        iov.iov_base = ws->batch + ws->batch_sent;
+        iov.iov_len = ws->batch_len - ws->batch_sent;
+        ws->batch_frame_started = true;
+        rc = websocket_writev_frame(ws, &iov, 1, WEBSOCKET_BINARY_FINAL);
+        if (rc < 0) {
+            return rc;
+        }
+        if (rc == 0) {
+            errno = EAGAIN;
+            return -1;
+        }
+        ws->batch_sent += rc;
+    }
+    ws->batch_len = 0;
+    ws->batch_sent = 0;
+    ws->batch_frame_started = false;
+    return 1;
+}
+
+int websocket_writev(RedsWebSocket *ws, const struct iovec *iov, int iovcnt, unsigned flags)
+{
+    uint64_t len;
+    int rc;
+    int i;
+
+    if (ws->closed) {
+        errno = EPIPE;
+        return -1;
+    }
+
+    for (i = 0, len = 0; i < iovcnt; i++) {
+        len += iov[i].iov_len;
+    }
+
+    /* append to the batch if it's not being sent and we are between frames,
+     * the message is then reported as written */
+    if (ws->batching && !ws->batch_frame_started &&
+        ws->write_remainder == 0 && ws->write_header_pos >= ws->write_header_len &&
+        len <= WEBSOCKET_BATCH_MAX_COPY && ws->batch_len + len <= WEBSOCKET_BATCH_SIZE) {
+        for (i = 0; i < iovcnt; i++) {
+            memcpy(ws->batch + ws->batch_len, iov[i].iov_base, iov[i].iov_len);
+            ws->batch_len += iov[i].iov_len;
+        }
+        return len;
+    }
+
+    /* the batched data goes first */
+    if (ws->write_remainder == 0 || ws->batch_frame_started) {
+        rc = websocket_send_batch(ws);
+        if (rc <= 0) {
+            return rc;
+        }
+    }
+    return websocket_writev_frame(ws, iov, iovcnt, flags);
+}
+
 int websocket_write(RedsWebSocket *ws, const void *buf, size_t len, unsigned flags)
 {
     int rc;
@@ -661,6 +782,14 @@ int websocket_write(RedsWebSocket *ws, const void *buf, size_t len, unsigned fla
         return -1;
     }
 
+    if (ws->batching || ws->batch_len) {
+        struct iovec iov;
+
+        iov.iov_base = (void *) buf;
+        iov.iov_len = len;
+        return websocket_writev(ws, &iov, 1, flags);
+    }
+
     rc = send_pending_data(ws);
     if (rc <= 0) {
         return rc;
@@ -793,5 +922,23 @@ RedsWebSocket *websocket_new(const void *buf, size_t len, void *stream, websocke
 
 void websocket_free(RedsWebSocket *ws)
 {
+    g_free(ws->batch);
     g_free(ws);
 }
+
+void websocket_set_batching(RedsWebSocket *ws, bool batching)
+{
+    if (batching && !ws->batch) {
+        ws->batch = g_malloc(WEBSOCKET_BATCH_SIZE);
+    }
+    ws->batching = batching;
+}
+
+int websocket_flush(RedsWebSocket *ws)
+{
+    if (ws->closed) {
+        errno = EPIPE;
+        return -1;
+    }
+    return websocket_send_batch(ws);
+}
@@ -19,6 +19,7 @@
 #define WEBSOCKET_H_
 
 #include <stdint.h>
+#include <stdbool.h>
 #include <spice/macros.h>
 
 #include "sys-socket.h"
@@ -52,6 +53,17 @@ int websocket_read(RedsWebSocket *ws, uint8_t *buf, size_t len, unsigned *flags)
 int websocket_write(RedsWebSocket *ws, const void *buf, size_t len, unsigned flags);
 int websocket_writev(RedsWebSocket *ws, const struct iovec *iov, int iovcnt, unsigned flags);
 
+/**
+ * When batching, small binary messages are buffered and sent together in
+ * a single frame, by the next write of a bigger message or websocket_flush().
+ */
+void websocket_set_batching(RedsWebSocket *ws, bool batching);
+/**
+ * Send the batched messages.
+ * Returns 1 if everything was sent, otherwise -1 with errno set.
+ */
+int websocket_flush(RedsWebSocket *ws);
+
 SPICE_END_DECLS
 
 #endif